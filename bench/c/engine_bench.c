@@ -0,0 +1,512 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "opcode.h"
+#include "kernel.h"
+#include "reduce.h"
+#include "fuse.h"
+#include "pool.h"
+
+/*
+ * A benchmark of the kernels of the engine without the BEAM.
+ *
+ * Each kernel runs as execute() runs it, split into chunks by the pool,
+ * over the sizes, the element types and the numbers of threads.
+ * A line of JSON is printed for each measurement, of the fastest time
+ * per call in nanoseconds and the throughput in GB/s of the bytes read
+ * and written, which bench/compare.exs compares between two runs.
+ *
+ * Usage: engine_bench [-s sizes] [-t threads] [-m seconds] [-f filter]
+ *
+ *   -s  the comma separated numbers of elements, defaults to 1000,100000,10000000
+ *   -t  the comma separated numbers of threads, defaults to 1 and the number of cores
+ *   -m  the minimum time of a batch of calls, defaults to 0.05
+ *   -f  runs only the benchmarks whose group/name contains filter
+ */
+
+#define MAX_LIST 16
+#define BATCHES 5
+
+typedef struct type_info {
+    const char *name;
+    enum type_binary type;
+    enum bit_type_binary bit_type;
+    size_t size;
+} type_info_t;
+
+static const type_info_t types[] = {
+    {"u8", tb_u, btb_8, 1},
+    {"s32", tb_s, btb_32, 4},
+    {"s64", tb_s, btb_64, 8},
+    {"f16", tb_f, btb_16, 2},
+    {"bf16", tb_bf, btb_16, 2},
+    {"f32", tb_f, btb_32, 4},
+    {"f64", tb_f, btb_64, 8},
+};
+
+#define NUM_TYPES (sizeof(types) / sizeof(types[0]))
+
+typedef struct inst_info {
+    unsigned inst;
+    const char *name;
+} inst_info_t;
+
+static const inst_info_t binary_insts[] = {
+    {INST_ADD, "add"},
+    {INST_SUBTRACT, "subtract"},
+    {INST_MULTIPLY, "multiply"},
+    {INST_DIVIDE, "divide"},
+    {INST_POWER, "power"},
+    {INST_REMAINDER, "remainder"},
+    {INST_ATAN2, "atan2"},
+    {INST_MIN, "min"},
+    {INST_MAX, "max"},
+    {INST_QUOTIENT, "quotient"},
+    {INST_BITWISE_AND, "bitwise_and"},
+    {INST_BITWISE_OR, "bitwise_or"},
+    {INST_BITWISE_XOR, "bitwise_xor"},
+    {INST_LEFT_SHIFT, "left_shift"},
+    {INST_RIGHT_SHIFT, "right_shift"},
+    {INST_EQUAL, "equal"},
+    {INST_NOT_EQUAL, "not_equal"},
+    {INST_GREATER, "greater"},
+    {INST_LESS, "less"},
+    {INST_GREATER_EQUAL, "greater_equal"},
+    {INST_LESS_EQUAL, "less_equal"},
+    {INST_LOGICAL_AND, "logical_and"},
+    {INST_LOGICAL_OR, "logical_or"},
+    {INST_LOGICAL_XOR, "logical_xor"},
+};
+
+static const inst_info_t unary_insts[] = {
+    {INST_EXP, "exp"},
+    {INST_LOG, "log"},
+    {INST_LOG1P, "log1p"},
+    {INST_SIGMOID, "sigmoid"},
+    {INST_TANH, "tanh"},
+    {INST_ERF, "erf"},
+    {INST_SQRT, "sqrt"},
+    {INST_RSQRT, "rsqrt"},
+    {INST_ABS, "abs"},
+};
+
+static const inst_info_t reduce_insts[] = {
+    {INST_SUM, "sum"},
+    {INST_PRODUCT, "product"},
+    {INST_REDUCE_MAX, "reduce_max"},
+    {INST_REDUCE_MIN, "reduce_min"},
+    {INST_ARGMAX, "argmax"},
+    {INST_ARGMIN, "argmin"},
+    {INST_ALL, "all"},
+    {INST_ANY, "any"},
+};
+
+#define LENGTH(array) (sizeof(array) / sizeof((array)[0]))
+
+static struct {
+    size_t sizes[MAX_LIST];
+    unsigned num_sizes;
+    unsigned threads[MAX_LIST];
+    unsigned num_threads;
+    double min_time;
+    const char *filter;
+} options;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+typedef bool (*bench_t)(void *ctx);
+
+/*
+ * Calls bench in batches of at least the minimum time.
+ *
+ * Returns the fastest time per call of the batches in nanoseconds,
+ * or a negative number if bench fails.
+ */
+static double measure(bench_t bench, void *ctx)
+{
+    if(!bench(ctx)) {
+        return -1;
+    }
+    uint64_t target = (uint64_t)(options.min_time * 1e9);
+    size_t iterations = 1;
+    uint64_t elapsed;
+    for(;;) {
+        uint64_t start = now_ns();
+        for(size_t i = 0; i < iterations; i++) {
+            bench(ctx);
+        }
+        elapsed = now_ns() - start;
+        if(elapsed >= target) {
+            break;
+        }
+        iterations *= 2;
+    }
+    double best = (double)elapsed / iterations;
+    for(unsigned b = 1; b < BATCHES; b++) {
+        uint64_t start = now_ns();
+        for(size_t i = 0; i < iterations; i++) {
+            bench(ctx);
+        }
+        double ns = (double)(now_ns() - start) / iterations;
+        if(ns < best) {
+            best = ns;
+        }
+    }
+    return best;
+}
+
+static bool selected(const char *group, const char *name)
+{
+    if(options.filter == NULL) {
+        return true;
+    }
+    char key[128];
+    snprintf(key, sizeof(key), "%s/%s", group, name);
+    return strstr(key, options.filter) != NULL;
+}
+
+static void report(const char *group, const char *name, const char *type, size_t size, unsigned threads, double ns, double bytes)
+{
+    if(ns < 0) {
+        fprintf(stderr, "%s/%s %s %zu: failed\n", group, name, type, size);
+        return;
+    }
+    printf(
+        "{\"suite\":\"c\",\"group\":\"%s\",\"name\":\"%s\",\"type\":\"%s\",\"size\":%zu,\"threads\":%u,\"ns\":%.1f",
+        group, name, type, size, threads, ns);
+    // Bytes per nanosecond are GB/s.
+    if(bytes > 0) {
+        printf(",\"gbps\":%.3f}\n", bytes / ns);
+    } else {
+        printf(",\"gbps\":null}\n");
+    }
+    fflush(stdout);
+}
+
+static void *alloc_data(size_t bytes)
+{
+    void *data = aligned_alloc(64, (bytes + 63) / 64 * 64);
+    if(data == NULL) {
+        fprintf(stderr, "engine_bench: out of memory\n");
+        exit(1);
+    }
+    return data;
+}
+
+/*
+ * Fills the data with numbers in [1, 2), which every kernel accepts,
+ * converted to the type as as_type does.
+ */
+static void *make_data(const type_info_t *type, size_t n)
+{
+    double *source = alloc_data(n * sizeof(double));
+    for(size_t i = 0; i < n; i++) {
+        source[i] = 1.0 + (double)(i % 97) / 128.0;
+    }
+    void *data = alloc_data(n * type->size);
+    convert_kernel(tb_f, btb_64, type->type, type->bit_type)(n, source, data);
+    free(source);
+    return data;
+}
+
+typedef struct binary_ctx {
+    binary_kernel_t kernel;
+    const char *a;
+    const char *b;
+    char *out;
+    size_t n;
+    size_t in_size;
+    size_t out_size;
+} binary_ctx_t;
+
+static bool binary_chunk(void *arg, size_t begin, size_t end)
+{
+    const binary_ctx_t *ctx = arg;
+    return ctx->kernel(
+        end - begin,
+        ctx->a + begin * ctx->in_size, false,
+        ctx->b + begin * ctx->in_size, false,
+        ctx->out + begin * ctx->out_size);
+}
+
+static bool bench_binary(void *arg)
+{
+    binary_ctx_t *ctx = arg;
+    size_t widest = ctx->in_size > ctx->out_size ? ctx->in_size : ctx->out_size;
+    return pool_run(ctx->n, pool_grain(ctx->n, widest), binary_chunk, ctx);
+}
+
+typedef struct unary_ctx {
+    unary_kernel_t kernel;
+    const char *in;
+    char *out;
+    size_t n;
+    size_t in_size;
+    size_t out_size;
+} unary_ctx_t;
+
+static bool unary_chunk(void *arg, size_t begin, size_t end)
+{
+    const unary_ctx_t *ctx = arg;
+    ctx->kernel(end - begin, ctx->in + begin * ctx->in_size, ctx->out + begin * ctx->out_size);
+    return true;
+}
+
+static bool bench_unary(void *arg)
+{
+    unary_ctx_t *ctx = arg;
+    size_t widest = ctx->in_size > ctx->out_size ? ctx->in_size : ctx->out_size;
+    return pool_run(ctx->n, pool_grain(ctx->n, widest), unary_chunk, ctx);
+}
+
+typedef struct reduce_ctx {
+    unsigned inst;
+    const type_info_t *type;
+    const void *in;
+    uint64_t shape[1];
+    uint64_t out[1];
+} reduce_ctx_t;
+
+static bool bench_reduce(void *arg)
+{
+    reduce_ctx_t *ctx = arg;
+    return reduce(ctx->inst, ctx->type->type, ctx->type->bit_type, ctx->in, 1, ctx->shape, 1, false, ctx->out) == NULL;
+}
+
+typedef struct fuse_ctx {
+    fuse_plan_t plan;
+    uint64_t n;
+    void *out;
+} fuse_ctx_t;
+
+static bool bench_fuse(void *arg)
+{
+    fuse_ctx_t *ctx = arg;
+    return fuse_run(&ctx->plan, ctx->n, ctx->out) == NULL;
+}
+
+static bool noop_chunk(void *arg, size_t begin, size_t end)
+{
+    return true;
+}
+
+static bool bench_dispatch(void *arg)
+{
+    // A chunk per thread, so that all of the workers are woken.
+    size_t n = pool_threads();
+    return pool_run(n, 1, noop_chunk, NULL);
+}
+
+static void run_binary(size_t n, unsigned threads)
+{
+    for(unsigned t = 0; t < NUM_TYPES; t++) {
+        const type_info_t *type = &types[t];
+        void *a = make_data(type, n);
+        void *b = make_data(type, n);
+        void *out = alloc_data(n * type->size);
+        for(unsigned i = 0; i < LENGTH(binary_insts); i++) {
+            const inst_info_t *inst = &binary_insts[i];
+            binary_kernel_t kernel = binary_kernel(inst->inst, type->type, type->bit_type);
+            if(kernel == NULL || !selected("binary", inst->name)) {
+                continue;
+            }
+            size_t out_size = binary_returns_u8(inst->inst) ? 1 : type->size;
+            binary_ctx_t ctx = {kernel, a, b, out, n, type->size, out_size};
+            double ns = measure(bench_binary, &ctx);
+            report("binary", inst->name, type->name, n, threads, ns, (double)n * (2 * type->size + out_size));
+        }
+        free(a);
+        free(b);
+        free(out);
+    }
+}
+
+static void run_unary(size_t n, unsigned threads)
+{
+    for(unsigned t = 0; t < NUM_TYPES; t++) {
+        const type_info_t *type = &types[t];
+        void *in = make_data(type, n);
+        void *out = alloc_data(n * type->size);
+        for(unsigned i = 0; i < LENGTH(unary_insts); i++) {
+            const inst_info_t *inst = &unary_insts[i];
+            unary_kernel_t kernel = unary_kernel(inst->inst, type->type, type->bit_type);
+            if(kernel == NULL || !selected("unary", inst->name)) {
+                continue;
+            }
+            unary_ctx_t ctx = {kernel, in, out, n, type->size, type->size};
+            double ns = measure(bench_unary, &ctx);
+            report("unary", inst->name, type->name, n, threads, ns, (double)n * 2 * type->size);
+        }
+        free(in);
+        free(out);
+    }
+}
+
+static void run_as_type(size_t n, unsigned threads)
+{
+    for(unsigned from = 0; from < NUM_TYPES; from++) {
+        void *in = make_data(&types[from], n);
+        void *out = alloc_data(n * 8);
+        for(unsigned to = 0; to < NUM_TYPES; to++) {
+            char name[32];
+            snprintf(name, sizeof(name), "as_type_%s", types[to].name);
+            unary_kernel_t kernel = convert_kernel(
+                types[from].type, types[from].bit_type, types[to].type, types[to].bit_type);
+            if(from == to || kernel == NULL || !selected("as_type", name)) {
+                continue;
+            }
+            unary_ctx_t ctx = {kernel, in, out, n, types[from].size, types[to].size};
+            double ns = measure(bench_unary, &ctx);
+            report("as_type", name, types[from].name, n, threads, ns, (double)n * (types[from].size + types[to].size));
+        }
+        free(in);
+        free(out);
+    }
+}
+
+static void run_reduce(size_t n, unsigned threads)
+{
+    for(unsigned t = 0; t < NUM_TYPES; t++) {
+        const type_info_t *type = &types[t];
+        void *in = make_data(type, n);
+        for(unsigned i = 0; i < LENGTH(reduce_insts); i++) {
+            const inst_info_t *inst = &reduce_insts[i];
+            enum type_binary result_type;
+            enum bit_type_binary result_bit_type;
+            if(!reduce_result_type(inst->inst, type->type, type->bit_type, &result_type, &result_bit_type) ||
+               !selected("reduce", inst->name)) {
+                continue;
+            }
+            reduce_ctx_t ctx = {inst->inst, type, in, {n}, {0}};
+            double ns = measure(bench_reduce, &ctx);
+            report("reduce", inst->name, type->name, n, threads, ns, (double)n * type->size);
+        }
+        free(in);
+    }
+}
+
+// exp(a * b + c), which fuse computes in one pass over the tiles.
+static void run_fuse(size_t n, unsigned threads)
+{
+    static const fuse_op_t ops[] = {
+        {INST_ALOADT, 0},
+        {INST_ALOADT, 1},
+        {INST_MULTIPLY, 0},
+        {INST_ALOADT, 2},
+        {INST_ADD, 0},
+        {INST_EXP, 0},
+    };
+    if(!selected("fuse", "exp_multiply_add")) {
+        return;
+    }
+    for(unsigned t = 0; t < NUM_TYPES; t++) {
+        const type_info_t *type = &types[t];
+        if(type->type != tb_f && type->type != tb_bf) {
+            continue;
+        }
+        void *data[3];
+        fuse_input_t inputs[3];
+        for(unsigned i = 0; i < 3; i++) {
+            data[i] = make_data(type, n);
+            inputs[i] = (fuse_input_t){type->type, type->bit_type, n, data[i]};
+        }
+        fuse_ctx_t ctx = {.n = n, .out = alloc_data(n * type->size)};
+        if(fuse_prepare(&ctx.plan, ops, LENGTH(ops), inputs, 3) == NULL) {
+            double ns = measure(bench_fuse, &ctx);
+            report("fuse", "exp_multiply_add", type->name, n, threads, ns, (double)n * 4 * type->size);
+        }
+        for(unsigned i = 0; i < 3; i++) {
+            free(data[i]);
+        }
+        free(ctx.out);
+    }
+}
+
+static unsigned parse_list(const char *arg, size_t *out)
+{
+    unsigned count = 0;
+    const char *p = arg;
+    while(*p != '\0' && count < MAX_LIST) {
+        char *end;
+        unsigned long long value = strtoull(p, &end, 10);
+        if(end == p || value == 0) {
+            fprintf(stderr, "engine_bench: invalid list: %s\n", arg);
+            exit(2);
+        }
+        out[count++] = (size_t)value;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+int main(int argc, char **argv)
+{
+    size_t threads[MAX_LIST];
+    options.sizes[0] = 1000;
+    options.sizes[1] = 100000;
+    options.sizes[2] = 10000000;
+    options.num_sizes = 3;
+    threads[0] = 1;
+    threads[1] = (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+    options.num_threads = threads[1] > 1 ? 2 : 1;
+    options.min_time = 0.05;
+
+    int c;
+    while((c = getopt(argc, argv, "s:t:m:f:")) != -1) {
+        switch(c) {
+            case 's':
+                options.num_sizes = parse_list(optarg, options.sizes);
+                break;
+            case 't':
+                options.num_threads = parse_list(optarg, threads);
+                break;
+            case 'm':
+                options.min_time = atof(optarg);
+                break;
+            case 'f':
+                options.filter = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-s sizes] [-t threads] [-m seconds] [-f filter]\n", argv[0]);
+                return 2;
+        }
+    }
+    for(unsigned i = 0; i < options.num_threads; i++) {
+        options.threads[i] = (unsigned)threads[i];
+    }
+
+    for(unsigned t = 0; t < options.num_threads; t++) {
+        if(pool_start(options.threads[t]) != 0) {
+            fprintf(stderr, "engine_bench: failed to start the pool of %u threads\n", options.threads[t]);
+            return 1;
+        }
+        unsigned actual = pool_threads();
+
+        if(selected("overhead", "pool_dispatch")) {
+            report("overhead", "pool_dispatch", "none", actual, actual, measure(bench_dispatch, NULL), 0);
+        }
+        for(unsigned s = 0; s < options.num_sizes; s++) {
+            size_t n = options.sizes[s];
+            run_binary(n, actual);
+            run_unary(n, actual);
+            run_as_type(n, actual);
+            run_reduce(n, actual);
+            run_fuse(n, actual);
+        }
+        pool_stop();
+    }
+    return 0;
+}
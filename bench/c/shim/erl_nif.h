@@ -0,0 +1,108 @@
+#ifndef PELEMAY_BENCH_ERL_NIF_H
+#define PELEMAY_BENCH_ERL_NIF_H
+
+/*
+ * The subset of erl_nif.h which the kernels, the reductions, fuse and
+ * the pool use, over pthreads and malloc, so that they run without the BEAM.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+typedef pthread_mutex_t ErlNifMutex;
+typedef pthread_cond_t ErlNifCond;
+typedef pthread_t ErlNifTid;
+typedef int ErlNifThreadOpts;
+
+static inline void *enif_alloc(size_t size)
+{
+    return malloc(size);
+}
+
+static inline void enif_free(void *ptr)
+{
+    free(ptr);
+}
+
+static inline ErlNifMutex *enif_mutex_create(char *name)
+{
+    ErlNifMutex *mutex = malloc(sizeof(*mutex));
+    if(mutex != NULL && pthread_mutex_init(mutex, NULL) != 0) {
+        free(mutex);
+        return NULL;
+    }
+    return mutex;
+}
+
+static inline void enif_mutex_destroy(ErlNifMutex *mutex)
+{
+    pthread_mutex_destroy(mutex);
+    free(mutex);
+}
+
+static inline void enif_mutex_lock(ErlNifMutex *mutex)
+{
+    pthread_mutex_lock(mutex);
+}
+
+static inline int enif_mutex_trylock(ErlNifMutex *mutex)
+{
+    return pthread_mutex_trylock(mutex);
+}
+
+static inline void enif_mutex_unlock(ErlNifMutex *mutex)
+{
+    pthread_mutex_unlock(mutex);
+}
+
+static inline ErlNifCond *enif_cond_create(char *name)
+{
+    ErlNifCond *cond = malloc(sizeof(*cond));
+    if(cond != NULL && pthread_cond_init(cond, NULL) != 0) {
+        free(cond);
+        return NULL;
+    }
+    return cond;
+}
+
+static inline void enif_cond_destroy(ErlNifCond *cond)
+{
+    pthread_cond_destroy(cond);
+    free(cond);
+}
+
+static inline void enif_cond_wait(ErlNifCond *cond, ErlNifMutex *mutex)
+{
+    pthread_cond_wait(cond, mutex);
+}
+
+static inline void enif_cond_signal(ErlNifCond *cond)
+{
+    pthread_cond_signal(cond);
+}
+
+static inline void enif_cond_broadcast(ErlNifCond *cond)
+{
+    pthread_cond_broadcast(cond);
+}
+
+static inline ErlNifThreadOpts *enif_thread_opts_create(char *name)
+{
+    return NULL;
+}
+
+static inline void enif_thread_opts_destroy(ErlNifThreadOpts *opts)
+{
+}
+
+static inline int enif_thread_create(char *name, ErlNifTid *tid, void *(*func)(void *), void *arg, ErlNifThreadOpts *opts)
+{
+    return pthread_create(tid, NULL, func, arg);
+}
+
+static inline int enif_thread_join(ErlNifTid tid, void **result)
+{
+    return pthread_join(tid, result);
+}
+
+#endif // PELEMAY_BENCH_ERL_NIF_H
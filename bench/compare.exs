@@ -0,0 +1,69 @@
+# Compares two runs of the benchmarks, such as of two releases:
+#
+#     elixir bench/compare.exs base.jsonl new.jsonl [--threshold 0.1]
+#
+# Each file is lines of JSON written by bench/c/engine_bench or the Elixir
+# benchmarks. The results of the same benchmark, type, size and number of
+# threads are compared by the time of a call, and those slower by more than
+# the threshold (10% by default) are listed as regressions, in which case
+# it exits with status 1.
+
+Mix.install([{:jason, "~> 1.4"}])
+
+{opts, files} = OptionParser.parse!(System.argv(), strict: [threshold: :float])
+threshold = Keyword.get(opts, :threshold, 0.1)
+
+[base, new] =
+  case files do
+    [_, _] ->
+      Enum.map(files, fn file ->
+        file
+        |> File.stream!()
+        |> Stream.reject(&(String.trim(&1) == ""))
+        |> Map.new(fn line ->
+          result = Jason.decode!(line)
+          key = Map.take(result, ["suite", "group", "name", "type", "size", "threads"])
+          {key, result}
+        end)
+      end)
+
+    _ ->
+      IO.puts(:stderr, "usage: elixir bench/compare.exs base.jsonl new.jsonl [--threshold 0.1]")
+      System.halt(2)
+  end
+
+label = fn key ->
+  "#{key["suite"]} #{key["group"]}/#{key["name"]} " <>
+    "#{key["type"]} #{key["size"]} x#{key["threads"]}"
+end
+
+compared =
+  for {key, %{"ns" => new_ns}} <- new, Map.has_key?(base, key) do
+    base_ns = base[key]["ns"]
+    {key, base_ns, new_ns, new_ns / base_ns - 1}
+  end
+  |> Enum.sort_by(&elem(&1, 3), :desc)
+
+{regressions, others} = Enum.split_with(compared, fn {_, _, _, change} -> change > threshold end)
+
+for {title, results} <- [{"Regressions", regressions}, {"Others", others}], results != [] do
+  IO.puts("#{title}:")
+
+  for {key, base_ns, new_ns, change} <- results do
+    sign = if change >= 0, do: "+", else: ""
+    from = :erlang.float_to_binary(base_ns / 1, decimals: 1)
+    to = :erlang.float_to_binary(new_ns / 1, decimals: 1)
+    percent = Float.round(change * 100, 1)
+    name = String.pad_trailing(label.(key), 56)
+
+    IO.puts("  #{name} #{from} ns -> #{to} ns (#{sign}#{percent}%)")
+  end
+end
+
+missing = Map.keys(base) -- Map.keys(new)
+
+for key <- missing do
+  IO.puts("Missing: #{label.(key)}")
+end
+
+if regressions != [], do: System.halt(1)
@@ -0,0 +1,59 @@
+# The fixed cost of a call of the engine, apart from the kernels:
+# an empty program, decoding the program on every call instead of once
+# by `PelemayBackend.Engine.load/1`, and returning the result from
+# the NIF compared with sending it by `enif_send`.
+#
+# To run this benchmark, `elixir bench/engine_overhead_bench.exs`.
+# The results are appended to `BENCH_OUTPUT` (bench_output.jsonl by default)
+# as lines of JSON, which `bench/compare.exs` compares between runs.
+
+Mix.install([
+  {:pelemay_backend, path: "."},
+  {:benchee, "~> 1.1"},
+  {:jason, "~> 1.4"}
+])
+
+Code.require_file("support/bench_report.exs", __DIR__)
+
+alias PelemayBackend.Engine
+
+empty = Engine.assemble("return\n")
+identity = Engine.assemble("aloadt 0\nsendt\n")
+# 64 instructions which do nothing but be decoded.
+long = Engine.assemble("aloadt 0\n" <> String.duplicate("dup\npop\n", 31) <> "sendt\n")
+
+loaded_empty = Engine.load(empty)
+loaded_identity = Engine.load(identity)
+loaded_long = Engine.load(long)
+
+x = Nx.iota({8}, type: {:f, 32}, backend: Nx.BinaryBackend)
+arg = {Nx.size(x), Nx.shape(x), Nx.type(x), Nx.to_binary(x)}
+buffer_arg = put_elem(arg, 3, PelemayBackend.NIF.buffer_from_binary(Nx.to_binary(x)))
+
+jobs = %{
+  "empty program" => fn -> {:ok, {}} = Engine.execute(loaded_empty, []) end,
+  "empty program decoded per call" => fn -> {:ok, {}} = Engine.execute(empty, []) end,
+  "64 instructions" => fn -> {:ok, _} = Engine.execute(loaded_long, [arg]) end,
+  "64 instructions decoded per call" => fn -> {:ok, _} = Engine.execute(long, [arg]) end,
+  "result returned" => fn -> {:ok, _} = Engine.execute(loaded_identity, [arg]) end,
+  "result returned in a buffer" => fn ->
+    {:ok, _} = Engine.execute(loaded_identity, [buffer_arg], :return, :buffer)
+  end,
+  "result sent by enif_send" => fn ->
+    :ok = Engine.execute(loaded_identity, [arg], self())
+
+    receive do
+      {:result, _, _, _} -> :ok
+    end
+  end,
+  "submitted to the queue" => fn -> Engine.await(elem(Engine.submit(loaded_identity, [x]), 1)) end
+}
+
+suite = Benchee.run(jobs, BenchReport.benchee_options())
+
+meta =
+  Map.new(jobs, fn {name, _} ->
+    {name, %{group: "overhead", name: name, type: "f32", size: Nx.size(x), bytes: nil}}
+  end)
+
+BenchReport.write(suite, meta, BenchReport.threads())
@@ -0,0 +1,131 @@
+# The throughput of each instruction of the engine in GB/s of the bytes
+# read and written, over the sizes and the types of the tensors,
+# including the fixed cost of a call from Elixir. The tensors are kept
+# in native buffers, so that they are not copied.
+#
+# To run this benchmark, `elixir bench/kernel_bench.exs`.
+#
+#   * `PELEMAY_THREADS` - the number of threads of the pool. Run the benchmark
+#     for each number of threads to measure the scaling.
+#   * `BENCH_SIZES` - the comma separated numbers of elements,
+#     defaults to 1000,100000,1000000.
+#   * `BENCH_TIME` - the seconds to run each job, defaults to 1.0.
+#   * `BENCH_OUTPUT` - the file to which the results are appended as lines
+#     of JSON, defaults to bench_output.jsonl.
+#
+# See also `bench/c`, which runs the kernels without the BEAM.
+
+config =
+  case System.get_env("PELEMAY_THREADS") do
+    nil -> []
+    threads -> [pelemay_backend: [threads: String.to_integer(threads)]]
+  end
+
+Mix.install(
+  [
+    {:pelemay_backend, path: "."},
+    {:benchee, "~> 1.1"},
+    {:jason, "~> 1.4"}
+  ],
+  config: config
+)
+
+Code.require_file("support/bench_report.exs", __DIR__)
+
+alias PelemayBackend.Engine
+
+sizes =
+  System.get_env("BENCH_SIZES", "1000,100000,1000000")
+  |> String.split(",")
+  |> Enum.map(&String.to_integer/1)
+
+int_types = [{:s, 32}]
+float_types = [{:f, 16}, {:f, 32}, {:f, 64}]
+reduce_types = int_types ++ [{:f, 32}, {:f, 64}]
+
+programs =
+  for(op <- [:add, :multiply, :max, :less], do: {:binary, op, int_types ++ float_types}) ++
+    [{:binary, :divide, float_types}] ++
+    for(op <- [:exp, :log, :sigmoid, :tanh, :erf, :sqrt], do: {:unary, op, float_types}) ++
+    [{:unary, :abs, int_types ++ float_types}] ++
+    for(op <- [:sum, :reduce_max, :argmax], do: {:reduce, op, reduce_types}) ++
+    [{:as_type, {:f, 32}, [{:s, 32}, {:f, 16}, {:f, 64}]}] ++
+    [{:fuse, :exp_multiply_add, float_types}]
+
+# Numbers in [1, 2), which every instruction accepts.
+tensor = fn size, type ->
+  Nx.iota({size}, type: {:f, 64}, backend: Nx.BinaryBackend)
+  |> Nx.remainder(97)
+  |> Nx.divide(128)
+  |> Nx.add(1)
+  |> Nx.as_type(type)
+  |> Nx.backend_transfer({PelemayBackend.Backend, storage: :buffer})
+end
+
+name = fn op, type, size -> "#{op} #{Nx.Type.to_string(type)} #{size}" end
+
+cases =
+  for size <- sizes, {kind, op, types} <- programs, type <- types do
+    a = tensor.(size, type)
+    element = Nx.Type.to_bits(type) |> div(8)
+
+    {code, args, group, bytes} =
+      case kind do
+        :binary ->
+          out = if op == :less, do: 1, else: element
+          code = "aloadt 0\naloadt 1\n#{op}\nsendt\n"
+          {code, [a, tensor.(size, type)], "binary", size * (2 * element + out)}
+
+        :unary ->
+          {"aloadt 0\n#{op}\nsendt\n", [a], "unary", size * 2 * element}
+
+        :reduce ->
+          {"aloadt 0\n#{op} {1, false}\nsendt\n", [a], "reduce", size * element}
+
+        :as_type ->
+          {"aloadt 0\nas_type #{inspect(op)}\nsendt\n", [a], "as_type",
+           size * (element + div(Nx.Type.to_bits(op), 8))}
+
+        :fuse ->
+          # exp(a * b + c)
+          code =
+            "aloadt 0\naloadt 1\naloadt 2\nfuse {3, 6}\n" <>
+              "aloadt 0\naloadt 1\nmultiply\naloadt 2\nadd\nexp\nsendt\n"
+
+          {code, [a, tensor.(size, type), tensor.(size, type)], "fuse", size * 4 * element}
+      end
+
+    op = if kind == :as_type, do: "as_type_#{Nx.Type.to_string(op)}", else: "#{op}"
+    program = code |> Engine.assemble() |> Engine.load()
+    meta = %{group: group, name: op, type: Nx.Type.to_string(type), size: size, bytes: bytes}
+    {name.(op, type, size), fn -> Engine.run(program, args, storage: :buffer) end, meta}
+  end
+
+# BLAS, where gemm multiplies square matrices of about size elements.
+blas_cases =
+  for size <- sizes, type <- [{:f, 32}, {:f, 64}], op <- [:dot, :gemm] do
+    element = Nx.Type.to_bits(type) |> div(8)
+
+    {a, b, n} =
+      case op do
+        :dot ->
+          {tensor.(size, type), tensor.(size, type), size}
+
+        :gemm ->
+          side = size |> :math.sqrt() |> trunc()
+          a = tensor.(side * side, type) |> Nx.reshape({side, side})
+          b = Nx.transpose(a) |> Nx.backend_copy({PelemayBackend.Backend, storage: :buffer})
+          {a, b, side * side}
+      end
+
+    # dot reads two vectors, and gemm reads two matrices and writes one.
+    bytes = if op == :dot, do: 2 * n * element, else: 3 * n * element
+    meta = %{group: "blas", name: "#{op}", type: Nx.Type.to_string(type), size: n, bytes: bytes}
+    {name.(op, type, size), fn -> Nx.dot(a, b) end, meta}
+  end
+
+all = cases ++ blas_cases
+jobs = Map.new(all, fn {name, job, _} -> {name, job} end)
+metas = Map.new(all, fn {name, _, meta} -> {name, meta} end)
+suite = Benchee.run(jobs, BenchReport.benchee_options())
+BenchReport.write(suite, metas, BenchReport.threads())
@@ -0,0 +1,43 @@
+defmodule BenchReport do
+  @moduledoc false
+
+  # Writes the results of a Benchee suite as lines of JSON, in the same form
+  # as bench/c/engine_bench, so that bench/compare.exs compares them.
+  #
+  # meta maps the name of each job to the fields of its line, of which
+  # :bytes is the bytes read and written by a call, or nil.
+  # The time of a call is the median of Benchee.
+
+  def write(suite, meta, threads) do
+    path = System.get_env("BENCH_OUTPUT", "bench_output.jsonl")
+
+    lines =
+      for scenario <- suite.scenarios do
+        %{bytes: bytes} = fields = Map.fetch!(meta, scenario.job_name)
+        ns = scenario.run_time_data.statistics.median
+
+        fields
+        |> Map.delete(:bytes)
+        |> Map.merge(%{suite: "elixir", threads: threads, ns: Float.round(ns / 1, 1)})
+        |> Map.put(:gbps, if(bytes, do: Float.round(bytes / ns, 3)))
+        |> Jason.encode!()
+      end
+
+    File.write!(path, Enum.map(lines, &[&1, ?\n]), [:append])
+    IO.puts("Wrote #{length(lines)} results to #{path}")
+  end
+
+  # The number of threads of the pool, as the NIF is configured.
+  def threads do
+    Application.get_env(:pelemay_backend, :threads, :erlang.system_info(:dirty_cpu_schedulers))
+  end
+
+  def benchee_options do
+    [
+      time: String.to_float(System.get_env("BENCH_TIME", "1.0")),
+      warmup: 0.2,
+      memory_time: 0,
+      print: [fast_warning: false]
+    ]
+  end
+end
@@ -128,7 +128,13 @@ defmodule PelemayBackend do
       {:chunk, 4}
       {:result, 5}
 
-  **Note:** While any process can call `Nx.Stream.send/2`, EXLA
+  The function is compiled once when the stream starts. Unless it has
+  control flow, the accumulator is kept in native buffers by
+  the process of the stream from a chunk to the next, and the programs
+  update it in place, so that it is copied back only by `Nx.Stream.done/1`.
+  Otherwise, the chunks are evaluated by `Nx.Defn.Evaluator`.
+
+  **Note:** While any process can call `Nx.Stream.send/2`, PelemayBackend
   expects the process that starts the streaming to be the one
   calling `Nx.Stream.recv/1` and `Nx.Stream.done/1`.
 
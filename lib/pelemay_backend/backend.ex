@@ -1,15 +1,33 @@
 defmodule PelemayBackend.Backend do
   @moduledoc ~S"""
   An integrated lightweight tensor backend for Nx.
+
+  The data of a tensor is a binary by default. With the backend option
+  `storage: :buffer`, it is kept in a native buffer aligned to 64 bytes,
+  which the engine reads and writes without copying:
+
+      Nx.default_backend({PelemayBackend.Backend, storage: :buffer})
+
+  The results of the native operations on such tensors are kept in native
+  buffers too. The buffer is freed by `Nx.backend_deallocate/1` or
+  when the tensor is garbage collected.
+
+  `Nx.reshape/2`, `Nx.squeeze/2`, `Nx.transpose/2`, `Nx.broadcast/3` and
+  `Nx.slice/4` with integer start indices return views, which share the
+  data of the tensor with an offset and the strides of the axes instead
+  of copying it. The engine reads views in place, and the other operations
+  copy them. Deallocating a view does nothing, and deallocating the tensor
+  of a buffer invalidates its views.
   """
-  require Logger
 
   @behaviour Nx.Backend
   # @enforce_keys [:state]
 
-  @spec __struct__ :: %PelemayBackend.Backend{state: nil}
+  # view is nil if state is exactly the data of the tensor in row major order,
+  # or {offset, strides} in elements otherwise.
+  @spec __struct__ :: %PelemayBackend.Backend{state: nil, view: nil}
   @doc false
-  defstruct [:state]
+  defstruct [:state, :view]
 
   alias Nx.Tensor, as: T
   alias PelemayBackend.Backend, as: B
@@ -17,23 +35,54 @@ defmodule PelemayBackend.Backend do
   import Nx.Shared
 
   @impl true
-  def constant(%{type: type, shape: shape} = out, constant, _backend_options) do
+  def constant(%{type: type, shape: shape} = out, constant, backend_options) do
     data = :binary.copy(number_to_binary(constant, type), Nx.size(shape))
-    from_binary(out, data)
+    from_binary(out, data, backend_options)
   end
 
   @impl true
-  def from_binary(t, binary, _backend_options), do: from_binary(t, binary)
+  def from_binary(t, binary, backend_options) do
+    case backend_options[:storage] do
+      :buffer ->
+        buffer = PelemayBackend.NIF.buffer_from_binary(IO.iodata_to_binary(binary))
+        from_binary(t, buffer)
+
+      _ ->
+        from_binary(t, binary)
+    end
+  end
 
   defp from_binary(t, binary) when is_binary(binary), do: %{t | data: %B{state: binary}}
+  defp from_binary(t, buffer) when is_reference(buffer), do: %{t | data: %B{state: buffer}}
   defp from_binary(t, other), do: %{t | data: %B{state: IO.iodata_to_binary(other)}}
 
   @impl true
+  def backend_copy(%T{data: %B{state: state, view: view}} = tensor, Nx.Tensor, _opts)
+      when is_reference(state) or view != nil do
+    from_binary(tensor, to_binary(tensor))
+  end
+
+  def backend_copy(%T{data: %B{state: state, view: view}} = tensor, backend, opts)
+      when is_reference(state) or view != nil do
+    backend.from_binary(tensor, to_binary(tensor), opts)
+  end
+
   def backend_copy(tensor, backend, opts) do
     backend_transfer(tensor, backend, opts)
   end
 
   @impl true
+  def backend_transfer(%T{data: %B{view: {_, _}}} = tensor, backend, opts) do
+    backend_copy(tensor, backend, opts)
+  end
+
+  def backend_transfer(%T{data: %B{state: buffer}} = tensor, backend, opts)
+      when is_reference(buffer) do
+    copied = backend_copy(tensor, backend, opts)
+    backend_deallocate(tensor)
+    copied
+  end
+
   def backend_transfer(tensor, Nx.Tensor, _opts) do
     tensor
   end
@@ -42,8 +91,11 @@ defmodule PelemayBackend.Backend do
     tensor
   end
 
-  def backend_transfer(tensor, PelemayBackend.Backend, _opts) do
-    tensor
+  def backend_transfer(tensor, PelemayBackend.Backend, opts) do
+    case opts[:storage] do
+      :buffer -> from_binary(tensor, to_binary(tensor), opts)
+      _ -> tensor
+    end
   end
 
   def backend_transfer(tensor, backend, opts) do
@@ -51,6 +103,10 @@ defmodule PelemayBackend.Backend do
   end
 
   @impl true
+  def backend_deallocate(%T{data: %B{state: buffer, view: nil}}) when is_reference(buffer) do
+    PelemayBackend.NIF.buffer_deallocate(buffer)
+  end
+
   def backend_deallocate(_tensor) do
     :ok
   end
@@ -105,6 +161,21 @@ defmodule PelemayBackend.Backend do
     end
   end
 
+  # A contiguous view of a binary is a part of it, and the others are gathered by the engine.
+  defp to_binary(%T{data: %{state: binary, view: {offset, strides}}, type: {_, size}} = t)
+       when is_binary(binary) do
+    if contiguous?(t.shape, strides) do
+      binary_part(binary, offset * div(size, 8), Nx.size(t) * div(size, 8))
+    else
+      gather(t)
+    end
+  end
+
+  defp to_binary(%T{data: %{view: {_, _}}} = t), do: gather(t)
+
+  defp to_binary(%T{data: %{state: buffer}}) when is_reference(buffer),
+    do: PelemayBackend.NIF.buffer_to_binary(buffer)
+
   defp to_binary(%T{data: %{state: data}}), do: data
 
   @impl true
@@ -136,15 +207,21 @@ defmodule PelemayBackend.Backend do
 
   @impl true
   def slice(out, tensor, start_indices, lengths, strides) do
-    out = Nx.to_template(out)
-
     if Enum.all?(start_indices, &is_integer/1) do
-      expr_fun = fn tensor ->
-        Nx.Defn.Expr.slice(out, tensor, start_indices, lengths, strides)
-      end
+      # The start indices are clamped so that the slice is in the tensor.
+      {offset, view_strides} = view(tensor)
 
-      jit(expr_fun, [tensor])
+      offset =
+        [start_indices, lengths, Tuple.to_list(tensor.shape), view_strides]
+        |> Enum.zip()
+        |> Enum.reduce(offset, fn {start, length, dim, stride}, offset ->
+          offset + min(max(start, 0), dim - length) * stride
+        end)
+
+      put_view(out, tensor, offset, Enum.zip_with(view_strides, strides, &(&1 * &2)))
     else
+      out = Nx.to_template(out)
+
       expr_fun = fn tensor, start_indices ->
         Nx.Defn.Expr.slice(out, tensor, Tuple.to_list(start_indices), lengths, strides)
       end
@@ -185,18 +262,11 @@ defmodule PelemayBackend.Backend do
     jit(wrapper_fun, [List.to_tuple(tensors)])
   end
 
-  # [:add, :subtract, :multiply, :power, :remainder, :divide, :atan2, :min, :max, :quotient] ++
-  binary_ops =
-    [:add, :subtract, :power, :remainder, :divide, :atan2, :min, :max, :quotient] ++
-      [:bitwise_and, :bitwise_or, :bitwise_xor, :left_shift, :right_shift] ++
-      [:equal, :not_equal, :greater, :less, :greater_equal, :less_equal] ++
-      [:logical_and, :logical_or, :logical_xor]
-
   unary_ops =
-    [:exp, :expm1, :log, :log1p, :sigmoid, :cos, :sin, :tan] ++
-      [:cosh, :sinh, :tanh, :acos, :asin, :atan, :acosh, :asinh, :atanh] ++
-      [:sqrt, :rsqrt, :cbrt, :is_nan, :is_infinity, :erf, :erfc, :erf_inv] ++
-      [:abs, :bitwise_not, :ceil, :conjugate, :floor, :negate, :round, :sign] ++
+    [:expm1, :cos, :sin, :tan] ++
+      [:cosh, :sinh, :acos, :asin, :atan, :acosh, :asinh, :atanh] ++
+      [:cbrt, :is_nan, :is_infinity, :erfc, :erf_inv] ++
+      [:bitwise_not, :ceil, :conjugate, :floor, :negate, :round, :sign] ++
       [:count_leading_zeros, :population_count, :real, :imag]
 
   callbacks =
@@ -205,29 +275,15 @@ defmodule PelemayBackend.Backend do
       {:iota, [:axis, :backend_options], []},
       {:random_uniform, [:min, :max, :backend_options], [:min, :max]},
       {:random_normal, [:mu, :sigma, :backend_options], [:mu, :sigma]},
-      {:as_type, [:tensor], [:tensor]},
       {:bitcast, [:tensor], [:tensor]},
-      {:reshape, [:tensor], [:tensor]},
-      {:squeeze, [:tensor, :axes], [:tensor]},
-      {:broadcast, [:tensor, :shape, :axes], [:tensor]},
-      {:transpose, [:tensor, :axes], [:tensor]},
       {:pad, [:tensor, :pad_value, :padding_config], [:tensor, :pad_value]},
       {:reverse, [:tensor, :axes], [:tensor]},
-      {:dot, [:left, :c1, :b1, :right, :c2, :b2], [:left, :right]},
       {:clip, [:tensor, :min, :max], [:tensor, :min, :max]},
       {:take, [:tensor, :indices, :axis], [:tensor, :indices]},
       {:take_along_axis, [:tensor, :indices, :axis], [:tensor, :indices]},
       {:gather, [:input, :indices], [:input, :indices]},
       {:select, [:pred, :on_true, :on_false], [:pred, :on_true, :on_false]},
       {:conv, [:tensor, :kernel, :opts], [:tensor, :kernel]},
-      {:all, [:tensor, :opts], [:tensor]},
-      {:any, [:tensor, :opts], [:tensor]},
-      {:sum, [:tensor, :opts], [:tensor]},
-      {:product, [:tensor, :opts], [:tensor]},
-      {:reduce_max, [:tensor, :opts], [:tensor]},
-      {:reduce_min, [:tensor, :opts], [:tensor]},
-      {:argmax, [:tensor, :opts], [:tensor]},
-      {:argmin, [:tensor, :opts], [:tensor]},
       {:reduce, [:tensor, :acc, :opts, :fun], [:tensor, :acc]},
       {:window_reduce, [:tensor, :acc, :shape, :opts, :fun], [:tensor, :acc]},
       {:window_sum, [:tensor, :shape, :opts], [:tensor]},
@@ -252,45 +308,367 @@ defmodule PelemayBackend.Backend do
       {:fft, [:tensor, :opts], [:tensor]},
       {:ifft, [:tensor, :opts], [:tensor]}
     ] ++
-      for(op <- binary_ops, do: {op, [:left, :right], [:left, :right]}) ++
       for(op <- unary_ops, do: {op, [:tensor], [:tensor]})
 
   for {name, args, tensor_args} <- callbacks do
     args = Enum.map(args, &Macro.var(&1, __MODULE__))
-    _tensor_args = Enum.map(tensor_args, &Macro.var(&1, __MODULE__))
+    tensor_args = Enum.map(tensor_args, &Macro.var(&1, __MODULE__))
+    states = Enum.map(tensor_args, &quote(do: binary_state(unquote(&1))))
 
     @impl true
-    defdelegate unquote(name)(out, unquote_splicing(args)), to: Nx.BinaryBackend
+    def unquote(name)(out, unquote_splicing(args)) do
+      {unquote_splicing(tensor_args)} = {unquote_splicing(states)}
+      Nx.BinaryBackend.unquote(name)(out, unquote_splicing(args))
+    end
   end
 
-  binary_ops = [:multiply]
+  ## Views
 
-  unary_ops = []
+  @impl true
+  def reshape(out, %T{data: %B{view: nil} = data}), do: %{out | data: data}
 
-  callbacks =
-    [] ++
-      for(op <- binary_ops, do: {op, [:left, :right], [:left, :right]}) ++
-      for(op <- unary_ops, do: {op, [:tensor], [:tensor]})
+  def reshape(out, %T{data: %B{view: {offset, strides}}} = tensor) do
+    if contiguous?(tensor.shape, strides) do
+      put_view(out, tensor, offset, strides(out.shape))
+    else
+      reshape(out, copy(tensor))
+    end
+  end
 
-  for {name, args, tensor_args} <- callbacks do
-    args = Enum.map(args, &Macro.var(&1, __MODULE__))
-    tensor_args = Enum.map(tensor_args, &Macro.var(&1, __MODULE__))
+  @impl true
+  def squeeze(out, %T{data: %B{view: nil} = data}, _axes), do: %{out | data: data}
 
-    @impl true
-    def unquote(name)(out, unquote_splicing(args)) do
-      out = Nx.to_template(out)
+  def squeeze(out, %T{data: %B{view: {offset, strides}}} = tensor, axes) do
+    strides = for {stride, axis} <- Enum.with_index(strides), axis not in axes, do: stride
+    put_view(out, tensor, offset, strides)
+  end
+
+  @impl true
+  def transpose(out, tensor, axes) do
+    {offset, strides} = view(tensor)
+    put_view(out, tensor, offset, Enum.map(axes, &Enum.at(strides, &1)))
+  end
+
+  # The axis i of the tensor is the axis axes[i] of the result,
+  # and the other axes and the expanded axes of size 1 are of the stride 0.
+  @impl true
+  def broadcast(out, tensor, shape, axes) do
+    {offset, strides} = view(tensor)
+
+    mapped =
+      [axes, Tuple.to_list(tensor.shape), strides]
+      |> Enum.zip()
+      |> Map.new(fn {axis, dim, stride} ->
+        {axis, if(dim == elem(shape, axis), do: stride, else: 0)}
+      end)
+
+    strides = for axis <- 0..(tuple_size(shape) - 1)//1, do: Map.get(mapped, axis, 0)
+    put_view(out, tensor, offset, strides)
+  end
+
+  defp view(%T{data: %B{view: nil}, shape: shape}), do: {0, strides(shape)}
+  defp view(%T{data: %B{view: view}}), do: view
+
+  # The view is dropped if the result is exactly the data of the tensor.
+  defp put_view(out, %T{data: %B{state: state, view: view}} = tensor, offset, strides) do
+    if view == nil and offset == 0 and Nx.size(out) == Nx.size(tensor) and
+         contiguous?(out.shape, strides) do
+      %{out | data: %B{state: state}}
+    else
+      %{out | data: %B{state: state, view: {offset, strides}}}
+    end
+  end
+
+  defp strides(shape) do
+    shape
+    |> Tuple.to_list()
+    |> Enum.reverse()
+    |> Enum.map_reduce(1, fn dim, stride -> {stride, stride * dim} end)
+    |> elem(0)
+    |> Enum.reverse()
+  end
+
+  # The axes of size 1 can be of any stride.
+  defp contiguous?(shape, strides) do
+    [Tuple.to_list(shape), strides, strides(shape)]
+    |> Enum.zip()
+    |> Enum.all?(fn {dim, stride, contiguous} -> dim == 1 or stride == contiguous end)
+  end
+
+  @copy_code PelemayBackend.Engine.assemble("""
+             aloadt 0
+             copy
+             sendt
+             """)
 
-      expr_fun = fn unquote_splicing(tensor_args) ->
-        Nx.Defn.Expr.unquote(name)(out, unquote_splicing(args))
+  # Copies a view into a tensor of its own in the same storage.
+  defp copy(tensor), do: run(tensor, program(:copy, fn -> @copy_code end), [tensor])
+
+  defp gather(tensor) do
+    program = program(:copy, fn -> @copy_code end)
+    {data, _shape, _type} = PelemayBackend.Engine.run(program, [tensor])
+    data
+  end
+
+  blas_code =
+    [
+      dot: "dot",
+      gemv_n: "gemv :n",
+      gemv_t: "gemv :t",
+      gemm_nn: "gemm {:n, :n}",
+      gemm_nt: "gemm {:n, :t}",
+      gemm_tn: "gemm {:t, :n}",
+      gemm_tt: "gemm {:t, :t}"
+    ]
+    |> Map.new(fn {key, inst} ->
+      {
+        key,
+        PelemayBackend.Engine.assemble("""
+        aloadt 0
+        aloadt 1
+        #{inst}
+        sendt
+        """)
+      }
+    end)
+
+  @blas_code blas_code
+
+  @impl true
+  def dot(
+        %{type: {:f, size} = type} = out,
+        %{type: type} = left,
+        [c1],
+        [],
+        %{type: type} = right,
+        [c2],
+        []
+      )
+      when size in [32, 64] and tuple_size(left.shape) in [1, 2] and
+             tuple_size(right.shape) in [1, 2] do
+    # Nx.dot contracts c1 of left with c2 of right.
+    # The shapes are row major, so that contracting the first axis of a matrix
+    # is the product of the transposed matrix.
+    {key, args} =
+      case {tuple_size(left.shape), c1, tuple_size(right.shape), c2} do
+        {1, 0, 1, 0} -> {:dot, [left, right]}
+        {2, 1, 1, 0} -> {:gemv_n, [left, right]}
+        {2, 0, 1, 0} -> {:gemv_t, [left, right]}
+        {1, 0, 2, 1} -> {:gemv_n, [right, left]}
+        {1, 0, 2, 0} -> {:gemv_t, [right, left]}
+        {2, 1, 2, 0} -> {:gemm_nn, [left, right]}
+        {2, 1, 2, 1} -> {:gemm_nt, [left, right]}
+        {2, 0, 2, 0} -> {:gemm_tn, [left, right]}
+        {2, 0, 2, 1} -> {:gemm_tt, [left, right]}
       end
 
-      jit(expr_fun, [unquote_splicing(tensor_args)])
+    run(out, program({:blas, key}, fn -> Map.fetch!(@blas_code, key) end), args)
+  end
+
+  def dot(out, left, c1, b1, right, c2, b2) do
+    Nx.BinaryBackend.dot(out, binary_state(left), c1, b1, binary_state(right), c2, b2)
+  end
+
+  ## Elementwise binary operations
+
+  int_types = for t <- [:s, :u], size <- [8, 16, 32, 64], do: {t, size}
+  # {:f, 16} and {:bf, 16} are computed in {:f, 32}.
+  float_types = [{:f, 16}, {:bf, 16}, {:f, 32}, {:f, 64}]
+  all_types = int_types ++ float_types
+
+  # The types which the engine supports natively for each operation.
+  elementwise_ops =
+    [add: all_types, subtract: all_types, multiply: all_types, remainder: all_types] ++
+      [min: all_types, max: all_types] ++
+      [divide: float_types, power: float_types, atan2: float_types] ++
+      [quotient: int_types, bitwise_and: int_types, bitwise_or: int_types] ++
+      [bitwise_xor: int_types, left_shift: int_types, right_shift: int_types] ++
+      [equal: all_types, not_equal: all_types, greater: all_types, less: all_types] ++
+      [greater_equal: all_types, less_equal: all_types] ++
+      [logical_and: all_types, logical_or: all_types, logical_xor: all_types]
+
+  # The operations which return {:u, 8} compute in the merged type of the operands.
+  @u8_ops [:equal, :not_equal, :greater, :less, :greater_equal, :less_equal] ++
+            [:logical_and, :logical_or, :logical_xor]
+
+  @elementwise_code Map.new(elementwise_ops, fn {op, _types} ->
+                      {
+                        op,
+                        PelemayBackend.Engine.assemble("""
+                        aloadt 0
+                        aloadt 1
+                        #{op}
+                        sendt
+                        """)
+                      }
+                    end)
+
+  for {op, types} <- elementwise_ops do
+    @impl true
+    def unquote(op)(out, left, right) do
+      elementwise(unquote(op), unquote(Macro.escape(types)), out, left, right)
+    end
+  end
+
+  defp elementwise(op, types, out, left, right) do
+    type = if op in @u8_ops, do: Nx.Type.merge(left.type, right.type), else: out.type
+
+    if type in types do
+      args = [elementwise_arg(left, type, out.shape), elementwise_arg(right, type, out.shape)]
+      run(out, program(op, fn -> Map.fetch!(@elementwise_code, op) end), args)
+    else
+      apply(Nx.BinaryBackend, op, [out, binary_state(left), binary_state(right)])
+    end
+  end
+
+  # The engine broadcasts only tensors of size 1.
+  defp elementwise_arg(tensor, type, shape) do
+    tensor = if tensor.type == type, do: tensor, else: Nx.as_type(tensor, type)
+
+    if tensor.shape == shape or Nx.size(tensor) == 1 do
+      tensor
+    else
+      Nx.broadcast(tensor, shape)
+    end
+  end
+
+  ## Elementwise unary operations
+
+  # The types which the engine supports natively for each operation.
+  float_unary_ops = [:exp, :log, :log1p, :sigmoid, :tanh, :erf, :sqrt, :rsqrt]
+
+  elementwise_unary_ops =
+    for(op <- float_unary_ops, do: {op, float_types}) ++ [abs: all_types]
+
+  @elementwise_unary_code Map.new(elementwise_unary_ops, fn {op, _types} ->
+                            {
+                              op,
+                              PelemayBackend.Engine.assemble("""
+                              aloadt 0
+                              #{op}
+                              sendt
+                              """)
+                            }
+                          end)
+
+  for {op, types} <- elementwise_unary_ops do
+    @impl true
+    def unquote(op)(out, tensor) do
+      elementwise_unary(unquote(op), unquote(Macro.escape(types)), out, tensor)
+    end
+  end
+
+  # abs of a complex tensor is real, so it is not computed in the type of the result.
+  defp elementwise_unary(op, types, out, tensor) do
+    if out.type in types and not match?({:c, _}, tensor.type) do
+      args = [elementwise_arg(tensor, out.type, out.shape)]
+      run(out, program(op, fn -> Map.fetch!(@elementwise_unary_code, op) end), args)
+    else
+      apply(Nx.BinaryBackend, op, [out, binary_state(tensor)])
+    end
+  end
+
+  ## Conversions
+
+  @real_types all_types
+
+  @impl true
+  def as_type(out, tensor) do
+    if out.type in @real_types and tensor.type in @real_types do
+      code =
+        program({:as_type, out.type}, fn ->
+          PelemayBackend.Engine.assemble("""
+          aloadt 0
+          as_type #{inspect(out.type)}
+          sendt
+          """)
+        end)
+
+      run(out, code, [tensor])
+    else
+      Nx.BinaryBackend.as_type(out, binary_state(tensor))
     end
   end
 
+  ## Reductions
+
+  # The types which the engine supports natively.
+  # sum and product compute in the type of the result, such as {:s, 64} for {:s, 32}.
+  reduce_types = int_types ++ [{:f, 32}, {:f, 64}]
+
+  @reduce_types reduce_types
+
+  for op <- [:sum, :product, :reduce_max, :reduce_min, :all, :any] do
+    @impl true
+    def unquote(op)(out, tensor, opts) do
+      reduce(unquote(op), out, tensor, opts[:axes], opts[:keep_axes] || false, opts)
+    end
+  end
+
+  for op <- [:argmax, :argmin] do
+    @impl true
+    def unquote(op)(out, tensor, opts) do
+      axes = if opts[:axis], do: [opts[:axis]], else: nil
+      reduce(unquote(op), out, tensor, axes, opts[:keep_axis] || false, opts)
+    end
+  end
+
+  defp reduce(op, out, tensor, axes, keep_axes, opts) do
+    type = if op in [:sum, :product], do: out.type, else: tensor.type
+
+    typed? = type in @reduce_types and tensor.type in @reduce_types
+    indexed? = op not in [:argmax, :argmin] or out.type == {:s, 64}
+    nonempty? = op in [:sum, :product, :all, :any] or Nx.size(tensor) > 0
+
+    if typed? and tuple_size(tensor.shape) <= 8 and indexed? and nonempty? do
+      axes = axes || Nx.axes(tensor)
+      axes_mask = Enum.reduce(axes, 0, &Bitwise.bor(Bitwise.bsl(1, &1), &2))
+      tie_break = if opts[:tie_break] == :high, do: ", :high", else: ""
+      tensor = if tensor.type == type, do: tensor, else: Nx.as_type(tensor, type)
+
+      code =
+        program({op, axes_mask, keep_axes, tie_break}, fn ->
+          PelemayBackend.Engine.assemble("""
+          aloadt 0
+          #{op} {#{axes_mask}, #{keep_axes}#{tie_break}}
+          sendt
+          """)
+        end)
+
+      run(out, code, [tensor])
+    else
+      apply(Nx.BinaryBackend, op, [out, binary_state(tensor), opts])
+    end
+  end
+
+  # The programs are loaded once and kept in LockedCache.
+  defp program(key, fun) do
+    {_, program} =
+      PelemayBackend.Defn.LockedCache.run({__MODULE__, key}, fn ->
+        {nil, PelemayBackend.Engine.load(fun.())}
+      end)
+
+    program
+  end
+
+  # The result is kept in a native buffer if any of the arguments is.
+  defp run(out, code, args) do
+    storage = if Enum.any?(args, &buffer?/1), do: :buffer, else: :binary
+    {data, _shape, _type} = PelemayBackend.Engine.run(code, args, storage: storage)
+    from_binary(out, data)
+  end
+
+  defp buffer?(%T{data: %B{state: buffer}}), do: is_reference(buffer)
+  defp buffer?(_), do: false
+
+  # Nx.BinaryBackend reads the data of tensors as binaries.
+  defp binary_state(%T{data: %B{state: state, view: view}} = tensor)
+       when is_reference(state) or view != nil,
+       do: from_binary(tensor, to_binary(tensor))
+
+  defp binary_state(other), do: other
+
   defp jit(fun, args) do
-    # Logger.debug("fun: #{inspect(fun)}")
-    # Logger.debug("args: #{inspect(args)}")
     PelemayBackend.jit_apply(fun, args, on_conflict: :force)
   end
 
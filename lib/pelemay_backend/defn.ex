@@ -1,10 +1,59 @@
 defmodule PelemayBackend.Defn do
   @moduledoc false
 
-  require Logger
+  alias Nx.Defn.Expr
+  alias PelemayBackend.Defn.LockedCache
+  alias Nx.Tensor, as: T
 
   @doc false
-  def __stream__(_key, _input, _acc, _vars, _fun, [_args], _options) do
+  def __stream__(key, input, acc, vars, fun, [args], options) do
+    {{expr_cache_fun, comp_cache_fun}, options} = cache_funs(options)
+
+    args_key = Enum.map(vars, &Nx.to_template/1)
+
+    {_, {ref, expr}} =
+      expr_cache_fun.({key, args_key}, fn -> {nil, {make_ref(), fun.(vars)}} end)
+
+    input_count = Nx.Defn.Composite.count(input)
+    acc_count = Nx.Defn.Composite.count(acc)
+
+    {_, plan} =
+      comp_cache_fun.({__MODULE__, :stream, ref}, fn ->
+        {nil, stream_plan(expr, input_count, acc_count)}
+      end)
+
+    case plan do
+      {:engine, outputs, accs, owned, steps} ->
+        {acc_args, rest_args} = args |> Enum.drop(input_count) |> Enum.split(acc_count)
+        {output_expr, acc_expr} = expr
+        acc_ids = MapSet.new(accs, &id/1)
+
+        step = fn input_args, acc_args ->
+          env = Enum.reduce(steps, %{}, &run_step(&1, &2, input_args ++ acc_args ++ rest_args))
+
+          # The next step may take over the accumulator, so that an output which is one is copied.
+          results =
+            Enum.map(outputs, fn output ->
+              tensor = Map.fetch!(env, id(output))
+
+              if MapSet.member?(acc_ids, id(output)),
+                do: copy_result(tensor, output),
+                else: result(tensor, output)
+            end)
+
+          acc_args = accs |> Enum.map(&Map.fetch!(env, id(&1))) |> own(owned)
+          {rebuild(output_expr, results), acc_args}
+        end
+
+        done = fn acc_args -> rebuild(acc_expr, Enum.zip_with(acc_args, accs, &result/2)) end
+
+        # The initial accumulator is the caller's, so that it is always copied.
+        acc_args = own(acc_args, Enum.map(acc_args, fn _ -> false end))
+        [PelemayBackend.Defn.Stream.start_link(input, acc_args, step, done)]
+
+      :evaluator ->
+        Nx.Defn.Evaluator.__stream__(key, input, acc, vars, fun, [args], options)
+    end
   end
 
   @doc false
@@ -13,77 +62,651 @@ defmodule PelemayBackend.Defn do
   end
 
   @doc false
-  def __compile__(_key, _vars, _fun, options) do
-    # Logger.debug(
-    #  "__compile__(key: #{inspect(key)}, vars: #{inspect(vars)}, fun: #{inspect(fun)}, options: #{inspect(options)})"
-    # )
+  def __compile__(key, vars, fun, options) do
+    {{expr_cache_fun, comp_cache_fun}, options} = cache_funs(options)
+
+    # The function is traced once for each signature of the arguments,
+    # and the traced expression is compiled once into engine programs.
+    args_key = Enum.map(vars, &Nx.to_template/1)
+
+    {_, {ref, expr}} =
+      expr_cache_fun.({key, args_key}, fn -> {nil, {make_ref(), fun.(vars)}} end)
+
+    {_, plan} = comp_cache_fun.({__MODULE__, ref}, fn -> {nil, plan(expr)} end)
+
+    case plan do
+      {:engine, [root], steps} ->
+        fn [args] -> [run(root, steps, args)] end
+
+      :evaluator ->
+        Nx.Defn.Evaluator.__compile__(key, vars, fun, options)
+    end
+  end
+
+  defp cache_funs(options) do
+    {_run_options, options} = Keyword.pop(options, :run_options, [])
+    {cache?, options} = Keyword.pop(options, :cache, true)
+
+    if cache? do
+      Keyword.pop(options, PelemayBackend, {&LockedCache.run/2, &LockedCache.run/2})
+    else
+      cache_fun = fn _key, fun -> fun.() end
+      Keyword.pop(options, PelemayBackend, {cache_fun, cache_fun})
+    end
+  end
+
+  defp plan(%T{data: %Expr{}} = expr) do
+    compile([expr])
+  catch
+    :unsupported -> :evaluator
+  end
+
+  defp plan(_container), do: :evaluator
+
+  # The stream function returns {output, acc}, whose parameters are
+  # the input, the accumulator and the rest in this order.
+  #
+  # The accumulator is kept in native buffers owned by the stream
+  # from a chunk to the next, so that the programs which read it last
+  # take it over by donation and accumulate in place.
+  defp stream_plan({output, acc}, input_count, acc_count) do
+    outputs = Nx.Defn.Composite.flatten_list([output])
+    accs = Nx.Defn.Composite.flatten_list([acc])
+
+    if Enum.all?(outputs ++ accs, &match?(%T{data: %Expr{}}, &1)) do
+      owned = Enum.to_list(input_count..(input_count + acc_count - 1)//1)
+      {:engine, roots, steps} = compile(outputs ++ accs, accs, owned)
+      {outputs, accs} = Enum.split(roots, length(outputs))
+      {:engine, outputs, accs, owned_accs(accs, steps, owned), steps}
+    else
+      :evaluator
+    end
+  catch
+    :unsupported -> :evaluator
+  end
+
+  defp stream_plan(_container, _input_count, _acc_count), do: :evaluator
+
+  # Whether each result of the accumulator is a buffer owned by the stream,
+  # that is the result of a program or the accumulator passed through,
+  # unless it is the same as an earlier one. The others are copied.
+  defp owned_accs(accs, steps, owned) do
+    ids =
+      for step <- steps, into: MapSet.new() do
+        case step do
+          {:engine, id, _node, _code, _inputs, _opts} -> id
+          {:parameter, id, i} -> if i in owned, do: id
+          _ -> nil
+        end
+      end
+
+    {owned_accs, _seen} =
+      Enum.map_reduce(accs, MapSet.new(), fn acc, seen ->
+        id = id(acc)
+        {MapSet.member?(ids, id) and not MapSet.member?(seen, id), MapSet.put(seen, id)}
+      end)
+
+    owned_accs
+  end
+
+  ## Compilation of the graph
+  #
+  # The graph is compiled into steps run in the topological order.
+  # Each step computes a node which should be materialized,
+  # that is the result, or an operand of a node which the engine does not support.
+  #
+  # A node which the engine supports is computed by an engine program,
+  # which inlines the supported nodes it depends on. The nodes used more than
+  # once in a program are kept in locals by `store` and `load`, and the last
+  # use takes the local by `take`, so that the engine can compute in place over it.
+  # The result of a program read only by later programs is kept in a native
+  # buffer, which the last of them takes over by donation.
+  # A node which the engine does not support falls back to Nx.BinaryBackend.
+  #
+  # The functions, control flow and tokens can't fall back per node,
+  # so that the graph containing them throws :unsupported and
+  # the whole of it is evaluated by Nx.Defn.Evaluator, as is a container of results
+  # but for streaming.
+  #
+  # The results in kept are kept in native buffers, and the parameters of
+  # the indices in owned are buffers which the programs may take over.
+
+  @unsupported_ops [:fun, :cond, :while, :elem, :token, :attach_token, :optional]
+
+  defp compile(exprs, kept \\ [], owned \\ []) do
+    roots = Enum.map(exprs, &unwrap/1)
+    {order, _visited} = Enum.reduce(roots, {[], MapSet.new()}, &topsort/2)
+    order = Enum.reverse(order)
+    kinds = Map.new(order, &{id(&1), kind(&1)})
+
+    # A node which falls back is a step of its own, whether an engine program
+    # or another fallback reads it.
+    materialized =
+      Enum.reduce(order, MapSet.new(roots, &id/1), fn node, acc ->
+        case Map.fetch!(kinds, id(node)) do
+          :fallback ->
+            operands(node)
+            |> Enum.reduce(acc, &MapSet.put(&2, id(&1)))
+            |> MapSet.put(id(node))
+
+          _ ->
+            acc
+        end
+      end)
+
+    # The parameters and tensors are always put into the environment,
+    # while the constants in engine programs are materialized in the types they need.
+    steps =
+      for node <- order,
+          kind = Map.fetch!(kinds, id(node)),
+          MapSet.member?(materialized, id(node)) or
+            match?({op, _} when op in [:parameter, :tensor], kind) do
+        case kind do
+          {:engine, _, _} -> engine_step(node, kinds, materialized)
+          :fallback -> {:fallback, node}
+          {:constant, number} -> {:constant, id(node), constant(number, node.type, node.shape)}
+          {:tensor, tensor} -> {:constant, id(node), tensor}
+          {:parameter, i} -> {:parameter, id(node), i}
+        end
+      end
+
+    kept = MapSet.new(kept, &id(unwrap(&1)))
+    {:engine, roots, plan_buffers(steps, MapSet.new(roots, &id/1), kept, owned)}
+  end
+
+  defp plan_buffers(steps, roots, kept, owned) do
+    # The readers of each node, the last first.
+    readers =
+      Enum.reduce(steps, %{}, fn
+        {:engine, id, _node, _code, inputs, _loads}, acc ->
+          Enum.reduce(inputs, acc, fn
+            {:node, input}, acc -> Map.update(acc, input, [{:engine, id}], &[{:engine, id} | &1])
+            _, acc -> acc
+          end)
+
+        {:fallback, node}, acc ->
+          Enum.reduce(operands(node), acc, fn operand, acc ->
+            Map.update(acc, id(operand), [:fallback], &[:fallback | &1])
+          end)
+
+        _, acc ->
+          acc
+      end)
+
+    buffered =
+      for step <- steps,
+          id = buffer_candidate(step, owned),
+          not MapSet.member?(roots, id),
+          (r = Map.get(readers, id, [])) != [] and Enum.all?(r, &match?({:engine, _}, &1)),
+          into: MapSet.new(),
+          do: id
+
+    Enum.map(steps, fn
+      {:engine, id, node, code, inputs, loads} ->
+        donate =
+          for {{{:node, input}, 1}, i} <- inputs |> Enum.zip(loads) |> Enum.with_index(),
+              MapSet.member?(buffered, input) and hd(Map.fetch!(readers, input)) == {:engine, id},
+              do: i
+
+        buffer? = MapSet.member?(buffered, id) or MapSet.member?(kept, id)
+        storage = if buffer?, do: :buffer, else: :binary
+        {:engine, id, node, code, inputs, storage: storage, donate: donate}
+
+      step ->
+        step
+    end)
+  end
+
+  defp buffer_candidate({:engine, id, _node, _code, _inputs, _loads}, _owned), do: id
+  defp buffer_candidate({:parameter, id, i}, owned), do: if(i in owned, do: id)
+  defp buffer_candidate(_step, _owned), do: nil
+
+  defp run(root, steps, args) do
+    env = Enum.reduce(steps, %{}, &run_step(&1, &2, args))
+    result(Map.fetch!(env, id(root)), root)
+  end
+
+  # The result keeps the storage of the engine rather than being copied,
+  # unless the default backend is another one.
+  defp result(tensor, root) do
+    {backend, _options} = Nx.default_backend()
+
+    if tensor.data.__struct__ == backend do
+      Nx.reshape(tensor, root.shape, names: root.names)
+    else
+      copy_result(tensor, root)
+    end
+  end
+
+  defp copy_result(tensor, root) do
+    tensor
+    |> Nx.to_binary()
+    |> Nx.from_binary(root.type)
+    |> Nx.reshape(root.shape, names: root.names)
+  end
+
+  # Copies the tensors not owned into native buffers of their own.
+  defp own(tensors, owned) do
+    Enum.zip_with(tensors, owned, fn
+      tensor, true -> tensor
+      tensor, false -> Nx.backend_copy(tensor, {PelemayBackend.Backend, storage: :buffer})
+    end)
+  end
+
+  defp rebuild(container, results) do
+    {container, []} =
+      Nx.Defn.Composite.traverse(container, results, fn _expr, [result | rest] ->
+        {result, rest}
+      end)
+
+    container
+  end
+
+  defp run_step({:parameter, id, i}, env, args), do: Map.put(env, id, Enum.at(args, i))
+
+  defp run_step({:constant, id, tensor}, env, _args), do: Map.put(env, id, tensor)
+
+  defp run_step({:engine, id, node, code, inputs, opts}, env, _args) do
+    args = Enum.map(inputs, &input(&1, env))
+    {data, _shape, _type} = PelemayBackend.Engine.run(code, args, opts)
+    Map.put(env, id, PelemayBackend.Backend.from_binary(node, data, []))
+  end
+
+  # The creation ops take the backend options last, which Nx.Defn.Evaluator appends too.
+  @creation_ops [:eye, :iota, :from_binary, :random_uniform, :random_normal]
+
+  defp run_step({:fallback, %T{data: %Expr{id: id, op: op, args: args}} = node}, env, _args) do
+    args = Enum.map(args, &fallback_arg(&1, env))
+    args = if op in @creation_ops, do: args ++ [[]], else: args
+    Map.put(env, id, apply(Nx.BinaryBackend, op, [node | args]))
+  end
+
+  defp input({:node, id}, env), do: Map.fetch!(env, id)
+  defp input({:constant, number, type, shape}, _env), do: constant(number, type, shape)
+
+  # Nx.BinaryBackend reads the data of tensors as binaries, not native buffers or views.
+  defp fallback_arg(%T{} = t, env) do
+    case Map.fetch!(env, id(unwrap(t))) do
+      %T{data: %PelemayBackend.Backend{state: state, view: view}} = t
+      when is_reference(state) or view != nil ->
+        Nx.backend_copy(t, Nx.BinaryBackend)
+
+      t ->
+        t
+    end
+  end
+  defp fallback_arg(list, env) when is_list(list), do: Enum.map(list, &fallback_arg(&1, env))
+  defp fallback_arg(other, _env), do: other
+
+  defp constant(number, type, shape) do
+    number
+    |> Nx.tensor(type: type, backend: Nx.BinaryBackend)
+    |> Nx.broadcast(shape)
+  end
+
+  defp id(%T{data: %Expr{id: id}}), do: id
+
+  # The metadata such as stop_grad does not affect the evaluation.
+  defp unwrap(%T{data: %Expr{op: :metadata, args: [expr, _metadata]}}), do: unwrap(expr)
+  defp unwrap(t), do: t
+
+  defp operands(%T{data: %Expr{op: op}}) when op in [:parameter, :constant, :tensor], do: []
 
-    # Logger.debug("fun #{inspect(fun)}(#{inspect(vars)}): #{inspect(fun.(vars))}")
+  defp operands(%T{data: %Expr{args: args}}) do
+    Enum.flat_map(args, fn
+      %T{} = t -> [unwrap(t)]
+      list when is_list(list) -> for %T{} = t <- list, do: unwrap(t)
+      _ -> []
+    end)
+  end
+
+  defp topsort(%T{data: %Expr{id: id, op: op, args: args}} = node, {order, visited}) do
+    cond do
+      MapSet.member?(visited, id) ->
+        {order, visited}
+
+      op in @unsupported_ops or Enum.any?(args, &function_arg?/1) ->
+        throw(:unsupported)
+
+      true ->
+        {order, visited} =
+          Enum.reduce(operands(node), {order, MapSet.put(visited, id)}, &topsort/2)
+        {[node | order], visited}
+    end
+  end
 
-    {_run_options, _compile_options} = Keyword.pop(options, :run_options, [])
+  defp function_arg?(%T{data: %Expr{op: :fun}}), do: true
+  defp function_arg?(arg), do: is_function(arg)
+
+  ## Code generation of engine programs
+
+  defp engine_step(node, kinds, materialized) do
+    uses = count_uses(node, kinds, materialized, %{})
+    state = %{code: [], inputs: [], loads: %{}, locals: %{}, remaining: %{}, uses: uses}
+    state = emit(node, nil, nil, kinds, materialized, state, true)
 
     code =
-      """
-      aloadt 0
-      copy
-      is_scalar
-      skip {10, {:if, true}}
-      aloadt 1
-      is_scalar
-      skip {4, {:if, true}}
-      sende 'multiply with two vectors is not supported.'
-      pop2
-      pop2
-      return
-      scal 1
-      sendt
-      return
-      aloadt 1
-      copy
-      swap
-      scal 1
-      sendt
-      """
+      [state.code, "sendt\n"]
+      |> IO.iodata_to_binary()
       |> PelemayBackend.Engine.assemble()
+      |> PelemayBackend.Engine.load()
+
+    inputs = Enum.reverse(state.inputs)
+    loads = Enum.map(0..(length(inputs) - 1)//1, &Map.fetch!(state.loads, &1))
+    {:engine, id(node), node, code, inputs, loads}
+  end
+
+  defp inline?(node, kinds, materialized, root?) do
+    match?({:engine, _, _}, Map.fetch!(kinds, id(node))) and
+      (root? or not MapSet.member?(materialized, id(node)))
+  end
+
+  defp count_uses(node, kinds, materialized, uses) do
+    {:engine, operands, _inst} = Map.fetch!(kinds, id(node))
+
+    Enum.reduce(operands, uses, fn {operand, _type, _shape}, uses ->
+      id = id(operand)
+      seen? = Map.has_key?(uses, id)
+      uses = Map.update(uses, id, 1, &(&1 + 1))
+
+      if not seen? and inline?(operand, kinds, materialized, false) do
+        count_uses(operand, kinds, materialized, uses)
+      else
+        uses
+      end
+    end)
+  end
+
+  # type and shape are those in which a constant operand is materialized,
+  # or nil to keep those of the constant.
+  defp emit(node, type, shape, kinds, materialized, state, root? \\ false) do
+    id = id(node)
+
+    cond do
+      Map.has_key?(state.locals, id) ->
+        local = Map.fetch!(state.locals, id)
+
+        # The uses are counted per operand, which may overcount those of
+        # the leaves of fuse, so that a local is never taken too early.
+        case Map.fetch!(state.remaining, id) do
+          1 ->
+            push(%{state | remaining: Map.put(state.remaining, id, 0)}, "take #{local}")
+
+          n ->
+            push(%{state | remaining: Map.put(state.remaining, id, n - 1)}, "load #{local}")
+        end
+
+      inline?(node, kinds, materialized, root?) ->
+        state =
+          case fusion(node, kinds, materialized, state) do
+            {:ok, leaves, body} ->
+              state =
+                Enum.reduce(leaves, state, fn {leaf, type, shape}, state ->
+                  emit(leaf, type, shape, kinds, materialized, state)
+                end)
 
-    fn [args] ->
-      args =
-        Enum.map(args, fn a ->
-          cond do
-            is_struct(a, Nx.Tensor) ->
-              {
-                Nx.size(a),
-                Nx.shape(a),
-                Nx.type(a),
-                Nx.to_binary(a)
-              }
-
-            true ->
-              a
+              state = push(state, "fuse {#{length(leaves)}, #{length(body)}}")
+              Enum.reduce(body, state, &push(&2, &1))
+
+            :error ->
+              {:engine, operands, inst} = Map.fetch!(kinds, id)
+
+              state =
+                Enum.reduce(operands, state, fn {operand, type, shape}, state ->
+                  emit(operand, type, shape, kinds, materialized, state)
+                end)
+
+              push(state, inst)
           end
-        end)
 
-      try do
-        case PelemayBackend.Engine.execute(code, args, self()) do
-          :ok -> :ok
-          {:error, reason} -> raise RuntimeError, message: List.to_string(reason)
+        uses = Map.get(state.uses, id, 1)
+
+        if uses > 1 do
+          local = map_size(state.locals)
+          state = push(state, "dup\nstore #{local}")
+
+          %{
+            state
+            | locals: Map.put(state.locals, id, local),
+              remaining: Map.put(state.remaining, id, uses - 1)
+          }
+        else
+          state
         end
-      rescue
-        e in ErlangError -> raise RuntimeError, message: List.to_string(e.original)
+
+      true ->
+        input =
+          case Map.fetch!(kinds, id) do
+            {:constant, number} -> {:constant, number, type || node.type, shape || node.shape}
+            _ -> {:node, id}
+          end
+
+        index =
+          Enum.find_index(Enum.reverse(state.inputs), &(&1 == input)) || length(state.inputs)
+
+        state =
+          if index == length(state.inputs),
+            do: %{state | inputs: [input | state.inputs]},
+            else: state
+        state = %{state | loads: Map.update(state.loads, index, 1, &(&1 + 1))}
+        push(state, "aloadt #{index}")
+    end
+  end
+
+  defp push(state, line), do: %{state | code: [state.code, line, "\n"]}
+
+  ## Classification of nodes
+
+  @int_types for t <- [:s, :u], size <- [8, 16, 32, 64], do: {t, size}
+  @blas_types [{:f, 32}, {:f, 64}]
+  # {:f, 16} and {:bf, 16} are computed in {:f, 32}.
+  @float_types [{:f, 16}, {:bf, 16}] ++ @blas_types
+  @all_types @int_types ++ @float_types
+  @reduce_types @int_types ++ @blas_types
+
+  # The types which the engine supports natively for each operation.
+  @binary_types Map.new(
+                  [add: @all_types, subtract: @all_types, remainder: @all_types] ++
+                    [multiply: @all_types, min: @all_types, max: @all_types] ++
+                    [divide: @float_types, power: @float_types, atan2: @float_types] ++
+                    [quotient: @int_types, bitwise_and: @int_types, bitwise_or: @int_types] ++
+                    [bitwise_xor: @int_types, left_shift: @int_types, right_shift: @int_types] ++
+                    [equal: @all_types, not_equal: @all_types, greater: @all_types] ++
+                    [less: @all_types, greater_equal: @all_types, less_equal: @all_types] ++
+                    [logical_and: @all_types, logical_or: @all_types, logical_xor: @all_types]
+                )
+
+  # The operations which return {:u, 8} compute in the merged type of the operands.
+  @u8_ops [:equal, :not_equal, :greater, :less, :greater_equal, :less_equal] ++
+            [:logical_and, :logical_or, :logical_xor]
+
+  @unary_types %{
+    exp: @float_types,
+    log: @float_types,
+    log1p: @float_types,
+    sigmoid: @float_types,
+    tanh: @float_types,
+    erf: @float_types,
+    sqrt: @float_types,
+    rsqrt: @float_types,
+    abs: @all_types
+  }
+
+  @reduce_ops [:sum, :product, :reduce_max, :reduce_min, :all, :any, :argmax, :argmin]
+
+  # {:engine, [{operand, type, shape}], instruction} if the engine supports the node,
+  # where type and shape are those of a constant operand, or :fallback otherwise.
+  defp kind(%T{data: %Expr{op: :parameter, args: [i]}}), do: {:parameter, i}
+  defp kind(%T{data: %Expr{op: :constant, args: [number]}}), do: {:constant, number}
+  defp kind(%T{data: %Expr{op: :tensor, args: [tensor]}}), do: {:tensor, tensor}
+
+  defp kind(%T{data: %Expr{op: op, args: [left, right]}} = out)
+       when is_map_key(@binary_types, op) do
+    {left, right} = {unwrap(left), unwrap(right)}
+    type = if op in @u8_ops, do: Nx.Type.merge(left.type, right.type), else: out.type
+
+    # A constant operand is broadcast by the engine, unless the result is of size 1.
+    shape = if Nx.size(out) > 1, do: {}, else: out.shape
+
+    if type in Map.fetch!(@binary_types, op) and binary_operand?(left, type, out) and
+         binary_operand?(right, type, out) do
+      {:engine, [{left, type, shape}, {right, type, shape}], "#{op}"}
+    else
+      :fallback
+    end
+  end
+
+  defp kind(%T{data: %Expr{op: op, args: [tensor]}} = out) when is_map_key(@unary_types, op) do
+    tensor = unwrap(tensor)
+
+    if out.type in Map.fetch!(@unary_types, op) and operand?(tensor, out.type) do
+      {:engine, [{tensor, out.type, nil}], "#{op}"}
+    else
+      :fallback
+    end
+  end
+
+  defp kind(%T{data: %Expr{op: op, args: [tensor, opts]}} = out) when op in @reduce_ops do
+    tensor = unwrap(tensor)
+
+    {type, axes, keep_axes} =
+      case op do
+        op when op in [:sum, :product] ->
+          {out.type, opts[:axes], opts[:keep_axes]}
+
+        op when op in [:argmax, :argmin] ->
+          {tensor.type, opts[:axis] && [opts[:axis]], opts[:keep_axis]}
+
+        _ ->
+          {tensor.type, opts[:axes], opts[:keep_axes]}
+      end
+
+    if type in @reduce_types and operand?(tensor, type) and tuple_size(tensor.shape) <= 8 and
+         (op not in [:argmax, :argmin] or out.type == {:s, 64}) and
+         (op in [:sum, :product, :all, :any] or Nx.size(tensor) > 0) do
+      axes_mask = Enum.reduce(axes || Nx.axes(tensor), 0, &Bitwise.bor(Bitwise.bsl(1, &1), &2))
+      tie_break = if opts[:tie_break] == :high, do: ", :high", else: ""
+      {:engine, [{tensor, type, nil}], "#{op} {#{axes_mask}, #{keep_axes || false}#{tie_break}}"}
+    else
+      :fallback
+    end
+  end
+
+  defp kind(%T{data: %Expr{op: :as_type, args: [tensor]}} = out) do
+    tensor = unwrap(tensor)
+
+    if out.type in @all_types and tensor.type in @all_types do
+      {:engine, [{tensor, nil, nil}], "as_type #{inspect(out.type)}"}
+    else
+      :fallback
+    end
+  end
+
+  defp kind(%T{data: %Expr{op: :dot, args: [left, [c1], [], right, [c2], []]}} = out)
+       when out.type in @blas_types do
+    {left, right} = {unwrap(left), unwrap(right)}
+
+    # The shapes are row major, so that contracting the first axis of a matrix
+    # is the product of the transposed matrix.
+    with true <- left.type == out.type and right.type == out.type,
+         {:ok, operands, inst} <-
+           dot(tuple_size(left.shape), c1, tuple_size(right.shape), c2, left, right) do
+      {:engine, Enum.map(operands, &{&1, nil, nil}), inst}
+    else
+      _ -> :fallback
+    end
+  end
+
+  defp kind(_node), do: :fallback
+
+  defp dot(1, 0, 1, 0, left, right), do: {:ok, [left, right], "dot"}
+  defp dot(2, 1, 1, 0, left, right), do: {:ok, [left, right], "gemv :n"}
+  defp dot(2, 0, 1, 0, left, right), do: {:ok, [left, right], "gemv :t"}
+  defp dot(1, 0, 2, 1, left, right), do: {:ok, [right, left], "gemv :n"}
+  defp dot(1, 0, 2, 0, left, right), do: {:ok, [right, left], "gemv :t"}
+  defp dot(2, 1, 2, 0, left, right), do: {:ok, [left, right], "gemm {:n, :n}"}
+  defp dot(2, 1, 2, 1, left, right), do: {:ok, [left, right], "gemm {:n, :t}"}
+  defp dot(2, 0, 2, 0, left, right), do: {:ok, [left, right], "gemm {:t, :n}"}
+  defp dot(2, 0, 2, 1, left, right), do: {:ok, [left, right], "gemm {:t, :t}"}
+  defp dot(_, _, _, _, _, _), do: :error
+
+  # A constant is materialized in the type in which the node computes.
+  defp operand?(%T{data: %Expr{op: :constant}}, _type), do: true
+  defp operand?(tensor, type), do: tensor.type == type
+
+  # The engine broadcasts only tensors of size 1,
+  # and the shape of the result is that of the larger operand.
+  defp binary_operand?(%T{data: %Expr{op: :constant}}, _type, _out), do: true
+
+  defp binary_operand?(tensor, type, out) do
+    tensor.type == type and
+      (tensor.shape == out.shape or (Nx.size(tensor) == 1 and Nx.size(out) > 1))
+  end
+
+  ## Loop fusion
+  #
+  # A tree of elementwise operations is computed by `fuse` in one loop,
+  # which keeps the intermediate values in the cache instead of sweeping
+  # the memory for each of them. The tree extends to the operands used only
+  # once in the program, and the other operands are the leaves, which are
+  # the inputs of `fuse`.
+
+  @fuse_max_ops 64
+  @fuse_max_depth 8
+  @fuse_max_inputs 16
+
+  defp fusion(node, kinds, materialized, state) do
+    if elementwise?(node, kinds) and Nx.size(node) > 1 do
+      {{leaves, body, ops}, depth} =
+        fuse_walk(node, nil, nil, kinds, materialized, state, {[], [], 0}, true)
+
+      if ops >= 2 and length(body) <= @fuse_max_ops and length(leaves) <= @fuse_max_inputs and
+           depth <= @fuse_max_depth do
+        {:ok, leaves |> Enum.reverse() |> Enum.map(&elem(&1, 1)), Enum.reverse(body)}
+      else
+        :error
       end
+    else
+      :error
+    end
+  end
+
+  # Returns the body in reverse order and the depth of the stack it needs.
+  defp fuse_walk(node, type, shape, kinds, materialized, state, {leaves, body, ops}, root?) do
+    id = id(node)
+
+    if root? or
+         (elementwise?(node, kinds) and inline?(node, kinds, materialized, false) and
+            not Map.has_key?(state.locals, id) and Map.get(state.uses, id, 1) == 1) do
+      {:engine, operands, inst} = Map.fetch!(kinds, id)
+
+      {depths, {leaves, body, ops}} =
+        Enum.map_reduce(operands, {leaves, body, ops}, fn {operand, type, shape}, acc ->
+          {acc, depth} = fuse_walk(operand, type, shape, kinds, materialized, state, acc, false)
+          {depth, acc}
+        end)
 
-      receive do
-        {:result, binary, shape, type} ->
-          Nx.from_binary(binary, type)
-          |> Nx.reshape(shape)
-          |> then(&[&1])
-
-        {:error, reason} ->
-          raise RuntimeError, message: List.to_string(reason)
-      after
-        5000 ->
-          raise RuntimeError, message: "timeout"
+      depth =
+        case depths do
+          [left, right] -> max(left, right + 1)
+          [operand] -> operand
+        end
+
+      {{leaves, [inst | body], ops + 1}, depth}
+    else
+      key = {id, type, shape}
+      index = Enum.find_index(Enum.reverse(leaves), &(elem(&1, 0) == key))
+
+      if index do
+        {{leaves, ["aloadt #{index}" | body], ops}, 1}
+      else
+        {{[{key, {node, type, shape}} | leaves], ["aloadt #{length(leaves)}" | body], ops}, 1}
       end
     end
   end
+
+  defp elementwise?(%T{data: %Expr{op: op}} = node, kinds) do
+    (is_map_key(@binary_types, op) or is_map_key(@unary_types, op)) and
+      match?({:engine, _, _}, Map.fetch!(kinds, id(node)))
+  end
 end
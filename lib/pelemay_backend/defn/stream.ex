@@ -0,0 +1,95 @@
+defmodule PelemayBackend.Defn.Stream do
+  @moduledoc false
+
+  # The process of a stream compiled into engine programs.
+  #
+  # The process keeps the accumulator in native buffers from a chunk
+  # to the next, so that it is never copied back to Elixir until done.
+  # step computes {output, acc} from the flattened input of a chunk
+  # and the accumulator, and done computes the result of the accumulator.
+  use GenServer
+
+  @derive {Inspect, only: [:pid, :input]}
+  defstruct [:pid, :input]
+
+  def start_link(input, acc, step, done) do
+    {:ok, pid} = GenServer.start_link(__MODULE__, {acc, step, done})
+    %PelemayBackend.Defn.Stream{pid: pid, input: input}
+  end
+
+  @impl true
+  def init({acc, step, done}) do
+    {:ok, %{acc: acc, step: step, done: done, outputs: :queue.new(), waiting: :queue.new()}}
+  end
+
+  @impl true
+  def handle_cast({:send, input}, %{acc: acc, step: step} = state) do
+    {output, acc} = step.(input, acc)
+    state = %{state | acc: acc}
+
+    case :queue.out(state.waiting) do
+      {{:value, from}, waiting} ->
+        GenServer.reply(from, output)
+        {:noreply, %{state | waiting: waiting}}
+
+      {:empty, _} ->
+        {:noreply, %{state | outputs: :queue.in(output, state.outputs)}}
+    end
+  end
+
+  @impl true
+  def handle_call(:recv, from, state) do
+    case :queue.out(state.outputs) do
+      {{:value, output}, outputs} -> {:reply, output, %{state | outputs: outputs}}
+      {:empty, _} -> {:noreply, %{state | waiting: :queue.in(from, state.waiting)}}
+    end
+  end
+
+  def handle_call(:done, _from, state) do
+    if :queue.is_empty(state.outputs) do
+      {:stop, :normal, {:ok, state.done.(state.acc)}, state}
+    else
+      {:reply, {:error, "cannot mark stream as done when there are results to recv"}, state}
+    end
+  end
+
+  defimpl Nx.Stream do
+    def send(%{pid: pid, input: input}, data) do
+      templates = Nx.Defn.Composite.flatten_list([input])
+      tensors = [data] |> Nx.Defn.Composite.flatten_list() |> Enum.map(&Nx.to_tensor/1)
+
+      compatible? =
+        length(templates) == length(tensors) and
+          Enum.all?(Enum.zip(templates, tensors), fn {template, tensor} ->
+            Nx.shape(template) == Nx.shape(tensor) and Nx.type(template) == Nx.type(tensor)
+          end)
+
+      unless compatible? do
+        raise ArgumentError, """
+        Nx stream expected a tensor of the same type and shape as the input template on send.
+
+        Input template:
+
+        #{inspect(input)}
+
+        Sent data:
+
+        #{inspect(data)}
+        """
+      end
+
+      GenServer.cast(pid, {:send, tensors})
+    end
+
+    def recv(%{pid: pid}) do
+      GenServer.call(pid, :recv, :infinity)
+    end
+
+    def done(%{pid: pid}) do
+      case GenServer.call(pid, :done, :infinity) do
+        {:ok, acc} -> acc
+        {:error, message} -> raise RuntimeError, message: message
+      end
+    end
+  end
+end
@@ -3,13 +3,44 @@ defmodule PelemayBackend.Engine do
   Document for `PelemayBackend.Engine`.
   """
   import Bitwise
-  require Logger
 
   @opcode_macro "PELEMAY_ENGINE_OPCODE_H"
   @opcode_header "nif_src/opcode.h"
 
+  @binary_insts [
+    :add,
+    :subtract,
+    :multiply,
+    :divide,
+    :power,
+    :remainder,
+    :atan2,
+    :min,
+    :max,
+    :quotient,
+    :bitwise_and,
+    :bitwise_or,
+    :bitwise_xor,
+    :left_shift,
+    :right_shift,
+    :equal,
+    :not_equal,
+    :greater,
+    :less,
+    :greater_equal,
+    :less_equal,
+    :logical_and,
+    :logical_or,
+    :logical_xor
+  ]
+
+  @unary_insts [:exp, :log, :log1p, :sigmoid, :tanh, :erf, :sqrt, :rsqrt, :abs]
+
+  @reduce_insts [:sum, :product, :reduce_max, :reduce_min, :argmax, :argmin, :all, :any]
+
   @type opcode :: non_neg_integer()
   @type operand :: any()
+  @type program :: reference()
 
   @doc """
   Gets key of opcode.
@@ -31,6 +62,49 @@ defmodule PelemayBackend.Engine do
       copy: 0x0002,
       dot: 0x0003,
       axpy: 0x0004,
+      axpby: 0x0005,
+      add: 0x0100,
+      subtract: 0x0101,
+      multiply: 0x0102,
+      divide: 0x0103,
+      power: 0x0104,
+      remainder: 0x0105,
+      atan2: 0x0106,
+      min: 0x0107,
+      max: 0x0108,
+      quotient: 0x0109,
+      bitwise_and: 0x010A,
+      bitwise_or: 0x010B,
+      bitwise_xor: 0x010C,
+      left_shift: 0x010D,
+      right_shift: 0x010E,
+      equal: 0x010F,
+      not_equal: 0x0110,
+      greater: 0x0111,
+      less: 0x0112,
+      greater_equal: 0x0113,
+      less_equal: 0x0114,
+      logical_and: 0x0115,
+      logical_or: 0x0116,
+      logical_xor: 0x0117,
+      exp: 0x0200,
+      log: 0x0201,
+      log1p: 0x0202,
+      sigmoid: 0x0203,
+      tanh: 0x0204,
+      erf: 0x0205,
+      sqrt: 0x0206,
+      rsqrt: 0x0207,
+      abs: 0x0208,
+      sum: 0x0300,
+      product: 0x0301,
+      reduce_max: 0x0302,
+      reduce_min: 0x0303,
+      argmax: 0x0304,
+      argmin: 0x0305,
+      all: 0x0306,
+      any: 0x0307,
+      as_type: 0x0400,
       gemv: 0x1000,
       gemm: 0x2000,
       aloadt: 0x8000,
@@ -42,7 +116,33 @@ defmodule PelemayBackend.Engine do
       pop: 0x8006,
       pop2: 0x8007,
       swap: 0x8008,
-      sende: 0x8009
+      sende: 0x8009,
+      store: 0x800A,
+      load: 0x800B,
+      fuse: 0x800C,
+      take: 0x800D
+    }
+  end
+
+  @doc """
+  Gets map of transposition to flag of the operands of gemv and gemm.
+  """
+  def transpose_flag() do
+    %{
+      a: 0x1,
+      b: 0x2
+    }
+  end
+
+  @doc """
+  Gets map of option to flag of the operand of reductions.
+
+  The lower 8 bits of the operand are the mask of the reduced axes.
+  """
+  def reduce_flag() do
+    %{
+      keep_axes: 0x100,
+      tie_break_high: 0x200
     }
   end
 
@@ -190,6 +290,17 @@ defmodule PelemayBackend.Engine do
       btb_c64 = 2,
       btb_c128 = 3,
     };
+
+    enum transpose_flag {
+      TRANSPOSE_A = 0x1,
+      TRANSPOSE_B = 0x2,
+    };
+
+    enum reduce_flag {
+      REDUCE_AXES_MASK = 0xFF,
+      REDUCE_KEEP_AXES = 0x100,
+      REDUCE_TIE_BREAK_HIGH = 0x200,
+    };
     #endif // #{macro}
     """
   end
@@ -210,32 +321,424 @@ defmodule PelemayBackend.Engine do
   end
 
   @doc """
-  Executes code for the engine.
+  Loads code into a program for the engine.
 
   The code should be a list of tuples of an opcode and an operand.
+  It is validated and decoded only once here, so the returned program
+  can be executed many times without re-parsing the code.
+
+  The stack is verified along every path of `skip`: each instruction
+  should find the values which it pops, booleans for `skip` and tensors
+  for the others, and the stack should be empty at `return` and at the end.
+  Otherwise, it raises an `ErlangError` which tells the position.
+  """
+  @spec load(list({opcode(), operand()})) :: program()
+  def load(code) do
+    PelemayBackend.NIF.load_program(code)
+  end
+
+  @doc """
+  Executes code for the engine.
+
+  The code should be a program loaded by `load/1`, or a list of tuples of
+  an opcode and an operand, which is loaded on every call.
+
+  The data of each tensor argument is a binary or a buffer made by
+  `PelemayBackend.NIF.buffer_from_binary/1`. The data of the results is
+  a buffer if `storage` is `:buffer`, or a binary otherwise.
+
+  A tuple of a tensor argument in a buffer may have `:donate` as the fifth
+  element, which allows the program to overwrite the buffer to compute
+  in place. The caller should not use the donated buffer afterwards,
+  and the program should load it by `aloadt` only once.
+
+  Instead, the fifth element may be a view `{offset, strides}`, where the
+  tensor is the elements of the data at `offset` and the tuple of `strides`
+  of its axes, both in elements. A stride of 0 broadcasts the axis.
+  The elementwise instructions read a view without copying it.
+
+  If `reply` is `:return`, returns `{:ok, results}`, where `results` is
+  a tuple of `{data, shape, type}` of the tensors in the order of `sendt`,
+  or `{:error, reason}` with the operand of `sende`.
+  If `reply` is a pid, the results are sent to it as
+  `{:result, data, shape, type}` and the error as `{:error, reason}`.
+
+  Programs whose tensor arguments total 1 MiB or more are run on
+  a dirty CPU scheduler, so that they do not block a normal scheduler.
+  For a program with `gemm`, each matrix counts as its bytes times
+  its smaller dimension, since the product does more work than it reads.
+
+  While the stats are enabled, each call emits the `:telemetry` span
+  `[:pelemay_backend, :engine, :execute]`, whose metadata has the loaded
+  `:program`. The measurements of its `:stop` event have the `:duration`
+  and the `:instructions`, which are `program_stats/1` after the call.
+  The code of a list is then loaded once and kept, so that its counters
+  add up over the calls as those of a loaded program do.
   """
-  @spec execute(list({opcode(), operand()}), list(), pid()) :: :ok | {:error, String.t()}
-  def execute(code, args, pid) do
-    PelemayBackend.NIF.execute_engine(code, args, pid)
+  @spec execute(
+          program() | list({opcode(), operand()}),
+          list(),
+          :return | pid(),
+          :binary | :buffer
+        ) ::
+          {:ok, tuple()} | :ok | {:error, charlist()}
+  def execute(code, args, reply \\ :return, storage \\ :binary) do
+    if PelemayBackend.NIF.engine_stats_enabled() do
+      program = stats_program(code)
+      metadata = %{program: program, reply: reply, storage: storage}
+
+      span([:pelemay_backend, :engine, :execute], program, metadata, fn ->
+        PelemayBackend.NIF.execute_engine(program, args, reply, storage)
+      end)
+    else
+      PelemayBackend.NIF.execute_engine(code, args, reply, storage)
+    end
   end
 
+  @doc """
+  Executes code for the engine with each of the lists of arguments in
+  `batches` in a single call, and returns the list of `{:ok, results}` or
+  `{:error, reason}` of each in order, as `execute/4` returns them.
+
+  The code is loaded once, and the sets run one after another, reusing
+  the memory of the previous one, so that a batch of small inputs pays
+  the overhead of a call once. An error of a set does not stop the rest.
+
+  Batches whose tensor arguments total 1 MiB or more, or which have
+  more than 256 sets, are run on a dirty CPU scheduler.
+
+  While the stats are enabled, each call emits the `:telemetry` span
+  `[:pelemay_backend, :engine, :execute_batch]` as `execute/4` does,
+  whose metadata also has the number of the sets as `:batch_size`.
+  """
+  @spec execute_batch(program() | list({opcode(), operand()}), list(list()), :binary | :buffer) ::
+          list({:ok, tuple()} | {:error, charlist()})
+  def execute_batch(code, batches, storage \\ :binary) do
+    if PelemayBackend.NIF.engine_stats_enabled() do
+      program = stats_program(code)
+      metadata = %{program: program, batch_size: length(batches), storage: storage}
+
+      span([:pelemay_backend, :engine, :execute_batch], program, metadata, fn ->
+        PelemayBackend.NIF.execute_engine_batch(program, batches, storage)
+      end)
+    else
+      PelemayBackend.NIF.execute_engine_batch(code, batches, storage)
+    end
+  end
+
+  # The code of a list is loaded once, so that its counters add up over the calls.
+  defp stats_program(code) when is_list(code) do
+    {_, program} =
+      PelemayBackend.Defn.LockedCache.run({__MODULE__, code}, fn -> {nil, load(code)} end)
+
+    program
+  end
+
+  defp stats_program(program), do: program
+
+  # Emits the events of :telemetry.span/3 by hand, since the measurements
+  # of the stop event can be extended only by telemetry 1.1 or later.
+  defp span(event, program, metadata, fun) do
+    start = System.monotonic_time()
+
+    :telemetry.execute(
+      event ++ [:start],
+      %{system_time: System.system_time(), monotonic_time: start},
+      metadata
+    )
+
+    try do
+      fun.()
+    catch
+      kind, reason ->
+        duration = System.monotonic_time() - start
+
+        :telemetry.execute(
+          event ++ [:exception],
+          %{duration: duration},
+          Map.merge(metadata, %{kind: kind, reason: reason, stacktrace: __STACKTRACE__})
+        )
+
+        :erlang.raise(kind, reason, __STACKTRACE__)
+    else
+      result ->
+        duration = System.monotonic_time() - start
+        measurements = %{duration: duration, instructions: program_stats(program)}
+        :telemetry.execute(event ++ [:stop], measurements, metadata)
+        result
+    end
+  end
+
+  @typedoc """
+  The counters of an instruction: the number of `:executions`,
+  the `:elements` processed, the `:bytes` allocated for the data of tensors
+  and the nanoseconds `:ns` taken, in total.
+  """
+  @type stats :: %{
+          executions: non_neg_integer(),
+          elements: non_neg_integer(),
+          bytes: non_neg_integer(),
+          ns: non_neg_integer()
+        }
+
+  @doc """
+  Gets the counters of the instructions executed since the stats were reset,
+  by the name of the instruction.
+
+  The engine counts the instructions only while the stats are enabled,
+  by `enable_stats/1` or the `:stats` configuration of `PelemayBackend.NIF`.
+  The elements of an instruction are those of the larger of the tensor
+  on the top of the stack before and after it.
+  """
+  @spec stats() :: %{atom() => stats()}
+  def stats do
+    Map.new(PelemayBackend.NIF.engine_stats(), fn stats ->
+      {instruction_name(elem(stats, 0)), to_stats(stats)}
+    end)
+  end
+
+  @doc """
+  Resets the counters of `stats/0` to zero.
+  """
+  @spec reset_stats() :: :ok
+  def reset_stats do
+    PelemayBackend.NIF.reset_engine_stats()
+  end
+
+  @doc """
+  Enables or disables the counting of the instructions,
+  and returns whether it was enabled.
+
+  While it is enabled, each instruction reads the monotonic clock twice.
+  """
+  @spec enable_stats(boolean()) :: boolean()
+  def enable_stats(enabled) when is_boolean(enabled) do
+    PelemayBackend.NIF.enable_engine_stats(enabled)
+  end
+
+  @doc """
+  Gets the counters of each instruction of a program loaded by `load/1`
+  in the order of the code, as a list of the name of the instruction
+  and its counters. The instructions of the body of `fuse` are counted
+  as `fuse`.
+  """
+  @spec program_stats(program()) :: list({atom(), stats()})
+  def program_stats(program) do
+    for stats <- PelemayBackend.NIF.program_stats(program) do
+      {instruction_name(elem(stats, 0)), to_stats(stats)}
+    end
+  end
+
+  defp instruction_name(opcode) do
+    Enum.find_value(instruction_code(), fn {name, code} -> if code == opcode, do: name end)
+  end
+
+  defp to_stats({_opcode, executions, elements, bytes, ns}) do
+    %{executions: executions, elements: elements, bytes: bytes, ns: ns}
+  end
+
+  @doc """
+  Executes code for the engine with the given tensors,
+  and returns the result of `sendt`.
+
+  The program should send exactly one tensor. See `run_all/3` for programs
+  which send many.
+
+  Tensors of `PelemayBackend.Backend` in native buffers are passed
+  without copying.
+
+  ## Options
+
+    * `:storage` - `:binary` (default) returns the data of the result as
+      a binary, and `:buffer` as a native buffer.
+
+    * `:donate` - the indices of the arguments in native buffers which
+      the program may overwrite. Defaults to `[]`.
+
+  Returns `{data, shape, type}` of the result,
+  or raises `RuntimeError` in case of error.
+  """
+  @spec run(program() | list({opcode(), operand()}), list(), keyword()) ::
+          {binary() | reference(), tuple(), Nx.Type.t()}
+  def run(code, args, opts \\ []) do
+    case run_all(code, args, opts) do
+      {result} ->
+        result
+
+      results ->
+        raise RuntimeError,
+          message: "the program should send one tensor, but sent #{tuple_size(results)}"
+    end
+  end
+
+  @doc """
+  Executes code for the engine with the given tensors,
+  and returns the tuple of the results in the order of `sendt`.
+
+  Takes the same options as `run/3`.
+  """
+  @spec run_all(program() | list({opcode(), operand()}), list(), keyword()) :: tuple()
+  def run_all(code, args, opts \\ []) do
+    args = args(args, opts)
+
+    try do
+      execute(code, args, :return, Keyword.get(opts, :storage, :binary))
+    rescue
+      e in ErlangError -> raise RuntimeError, message: List.to_string(e.original)
+    end
+    |> case do
+      {:ok, results} -> results
+      {:error, reason} -> raise RuntimeError, message: List.to_string(reason)
+    end
+  end
+
+  @doc """
+  Executes code for the engine with each of the lists of tensors in
+  `batches` by `execute_batch/3`, and returns the list of the tuples of
+  the results in the order of `sendt`.
+
+  Takes the same options as `run/3`, which apply to every set.
+  Raises `RuntimeError` with the reason of the first set which fails.
+  """
+  @spec run_batch(program() | list({opcode(), operand()}), list(list()), keyword()) ::
+          list(tuple())
+  def run_batch(code, batches, opts \\ []) do
+    batches = Enum.map(batches, &args(&1, opts))
+
+    try do
+      execute_batch(code, batches, Keyword.get(opts, :storage, :binary))
+    rescue
+      e in ErlangError -> raise RuntimeError, message: List.to_string(e.original)
+    end
+    |> Enum.map(fn
+      {:ok, results} -> results
+      {:error, reason} -> raise RuntimeError, message: List.to_string(reason)
+    end)
+  end
+
+  @doc """
+  Submits code for the engine with the given tensors to the queue of
+  the engine, and returns `{:ok, job}` without waiting for it to finish.
+
+  The job runs on a native worker of the queue, and the caller receives
+  `{:result, job, results}`, where `results` is the tuple of the results
+  as `run_all/3` returns, or `{:error, job, reason}`. `await/2` waits for
+  either of them. The buffers of the arguments are kept until the job finishes,
+  so the caller may prepare the next job meanwhile.
+
+  Takes the same options as `run/3`.
+
+  Returns `{:error, :queue_full}` if as many jobs as the depth of the queue
+  are waiting. See `PelemayBackend.NIF` for the configuration.
+  """
+  @spec submit(program() | list({opcode(), operand()}), list(), keyword()) ::
+          {:ok, reference()} | {:error, :queue_full | charlist()}
+  def submit(code, args, opts \\ []) do
+    storage = Keyword.get(opts, :storage, :binary)
+    PelemayBackend.NIF.submit(code, args(args, opts), self(), storage)
+  rescue
+    e in ErlangError -> raise RuntimeError, message: List.to_string(e.original)
+  end
+
+  @doc """
+  Waits for the job submitted by `submit/3`, and returns the tuple of its results.
+
+  Raises `RuntimeError` in case of error, or if it does not finish in `timeout`
+  milliseconds, in which case the message may arrive later.
+  """
+  @spec await(reference(), timeout()) :: tuple()
+  def await(job, timeout \\ :infinity) do
+    receive do
+      {:result, ^job, results} -> results
+      {:error, ^job, reason} -> raise RuntimeError, message: List.to_string(reason)
+    after
+      timeout -> raise RuntimeError, message: "the job did not finish in #{timeout} ms"
+    end
+  end
+
+  @doc """
+  Cancels the job submitted by `submit/3` if it has not started.
+
+  Returns `true` if it is cancelled, in which case no message is sent,
+  or `false` if it has started.
+  """
+  @spec cancel(reference()) :: boolean()
+  def cancel(job) do
+    PelemayBackend.NIF.cancel(job)
+  end
+
+  defp args(args, opts) do
+    donate = Keyword.get(opts, :donate, [])
+
+    args
+    |> Enum.with_index()
+    |> Enum.map(fn {a, i} ->
+      cond do
+        is_struct(a, Nx.Tensor) ->
+          arg = {
+            Nx.size(a),
+            Nx.shape(a),
+            Nx.type(a),
+            data(a)
+          }
+
+          case a.data do
+            %PelemayBackend.Backend{view: {offset, strides}} ->
+              Tuple.append(arg, {offset, List.to_tuple(strides)})
+
+            _ ->
+              if i in donate and is_reference(elem(arg, 3)),
+                do: Tuple.append(arg, :donate),
+                else: arg
+          end
+
+        true ->
+          a
+      end
+    end)
+  end
+
+  defp data(%Nx.Tensor{data: %PelemayBackend.Backend{state: buffer}}) when is_reference(buffer),
+    do: buffer
+
+  defp data(%Nx.Tensor{data: %PelemayBackend.Backend{state: binary, view: {_, _}}}), do: binary
+
+  defp data(tensor), do: Nx.to_binary(tensor)
+
   @doc """
   Gets Regex of instructions.
+
+  It is compiled once and kept in `:persistent_term`.
   """
   def regex_inst() do
-    instruction_code()
-    |> Map.keys()
-    |> Enum.map(&Atom.to_string/1)
-    |> Enum.map(&"(^ *(?<#{&1}>#{&1}.*)$)")
-    |> Enum.join("|")
-    |> Regex.compile!()
+    case :persistent_term.get({__MODULE__, :regex_inst}, nil) do
+      nil ->
+        regex =
+          instruction_code()
+          |> Map.keys()
+          |> Enum.map(&Atom.to_string/1)
+          |> Enum.map(&"(^ *(?<#{&1}>#{&1}\\b.*)$)")
+          |> Enum.join("|")
+          |> Regex.compile!()
+
+        :persistent_term.put({__MODULE__, :regex_inst}, regex)
+        regex
+
+      regex ->
+        regex
+    end
   end
 
   @doc """
-  Assemble code into
+  Assemble code into a list of `{opcode, operand}`, which `load/1` loads.
+
+  ## Options
+
+    * `:optimize` - whether the instructions are optimized by `optimize/1`
+      before they are encoded. Defaults to `true`.
   """
-  @spec assemble(String.t()) :: list({opcode(), operand()})
-  def assemble(code) do
+  @spec assemble(String.t(), keyword()) :: list({opcode(), operand()})
+  def assemble(code, opts \\ []) do
     r = regex_inst()
 
     String.split(code, "\n")
@@ -259,12 +762,167 @@ defmodule PelemayBackend.Engine do
       inst = String.to_atom(inst)
       acc ++ [{inst, args}]
     end)
+    |> then(&if(Keyword.get(opts, :optimize, true), do: optimize(&1), else: &1))
     |> Stream.map(fn {inst, args} ->
       encode(inst, args)
     end)
     |> Enum.to_list()
   end
 
+  @doc """
+  Optimizes a list of `{instruction, operand}` by the names of the instructions,
+  as `assemble/2` parses them, so that fewer instructions run and fewer of them
+  sweep the data of tensors.
+
+  The following are repeated until none of them applies:
+
+    * The code which no path reaches, such as after `return` or `skip {n, true}`,
+      is dropped.
+    * `skip` to the next instruction is dropped, or replaced by `pop`
+      of the condition if it is conditional.
+    * `dup` followed by `pop`, and `swap` followed by `swap` are dropped.
+    * `copy` of the tensor which `scal` scales next is dropped, since `scal`
+      scales a tensor which it does not own into a copy in one pass.
+    * `scal 1` of `y` followed by `axpy` is merged into `axpby`.
+
+  The scalar of `scal` and `axpy` should be pushed by `aloadt`, `load` or `take`,
+  and no `skip` should jump into the instructions merged after the first.
+  The body of `fuse` is kept as it is. The operand of `skip` is the increment
+  of PC after the removed instructions.
+
+  Returns the instructions as they are if an operand of `skip` or `fuse` is
+  not of its form, so that `load/1` reports it.
+  """
+  @spec optimize(list({atom(), any()})) :: list({atom(), any()})
+  def optimize(insts) do
+    well_formed? =
+      Enum.all?(insts, fn
+        {:skip, {n, _}} -> is_integer(n) and n >= 0
+        {:skip, _} -> false
+        {:fuse, {inputs, length}} -> is_integer(inputs) and is_integer(length) and length >= 0
+        {:fuse, _} -> false
+        _ -> true
+      end)
+
+    if well_formed? do
+      # The target of skip is kept as the index of the instruction in insts,
+      # so that it is the first instruction left at or after it.
+      insts
+      |> Enum.with_index(fn
+        {:skip, {n, condition}}, i -> {i, :skip, {i + 1 + n, condition}}
+        {inst, args}, i -> {i, inst, args}
+      end)
+      |> optimize_code()
+      |> resolve_skips()
+    else
+      insts
+    end
+  end
+
+  defp optimize_code(code) do
+    optimized = code |> drop_unreachable() |> fold_skips() |> peephole()
+    if optimized == code, do: code, else: optimize_code(optimized)
+  end
+
+  # Sweeps the code forward, since skip only jumps forward.
+  defp drop_unreachable(code) do
+    {code, _reached, _targets, _body} =
+      Enum.reduce(code, {[], true, [], {0, false}}, fn
+        inst, {acc, reached, targets, {left, kept}} when left > 0 ->
+          {if(kept, do: [inst | acc], else: acc), reached, targets, {left - 1, kept}}
+
+        {id, inst, args} = op, {acc, reached, targets, _body} ->
+          {jumped, targets} = Enum.split_with(targets, &(&1 <= id))
+
+          if reached or jumped != [] do
+            case {inst, args} do
+              {:return, _} -> {[op | acc], false, targets, {0, false}}
+              {:skip, {target, true}} -> {[op | acc], false, [target | targets], {0, false}}
+              {:skip, {target, _}} -> {[op | acc], true, [target | targets], {0, false}}
+              {:fuse, {_, length}} -> {[op | acc], true, targets, {length, true}}
+              _ -> {[op | acc], true, targets, {0, false}}
+            end
+          else
+            case {inst, args} do
+              {:fuse, {_, length}} -> {acc, false, targets, {length, false}}
+              _ -> {acc, false, targets, {0, false}}
+            end
+          end
+      end)
+
+    Enum.reverse(code)
+  end
+
+  defp fold_skips(code) do
+    code
+    |> Enum.chunk_every(2, 1, [:end])
+    |> Enum.flat_map(fn
+      # The last skip can only jump to the end, which is next to it.
+      [{id, :skip, {_target, condition}}, :end] ->
+        fold_skip(id, condition)
+
+      [{id, :skip, {target, condition}}, {next, _inst, _args}] when target <= next ->
+        fold_skip(id, condition)
+
+      [inst, _next] ->
+        [inst]
+    end)
+  end
+
+  defp fold_skip(_id, true), do: []
+  defp fold_skip(id, _condition), do: [{id, :pop, nil}]
+
+  defp peephole(code) do
+    targets = for {_id, :skip, {target, _}} <- code, do: target
+
+    {code, _previous} =
+      Enum.map_reduce(code, -1, fn {id, inst, args}, previous ->
+        {{id, inst, args, Enum.any?(targets, &(previous < &1 and &1 <= id))}, id}
+      end)
+
+    peephole(code, [])
+  end
+
+  @scalar_pushes [:aloadt, :load, :take]
+
+  defp peephole([], acc), do: Enum.reverse(acc)
+
+  defp peephole([{_, :fuse, {_, length}, _} = fuse | rest], acc) do
+    {body, rest} = Enum.split(rest, length)
+    peephole(rest, Enum.reverse(strip([fuse | body]), acc))
+  end
+
+  defp peephole([{_, :dup, _, _}, {_, :pop, _, false} | rest], acc), do: peephole(rest, acc)
+
+  defp peephole([{_, :swap, _, _}, {_, :swap, _, false} | rest], acc), do: peephole(rest, acc)
+
+  defp peephole([{_, :copy, _, _}, {_, push, _, false} = p, {_, :scal, _, false} = s | rest], acc)
+       when push in @scalar_pushes,
+       do: peephole(rest, [strip(s), strip(p) | acc])
+
+  defp peephole([{_, :scal, 1, _}, {_, push, _, false} = p, {id, :axpy, _, false} | rest], acc)
+       when push in @scalar_pushes,
+       do: peephole(rest, [{id, :axpby, nil}, strip(p) | acc])
+
+  defp peephole([inst | rest], acc), do: peephole(rest, [strip(inst) | acc])
+
+  defp strip(list) when is_list(list), do: Enum.map(list, &strip/1)
+  defp strip({id, inst, args, _target}), do: {id, inst, args}
+
+  defp resolve_skips(code) do
+    ids = Enum.map(code, &elem(&1, 0))
+
+    code
+    |> Enum.with_index()
+    |> Enum.map(fn
+      {{_id, :skip, {target, condition}}, pc} ->
+        {:skip, {Enum.count(ids, &(&1 < target)) - pc - 1, condition}}
+
+      {{_id, inst, args}, _pc} ->
+        {inst, args}
+    end)
+  end
+
   defp evaluate([]), do: []
 
   defp evaluate([:error]), do: []
@@ -278,49 +936,122 @@ defmodule PelemayBackend.Engine do
   defp evaluate(tuple: list), do: list |> Enum.map(&evaluate([&1])) |> List.to_tuple()
 
   defp encode(:scal, args) do
-    # Logger.debug("scal #{inspect(args)}")
-
     code = {
       Map.get(instruction_code(), :scal),
       args
     }
 
-    # Logger.debug("generated code of scal: #{inspect(code)}")
-
     code
   end
 
-  defp encode(:sscal, _args) do
-    # Logger.debug("sscal")
-  end
+  defp encode(:sscal, _args), do: nil
 
   defp encode(:copy, args) do
-    # Logger.debug("copy")
-
     code = {
       Map.get(instruction_code(), :copy),
       args
     }
 
-    # Logger.debug("generated code of copy: #{inspect(code)}")
-
     code
   end
 
   defp encode(:dot, _args) do
-    # Logger.debug("dot")
+    code = {
+      Map.get(instruction_code(), :dot),
+      nil
+    }
+
+    code
   end
 
   defp encode(:axpy, _args) do
-    # Logger.debug("axpy")
+    code = {
+      Map.get(instruction_code(), :axpy),
+      nil
+    }
+
+    code
+  end
+
+  defp encode(:axpby, _args) do
+    code = {
+      Map.get(instruction_code(), :axpby),
+      nil
+    }
+
+    code
+  end
+
+  defp encode(inst, _args) when inst in @binary_insts do
+    code = {
+      Map.get(instruction_code(), inst),
+      nil
+    }
+
+    code
+  end
+
+  defp encode(inst, _args) when inst in @unary_insts do
+    code = {
+      Map.get(instruction_code(), inst),
+      nil
+    }
+
+    code
   end
 
-  defp encode(:gemv, _args) do
-    # Logger.debug("gemv")
+  defp encode(inst, args) when inst in @reduce_insts do
+    # sum {axes_mask, keep_axes} or argmax {axes_mask, keep_axes, :low | :high}
+    {axes_mask, keep_axes, tie_break} =
+      case args do
+        {axes_mask, keep_axes, tie_break} -> {axes_mask, keep_axes, tie_break}
+        {axes_mask, keep_axes} -> {axes_mask, keep_axes, :low}
+      end
+
+    code = {
+      Map.get(instruction_code(), inst),
+      axes_mask
+      |> bor(if keep_axes, do: Map.get(reduce_flag(), :keep_axes), else: 0)
+      |> bor(if tie_break == :high, do: Map.get(reduce_flag(), :tie_break_high), else: 0)
+    }
+
+    code
   end
 
-  defp encode(:gemm, _args) do
-    # Logger.debug("gemm")
+  defp encode(:as_type, args) do
+    # as_type {:f, 16}
+    code = {
+      Map.get(instruction_code(), :as_type),
+      args
+    }
+
+    code
+  end
+
+  defp encode(:gemv, args) do
+    # gemv :n or gemv :t
+    code = {
+      Map.get(instruction_code(), :gemv),
+      encode_transpose(args, :a)
+    }
+
+    code
+  end
+
+  defp encode(:gemm, args) do
+    # gemm {:n, :n}, gemm {:n, :t}, gemm {:t, :n} or gemm {:t, :t}
+    {trans_a, trans_b} =
+      case args do
+        {trans_a, trans_b} -> {trans_a, trans_b}
+        _ -> {:n, :n}
+      end
+
+    code = {
+      Map.get(instruction_code(), :gemm),
+      bor(encode_transpose(trans_a, :a), encode_transpose(trans_b, :b))
+    }
+
+    code
   end
 
   defp encode(:sendt, _args) do
@@ -412,4 +1143,44 @@ defmodule PelemayBackend.Engine do
 
     code
   end
+
+  defp encode(:store, args) do
+    code = {
+      Map.get(instruction_code(), :store),
+      args
+    }
+
+    code
+  end
+
+  defp encode(:load, args) do
+    code = {
+      Map.get(instruction_code(), :load),
+      args
+    }
+
+    code
+  end
+
+  defp encode(:take, args) do
+    code = {
+      Map.get(instruction_code(), :take),
+      args
+    }
+
+    code
+  end
+
+  defp encode(:fuse, args) do
+    # fuse {inputs, length}
+    code = {
+      Map.get(instruction_code(), :fuse),
+      args
+    }
+
+    code
+  end
+
+  defp encode_transpose(:t, key), do: Map.get(transpose_flag(), key)
+  defp encode_transpose(_, _key), do: 0
 end
@@ -1,6 +1,31 @@
 defmodule PelemayBackend.NIF do
   @moduledoc """
   Documentation for `PelemayBackend.NIF`.
+
+  The engine runs large elementwise operations, fused loops and reductions
+  in a pool of native threads, and BLAS in the threads of OpenBLAS.
+  They are sized by the application environment when the NIF is loaded:
+
+      config :pelemay_backend, threads: 16, blas_threads: 16
+
+    * `:threads` - the number of threads which run a large operation,
+      including the calling scheduler. Defaults to the number of
+      dirty CPU schedulers, so that the pool uses no more cores than
+      the engine may when it runs on dirty schedulers.
+
+    * `:blas_threads` - the number of threads of OpenBLAS.
+      Defaults to `:threads`. BLAS and the pool do not run at once
+      in an execution, so they do not oversubscribe the cores together.
+
+    * `:queue_workers` - the number of native threads which run the jobs
+      submitted by `PelemayBackend.Engine.submit/3`. Defaults to `:threads`.
+
+    * `:queue_depth` - the number of the submitted jobs which may wait
+      for the workers. Defaults to `64`.
+
+    * `:stats` - whether the engine counts the instructions from the start,
+      which `PelemayBackend.Engine.enable_stats/1` also switches at runtime.
+      Defaults to `false`.
   """
   require Logger
 
@@ -10,12 +35,49 @@ defmodule PelemayBackend.NIF do
   def load_nif do
     nif_file = ~c'#{Application.app_dir(:pelemay_backend, "priv/libnif")}'
 
-    case :erlang.load_nif(nif_file, 0) do
+    case :erlang.load_nif(nif_file, load_info()) do
       :ok -> :ok
       {:error, {:reload, _}} -> :ok
       {:error, reason} -> Logger.error("Failed to load NIF: #{inspect(reason)}")
     end
   end
 
-  def execute_engine(_code, _args, _pid), do: :erlang.nif_error(:not_loaded)
+  defp load_info do
+    schedulers = :erlang.system_info(:dirty_cpu_schedulers)
+    threads = Application.get_env(:pelemay_backend, :threads, schedulers)
+
+    %{
+      threads: threads,
+      blas_threads: Application.get_env(:pelemay_backend, :blas_threads, threads),
+      queue_workers: Application.get_env(:pelemay_backend, :queue_workers, threads),
+      queue_depth: Application.get_env(:pelemay_backend, :queue_depth, 64),
+      stats: Application.get_env(:pelemay_backend, :stats, false)
+    }
+  end
+
+  def execute_engine(_code, _args, _pid, _storage), do: :erlang.nif_error(:not_loaded)
+
+  def execute_engine_batch(_code, _batches, _storage), do: :erlang.nif_error(:not_loaded)
+
+  def submit(_code, _args, _pid, _storage), do: :erlang.nif_error(:not_loaded)
+
+  def cancel(_job), do: :erlang.nif_error(:not_loaded)
+
+  def load_program(_code), do: :erlang.nif_error(:not_loaded)
+
+  def engine_stats(), do: :erlang.nif_error(:not_loaded)
+
+  def reset_engine_stats(), do: :erlang.nif_error(:not_loaded)
+
+  def enable_engine_stats(_enabled), do: :erlang.nif_error(:not_loaded)
+
+  def engine_stats_enabled(), do: :erlang.nif_error(:not_loaded)
+
+  def program_stats(_program), do: :erlang.nif_error(:not_loaded)
+
+  def buffer_from_binary(_binary), do: :erlang.nif_error(:not_loaded)
+
+  def buffer_to_binary(_buffer), do: :erlang.nif_error(:not_loaded)
+
+  def buffer_deallocate(_buffer), do: :erlang.nif_error(:not_loaded)
 end
@@ -33,6 +33,7 @@ defmodule PelemayBackend.MixProject do
       # {:dep_from_hexpm, "~> 0.3.0"},
       # {:dep_from_git, git: "https://github.com/elixir-lang/my_dep.git", tag: "0.1.0"}
       {:nx, "~> 0.3.0"},
+      {:telemetry, "~> 0.4.0 or ~> 1.0"},
       {:ex_doc, "~> 0.29", only: :dev, runtime: false},
       {:openblas_builder, "~> 0.1.0-dev", github: "zeam-vm/openblas_builder", branch: "main"},
       {:elixir_make, "~> 0.6", runtime: false},
@@ -109,6 +110,26 @@ defmodule PelemayBackend.MixProject do
       {"interface", "dscal"},
       {"interface", "cblas_dcopy"},
       {"interface", "dcopy"},
+      {"interface", "cblas_sdot"},
+      {"interface", "sdot"},
+      {"interface", "cblas_ddot"},
+      {"interface", "ddot"},
+      {"interface", "cblas_saxpy"},
+      {"interface", "saxpy"},
+      {"interface", "cblas_daxpy"},
+      {"interface", "daxpy"},
+      {"interface", "cblas_saxpby"},
+      {"interface", "saxpby"},
+      {"interface", "cblas_daxpby"},
+      {"interface", "daxpby"},
+      {"interface", "cblas_sgemv"},
+      {"interface", "sgemv"},
+      {"interface", "cblas_dgemv"},
+      {"interface", "dgemv"},
+      {"interface", "cblas_sgemm"},
+      {"interface", "sgemm"},
+      {"interface", "cblas_dgemm"},
+      {"interface", "dgemm"},
       {"driver/others", "memory"},
       {"driver/others", "blas_l1_thread"},
       {"driver/others", "blas_server"},
@@ -0,0 +1,269 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <erl_nif.h>
+
+#include "buffer.h"
+
+/*
+ * The pool of the blocks of the data of buffers.
+ *
+ * Each thread keeps the freed blocks by their size class of a power of two
+ * from 64 bytes to 64 MiB, up to BUFFER_POOL_MAX_BYTES in total, so that
+ * the buffers of the executions which follow reuse them instead of the
+ * allocator, and of the page faults of fresh memory for large ones.
+ * A block freed on another thread than it is allocated on moves into the
+ * pool of that thread. A larger block is allocated of its exact size,
+ * since it would never fit in the pool, and is not kept.
+ *
+ * The schedulers never trim their pools as the workers of the queue do
+ * before they exit, so that the pools of all the threads together keep
+ * up to BUFFER_POOL_TOTAL_BYTES, counted in pooled_bytes, and a block
+ * freed over it goes back to the allocator.
+ */
+#define BUFFER_POOL_MIN_SHIFT 6
+#define BUFFER_POOL_MAX_SHIFT 26
+#define BUFFER_POOL_CLASSES (BUFFER_POOL_MAX_SHIFT - BUFFER_POOL_MIN_SHIFT + 1)
+#define BUFFER_POOL_MAX_BYTES ((size_t)1 << BUFFER_POOL_MAX_SHIFT)
+#define BUFFER_POOL_TOTAL_BYTES (4 * BUFFER_POOL_MAX_BYTES)
+
+typedef struct free_block {
+    struct free_block *next;
+} free_block_t;
+
+static _Thread_local struct {
+    free_block_t *blocks[BUFFER_POOL_CLASSES];
+    size_t bytes;
+} pool;
+
+static atomic_size_t pooled_bytes;
+
+static ErlNifResourceType *buffer_resource_type;
+
+// Returns the size class of size, or -1 if it is too large to be kept.
+static int size_class(size_t size)
+{
+    if(size <= ((size_t)1 << BUFFER_POOL_MIN_SHIFT)) {
+        return 0;
+    }
+    int shift = 64 - __builtin_clzll((unsigned long long)size - 1);
+    return shift > BUFFER_POOL_MAX_SHIFT ? -1 : shift - BUFFER_POOL_MIN_SHIFT;
+}
+
+static void *block_alloc(size_t size, size_t *capacity)
+{
+    int c = size_class(size);
+    if(c < 0) {
+        *capacity = size;
+        return enif_alloc(size + BUFFER_ALIGNMENT - 1);
+    }
+    *capacity = (size_t)1 << (c + BUFFER_POOL_MIN_SHIFT);
+    free_block_t *block = pool.blocks[c];
+    if(block != NULL) {
+        pool.blocks[c] = block->next;
+        pool.bytes -= *capacity;
+        atomic_fetch_sub_explicit(&pooled_bytes, *capacity, memory_order_relaxed);
+        return block;
+    }
+    return enif_alloc(*capacity + BUFFER_ALIGNMENT - 1);
+}
+
+// Counts capacity in pooled_bytes, or returns false if it would exceed BUFFER_POOL_TOTAL_BYTES.
+static bool reserve_pooled(size_t capacity)
+{
+    size_t bytes = atomic_load_explicit(&pooled_bytes, memory_order_relaxed);
+    do {
+        if(bytes + capacity > BUFFER_POOL_TOTAL_BYTES) {
+            return false;
+        }
+    } while(!atomic_compare_exchange_weak_explicit(&pooled_bytes, &bytes, bytes + capacity, memory_order_relaxed, memory_order_relaxed));
+    return true;
+}
+
+static void block_free(void *raw, size_t capacity)
+{
+    int c = size_class(capacity);
+    if(c < 0 || pool.bytes + capacity > BUFFER_POOL_MAX_BYTES || !reserve_pooled(capacity)) {
+        enif_free(raw);
+        return;
+    }
+    free_block_t *block = (free_block_t *)raw;
+    block->next = pool.blocks[c];
+    pool.blocks[c] = block;
+    pool.bytes += capacity;
+}
+
+void buffer_pool_trim(void)
+{
+    for(int c = 0; c < BUFFER_POOL_CLASSES; c++) {
+        while(pool.blocks[c] != NULL) {
+            free_block_t *block = pool.blocks[c];
+            pool.blocks[c] = block->next;
+            enif_free(block);
+        }
+    }
+    atomic_fetch_sub_explicit(&pooled_bytes, pool.bytes, memory_order_relaxed);
+    pool.bytes = 0;
+}
+
+static void free_data(buffer_t *buffer)
+{
+    // Only the one which takes the pointer frees it.
+    void *raw = atomic_exchange(&buffer->raw, NULL);
+    if(raw != NULL) {
+        block_free(raw, buffer->capacity);
+    }
+}
+
+static void init_buffer(buffer_t *buffer, size_t size, size_t capacity, void *raw)
+{
+    buffer->size = size;
+    buffer->capacity = capacity;
+    atomic_init(&buffer->raw, raw);
+    buffer->data = (void *)(((uintptr_t)raw + BUFFER_ALIGNMENT - 1) & ~(uintptr_t)(BUFFER_ALIGNMENT - 1));
+    atomic_init(&buffer->pins, 0);
+    atomic_init(&buffer->deallocated, false);
+    atomic_init(&buffer->exposed, false);
+    buffer->writable = false;
+    buffer->refs = 0;
+}
+
+static void buffer_dtor(ErlNifEnv *env, void *obj)
+{
+    free_data((buffer_t *)obj);
+}
+
+int buffer_open_resource_type(ErlNifEnv *env, ErlNifResourceFlags flags)
+{
+    buffer_resource_type = enif_open_resource_type(env, NULL, "buffer", buffer_dtor, flags, NULL);
+    return buffer_resource_type == NULL ? -1 : 0;
+}
+
+buffer_t *buffer_alloc(size_t size)
+{
+    size_t capacity;
+    void *raw = block_alloc(size, &capacity);
+    if(__builtin_expect(raw == NULL, false)) {
+        return NULL;
+    }
+    buffer_t *buffer = enif_alloc_resource(buffer_resource_type, sizeof(buffer_t));
+    if(__builtin_expect(buffer == NULL, false)) {
+        block_free(raw, capacity);
+        return NULL;
+    }
+    init_buffer(buffer, size, capacity, raw);
+    buffer->arena = false;
+    buffer->resource = buffer;
+    return buffer;
+}
+
+void buffer_arena_init(buffer_arena_t *arena)
+{
+    arena->first.next = NULL;
+    arena->first.used = 0;
+    arena->chunks = &arena->first;
+}
+
+buffer_t *buffer_arena_alloc(buffer_arena_t *arena, size_t size)
+{
+    buffer_arena_chunk_t *chunk = arena->chunks;
+    if(chunk->used == BUFFER_ARENA_CHUNK) {
+        chunk = enif_alloc(sizeof(buffer_arena_chunk_t));
+        if(__builtin_expect(chunk == NULL, false)) {
+            return NULL;
+        }
+        chunk->next = arena->chunks;
+        chunk->used = 0;
+        arena->chunks = chunk;
+    }
+    size_t capacity;
+    void *raw = block_alloc(size, &capacity);
+    if(__builtin_expect(raw == NULL, false)) {
+        return NULL;
+    }
+    buffer_t *buffer = &chunk->buffers[chunk->used++];
+    init_buffer(buffer, size, capacity, raw);
+    buffer->arena = true;
+    buffer->resource = NULL;
+    return buffer;
+}
+
+void buffer_arena_release(buffer_arena_t *arena)
+{
+    buffer_arena_chunk_t *chunk = arena->chunks;
+    while(chunk != NULL) {
+        buffer_arena_chunk_t *next = chunk->next;
+        for(unsigned i = 0; i < chunk->used; i++) {
+            free_data(&chunk->buffers[i]);
+        }
+        if(chunk != &arena->first) {
+            enif_free(chunk);
+        }
+        chunk = next;
+    }
+    buffer_arena_init(arena);
+}
+
+buffer_t *buffer_export(buffer_t *buffer)
+{
+    if(buffer->resource != NULL) {
+        enif_keep_resource(buffer->resource);
+        return buffer->resource;
+    }
+    buffer_t *resource = enif_alloc_resource(buffer_resource_type, sizeof(buffer_t));
+    if(__builtin_expect(resource == NULL, false)) {
+        return NULL;
+    }
+    init_buffer(resource, buffer->size, buffer->capacity, atomic_exchange(&buffer->raw, NULL));
+    resource->arena = false;
+    resource->resource = resource;
+    buffer->resource = resource;
+    return resource;
+}
+
+bool buffer_get(ErlNifEnv *env, ERL_NIF_TERM term, buffer_t **buffer)
+{
+    return enif_get_resource(env, term, buffer_resource_type, (void **)buffer);
+}
+
+/*
+ * buffer_pin counts the pin before it checks deallocated,
+ * and buffer_deallocate sets deallocated before it checks the pins,
+ * so either of them sees the other.
+ */
+bool buffer_pin(buffer_t *buffer)
+{
+    atomic_fetch_add(&buffer->pins, 1);
+    if(__builtin_expect(atomic_load(&buffer->deallocated), false)) {
+        buffer_unpin(buffer);
+        return false;
+    }
+    return true;
+}
+
+void buffer_unpin(buffer_t *buffer)
+{
+    if(atomic_fetch_sub(&buffer->pins, 1) == 1
+        && atomic_load(&buffer->deallocated)
+        && !atomic_load(&buffer->exposed)) {
+        free_data(buffer);
+    }
+}
+
+bool buffer_deallocate(buffer_t *buffer)
+{
+    if(atomic_exchange(&buffer->deallocated, true)) {
+        return false;
+    }
+    if(atomic_load(&buffer->pins) == 0 && !atomic_load(&buffer->exposed)) {
+        free_data(buffer);
+    }
+    return true;
+}
+
+ERL_NIF_TERM buffer_make_binary(ErlNifEnv *env, buffer_t *buffer, size_t offset, size_t size)
+{
+    atomic_store(&buffer->exposed, true);
+    return enif_make_resource_binary(env, buffer, (char *)buffer->data + offset, size);
+}
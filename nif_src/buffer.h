@@ -0,0 +1,149 @@
+#ifndef PELEMAY_ENGINE_BUFFER_H
+#define PELEMAY_ENGINE_BUFFER_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <erl_nif.h>
+
+/*
+ * The alignment of the data of a buffer, which is the size of a cache line
+ * and of the widest vector registers.
+ */
+#define BUFFER_ALIGNMENT 64
+
+/*
+ * The native storage of a tensor held as a NIF resource.
+ *
+ * The data is allocated apart from the resource and aligned to BUFFER_ALIGNMENT,
+ * so that it can be freed by buffer_deallocate before the resource is collected.
+ *
+ * pins counts the executions which are reading the buffer.
+ * exposed is set once a binary refers to the data,
+ * which is then kept until the resource is collected.
+ *
+ * writable is set while an execution may overwrite the data, that is
+ * while the buffer is allocated by the execution and not yet returned,
+ * or donated by the caller. refs counts the values on the stack and
+ * in the locals which refer to a writable buffer. Only the thread of
+ * the execution uses them.
+ *
+ * The data is a block of capacity bytes from the pool of the thread.
+ * A buffer in an arena is not a resource, whose data is moved into
+ * resource by buffer_export. resource is the buffer itself otherwise.
+ */
+typedef struct buffer {
+    size_t size;
+    size_t capacity;
+    void *_Atomic raw;
+    void *data;
+    bool arena;
+    struct buffer *resource;
+    atomic_uint pins;
+    atomic_bool deallocated;
+    atomic_bool exposed;
+    bool writable;
+    unsigned refs;
+} buffer_t;
+
+/*
+ * Opens the resource type of buffers.
+ *
+ * Returns 0 on success, or -1.
+ */
+int buffer_open_resource_type(ErlNifEnv *env, ErlNifResourceFlags flags);
+
+/*
+ * Allocates a buffer of size bytes.
+ *
+ * The caller owns a reference, which should be released by enif_release_resource
+ * after it makes the term by enif_make_resource.
+ *
+ * Returns NULL if it fails to alloc memory.
+ */
+buffer_t *buffer_alloc(size_t size);
+
+/*
+ * The intermediate buffers of an execution.
+ *
+ * They are allocated without being resources or terms, and returned to
+ * the pool together by buffer_arena_release, except those exported.
+ * The first chunk of the headers is in the arena itself, so that an
+ * execution of a few instructions allocates none.
+ */
+#define BUFFER_ARENA_CHUNK 16
+
+typedef struct buffer_arena_chunk {
+    struct buffer_arena_chunk *next;
+    unsigned used;
+    buffer_t buffers[BUFFER_ARENA_CHUNK];
+} buffer_arena_chunk_t;
+
+typedef struct buffer_arena {
+    buffer_arena_chunk_t *chunks;
+    buffer_arena_chunk_t first;
+} buffer_arena_t;
+
+void buffer_arena_init(buffer_arena_t *arena);
+
+/*
+ * Allocates a buffer of size bytes in the arena.
+ *
+ * Returns NULL if it fails to alloc memory.
+ */
+buffer_t *buffer_arena_alloc(buffer_arena_t *arena, size_t size);
+
+/*
+ * Returns the data of the buffers which are not exported to the pool,
+ * after which the buffers cannot be used anymore.
+ */
+void buffer_arena_release(buffer_arena_t *arena);
+
+/*
+ * Moves the data of a buffer in an arena into a resource, which is kept
+ * as its resource, so that the data outlives the execution.
+ * Exporting it again returns the same resource.
+ *
+ * The caller owns a reference to the returned resource as buffer_alloc.
+ *
+ * Returns NULL if it fails to alloc memory.
+ */
+buffer_t *buffer_export(buffer_t *buffer);
+
+/*
+ * Frees the blocks which the pool of the calling thread keeps,
+ * which a thread calls before it exits.
+ */
+void buffer_pool_trim(void);
+
+/*
+ * Gets the buffer of the term.
+ */
+bool buffer_get(ErlNifEnv *env, ERL_NIF_TERM term, buffer_t **buffer);
+
+/*
+ * Keeps the data of the buffer from being freed by buffer_deallocate,
+ * until buffer_unpin.
+ *
+ * Returns false if the buffer has been deallocated.
+ */
+bool buffer_pin(buffer_t *buffer);
+
+void buffer_unpin(buffer_t *buffer);
+
+/*
+ * Frees the data of the buffer, unless it is pinned or exposed,
+ * in which case it is freed when the last pin is released or the
+ * resource is collected. The buffer cannot be used anymore.
+ *
+ * Returns false if the buffer has been deallocated.
+ */
+bool buffer_deallocate(buffer_t *buffer);
+
+/*
+ * Makes a binary term referring to size bytes from offset of the data of the buffer
+ * without copying it.
+ */
+ERL_NIF_TERM buffer_make_binary(ErlNifEnv *env, buffer_t *buffer, size_t offset, size_t size);
+
+#endif // PELEMAY_ENGINE_BUFFER_H
@@ -0,0 +1,262 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <erl_nif.h>
+
+#include "kernel.h"
+#include "fuse.h"
+#include "pool.h"
+
+/*
+ * Fused elementwise loops.
+ *
+ * The body runs over tiles of FUSE_TILE elements. Each value on the stack of
+ * the body is a tile in a scratch buffer, a tile of an input, or an element
+ * broadcast to the tile. A tile of the scratch buffers is small enough to
+ * stay in the L1 cache, so a chain of operations sweeps the memory only once
+ * to read the inputs and once to write the result.
+ *
+ * The last operation writes the tile of the result directly, unless its
+ * result is broadcast.
+ *
+ * Large tensors are split into chunks of whole tiles, which run in the pool.
+ */
+
+#define FUSE_TILE 512
+#define FUSE_MAX_ELEMENT_SIZE 8
+#define FUSE_BUFFERS (FUSE_MAX_DEPTH + 1)
+
+typedef struct fuse_entry {
+    const void *data;
+    bool scalar;
+    int buffer;
+} fuse_entry_t;
+
+const char *fuse_check(const fuse_op_t *ops, unsigned length, unsigned num_inputs)
+{
+    if(length == 0 || length > FUSE_MAX_OPS) {
+        return "The length of the body should be from 1 to 64 in case of fuse";
+    }
+    if(num_inputs == 0 || num_inputs > FUSE_MAX_INPUTS) {
+        return "The number of the inputs should be from 1 to 16 in case of fuse";
+    }
+    unsigned depth = 0;
+    for(unsigned i = 0; i < length; i++) {
+        unsigned inst = ops[i].inst;
+        if(inst == INST_ALOADT) {
+            if(ops[i].index >= num_inputs) {
+                return "The operand of aloadt is over the number of the inputs in case of fuse";
+            }
+            depth++;
+        } else if(inst == INST_DUP) {
+            if(depth < 1) {
+                return "Stack limit is less than 0 in the body of fuse";
+            }
+            depth++;
+        } else if(inst == INST_SWAP || IS_BINARY_INST(inst)) {
+            if(depth < 2) {
+                return "Stack limit is less than 1 in the body of fuse";
+            }
+            depth -= inst == INST_SWAP ? 0 : 1;
+        } else if(IS_UNARY_INST(inst)) {
+            if(depth < 1) {
+                return "Stack limit is less than 0 in the body of fuse";
+            }
+        } else {
+            return "The body of fuse should consist of aloadt, dup, swap and elementwise operations";
+        }
+        if(depth > FUSE_MAX_DEPTH) {
+            return "The stack of the body is over 8 in case of fuse";
+        }
+    }
+    if(depth != 1) {
+        return "The body of fuse should leave one value";
+    }
+    return NULL;
+}
+
+const char *fuse_prepare(fuse_plan_t *plan, const fuse_op_t *ops, unsigned length, const fuse_input_t *inputs, unsigned num_inputs)
+{
+    enum type_binary types[FUSE_MAX_DEPTH];
+    enum bit_type_binary bit_types[FUSE_MAX_DEPTH];
+    unsigned depth = 0;
+
+    plan->ops = ops;
+    plan->length = length;
+    plan->inputs = inputs;
+    plan->num_inputs = num_inputs;
+
+    for(unsigned i = 0; i < length; i++) {
+        unsigned inst = ops[i].inst;
+        if(inst == INST_ALOADT) {
+            const fuse_input_t *in = &inputs[ops[i].index];
+            if(in->type == tb_c || in->bit_type > btb_64) {
+                return "Sorry, fuse does not support complex numbers";
+            }
+            types[depth] = in->type;
+            bit_types[depth] = in->bit_type;
+            depth++;
+        } else if(inst == INST_DUP) {
+            types[depth] = types[depth - 1];
+            bit_types[depth] = bit_types[depth - 1];
+            depth++;
+        } else if(inst == INST_SWAP) {
+            enum type_binary t = types[depth - 1];
+            enum bit_type_binary b = bit_types[depth - 1];
+            types[depth - 1] = types[depth - 2];
+            bit_types[depth - 1] = bit_types[depth - 2];
+            types[depth - 2] = t;
+            bit_types[depth - 2] = b;
+        } else if(IS_BINARY_INST(inst)) {
+            depth--;
+            if(types[depth] != types[depth - 1] || bit_types[depth] != bit_types[depth - 1]) {
+                return "The types of tensors should be same in case of binary operations";
+            }
+            plan->kernels[i].binary = binary_kernel(inst, types[depth - 1], bit_types[depth - 1]);
+            if(plan->kernels[i].binary == NULL) {
+                return "Sorry, the binary operation does not support the type";
+            }
+            if(binary_returns_u8(inst)) {
+                types[depth - 1] = tb_u;
+                bit_types[depth - 1] = btb_8;
+            }
+        } else {
+            plan->kernels[i].unary = unary_kernel(inst, types[depth - 1], bit_types[depth - 1]);
+            if(plan->kernels[i].unary == NULL) {
+                return "Sorry, the unary operation does not support the type";
+            }
+        }
+        plan->element_size[i] = 1u << bit_types[depth - 1];
+    }
+    plan->type = types[0];
+    plan->bit_type = bit_types[0];
+    return NULL;
+}
+
+static int acquire_buffer(unsigned *refs)
+{
+    for(int b = 0; b < FUSE_BUFFERS; b++) {
+        if(refs[b] == 0) {
+            refs[b] = 1;
+            return b;
+        }
+    }
+    // unreachable, since the stack holds at most FUSE_MAX_DEPTH buffers.
+    return -1;
+}
+
+static void release_buffer(unsigned *refs, const fuse_entry_t *entry)
+{
+    if(entry->buffer >= 0) {
+        refs[entry->buffer]--;
+    }
+}
+
+static const char *run_range(const fuse_plan_t *plan, uint64_t begin, uint64_t end, void *out)
+{
+    char *scratch = enif_alloc(FUSE_BUFFERS * FUSE_TILE * FUSE_MAX_ELEMENT_SIZE);
+    if(scratch == NULL) {
+        return "Fail to alloc memory in case of fuse";
+    }
+    size_t out_size = (size_t)1 << plan->bit_type;
+
+    for(uint64_t start = begin; start < end; start += FUSE_TILE) {
+        size_t n = end - start < FUSE_TILE ? (size_t)(end - start) : FUSE_TILE;
+        char *out_tile = (char *)out + start * out_size;
+        fuse_entry_t stack[FUSE_MAX_DEPTH];
+        unsigned refs[FUSE_BUFFERS] = {0};
+        unsigned depth = 0;
+
+        for(unsigned i = 0; i < plan->length; i++) {
+            unsigned inst = plan->ops[i].inst;
+            if(inst == INST_ALOADT) {
+                const fuse_input_t *in = &plan->inputs[plan->ops[i].index];
+                bool scalar = in->size == 1;
+                stack[depth].data = scalar ? in->data : (const char *)in->data + start * plan->element_size[i];
+                stack[depth].scalar = scalar;
+                stack[depth].buffer = -1;
+                depth++;
+            } else if(inst == INST_DUP) {
+                stack[depth] = stack[depth - 1];
+                if(stack[depth].buffer >= 0) {
+                    refs[stack[depth].buffer]++;
+                }
+                depth++;
+            } else if(inst == INST_SWAP) {
+                fuse_entry_t t = stack[depth - 1];
+                stack[depth - 1] = stack[depth - 2];
+                stack[depth - 2] = t;
+            } else {
+                bool binary = IS_BINARY_INST(inst);
+                fuse_entry_t *a = &stack[depth - (binary ? 2 : 1)];
+                fuse_entry_t *b = &stack[depth - 1];
+                bool scalar = binary ? a->scalar && b->scalar : a->scalar;
+                bool direct = i + 1 == plan->length && !scalar;
+                int buffer = direct ? -1 : acquire_buffer(refs);
+                void *dst = direct ? (void *)out_tile : scratch + (size_t)buffer * FUSE_TILE * FUSE_MAX_ELEMENT_SIZE;
+                size_t count = scalar ? 1 : n;
+
+                if(binary) {
+                    if(!plan->kernels[i].binary(count, a->data, a->scalar && !scalar, b->data, b->scalar && !scalar, dst)) {
+                        enif_free(scratch);
+                        return "Division by zero in case of binary operations";
+                    }
+                    release_buffer(refs, b);
+                    depth--;
+                } else {
+                    plan->kernels[i].unary(count, a->data, dst);
+                }
+                release_buffer(refs, a);
+                a->data = dst;
+                a->scalar = scalar;
+                a->buffer = buffer;
+            }
+        }
+
+        if(stack[0].data != out_tile) {
+            if(stack[0].scalar) {
+                for(size_t j = 0; j < n; j++) {
+                    memcpy(out_tile + j * out_size, stack[0].data, out_size);
+                }
+            } else {
+                memcpy(out_tile, stack[0].data, n * out_size);
+            }
+        }
+    }
+    enif_free(scratch);
+    return NULL;
+}
+
+typedef struct fuse_job {
+    const fuse_plan_t *plan;
+    void *out;
+    const char *_Atomic error;
+} fuse_job_t;
+
+static bool run_chunk(void *arg, size_t begin, size_t end)
+{
+    fuse_job_t *job = arg;
+    const char *error = run_range(job->plan, begin, end, job->out);
+    if(error != NULL) {
+        atomic_store(&job->error, error);
+        return false;
+    }
+    return true;
+}
+
+const char *fuse_run(const fuse_plan_t *plan, uint64_t size, void *out)
+{
+    size_t widest = 1;
+    for(unsigned i = 0; i < plan->length; i++) {
+        if(plan->element_size[i] > widest) {
+            widest = plan->element_size[i];
+        }
+    }
+    size_t grain = pool_grain(size, widest);
+    fuse_job_t job = {.plan = plan, .out = out};
+    atomic_init(&job.error, NULL);
+    pool_run(size, (grain + FUSE_TILE - 1) / FUSE_TILE * FUSE_TILE, run_chunk, &job);
+    return atomic_load(&job.error);
+}
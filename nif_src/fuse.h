@@ -0,0 +1,77 @@
+#ifndef PELEMAY_ENGINE_FUSE_H
+#define PELEMAY_ENGINE_FUSE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "opcode.h"
+#include "kernel.h"
+
+#define FUSE_MAX_OPS 64
+#define FUSE_MAX_DEPTH 8
+#define FUSE_MAX_INPUTS 16
+
+/*
+ * An instruction of the body of fuse.
+ *
+ * The body is a stack program over the inputs of fuse, made of
+ * aloadt (which loads the input of index), dup, swap and
+ * the elementwise binary and unary instructions.
+ */
+typedef struct fuse_op {
+    unsigned inst;
+    unsigned index;
+} fuse_op_t;
+
+typedef struct fuse_input {
+    enum type_binary type;
+    enum bit_type_binary bit_type;
+    uint64_t size;
+    const void *data;
+} fuse_input_t;
+
+/*
+ * The body of fuse with the kernels for the types of the inputs.
+ */
+typedef struct fuse_plan {
+    const fuse_op_t *ops;
+    unsigned length;
+    const fuse_input_t *inputs;
+    unsigned num_inputs;
+    union {
+        binary_kernel_t binary;
+        unary_kernel_t unary;
+    } kernels[FUSE_MAX_OPS];
+    unsigned element_size[FUSE_MAX_OPS];
+    enum type_binary type;
+    enum bit_type_binary bit_type;
+} fuse_plan_t;
+
+/*
+ * Checks that the body is a valid stack program leaving one value,
+ * within the limits above.
+ *
+ * Returns NULL on success, or the message of the error.
+ */
+const char *fuse_check(const fuse_op_t *ops, unsigned length, unsigned num_inputs);
+
+/*
+ * Looks up the kernels of the body for the types of the inputs,
+ * and gets the type of the result into the plan.
+ *
+ * Returns NULL on success, or the message of the error.
+ */
+const char *fuse_prepare(fuse_plan_t *plan, const fuse_op_t *ops, unsigned length, const fuse_input_t *inputs, unsigned num_inputs);
+
+/*
+ * Runs the body over size elements into out, tile by tile, so that
+ * the intermediate values stay in the cache instead of going through memory.
+ *
+ * The size of each input should be size or 1, in which case it is broadcast.
+ *
+ * Returns NULL on success, or the message of the error.
+ */
+const char *fuse_run(const fuse_plan_t *plan, uint64_t size, void *out);
+
+#endif // PELEMAY_ENGINE_FUSE_H
@@ -0,0 +1,91 @@
+#ifndef PELEMAY_ENGINE_HALF_H
+#define PELEMAY_ENGINE_HALF_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Conversions between f32 and the 16 bit floating point types,
+ * which are stored as uint16_t and computed in f32.
+ *
+ * The narrowing conversions round to the nearest even, and keep NaN as NaN.
+ */
+
+static inline float f16_to_f32(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1F;
+    uint32_t mantissa = h & 0x3FF;
+    uint32_t x;
+    if(exponent == 0x1F) {
+        x = sign | 0x7F800000 | (mantissa << 13);
+    } else if(exponent != 0) {
+        x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    } else if(mantissa == 0) {
+        x = sign;
+    } else {
+        // subnormal
+        float f = (float)mantissa * 0x1p-24f;
+        return sign ? -f : f;
+    }
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+static inline uint16_t f32_to_f16(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint16_t sign = (uint16_t)((x >> 16) & 0x8000);
+    uint32_t abs = x & 0x7FFFFFFF;
+    if(abs >= 0x7F800000) {
+        // infinity, or NaN keeping the upper bits of the payload
+        return sign | 0x7C00 | (abs > 0x7F800000 ? 0x200 | ((abs >> 13) & 0x3FF) : 0);
+    }
+    if(abs >= 0x477FF000) {
+        // 65520 and over round to infinity
+        return sign | 0x7C00;
+    }
+    uint32_t h, rest, half;
+    if(abs >= 0x38800000) {
+        // normal, rebiasing the exponent
+        uint32_t r = abs - 0x38000000;
+        h = r >> 13;
+        rest = r & 0x1FFF;
+        half = 0x1000;
+    } else if(abs >= 0x33000000) {
+        // subnormal, shifting the mantissa with the implicit bit
+        unsigned shift = 126 - (abs >> 23);
+        uint32_t mantissa = (abs & 0x7FFFFF) | 0x800000;
+        h = mantissa >> shift;
+        rest = mantissa & ((1u << shift) - 1);
+        half = 1u << (shift - 1);
+    } else {
+        return sign;
+    }
+    if(rest > half || (rest == half && (h & 1))) {
+        h++;
+    }
+    return sign | (uint16_t)h;
+}
+
+static inline float bf16_to_f32(uint16_t h)
+{
+    uint32_t x = (uint32_t)h << 16;
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+static inline uint16_t f32_to_bf16(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    if((x & 0x7FFFFFFF) > 0x7F800000) {
+        return (uint16_t)((x >> 16) | 0x40);
+    }
+    return (uint16_t)((x + 0x7FFF + ((x >> 16) & 1)) >> 16);
+}
+
+#endif // PELEMAY_ENGINE_HALF_H
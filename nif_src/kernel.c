@@ -0,0 +1,498 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "half.h"
+#include "kernel.h"
+#include "vmath.h"
+
+/*
+ * Elementwise kernels.
+ *
+ * Each kernel is a plain loop, split into the cases where either operand
+ * is broadcast, so that the compiler vectorizes it.
+ * The pointers are not restrict, since the output may be an operand
+ * when an instruction computes in place; each element is read before
+ * it is written, and the compiler checks the overlap before the vector loop.
+ * Integer arithmetic is done in an unsigned type wide enough not to be
+ * promoted to int, so that it wraps around as Nx does.
+ */
+
+#define DEFINE_BINARY(name, ctype, otype, expr) \
+static bool name(size_t n, const void *va, bool scalar_a, const void *vb, bool scalar_b, void *vout) \
+{ \
+    const ctype *a = va; \
+    const ctype *b = vb; \
+    otype *out = vout; \
+    if(scalar_a && !scalar_b) { \
+        const ctype x = a[0]; \
+        for(size_t i = 0; i < n; i++) { \
+            const ctype y = b[i]; \
+            out[i] = (otype)(expr); \
+        } \
+    } else if(scalar_b && !scalar_a) { \
+        const ctype y = b[0]; \
+        for(size_t i = 0; i < n; i++) { \
+            const ctype x = a[i]; \
+            out[i] = (otype)(expr); \
+        } \
+    } else { \
+        for(size_t i = 0; i < n; i++) { \
+            const ctype x = a[i]; \
+            const ctype y = b[i]; \
+            out[i] = (otype)(expr); \
+        } \
+    } \
+    return true; \
+}
+
+/*
+ * Same as DEFINE_BINARY, but fails if any element of b is zero.
+ */
+#define DEFINE_BINARY_NONZERO(name, ctype, expr) \
+DEFINE_BINARY(name##_unchecked, ctype, ctype, expr) \
+static bool name(size_t n, const void *va, bool scalar_a, const void *vb, bool scalar_b, void *vout) \
+{ \
+    const ctype *b = vb; \
+    size_t nb = scalar_b ? 1 : n; \
+    bool zero = false; \
+    for(size_t i = 0; i < nb; i++) { \
+        zero |= b[i] == 0; \
+    } \
+    if(zero) { \
+        return false; \
+    } \
+    return name##_unchecked(n, va, scalar_a, vb, scalar_b, vout); \
+}
+
+#define DEFINE_COMMON_KERNELS(t, ctype) \
+DEFINE_BINARY(min_##t, ctype, ctype, x < y ? x : y) \
+DEFINE_BINARY(max_##t, ctype, ctype, x > y ? x : y) \
+DEFINE_BINARY(equal_##t, ctype, uint8_t, x == y) \
+DEFINE_BINARY(not_equal_##t, ctype, uint8_t, x != y) \
+DEFINE_BINARY(greater_##t, ctype, uint8_t, x > y) \
+DEFINE_BINARY(less_##t, ctype, uint8_t, x < y) \
+DEFINE_BINARY(greater_equal_##t, ctype, uint8_t, x >= y) \
+DEFINE_BINARY(less_equal_##t, ctype, uint8_t, x <= y) \
+DEFINE_BINARY(logical_and_##t, ctype, uint8_t, (x != 0) & (y != 0)) \
+DEFINE_BINARY(logical_or_##t, ctype, uint8_t, (x != 0) | (y != 0)) \
+DEFINE_BINARY(logical_xor_##t, ctype, uint8_t, (x != 0) ^ (y != 0))
+
+/*
+ * Shifts x left by s, or right by -s if s is negative, as Bitwise does.
+ */
+#define DEFINE_SHIFT(t, ctype, wtype, bits, is_signed) \
+static inline ctype shift_##t(ctype x, int64_t s) \
+{ \
+    if(s >= (bits)) { \
+        return 0; \
+    } else if(s >= 0) { \
+        return (ctype)((wtype)x << s); \
+    } else if(s <= -(bits)) { \
+        return (is_signed) ? (ctype)(x >> ((bits) - 1)) : 0; \
+    } else { \
+        return (ctype)(x >> -s); \
+    } \
+}
+
+#define DEFINE_INT_KERNELS(t, ctype, wtype, bits, is_signed) \
+DEFINE_COMMON_KERNELS(t, ctype) \
+DEFINE_SHIFT(t, ctype, wtype, bits, is_signed) \
+DEFINE_BINARY(add_##t, ctype, ctype, (wtype)x + (wtype)y) \
+DEFINE_BINARY(subtract_##t, ctype, ctype, (wtype)x - (wtype)y) \
+DEFINE_BINARY(multiply_##t, ctype, ctype, (wtype)x * (wtype)y) \
+DEFINE_BINARY_NONZERO(remainder_##t, ctype, ((is_signed) && y == (ctype)-1) ? 0 : x % y) \
+DEFINE_BINARY_NONZERO(quotient_##t, ctype, ((is_signed) && y == (ctype)-1) ? (ctype)(0 - (wtype)x) : x / y) \
+DEFINE_BINARY(bitwise_and_##t, ctype, ctype, x & y) \
+DEFINE_BINARY(bitwise_or_##t, ctype, ctype, x | y) \
+DEFINE_BINARY(bitwise_xor_##t, ctype, ctype, x ^ y) \
+DEFINE_BINARY(left_shift_##t, ctype, ctype, shift_##t(x, (int64_t)y)) \
+DEFINE_BINARY(right_shift_##t, ctype, ctype, shift_##t(x, -(int64_t)y))
+
+/*
+ * The functions of libm are computed in double and rounded,
+ * as Nx.BinaryBackend does with :math.
+ */
+#define DEFINE_FLOAT_KERNELS(t, ctype) \
+DEFINE_COMMON_KERNELS(t, ctype) \
+DEFINE_BINARY(add_##t, ctype, ctype, x + y) \
+DEFINE_BINARY(subtract_##t, ctype, ctype, x - y) \
+DEFINE_BINARY(multiply_##t, ctype, ctype, x * y) \
+DEFINE_BINARY(divide_##t, ctype, ctype, x / y) \
+DEFINE_BINARY(power_##t, ctype, ctype, pow(x, y)) \
+DEFINE_BINARY(remainder_##t, ctype, ctype, fmod(x, y)) \
+DEFINE_BINARY(atan2_##t, ctype, ctype, atan2(x, y))
+
+/*
+ * The 16 bit floating point types are computed in f32 and rounded.
+ * min and max return either operand as it is.
+ */
+#define DEFINE_HALF_KERNELS(t) \
+DEFINE_BINARY(min_##t, uint16_t, uint16_t, t##_to_f32(x) < t##_to_f32(y) ? x : y) \
+DEFINE_BINARY(max_##t, uint16_t, uint16_t, t##_to_f32(x) > t##_to_f32(y) ? x : y) \
+DEFINE_BINARY(equal_##t, uint16_t, uint8_t, t##_to_f32(x) == t##_to_f32(y)) \
+DEFINE_BINARY(not_equal_##t, uint16_t, uint8_t, t##_to_f32(x) != t##_to_f32(y)) \
+DEFINE_BINARY(greater_##t, uint16_t, uint8_t, t##_to_f32(x) > t##_to_f32(y)) \
+DEFINE_BINARY(less_##t, uint16_t, uint8_t, t##_to_f32(x) < t##_to_f32(y)) \
+DEFINE_BINARY(greater_equal_##t, uint16_t, uint8_t, t##_to_f32(x) >= t##_to_f32(y)) \
+DEFINE_BINARY(less_equal_##t, uint16_t, uint8_t, t##_to_f32(x) <= t##_to_f32(y)) \
+DEFINE_BINARY(logical_and_##t, uint16_t, uint8_t, (t##_to_f32(x) != 0) & (t##_to_f32(y) != 0)) \
+DEFINE_BINARY(logical_or_##t, uint16_t, uint8_t, (t##_to_f32(x) != 0) | (t##_to_f32(y) != 0)) \
+DEFINE_BINARY(logical_xor_##t, uint16_t, uint8_t, (t##_to_f32(x) != 0) ^ (t##_to_f32(y) != 0)) \
+DEFINE_BINARY(add_##t, uint16_t, uint16_t, f32_to_##t(t##_to_f32(x) + t##_to_f32(y))) \
+DEFINE_BINARY(subtract_##t, uint16_t, uint16_t, f32_to_##t(t##_to_f32(x) - t##_to_f32(y))) \
+DEFINE_BINARY(multiply_##t, uint16_t, uint16_t, f32_to_##t(t##_to_f32(x) * t##_to_f32(y))) \
+DEFINE_BINARY(divide_##t, uint16_t, uint16_t, f32_to_##t(t##_to_f32(x) / t##_to_f32(y))) \
+DEFINE_BINARY(power_##t, uint16_t, uint16_t, f32_to_##t(powf(t##_to_f32(x), t##_to_f32(y)))) \
+DEFINE_BINARY(remainder_##t, uint16_t, uint16_t, f32_to_##t(fmodf(t##_to_f32(x), t##_to_f32(y)))) \
+DEFINE_BINARY(atan2_##t, uint16_t, uint16_t, f32_to_##t(atan2f(t##_to_f32(x), t##_to_f32(y))))
+
+DEFINE_INT_KERNELS(s8, int8_t, uint32_t, 8, true)
+DEFINE_INT_KERNELS(s16, int16_t, uint32_t, 16, true)
+DEFINE_INT_KERNELS(s32, int32_t, uint32_t, 32, true)
+DEFINE_INT_KERNELS(s64, int64_t, uint64_t, 64, true)
+DEFINE_INT_KERNELS(u8, uint8_t, uint32_t, 8, false)
+DEFINE_INT_KERNELS(u16, uint16_t, uint32_t, 16, false)
+DEFINE_INT_KERNELS(u32, uint32_t, uint32_t, 32, false)
+DEFINE_INT_KERNELS(u64, uint64_t, uint64_t, 64, false)
+DEFINE_HALF_KERNELS(f16)
+DEFINE_HALF_KERNELS(bf16)
+DEFINE_FLOAT_KERNELS(f32, float)
+DEFINE_FLOAT_KERNELS(f64, double)
+
+#define COMMON_ENTRIES(t, kt) \
+    [BINARY_OP(INST_ADD)][kt] = add_##t, \
+    [BINARY_OP(INST_SUBTRACT)][kt] = subtract_##t, \
+    [BINARY_OP(INST_MULTIPLY)][kt] = multiply_##t, \
+    [BINARY_OP(INST_REMAINDER)][kt] = remainder_##t, \
+    [BINARY_OP(INST_MIN)][kt] = min_##t, \
+    [BINARY_OP(INST_MAX)][kt] = max_##t, \
+    [BINARY_OP(INST_EQUAL)][kt] = equal_##t, \
+    [BINARY_OP(INST_NOT_EQUAL)][kt] = not_equal_##t, \
+    [BINARY_OP(INST_GREATER)][kt] = greater_##t, \
+    [BINARY_OP(INST_LESS)][kt] = less_##t, \
+    [BINARY_OP(INST_GREATER_EQUAL)][kt] = greater_equal_##t, \
+    [BINARY_OP(INST_LESS_EQUAL)][kt] = less_equal_##t, \
+    [BINARY_OP(INST_LOGICAL_AND)][kt] = logical_and_##t, \
+    [BINARY_OP(INST_LOGICAL_OR)][kt] = logical_or_##t, \
+    [BINARY_OP(INST_LOGICAL_XOR)][kt] = logical_xor_##t
+
+#define INT_ENTRIES(t, kt) \
+    COMMON_ENTRIES(t, kt), \
+    [BINARY_OP(INST_QUOTIENT)][kt] = quotient_##t, \
+    [BINARY_OP(INST_BITWISE_AND)][kt] = bitwise_and_##t, \
+    [BINARY_OP(INST_BITWISE_OR)][kt] = bitwise_or_##t, \
+    [BINARY_OP(INST_BITWISE_XOR)][kt] = bitwise_xor_##t, \
+    [BINARY_OP(INST_LEFT_SHIFT)][kt] = left_shift_##t, \
+    [BINARY_OP(INST_RIGHT_SHIFT)][kt] = right_shift_##t
+
+#define FLOAT_ENTRIES(t, kt) \
+    COMMON_ENTRIES(t, kt), \
+    [BINARY_OP(INST_DIVIDE)][kt] = divide_##t, \
+    [BINARY_OP(INST_POWER)][kt] = power_##t, \
+    [BINARY_OP(INST_ATAN2)][kt] = atan2_##t
+
+static const binary_kernel_t binary_kernels[NUM_BINARY_OPS][NUM_KERNEL_TYPES] = {
+    INT_ENTRIES(s8, KERNEL_TYPE(tb_s, btb_8)),
+    INT_ENTRIES(s16, KERNEL_TYPE(tb_s, btb_16)),
+    INT_ENTRIES(s32, KERNEL_TYPE(tb_s, btb_32)),
+    INT_ENTRIES(s64, KERNEL_TYPE(tb_s, btb_64)),
+    INT_ENTRIES(u8, KERNEL_TYPE(tb_u, btb_8)),
+    INT_ENTRIES(u16, KERNEL_TYPE(tb_u, btb_16)),
+    INT_ENTRIES(u32, KERNEL_TYPE(tb_u, btb_32)),
+    INT_ENTRIES(u64, KERNEL_TYPE(tb_u, btb_64)),
+    FLOAT_ENTRIES(f16, KERNEL_TYPE(tb_f, btb_16)),
+    FLOAT_ENTRIES(bf16, KERNEL_TYPE(tb_bf, btb_16)),
+    FLOAT_ENTRIES(f32, KERNEL_TYPE(tb_f, btb_32)),
+    FLOAT_ENTRIES(f64, KERNEL_TYPE(tb_f, btb_64)),
+};
+
+binary_kernel_t binary_kernel(unsigned inst, enum type_binary type, enum bit_type_binary bit_type)
+{
+    unsigned kt = KERNEL_TYPE(type, bit_type);
+    if(!IS_BINARY_INST(inst) || kt >= NUM_KERNEL_TYPES) {
+        return NULL;
+    }
+    return binary_kernels[BINARY_OP(inst)][kt];
+}
+
+bool binary_returns_u8(unsigned inst)
+{
+    return inst >= INST_EQUAL && inst <= INST_LOGICAL_XOR;
+}
+
+#define DEFINE_UNARY(name, ctype, expr) \
+static void name(size_t n, const void *vin, void *vout) \
+{ \
+    const ctype *in = vin; \
+    ctype *out = vout; \
+    for(size_t i = 0; i < n; i++) { \
+        const ctype x = in[i]; \
+        out[i] = (ctype)(expr); \
+    } \
+}
+
+/*
+ * See vmath.h for the errors of the floating point functions.
+ */
+#define DEFINE_FLOAT_UNARY_KERNELS(t, ctype, sqrt_fn, abs_fn) \
+DEFINE_UNARY(exp_##t, ctype, vm_exp_##t(x)) \
+DEFINE_UNARY(log_##t, ctype, vm_log_##t(x)) \
+DEFINE_UNARY(log1p_##t, ctype, vm_log1p_##t(x)) \
+DEFINE_UNARY(sigmoid_##t, ctype, vm_sigmoid_##t(x)) \
+DEFINE_UNARY(tanh_##t, ctype, vm_tanh_##t(x)) \
+DEFINE_UNARY(erf_##t, ctype, vm_erf_##t(x)) \
+DEFINE_UNARY(sqrt_##t, ctype, sqrt_fn(x)) \
+DEFINE_UNARY(rsqrt_##t, ctype, 1 / sqrt_fn(x)) \
+DEFINE_UNARY(abs_##t, ctype, abs_fn(x))
+
+DEFINE_FLOAT_UNARY_KERNELS(f32, float, sqrtf, fabsf)
+DEFINE_FLOAT_UNARY_KERNELS(f64, double, sqrt, fabs)
+
+#define DEFINE_HALF_UNARY(name, t, expr) \
+DEFINE_UNARY(name##_##t, uint16_t, f32_to_##t(expr(t##_to_f32(x))))
+
+#define DEFINE_HALF_UNARY_KERNELS(t) \
+DEFINE_HALF_UNARY(exp, t, vm_exp_f32) \
+DEFINE_HALF_UNARY(log, t, vm_log_f32) \
+DEFINE_HALF_UNARY(log1p, t, vm_log1p_f32) \
+DEFINE_HALF_UNARY(sigmoid, t, vm_sigmoid_f32) \
+DEFINE_HALF_UNARY(tanh, t, vm_tanh_f32) \
+DEFINE_HALF_UNARY(erf, t, vm_erf_f32) \
+DEFINE_HALF_UNARY(sqrt, t, sqrtf) \
+DEFINE_HALF_UNARY(rsqrt, t, 1 / sqrtf) \
+DEFINE_UNARY(abs_##t, uint16_t, x & 0x7FFF)
+
+DEFINE_HALF_UNARY_KERNELS(f16)
+DEFINE_HALF_UNARY_KERNELS(bf16)
+
+// abs of the minimum of a signed type wraps around to itself, as Nx does.
+DEFINE_UNARY(abs_s8, int8_t, x < 0 ? 0 - (uint32_t)x : (uint32_t)x)
+DEFINE_UNARY(abs_s16, int16_t, x < 0 ? 0 - (uint32_t)x : (uint32_t)x)
+DEFINE_UNARY(abs_s32, int32_t, x < 0 ? 0 - (uint32_t)x : (uint32_t)x)
+DEFINE_UNARY(abs_s64, int64_t, x < 0 ? 0 - (uint64_t)x : (uint64_t)x)
+DEFINE_UNARY(abs_u8, uint8_t, x)
+DEFINE_UNARY(abs_u16, uint16_t, x)
+DEFINE_UNARY(abs_u32, uint32_t, x)
+DEFINE_UNARY(abs_u64, uint64_t, x)
+
+#define FLOAT_UNARY_ENTRIES(t, kt) \
+    [UNARY_OP(INST_EXP)][kt] = exp_##t, \
+    [UNARY_OP(INST_LOG)][kt] = log_##t, \
+    [UNARY_OP(INST_LOG1P)][kt] = log1p_##t, \
+    [UNARY_OP(INST_SIGMOID)][kt] = sigmoid_##t, \
+    [UNARY_OP(INST_TANH)][kt] = tanh_##t, \
+    [UNARY_OP(INST_ERF)][kt] = erf_##t, \
+    [UNARY_OP(INST_SQRT)][kt] = sqrt_##t, \
+    [UNARY_OP(INST_RSQRT)][kt] = rsqrt_##t, \
+    [UNARY_OP(INST_ABS)][kt] = abs_##t
+
+static const unary_kernel_t unary_kernels[NUM_UNARY_OPS][NUM_KERNEL_TYPES] = {
+    FLOAT_UNARY_ENTRIES(f16, KERNEL_TYPE(tb_f, btb_16)),
+    FLOAT_UNARY_ENTRIES(bf16, KERNEL_TYPE(tb_bf, btb_16)),
+    FLOAT_UNARY_ENTRIES(f32, KERNEL_TYPE(tb_f, btb_32)),
+    FLOAT_UNARY_ENTRIES(f64, KERNEL_TYPE(tb_f, btb_64)),
+    [UNARY_OP(INST_ABS)][KERNEL_TYPE(tb_s, btb_8)] = abs_s8,
+    [UNARY_OP(INST_ABS)][KERNEL_TYPE(tb_s, btb_16)] = abs_s16,
+    [UNARY_OP(INST_ABS)][KERNEL_TYPE(tb_s, btb_32)] = abs_s32,
+    [UNARY_OP(INST_ABS)][KERNEL_TYPE(tb_s, btb_64)] = abs_s64,
+    [UNARY_OP(INST_ABS)][KERNEL_TYPE(tb_u, btb_8)] = abs_u8,
+    [UNARY_OP(INST_ABS)][KERNEL_TYPE(tb_u, btb_16)] = abs_u16,
+    [UNARY_OP(INST_ABS)][KERNEL_TYPE(tb_u, btb_32)] = abs_u32,
+    [UNARY_OP(INST_ABS)][KERNEL_TYPE(tb_u, btb_64)] = abs_u64,
+};
+
+unary_kernel_t unary_kernel(unsigned inst, enum type_binary type, enum bit_type_binary bit_type)
+{
+    unsigned kt = KERNEL_TYPE(type, bit_type);
+    if(!IS_UNARY_INST(inst) || kt >= NUM_KERNEL_TYPES) {
+        return NULL;
+    }
+    return unary_kernels[UNARY_OP(inst)][kt];
+}
+
+/*
+ * Conversions between the element types.
+ *
+ * Integers wrap around to narrower types, as Nx does.
+ * Floating point numbers are truncated toward zero into integers,
+ * where NaN is 0 and those out of the range saturate to the minimum
+ * or the maximum of the integer type, as Nx does with the infinities.
+ */
+
+static inline int64_t float_to_signed(double x, int64_t min, int64_t max)
+{
+    if(x != x) {
+        return 0;
+    } else if(x <= (double)min) {
+        return min;
+    } else if(x >= (double)max) {
+        return max;
+    } else {
+        return (int64_t)x;
+    }
+}
+
+static inline uint64_t float_to_u64(double x)
+{
+    if(x != x || x <= 0) {
+        return 0;
+    } else if(x >= 18446744073709551616.0) {
+        return UINT64_MAX;
+    } else {
+        return (uint64_t)x;
+    }
+}
+
+#define CTYPE_s8 int8_t
+#define CTYPE_s16 int16_t
+#define CTYPE_s32 int32_t
+#define CTYPE_s64 int64_t
+#define CTYPE_u8 uint8_t
+#define CTYPE_u16 uint16_t
+#define CTYPE_u32 uint32_t
+#define CTYPE_u64 uint64_t
+#define CTYPE_f16 uint16_t
+#define CTYPE_bf16 uint16_t
+#define CTYPE_f32 float
+#define CTYPE_f64 double
+
+// Whether the value loaded from the type is an integer or a floating point number.
+#define KIND_s8 INT
+#define KIND_s16 INT
+#define KIND_s32 INT
+#define KIND_s64 INT
+#define KIND_u8 INT
+#define KIND_u16 INT
+#define KIND_u32 INT
+#define KIND_u64 INT
+#define KIND_f16 FLOAT
+#define KIND_bf16 FLOAT
+#define KIND_f32 FLOAT
+#define KIND_f64 FLOAT
+
+#define LOAD_s8(x) (x)
+#define LOAD_s16(x) (x)
+#define LOAD_s32(x) (x)
+#define LOAD_s64(x) (x)
+#define LOAD_u8(x) (x)
+#define LOAD_u16(x) (x)
+#define LOAD_u32(x) (x)
+#define LOAD_u64(x) (x)
+#define LOAD_f16(x) f16_to_f32(x)
+#define LOAD_bf16(x) bf16_to_f32(x)
+#define LOAD_f32(x) (x)
+#define LOAD_f64(x) (x)
+
+#define TO_INT_INT(v, min, max) (v)
+#define TO_INT_FLOAT(v, min, max) float_to_signed(v, min, max)
+#define TO_INT_(kind, v, min, max) TO_INT_##kind(v, min, max)
+#define TO_INT(kind, v, min, max) TO_INT_(kind, v, min, max)
+
+#define TO_U64_INT(v) (v)
+#define TO_U64_FLOAT(v) float_to_u64(v)
+#define TO_U64_(kind, v) TO_U64_##kind(v)
+#define TO_U64(kind, v) TO_U64_(kind, v)
+
+#define STORE_s8(v, kind) ((int8_t)TO_INT(kind, v, INT8_MIN, INT8_MAX))
+#define STORE_s16(v, kind) ((int16_t)TO_INT(kind, v, INT16_MIN, INT16_MAX))
+#define STORE_s32(v, kind) ((int32_t)TO_INT(kind, v, INT32_MIN, INT32_MAX))
+#define STORE_s64(v, kind) ((int64_t)TO_INT(kind, v, INT64_MIN, INT64_MAX))
+#define STORE_u8(v, kind) ((uint8_t)TO_INT(kind, v, 0, UINT8_MAX))
+#define STORE_u16(v, kind) ((uint16_t)TO_INT(kind, v, 0, UINT16_MAX))
+#define STORE_u32(v, kind) ((uint32_t)TO_INT(kind, v, 0, UINT32_MAX))
+#define STORE_u64(v, kind) ((uint64_t)TO_U64(kind, v))
+#define STORE_f16(v, kind) f32_to_f16((float)(v))
+#define STORE_bf16(v, kind) f32_to_bf16((float)(v))
+#define STORE_f32(v, kind) ((float)(v))
+#define STORE_f64(v, kind) ((double)(v))
+
+#define DEFINE_CONVERT(from, to) \
+static void convert_##from##_##to(size_t n, const void *vin, void *vout) \
+{ \
+    const CTYPE_##from *in = vin; \
+    CTYPE_##to *out = vout; \
+    for(size_t i = 0; i < n; i++) { \
+        out[i] = STORE_##to(LOAD_##from(in[i]), KIND_##from); \
+    } \
+}
+
+#define DEFINE_CONVERTS_FROM(from) \
+DEFINE_CONVERT(from, s8) \
+DEFINE_CONVERT(from, s16) \
+DEFINE_CONVERT(from, s32) \
+DEFINE_CONVERT(from, s64) \
+DEFINE_CONVERT(from, u8) \
+DEFINE_CONVERT(from, u16) \
+DEFINE_CONVERT(from, u32) \
+DEFINE_CONVERT(from, u64) \
+DEFINE_CONVERT(from, f16) \
+DEFINE_CONVERT(from, bf16) \
+DEFINE_CONVERT(from, f32) \
+DEFINE_CONVERT(from, f64)
+
+DEFINE_CONVERTS_FROM(s8)
+DEFINE_CONVERTS_FROM(s16)
+DEFINE_CONVERTS_FROM(s32)
+DEFINE_CONVERTS_FROM(s64)
+DEFINE_CONVERTS_FROM(u8)
+DEFINE_CONVERTS_FROM(u16)
+DEFINE_CONVERTS_FROM(u32)
+DEFINE_CONVERTS_FROM(u64)
+DEFINE_CONVERTS_FROM(f16)
+DEFINE_CONVERTS_FROM(bf16)
+DEFINE_CONVERTS_FROM(f32)
+DEFINE_CONVERTS_FROM(f64)
+
+#define KT_s8 KERNEL_TYPE(tb_s, btb_8)
+#define KT_s16 KERNEL_TYPE(tb_s, btb_16)
+#define KT_s32 KERNEL_TYPE(tb_s, btb_32)
+#define KT_s64 KERNEL_TYPE(tb_s, btb_64)
+#define KT_u8 KERNEL_TYPE(tb_u, btb_8)
+#define KT_u16 KERNEL_TYPE(tb_u, btb_16)
+#define KT_u32 KERNEL_TYPE(tb_u, btb_32)
+#define KT_u64 KERNEL_TYPE(tb_u, btb_64)
+#define KT_f16 KERNEL_TYPE(tb_f, btb_16)
+#define KT_bf16 KERNEL_TYPE(tb_bf, btb_16)
+#define KT_f32 KERNEL_TYPE(tb_f, btb_32)
+#define KT_f64 KERNEL_TYPE(tb_f, btb_64)
+
+#define CONVERT_ENTRIES_FROM(from) \
+    [KT_##from][KT_s8] = convert_##from##_s8, \
+    [KT_##from][KT_s16] = convert_##from##_s16, \
+    [KT_##from][KT_s32] = convert_##from##_s32, \
+    [KT_##from][KT_s64] = convert_##from##_s64, \
+    [KT_##from][KT_u8] = convert_##from##_u8, \
+    [KT_##from][KT_u16] = convert_##from##_u16, \
+    [KT_##from][KT_u32] = convert_##from##_u32, \
+    [KT_##from][KT_u64] = convert_##from##_u64, \
+    [KT_##from][KT_f16] = convert_##from##_f16, \
+    [KT_##from][KT_bf16] = convert_##from##_bf16, \
+    [KT_##from][KT_f32] = convert_##from##_f32, \
+    [KT_##from][KT_f64] = convert_##from##_f64
+
+static const unary_kernel_t convert_kernels[NUM_KERNEL_TYPES][NUM_KERNEL_TYPES] = {
+    CONVERT_ENTRIES_FROM(s8),
+    CONVERT_ENTRIES_FROM(s16),
+    CONVERT_ENTRIES_FROM(s32),
+    CONVERT_ENTRIES_FROM(s64),
+    CONVERT_ENTRIES_FROM(u8),
+    CONVERT_ENTRIES_FROM(u16),
+    CONVERT_ENTRIES_FROM(u32),
+    CONVERT_ENTRIES_FROM(u64),
+    CONVERT_ENTRIES_FROM(f16),
+    CONVERT_ENTRIES_FROM(bf16),
+    CONVERT_ENTRIES_FROM(f32),
+    CONVERT_ENTRIES_FROM(f64),
+};
+
+unary_kernel_t convert_kernel(enum type_binary from_type, enum bit_type_binary from_bit_type, enum type_binary to_type, enum bit_type_binary to_bit_type)
+{
+    unsigned from = KERNEL_TYPE(from_type, from_bit_type);
+    unsigned to = KERNEL_TYPE(to_type, to_bit_type);
+    if(from >= NUM_KERNEL_TYPES || to >= NUM_KERNEL_TYPES) {
+        return NULL;
+    }
+    return convert_kernels[from][to];
+}
@@ -0,0 +1,72 @@
+#ifndef PELEMAY_ENGINE_KERNEL_H
+#define PELEMAY_ENGINE_KERNEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "opcode.h"
+
+/*
+ * Kernels are looked up by the index of the element type:
+ * (enum type_binary << 2) | enum bit_type_binary
+ */
+#define KERNEL_TYPE(type, bit_type) ((((unsigned)(type)) << 2) | ((unsigned)(bit_type)))
+#define NUM_KERNEL_TYPES 16
+
+#define BINARY_OP(inst) ((inst) - INST_ADD)
+#define NUM_BINARY_OPS (INST_LOGICAL_XOR - INST_ADD + 1)
+#define IS_BINARY_INST(inst) ((inst) >= INST_ADD && (inst) <= INST_LOGICAL_XOR)
+
+#define UNARY_OP(inst) ((inst) - INST_EXP)
+#define NUM_UNARY_OPS (INST_ABS - INST_EXP + 1)
+#define IS_UNARY_INST(inst) ((inst) >= INST_EXP && (inst) <= INST_ABS)
+
+/*
+ * Computes out[i] = a[i] op b[i] for i in [0, n).
+ *
+ * If scalar_a or scalar_b is true, the corresponding operand has only one
+ * element and is broadcast to all n elements.
+ *
+ * out may be the same array as a or b, but should not overlap them otherwise.
+ *
+ * Returns false if an integer division by zero would occur.
+ */
+typedef bool (*binary_kernel_t)(size_t n, const void *a, bool scalar_a, const void *b, bool scalar_b, void *out);
+
+/*
+ * Computes out[i] = op(in[i]) for i in [0, n).
+ *
+ * out may be the same array as in, but should not overlap it otherwise.
+ */
+typedef void (*unary_kernel_t)(size_t n, const void *in, void *out);
+
+/*
+ * Gets the kernel of the binary instruction for the element type,
+ * or NULL if it is not supported.
+ */
+binary_kernel_t binary_kernel(unsigned inst, enum type_binary type, enum bit_type_binary bit_type);
+
+/*
+ * Whether the binary instruction returns {:u, 8} regardless of the type of operands,
+ * as comparison and logical operations do.
+ */
+bool binary_returns_u8(unsigned inst);
+
+/*
+ * Gets the kernel of the unary instruction for the element type,
+ * or NULL if it is not supported.
+ *
+ * The type of the result is the same as that of the operand.
+ */
+unary_kernel_t unary_kernel(unsigned inst, enum type_binary type, enum bit_type_binary bit_type);
+
+/*
+ * Gets the kernel which converts the elements from the type to the other,
+ * or NULL if either of them is not supported, as complex numbers.
+ *
+ * out may be the same array as in if the types are of the same size.
+ */
+unary_kernel_t convert_kernel(enum type_binary from_type, enum bit_type_binary from_bit_type, enum type_binary to_type, enum bit_type_binary to_bit_type);
+
+#endif // PELEMAY_ENGINE_KERNEL_H
@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
@@ -10,19 +11,230 @@
 #include <cblas.h>
 
 #include "opcode.h"
+#include "kernel.h"
+#include "reduce.h"
+#include "fuse.h"
+#include "buffer.h"
+#include "pool.h"
+#include "queue.h"
+#include "view.h"
+#include "stats.h"
+#include "verify.h"
 
 #define MAX_STACK 1024
+#define MAX_LOCALS 1024
 
+/*
+ * The operand stacks up to this size are on the native stack, and the deeper
+ * ones are allocated. An entry holds a tensor of about 200 bytes, and
+ * the dirty schedulers and the workers of the queue run on native stacks of
+ * a few hundred KiB, which BLAS and the reductions need as well.
+ */
+#define INLINE_STACK_BYTES (16 * 1024)
+
+/*
+ * Programs whose tensor arguments are larger than this in total are
+ * rescheduled onto a dirty CPU scheduler, since sweeping them takes
+ * longer than the 1 ms a NIF may hold a normal scheduler.
+ * The arguments of gemm are weighted by its work (see args_byte_size).
+ */
+#define DIRTY_THRESHOLD_BYTES (1 << 20)
+
+/*
+ * Batches of more argument sets than this are rescheduled onto a dirty
+ * CPU scheduler as well, since each set costs a run of the program.
+ */
+#define DIRTY_THRESHOLD_BATCH 256
+
+#define MAX_RANK 8
+
+/*
+ * The storage of the results which sendt sends.
+ */
+enum storage {
+    storage_binary,
+    storage_buffer,
+};
+
+enum skip_condition {
+    skip_always,
+    skip_if_true,
+    skip_if_false,
+};
+
+/*
+ * The handlers of execute(), a dense index which load resolves from the opcode.
+ *
+ * A handler may run a sequence of instructions, in which the shuffles of the
+ * stack are folded into the operands: BINARY_SWAP and BINARY_DUP run swap or
+ * dup followed by a binary operation, TEE runs dup followed by store, and
+ * POP2 runs pop followed by pop as well.
+ */
+#define HANDLERS(X) \
+    X(COPY) X(SCAL) X(DOT) X(AXPY) X(AXPBY) X(GEMV) X(GEMM) \
+    X(BINARY) X(BINARY_SWAP) X(BINARY_DUP) X(UNARY) X(AS_TYPE) X(REDUCE) \
+    X(SENDT) X(SENDE) X(IS_SCALAR) X(SKIP) X(RETURN) \
+    X(DUP) X(POP) X(POP2) X(SWAP) X(ALOADT) X(FUSE) \
+    X(STORE) X(TEE) X(LOAD) X(TAKE)
+
+enum handler {
+#define HANDLER_ENUM(name) HANDLER_##name,
+    HANDLERS(HANDLER_ENUM)
+#undef HANDLER_ENUM
+};
+
+/*
+ * With GCC and Clang, each handler jumps to the next through the table of
+ * the addresses of the handlers, so that each dispatch is an indirect branch
+ * of its own for the predictor, instead of all sharing that of the switch.
+ */
+#if defined(__GNUC__)
+#define THREADED_DISPATCH
+#endif
+
+/*
+ * An instruction decoded by load_program.
+ *
+ * The operand is pre-decoded according to the instruction:
+ * the index of the argument for aloadt, the index of the local for
+ * store and load, the increment for scal,
+ * the absolute target and the condition for skip,
+ * the number of the inputs and the length of the body for fuse,
+ * the type of the result for as_type, and
+ * the reason term (owned by the program environment) for sende.
+ *
+ * handler runs width instructions from this one. The folded instructions
+ * keep their own handlers, which run if a skip targets them.
+ */
 typedef struct code {
-    ErlNifUInt64 opcode;
-    ERL_NIF_TERM operand;
+    uint_fast16_t inst;
+    unsigned char handler;
+    unsigned char width;
+    union {
+        ErlNifUInt64 uint;
+        struct {
+            unsigned target;
+            enum skip_condition condition;
+        } skip;
+        struct {
+            unsigned inputs;
+            unsigned length;
+        } fuse;
+        struct {
+            enum type_binary type;
+            enum bit_type_binary bit_type;
+        } as_type;
+        ERL_NIF_TERM term;
+    } operand;
 } code_t;
 
+/*
+ * A program held as a NIF resource.
+ *
+ * The environment owns the operand terms which are kept as terms.
+ * locals is the number of the locals which store and load use.
+ * sends is the number of sendt, which bounds the number of the results.
+ * max_stack and args are what verify found: the depth of the stack which
+ * execute() allocates, and the number of the arguments which it should be given.
+ * stats are the counters of the instructions by pc, which follow the code.
+ * superlinear is set if the program has gemm, whose work grows faster than
+ * the bytes of its arguments, which args_byte_size weighs for it.
+ */
+typedef struct program {
+    ErlNifEnv *env;
+    unsigned length;
+    unsigned locals;
+    unsigned sends;
+    unsigned max_stack;
+    unsigned args;
+    bool superlinear;
+    stats_counter_t *stats;
+    code_t code[];
+} program_t;
+
+/*
+ * A tensor decoded from
+ * {
+ *   Nx.size(args),
+ *   Nx.shape(args),
+ *   Nx.type(args),
+ *   Nx.to_binary(args) or a buffer
+ * }
+ * optionally followed by :donate or a view {offset, strides}.
+ *
+ * Only the first MAX_RANK dimensions are kept in shape.
+ * The terms are kept to build the result without re-encoding, but storage,
+ * which is not made for the data in the arena of the execution until it is sent.
+ * buffer is the buffer which holds the data, or NULL if it is a binary.
+ * offset is that of data from the start of the storage in bytes.
+ * strided is set if the elements are not contiguous in row major order,
+ * in which case strides tells where they are (see view.h).
+ * Only aloadt pushes strided tensors, and the instructions which do not
+ * walk the strides make them contiguous by make_contiguous.
+ */
+typedef struct tensor {
+    enum type_binary type;
+    enum bit_type_binary bit_type;
+    ErlNifUInt64 size;
+    unsigned rank;
+    ErlNifUInt64 shape[MAX_RANK];
+    void *data;
+    ERL_NIF_TERM shape_term;
+    ERL_NIF_TERM type_term;
+    ERL_NIF_TERM storage;
+    buffer_t *buffer;
+    size_t offset;
+    bool strided;
+    ErlNifUInt64 strides[MAX_RANK];
+} tensor_t;
+
+/*
+ * Where sendt and sende put the results and the error.
+ *
+ * If pid is NULL, the results are collected into outputs,
+ * which execute_engine returns. Otherwise, they are sent to the process.
+ */
+typedef struct reply {
+    const ErlNifPid *pid;
+    enum storage storage;
+    ERL_NIF_TERM *outputs;
+    unsigned num_outputs;
+} reply_t;
+
 typedef struct p_stack {
     enum stack_type type;
-    ERL_NIF_TERM content;
+    union {
+        tensor_t tensor;
+        bool boolean;
+    };
 } p_stack_t;
 
+static ErlNifResourceType *program_resource_type;
+static ErlNifResourceType *job_resource_type;
+
+static ERL_NIF_TERM atom_ok;
+static ERL_NIF_TERM atom_error;
+static ERL_NIF_TERM atom_result;
+static ERL_NIF_TERM atom_if;
+static ERL_NIF_TERM atom_true;
+static ERL_NIF_TERM atom_false;
+static ERL_NIF_TERM atom_s;
+static ERL_NIF_TERM atom_u;
+static ERL_NIF_TERM atom_f;
+static ERL_NIF_TERM atom_bf;
+static ERL_NIF_TERM atom_c;
+static ERL_NIF_TERM atom_binary;
+static ERL_NIF_TERM atom_buffer;
+static ERL_NIF_TERM atom_already_deallocated;
+static ERL_NIF_TERM atom_return;
+static ERL_NIF_TERM atom_donate;
+static ERL_NIF_TERM atom_threads;
+static ERL_NIF_TERM atom_blas_threads;
+static ERL_NIF_TERM atom_queue_workers;
+static ERL_NIF_TERM atom_queue_depth;
+static ERL_NIF_TERM atom_queue_full;
+static ERL_NIF_TERM atom_stats;
+
 unsigned int get_degit(ErlNifUInt64 n)
 {
     unsigned int digit = 1;
@@ -34,811 +246,2979 @@ unsigned int get_degit(ErlNifUInt64 n)
     return digit;
 }
 
-bool getcode(ErlNifEnv *env, ERL_NIF_TERM list, code_t **code, unsigned *length, ERL_NIF_TERM *exception)
+size_t tensor_element_size(const tensor_t *tensor)
 {
-    if(__builtin_expect(!enif_get_list_length(env, list, length), false)) {
-        *exception = enif_make_badarg(env);
+    // complex types are twice as large as the bit_type tells.
+    return (size_t)1 << (tensor->bit_type + (tensor->type == tb_c ? 1 : 0));
+}
+
+bool get_type(ErlNifEnv *env, ERL_NIF_TERM term, enum type_binary *type, enum bit_type_binary *bit_type)
+{
+    int arity;
+    const ERL_NIF_TERM *array;
+    unsigned bits;
+    if(__builtin_expect(
+        !enif_get_tuple(env, term, &arity, &array)
+        || arity != 2
+        || !enif_get_uint(env, array[1], &bits),
+        false)) {
+        return false;
+    }
+    if(enif_is_identical(array[0], atom_f)) {
+        *type = tb_f;
+    } else if(enif_is_identical(array[0], atom_s)) {
+        *type = tb_s;
+    } else if(enif_is_identical(array[0], atom_u)) {
+        *type = tb_u;
+    } else if(enif_is_identical(array[0], atom_bf)) {
+        *type = tb_bf;
+    } else if(enif_is_identical(array[0], atom_c)) {
+        *type = tb_c;
+        bits /= 2;
+    } else {
         return false;
     }
-    *code = enif_alloc(*length * sizeof(code_t));
-    if(__builtin_expect(*code == NULL, false)) {
-        *exception = enif_raise_exception(env, enif_make_string(env, "Fail to alloc memory", ERL_NIF_LATIN1));
+    switch(bits) {
+        case 8:
+            *bit_type = btb_8;
+            return true;
+        case 16:
+            *bit_type = btb_16;
+            return true;
+        case 32:
+            *bit_type = btb_32;
+            return true;
+        case 64:
+            *bit_type = btb_64;
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*
+ * Decodes the tuple of a tensor into the descriptor.
+ *
+ * The data is a binary or a buffer, which should be pinned by the caller.
+ * The tuple may have :donate as the fifth element, which is read by pin_args,
+ * or a view {offset, strides} in elements, which should be in the data.
+ */
+bool get_tensor(ErlNifEnv *env, ERL_NIF_TERM term, tensor_t *tensor)
+{
+    int arity;
+    const ERL_NIF_TERM *array;
+    if(__builtin_expect(
+        !enif_get_tuple(env, term, &arity, &array)
+        || (arity != 4 && arity != 5)
+        || !enif_get_uint64(env, array[0], &tensor->size)
+        || !get_type(env, array[2], &tensor->type, &tensor->bit_type),
+        false)) {
         return false;
     }
-    ERL_NIF_TERM tail = list;
-    code_t *code_p = *code;
-    unsigned l = *length;
-    while(l > 0) {
-        list = tail;
-        ERL_NIF_TERM head;
-        if(__builtin_expect(!enif_get_list_cell(env, list, &head, &tail), false)) {
-            enif_free(*code);
-            *exception = enif_raise_exception(env, enif_make_string(env, "Should be list", ERL_NIF_LATIN1));
+    int rank;
+    const ERL_NIF_TERM *dims;
+    if(__builtin_expect(!enif_get_tuple(env, array[1], &rank, &dims) || rank > MAX_RANK, false)) {
+        return false;
+    }
+    tensor->rank = rank;
+    // The kernels take the dimensions from the shape, which should have size elements.
+    ErlNifUInt64 elements = 1;
+    for(int i = 0; i < rank; i++) {
+        if(__builtin_expect(
+            !enif_get_uint64(env, dims[i], &tensor->shape[i])
+            || __builtin_mul_overflow(elements, tensor->shape[i], &elements),
+            false)) {
             return false;
         }
-        int arity;
-        const ERL_NIF_TERM *array;
-        if(__builtin_expect(!enif_get_tuple(env, head, &arity, &array) || arity != 2, false)) {
-            enif_free(*code);
-            *exception = enif_raise_exception(env, enif_make_string(env, "Should be list of tuple2", ERL_NIF_LATIN1));
+    }
+    size_t element_size = tensor_element_size(tensor);
+    size_t bytes;
+    if(__builtin_expect(elements != tensor->size || __builtin_mul_overflow(tensor->size, element_size, &bytes), false)) {
+        return false;
+    }
+    tensor->offset = 0;
+    tensor->strided = false;
+    int view_arity;
+    const ERL_NIF_TERM *view;
+    if(arity == 5 && enif_get_tuple(env, array[4], &view_arity, &view)) {
+        int strides_arity;
+        const ERL_NIF_TERM *strides;
+        ErlNifUInt64 offset;
+        if(__builtin_expect(
+            view_arity != 2
+            || !enif_get_uint64(env, view[0], &offset)
+            || !enif_get_tuple(env, view[1], &strides_arity, &strides)
+            || strides_arity != rank,
+            false)) {
+            return false;
+        }
+        /*
+         * bytes is the extent of the view, which is from its first to its last element.
+         * The shape has size elements, so that a contiguous view, whose kernels read
+         * size elements from the offset, is in the extent as well.
+         */
+        ErlNifUInt64 last = offset;
+        for(int i = 0; i < rank; i++) {
+            ErlNifUInt64 span;
+            if(__builtin_expect(
+                !enif_get_uint64(env, strides[i], &tensor->strides[i])
+                || (tensor->shape[i] > 0
+                    && (__builtin_mul_overflow(tensor->shape[i] - 1, tensor->strides[i], &span)
+                        || __builtin_add_overflow(last, span, &last))),
+                false)) {
+                return false;
+            }
+        }
+        if(tensor->size == 0) {
+            bytes = 0;
+        } else if(__builtin_expect(last == UINT64_MAX || __builtin_mul_overflow(last + 1, element_size, &bytes), false)) {
+            return false;
+        }
+        if(__builtin_expect(__builtin_mul_overflow(offset, element_size, &tensor->offset), false)) {
+            return false;
+        }
+        tensor->strided = !view_is_contiguous(rank, tensor->shape, tensor->strides);
+    }
+    ErlNifBinary bin;
+    buffer_t *buffer;
+    if(enif_inspect_binary(env, array[3], &bin)) {
+        if(__builtin_expect(bin.size < bytes, false)) {
             return false;
         }
-        if(__builtin_expect(!enif_get_uint64(env, array[0], &code_p->opcode), false)) {
-            enif_free(*code);
-            *exception = enif_raise_exception(env, enif_make_string(env, "Invalid opcode", ERL_NIF_LATIN1));
+        tensor->data = bin.data + tensor->offset;
+        tensor->buffer = NULL;
+    } else if(buffer_get(env, array[3], &buffer)) {
+        if(__builtin_expect(buffer->size < bytes, false)) {
             return false;
         }
-        code_p->operand = array[1];
-        code_p++;
-        l--;
+        tensor->data = (char *)buffer->data + tensor->offset;
+        tensor->buffer = buffer;
+    } else {
+        return false;
+    }
+    tensor->shape_term = array[1];
+    tensor->type_term = array[2];
+    tensor->storage = array[3];
+    return true;
+}
+
+/*
+ * The bytes which alloc_tensor_data has allocated on the thread,
+ * by which execute() counts those which each instruction allocates.
+ */
+static _Thread_local uint64_t allocated_bytes;
+
+/*
+ * The arena of the execution running on the thread, if any.
+ */
+static _Thread_local buffer_arena_t *current_arena;
+
+/*
+ * Allocates an aligned buffer for the data of a new tensor of tensor->size elements,
+ * and puts it into the tensor.
+ *
+ * In an execution, the buffer is in its arena, whose storage is made by
+ * export_tensor if the tensor is sent. Otherwise, the environment keeps
+ * the buffer until the tensor is sent or dropped.
+ * The buffer is writable and referred to by the tensor, which should be
+ * pushed onto the stack.
+ */
+bool alloc_tensor_data(ErlNifEnv *env, tensor_t *tensor)
+{
+    size_t bytes = tensor->size * tensor_element_size(tensor);
+    buffer_t *buffer;
+    if(current_arena != NULL) {
+        buffer = buffer_arena_alloc(current_arena, bytes);
+        if(__builtin_expect(buffer == NULL, false)) {
+            return false;
+        }
+        tensor->storage = 0;
+    } else {
+        buffer = buffer_alloc(bytes);
+        if(__builtin_expect(buffer == NULL, false)) {
+            return false;
+        }
+        tensor->storage = enif_make_resource(env, buffer);
+        enif_release_resource(buffer);
+    }
+    allocated_bytes += bytes;
+    buffer->writable = true;
+    buffer->refs = 1;
+    tensor->buffer = buffer;
+    tensor->data = buffer->data;
+    tensor->offset = 0;
+    tensor->strided = false;
+    return true;
+}
+
+/*
+ * Moves the data of a tensor in the arena into a resource, and makes its storage,
+ * so that the data outlives the execution.
+ */
+static bool export_tensor(ErlNifEnv *env, tensor_t *tensor)
+{
+    buffer_t *resource = buffer_export(tensor->buffer);
+    if(__builtin_expect(resource == NULL, false)) {
+        return false;
     }
+    tensor->storage = enif_make_resource(env, resource);
+    enif_release_resource(resource);
     return true;
 }
 
-bool execute(ErlNifEnv *env, code_t *code, unsigned code_length, ERL_NIF_TERM *args, unsigned arg_length, ERL_NIF_TERM rpid, ERL_NIF_TERM *reason)
+bool is_blas_tensor(const p_stack_t *entry)
+{
+    return (entry->type == type_tensor || entry->type == type_scalar)
+        && entry->tensor.type == tb_f
+        && (entry->tensor.bit_type == btb_32 || entry->tensor.bit_type == btb_64);
+}
+
+bool same_type(const tensor_t *a, const tensor_t *b)
+{
+    return a->type == b->type && a->bit_type == b->bit_type;
+}
+
+ERL_NIF_TERM make_type(ErlNifEnv *env, enum type_binary type, enum bit_type_binary bit_type)
 {
-    p_stack_t stack[MAX_STACK];
+    ERL_NIF_TERM atom;
+    switch(type) {
+        case tb_s:
+            atom = atom_s;
+            break;
+        case tb_u:
+            atom = atom_u;
+            break;
+        case tb_f:
+            atom = atom_f;
+            break;
+        case tb_bf:
+            atom = atom_bf;
+            break;
+        default:
+            atom = atom_c;
+            break;
+    }
+    // complex types are twice as large as the bit_type tells.
+    return enif_make_tuple2(env, atom, enif_make_uint(env, 8u << (bit_type + (type == tb_c ? 1 : 0))));
+}
 
-    for(size_t i = 0; i < MAX_STACK; i++) {
-        stack[i].type = type_undefined;
+/*
+ * Allocates the data of a new tensor from its type, rank and shape,
+ * and sets its size and shape_term.
+ */
+bool alloc_tensor(ErlNifEnv *env, tensor_t *tensor)
+{
+    ERL_NIF_TERM dims[MAX_RANK];
+    tensor->size = 1;
+    for(unsigned i = 0; i < tensor->rank; i++) {
+        tensor->size *= tensor->shape[i];
+        dims[i] = enif_make_uint64(env, tensor->shape[i]);
     }
+    tensor->shape_term = enif_make_tuple_from_array(env, dims, tensor->rank);
+    return alloc_tensor_data(env, tensor);
+}
 
-    size_t stack_idx = 0;
-    
-    for(code_t *code_p = code; code_length > 0; code_length--, code_p++) {
-        if(__builtin_expect(code_p->opcode & MASK_RESERVED, 0)) {
-            *reason = enif_make_string(env, "Should not use reserved bit", ERL_NIF_LATIN1);
+/*
+ * Ownership of the data of tensors.
+ *
+ * An instruction may overwrite the data of an operand instead of allocating
+ * the result if the operand owns it, that is, it is in a writable buffer
+ * and no other value on the stack or in the locals refers to it.
+ * The instructions retain the values they copy, such as dup and load,
+ * and release the values they consume.
+ */
+static inline void retain(const tensor_t *tensor)
+{
+    if(tensor->buffer != NULL && tensor->buffer->writable) {
+        tensor->buffer->refs++;
+    }
+}
+
+static inline void release(const tensor_t *tensor)
+{
+    if(tensor->buffer != NULL && tensor->buffer->writable) {
+        tensor->buffer->refs--;
+    }
+}
+
+static inline void retain_entry(const p_stack_t *entry)
+{
+    if(entry->type == type_tensor || entry->type == type_scalar) {
+        retain(&entry->tensor);
+    }
+}
+
+static inline void release_entry(const p_stack_t *entry)
+{
+    if(entry->type == type_tensor || entry->type == type_scalar) {
+        release(&entry->tensor);
+    }
+}
+
+static inline bool owned(const tensor_t *tensor)
+{
+    return tensor->buffer != NULL && tensor->buffer->writable && tensor->buffer->refs == 1 && !tensor->strided;
+}
+
+/*
+ * Whether the result can be written over the data of the operand in place.
+ */
+static inline bool reusable(const tensor_t *operand, const tensor_t *result)
+{
+    return owned(operand) && same_type(operand, result) && operand->size == result->size;
+}
+
+/*
+ * Gathers a strided tensor into a new contiguous buffer.
+ */
+static bool make_contiguous(ErlNifEnv *env, tensor_t *tensor)
+{
+    if(!tensor->strided) {
+        return true;
+    }
+    tensor_t in = *tensor;
+    if(__builtin_expect(!alloc_tensor_data(env, tensor), false)) {
+        return false;
+    }
+    view_gather(in.data, tensor_element_size(&in), in.rank, in.shape, in.strides, tensor->data);
+    release(&in);
+    return true;
+}
+
+static bool make_contiguous_entries(ErlNifEnv *env, p_stack_t *entries, unsigned n, ERL_NIF_TERM *reason)
+{
+    for(unsigned i = 0; i < n; i++) {
+        if((entries[i].type == type_tensor || entries[i].type == type_scalar)
+            && __builtin_expect(!make_contiguous(env, &entries[i].tensor), false)) {
+            *reason = enif_make_string(env, "Fail to alloc memory to make a view contiguous", ERL_NIF_LATIN1);
             return false;
         }
-        uint_fast16_t inst = (code_p->opcode & MASK_INSTRUCTION) >> SHIFT_INSTRUCTION;
+    }
+    return true;
+}
 
-        // enif_fprintf(stdout, "instruction: %04X\n", inst);
-        switch(inst) {
-            case INST_COPY:
-                {
-                    // enif_fprintf(stdout, "inst: copy\n");
+/*
+ * Computes a binary operation of which an operand is strided, row by row.
+ *
+ * An operand of the size of out is addressed by its strides, and the other
+ * one is a scalar. A row whose stride is 1 is passed to the kernel as it is,
+ * one whose stride is 0 as a scalar, and the others are gathered into scratch,
+ * so that a broadcast operand is never materialized.
+ *
+ * Returns NULL on success, or the reason.
+ */
+static const char *binary_strided(ErlNifEnv *env, binary_kernel_t kernel, tensor_t *left, tensor_t *right, const tensor_t *out)
+{
+    tensor_t *operands[2] = {left, right};
+    uint64_t strides[2][MAX_RANK];
+    for(int k = 0; k < 2; k++) {
+        tensor_t *t = operands[k];
+        bool same_shape = t->rank == out->rank && memcmp(t->shape, out->shape, out->rank * sizeof(t->shape[0])) == 0;
+        if(t->strided && !same_shape && __builtin_expect(!make_contiguous(env, t), false)) {
+            return "Fail to alloc memory in case of binary operations";
+        }
+        if(t->size != out->size) {
+            memset(strides[k], 0, sizeof(strides[k]));
+        } else if(t->strided) {
+            memcpy(strides[k], t->strides, out->rank * sizeof(uint64_t));
+        } else {
+            view_contiguous_strides(out->rank, out->shape, strides[k]);
+        }
+    }
+    uint64_t length;
+    uint64_t rows = view_rows(out->rank, out->shape, &length);
+    size_t in_size = tensor_element_size(left);
+    size_t out_size = tensor_element_size(out);
+    char *scratch = enif_alloc(2 * length * in_size + 1);
+    if(__builtin_expect(scratch == NULL, false)) {
+        return "Fail to alloc memory in case of binary operations";
+    }
+    const char *error = NULL;
+    for(uint64_t row = 0; row < rows && error == NULL; row++) {
+        const void *p[2];
+        bool scalar[2];
+        for(int k = 0; k < 2; k++) {
+            uint64_t stride = out->rank == 0 ? 1 : strides[k][out->rank - 1];
+            const char *in = (const char *)operands[k]->data
+                + view_row_offset(out->rank, out->shape, strides[k], row) * in_size;
+            scalar[k] = stride == 0;
+            if(stride <= 1 && !(k == 1 && scalar[0] && scalar[1] && length > 1)) {
+                p[k] = in;
+            } else {
+                // the kernels broadcast only one of the operands.
+                view_gather_row(in, in_size, length, stride, scratch + k * length * in_size);
+                p[k] = scratch + k * length * in_size;
+                scalar[k] = false;
+            }
+        }
+        if(__builtin_expect(!kernel(length, p[0], scalar[0], p[1], scalar[1], (char *)out->data + row * length * out_size), false)) {
+            error = "Division by zero in case of binary operations";
+        }
+    }
+    enif_free(scratch);
+    return error;
+}
 
-                    /*
-                     * Copys the binary of the top of the stack.
-                     * 
-                     * The stak top should be type_tensor:
-                     * {
-                     *   Nx.size(args),
-                     *   Nx.shape(args),
-                     *   Nx.type(args),
-                     *   Nx.to_binary(args)
-                     * }
-                     *
-                     * Now, copy supports only in case that the operand is nil.
-                     * When the operand is nil, increment of the source adn the destination are 1.
-                     * 
-                     * Now, copy supports only in case that Nx.type is as follows:
-                     * {:f, 32}
-                     * {:f, 64}
-                     */
+/*
+ * Elementwise kernels over large tensors run chunk by chunk in the pool.
+ * The chunks are disjoint, so an operand may still be the output.
+ */
+typedef struct binary_job {
+    binary_kernel_t kernel;
+    const char *a;
+    bool scalar_a;
+    const char *b;
+    bool scalar_b;
+    char *out;
+    size_t in_size;
+    size_t out_size;
+} binary_job_t;
 
-                    if(__builtin_expect(stack_idx == 0, false)) {
-                        *reason = enif_make_string(env, "Stack limit is less than 0", ERL_NIF_LATIN1);
-                        return false;
-                    }
-                    if(__builtin_expect(stack[stack_idx - 1].type != type_tensor, false)) {
-                        *reason = enif_make_string(env, "Should be a tensor in case of copy", ERL_NIF_LATIN1);
-                        return false;
-                    }
-                    int arity;
-                    const ERL_NIF_TERM *array;
-                    if(__builtin_expect(!enif_get_tuple(env, stack[stack_idx - 1].content, &arity, &array), false)) {
-                        *reason = enif_make_string(env, "Stack top should be a tuple in case of copy", ERL_NIF_LATIN1);
-                        return false;
-                    }
-                    if(__builtin_expect(arity != 4, false)) {
-                        *reason = enif_make_string(env, "The arity of tuple should be 4 in case of copy", ERL_NIF_LATIN1);
-                        return false;
-                    }
-                    ErlNifUInt64 size;
-                    if(__builtin_expect(!enif_get_uint64(env, array[0], &size), false)) {
-                        *reason = enif_make_string(env, "Fail to get uint64 in case of copy", ERL_NIF_LATIN1);
-                        return false;
-                    }
-                    int arity_type;
-                    const ERL_NIF_TERM *array_type;
-                    char *type;
-                    unsigned typel;
-                    unsigned int type_size;
-                    if(__builtin_expect(
-                        !enif_get_tuple(env, array[2], &arity_type, &array_type)
-                        || arity_type != 2
-                        || !enif_get_atom_length(env, array_type[0], &typel, ERL_NIF_LATIN1)
-                        || (type = (char *)enif_alloc((typel + 1) * sizeof(char))) == NULL
-                        || !enif_get_atom(env, array_type[0], type, typel + 1, ERL_NIF_LATIN1),
-                        false)) {
-                        *reason = enif_make_string(env, "Fail to get type in case of copy", ERL_NIF_LATIN1);
-                        return false;
-                    }
-                    if(__builtin_expect(
-                        strncmp(type, "f", 1) != 0
-                        || !enif_get_uint(env, array_type[1], &type_size)
-                        || !(type_size == 32 || type_size == 64),
-                        false)) {
-                        *reason = enif_make_string(env, "Sorry, copy now supports only {:f, 32} or {:f, 64}", ERL_NIF_LATIN1);
-                        return false;
-                    }
-                    ErlNifBinary bin_in;
-                    if(__builtin_expect(!enif_inspect_binary(env, array[3], &bin_in), false)) {
-                        *reason = enif_make_string(env, "Fail to get binary in case of copy", ERL_NIF_LATIN1);
-                        return false;
-                    }
-                    ErlNifBinary bin_out;
-                    if(__builtin_expect(!enif_alloc_binary(bin_in.size, &bin_out), false)) {
-                        *reason = enif_make_string(env, "Fail to alloc memory in case of copy", ERL_NIF_LATIN1);
-                        return false;
-                    }
-                    // omit check the operand is nil.
-                    
-                    switch(type_size) {
-                        case 32:
-                            cblas_scopy(size, (float *)bin_in.data, 1, (float *)bin_out.data, 1);
-                            break;
-                        
-                        case 64:
-                            cblas_dcopy(size, (double *)bin_in.data, 1, (double *)bin_out.data, 1);
-                            break;
-                        
-                        default:
-                            *reason = enif_make_string(env, "unexpected", ERL_NIF_LATIN1);
-                            return false;
-                    }
+static bool binary_chunk(void *arg, size_t begin, size_t end)
+{
+    const binary_job_t *job = arg;
+    return job->kernel(
+        end - begin,
+        job->scalar_a ? job->a : job->a + begin * job->in_size, job->scalar_a,
+        job->scalar_b ? job->b : job->b + begin * job->in_size, job->scalar_b,
+        job->out + begin * job->out_size);
+}
+
+static bool run_binary(binary_kernel_t kernel, size_t n, const tensor_t *a, bool scalar_a, const tensor_t *b, bool scalar_b, const tensor_t *out)
+{
+    binary_job_t job = {
+        kernel, a->data, scalar_a, b->data, scalar_b, out->data,
+        tensor_element_size(a), tensor_element_size(out)
+    };
+    size_t widest = job.in_size > job.out_size ? job.in_size : job.out_size;
+    return pool_run(n, pool_grain(n, widest), binary_chunk, &job);
+}
+
+typedef struct unary_job {
+    unary_kernel_t kernel;
+    const char *in;
+    char *out;
+    size_t in_size;
+    size_t out_size;
+} unary_job_t;
+
+static bool unary_chunk(void *arg, size_t begin, size_t end)
+{
+    const unary_job_t *job = arg;
+    job->kernel(end - begin, job->in + begin * job->in_size, job->out + begin * job->out_size);
+    return true;
+}
+
+static void run_unary(unary_kernel_t kernel, const tensor_t *in, const tensor_t *out)
+{
+    unary_job_t job = {kernel, in->data, out->data, tensor_element_size(in), tensor_element_size(out)};
+    size_t widest = job.in_size > job.out_size ? job.in_size : job.out_size;
+    pool_run(out->size, pool_grain(out->size, widest), unary_chunk, &job);
+}
+
+static void program_dtor(ErlNifEnv *env, void *obj)
+{
+    program_t *program = (program_t *)obj;
+    if(program->env != NULL) {
+        enif_free_env(program->env);
+    }
+}
+
+static ERL_NIF_TERM raise_exception(ErlNifEnv *env, const char *message)
+{
+    return enif_raise_exception(env, enif_make_string(env, message, ERL_NIF_LATIN1));
+}
+
+bool decode_operand(ErlNifEnv *env, program_t *program, unsigned pc, ERL_NIF_TERM operand, ERL_NIF_TERM *exception)
+{
+    code_t *code_p = &program->code[pc];
+
+    switch(code_p->inst) {
+        case INST_SCAL:
+            if(__builtin_expect(!enif_get_uint64(env, operand, &code_p->operand.uint), false)) {
+                *exception = raise_exception(env, "Fail to get uint64 from operand in case of scal");
+                return false;
+            }
+            return true;
+
+        case INST_GEMV:
+        case INST_GEMM:
+            if(__builtin_expect(!enif_get_uint64(env, operand, &code_p->operand.uint), false)) {
+                *exception = raise_exception(env, "Fail to get uint64 from operand in case of gemv or gemm");
+                return false;
+            }
+            return true;
 
+        case INST_SUM:
+        case INST_PRODUCT:
+        case INST_REDUCE_MAX:
+        case INST_REDUCE_MIN:
+        case INST_ARGMAX:
+        case INST_ARGMIN:
+        case INST_ALL:
+        case INST_ANY:
+            if(__builtin_expect(!enif_get_uint64(env, operand, &code_p->operand.uint), false)) {
+                *exception = raise_exception(env, "Fail to get uint64 from operand in case of reductions");
+                return false;
+            }
+            return true;
 
-                    ERL_NIF_TERM b = enif_make_binary(env, &bin_out);
-                    stack[stack_idx - 1].content = enif_make_tuple4(env, array[0], array[1], array[2], b);
+        case INST_AS_TYPE:
+            if(__builtin_expect(!get_type(env, operand, &code_p->operand.as_type.type, &code_p->operand.as_type.bit_type), false)) {
+                *exception = raise_exception(env, "the operand of as_type should be a type");
+                return false;
+            }
+            if(__builtin_expect(code_p->operand.as_type.type == tb_c, false)) {
+                *exception = raise_exception(env, "Sorry, as_type does not support complex numbers");
+                return false;
+            }
+            return true;
+
+        case INST_ALOADT:
+            if(__builtin_expect(!enif_get_uint64(env, operand, &code_p->operand.uint), false)) {
+                *exception = raise_exception(env, "the operand of aloadt should be unsigned integer");
+                return false;
+            }
+            return true;
+
+        case INST_STORE:
+        case INST_LOAD:
+        case INST_TAKE:
+            if(__builtin_expect(!enif_get_uint64(env, operand, &code_p->operand.uint), false)) {
+                *exception = raise_exception(env, "the operand of store, load and take should be unsigned integer");
+                return false;
+            }
+            if(__builtin_expect(code_p->operand.uint >= MAX_LOCALS, false)) {
+                *exception = raise_exception(env, "the operand of store, load and take is over MAX_LOCALS");
+                return false;
+            }
+            if(code_p->operand.uint >= program->locals) {
+                program->locals = (unsigned)code_p->operand.uint + 1;
+            }
+            return true;
+
+        case INST_FUSE:
+            {
+                int arity;
+                const ERL_NIF_TERM *array;
+                unsigned inputs, length;
+                if(__builtin_expect(
+                    !enif_get_tuple(env, operand, &arity, &array)
+                    || arity != 2
+                    || !enif_get_uint(env, array[0], &inputs)
+                    || !enif_get_uint(env, array[1], &length),
+                    false)) {
+                    *exception = raise_exception(env, "Fail to get tuple2 of unsigned integers from the operand in case of fuse");
+                    return false;
                 }
-                break;
+                if(__builtin_expect(length > program->length - pc - 1, false)) {
+                    *exception = raise_exception(env, "The body is over the end of code in case of fuse");
+                    return false;
+                }
+                code_p->operand.fuse.inputs = inputs;
+                code_p->operand.fuse.length = length;
+                return true;
+            }
 
-            case INST_SCAL:
-                {
-                    // enif_fprintf(stdout, "inst: scal\n");
+        case INST_SENDE:
+            code_p->operand.term = enif_make_copy(program->env, operand);
+            return true;
 
-                    /*
-                     * Scales a tensor by a constant.
-                     * 
-                     * Pops the two values from the stack, and push the result.
-                     * 
-                     * The operand should be the positive integer as increment.
-                     * 
-                     * The stack top should be type_scalar:
-                     * {
-                     *   Nx.size(args),
-                     *   Nx.shape(args),
-                     *   Nx.type(args),
-                     *   Nx.to_binary(args)
-                     * }
-                     * 
-                     * The next of it should be type_tensor or type_scalar:
-                     * {
-                     *   Nx.size(args),
-                     *   Nx.shape(args),
-                     *   Nx.type(args),
-                     *   Nx.to_binary(args)
-                     * }
-                     *
-                     * Now, scal supports only in case that Nx.type is as follows:
-                     * {:f, 32}
-                     * {:f, 64}
-                     */
+        case INST_SKIP:
+            {
+                /*
+                 * The operand should be a tuple as follows:
+                 * {
+                 *   (a non positive number increment of PC),
+                 *   {
+                 *     :if,
+                 *     true or false
+                 *   }
+                 * }
+                 * or
+                 * {
+                 *   (a non positive number increment of PC),
+                 *   true
+                 * }
+                 *
+                 * The increment is resolved into the absolute target here.
+                 */
+                int arity;
+                const ERL_NIF_TERM *array;
+                if(__builtin_expect(
+                    !enif_get_tuple(env, operand, &arity, &array)
+                    || arity != 2,
+                    false)) {
+                    *exception = raise_exception(env, "Fail to get tuple2 from the operand in case of skip");
+                    return false;
+                }
+                ErlNifUInt64 skip;
+                if(__builtin_expect(!enif_get_uint64(env, array[0], &skip), false)) {
+                    *exception = raise_exception(env, "Fail to get uint64 from the increment of PC in case of skip");
+                    return false;
+                }
+                if(__builtin_expect(skip > program->length - pc - 1, false)) {
+                    *exception = raise_exception(env, "The increment of PC is over the end of code in case of skip");
+                    return false;
+                }
+                code_p->operand.skip.target = pc + 1 + (unsigned)skip;
 
-                    if(__builtin_expect(stack_idx <= 1, false)) {
-                        *reason = enif_make_string(env, "Stack limit is less than 1", ERL_NIF_LATIN1);
+                ERL_NIF_TERM value = array[1];
+                if(enif_is_atom(env, value)) {
+                    // case of unconditional branch
+                    if(__builtin_expect(!enif_is_identical(value, atom_true), false)) {
+                        *exception = raise_exception(env, "The conditional value should be true in case of unconditional branch");
                         return false;
                     }
-                    stack_idx -= 2;
-                    // stack[stack_idx + 1].type == type_scalar
-                    // stack[stack_idx].type == type.tensor or type.scalar
+                    code_p->operand.skip.condition = skip_always;
+                    return true;
+                }
+                // case of conditional branch
+                if(__builtin_expect(
+                    !enif_get_tuple(env, value, &arity, &array)
+                    || arity != 2, false)) {
+                    *exception = raise_exception(env, "Unrecognized format of the branch condition in case of skip");
+                    return false;
+                }
+                if(__builtin_expect(!enif_is_identical(array[0], atom_if), false)) {
+                    *exception = raise_exception(env, "The conditional value should be :if in case of conditional branch");
+                    return false;
+                }
+                if(enif_is_identical(array[1], atom_true)) {
+                    code_p->operand.skip.condition = skip_if_true;
+                } else if(enif_is_identical(array[1], atom_false)) {
+                    code_p->operand.skip.condition = skip_if_false;
+                } else {
+                    *exception = raise_exception(env, "The conditional value should be true or false in case of conditional branch");
+                    return false;
+                }
+                return true;
+            }
 
-                    // Get the given tensor
-                    if(__builtin_expect(
-                        !(stack[stack_idx].type == type_tensor || stack[stack_idx].type == type_scalar),
-                        false)) {
-                        *reason = enif_make_string(env, "Should be a tensor or a scalar in case of scal", ERL_NIF_LATIN1);
-                        return false;
-                    }
-                    int arity;
-                    const ERL_NIF_TERM *array;
-                    if(__builtin_expect(!enif_get_tuple(env, stack[stack_idx].content, &arity, &array), false)) {
-                        *reason = enif_make_string(env, "Stack top should be a tuple in case of scal", ERL_NIF_LATIN1);
-                        return false;
-                    }
-                    if(__builtin_expect(arity != 4, false)) {
-                        *reason = enif_make_string(env, "The arity of tuple should be 4 in case of scal", ERL_NIF_LATIN1);
-                        return false;
-                    }
-                    ErlNifUInt64 size;
-                    if(__builtin_expect(!enif_get_uint64(env, array[0], &size), false)) {
-                        *reason = enif_make_string(env, "Fail to get uint64 in case of scal", ERL_NIF_LATIN1);
-                        return false;
-                    }
-                    int arity_type;
-                    const ERL_NIF_TERM *array_type;
-                    char *type;
-                    unsigned typel;
-                    unsigned int type_size;
-                    if(__builtin_expect(
-                        !enif_get_tuple(env, array[2], &arity_type, &array_type)
-                        || arity_type != 2
-                        || !enif_get_atom_length(env, array_type[0], &typel, ERL_NIF_LATIN1)
-                        || (type = (char *)enif_alloc((typel + 1) * sizeof(char))) == NULL
-                        || !enif_get_atom(env, array_type[0], type, typel + 1, ERL_NIF_LATIN1),
-                        false)) {
-                        *reason = enif_make_string(env, "Fail to get type in case of scal", ERL_NIF_LATIN1);
-                        return false;
-                    }
-                    if(__builtin_expect(
-                        strncmp(type, "f", 1) != 0
-                        || !enif_get_uint(env, array_type[1], &type_size)
-                        || !(type_size == 32 || type_size == 64),
-                        false)) {
-                        *reason = enif_make_string(env, "Sorry, scal now supports only {:f, 32} or {:f, 64} as a tensor", ERL_NIF_LATIN1);
-                        return false;
-                    }
-                    ErlNifBinary bin;
-                    if(__builtin_expect(!enif_inspect_binary(env, array[3], &bin), false)) {
-                        *reason = enif_make_string(env, "Fail to get binary in case of scal", ERL_NIF_LATIN1);
-                        return false;
-                    }
+        case INST_SENDT:
+            program->sends++;
+            return true;
 
-                    // Get the given scalar
-                    if(__builtin_expect(
-                        !(stack[stack_idx + 1].type == type_scalar),
-                        false)) {
-                        *reason = enif_make_string(env, "Should be a scalar in case of scal", ERL_NIF_LATIN1);
+        case INST_COPY:
+        case INST_DOT:
+        case INST_AXPY:
+        case INST_AXPBY:
+        case INST_RETURN:
+        case INST_IS_SCALAR:
+        case INST_DUP:
+        case INST_POP:
+        case INST_POP2:
+        case INST_SWAP:
+            // omit check the operand is nil.
+            return true;
+
+        default:
+            if(IS_BINARY_INST(code_p->inst) || IS_UNARY_INST(code_p->inst)) {
+                return true;
+            }
+            {
+                const char *err = "unrecognized instruction %04X";
+                size_t length = strlen(err) + 1;
+                char error_message[length];
+                enif_snprintf(error_message, length, err, (unsigned)code_p->inst);
+                *exception = raise_exception(env, error_message);
+                return false;
+            }
+    }
+}
+
+static enum handler handler_of(unsigned inst)
+{
+    if(IS_BINARY_INST(inst)) {
+        return HANDLER_BINARY;
+    }
+    if(IS_UNARY_INST(inst)) {
+        return HANDLER_UNARY;
+    }
+    if(IS_REDUCE_INST(inst)) {
+        return HANDLER_REDUCE;
+    }
+    switch(inst) {
+        case INST_COPY: return HANDLER_COPY;
+        case INST_SCAL: return HANDLER_SCAL;
+        case INST_DOT: return HANDLER_DOT;
+        case INST_AXPY: return HANDLER_AXPY;
+        case INST_AXPBY: return HANDLER_AXPBY;
+        case INST_GEMV: return HANDLER_GEMV;
+        case INST_GEMM: return HANDLER_GEMM;
+        case INST_AS_TYPE: return HANDLER_AS_TYPE;
+        case INST_SENDT: return HANDLER_SENDT;
+        case INST_SENDE: return HANDLER_SENDE;
+        case INST_IS_SCALAR: return HANDLER_IS_SCALAR;
+        case INST_SKIP: return HANDLER_SKIP;
+        case INST_RETURN: return HANDLER_RETURN;
+        case INST_DUP: return HANDLER_DUP;
+        case INST_POP: return HANDLER_POP;
+        case INST_POP2: return HANDLER_POP2;
+        case INST_SWAP: return HANDLER_SWAP;
+        case INST_ALOADT: return HANDLER_ALOADT;
+        case INST_FUSE: return HANDLER_FUSE;
+        case INST_STORE: return HANDLER_STORE;
+        case INST_LOAD: return HANDLER_LOAD;
+        default: return HANDLER_TAKE;
+    }
+}
+
+/*
+ * Resolves the handler of each instruction of a verified program,
+ * folding a shuffle of the stack into the instruction which follows it.
+ */
+static void resolve_handlers(program_t *program)
+{
+    for(unsigned pc = 0; pc < program->length; pc++) {
+        program->code[pc].handler = handler_of(program->code[pc].inst);
+        program->code[pc].width = 1;
+    }
+    for(unsigned pc = 0; pc + 1 < program->length; pc++) {
+        code_t *code_p = &program->code[pc];
+        unsigned next = program->code[pc + 1].inst;
+        if(code_p->inst == INST_SWAP && IS_BINARY_INST(next)) {
+            code_p->handler = HANDLER_BINARY_SWAP;
+        } else if(code_p->inst == INST_DUP && IS_BINARY_INST(next)) {
+            code_p->handler = HANDLER_BINARY_DUP;
+        } else if(code_p->inst == INST_DUP && next == INST_STORE) {
+            code_p->handler = HANDLER_TEE;
+        } else if(code_p->inst == INST_POP && next == INST_POP) {
+            code_p->handler = HANDLER_POP2;
+        } else {
+            continue;
+        }
+        code_p->width = 2;
+    }
+}
+
+/*
+ * Validates and decodes the list of tuples of an opcode and an operand
+ * into a program resource.
+ */
+program_t *load(ErlNifEnv *env, ERL_NIF_TERM list, ERL_NIF_TERM *exception)
+{
+    unsigned length;
+    if(__builtin_expect(!enif_get_list_length(env, list, &length), false)) {
+        *exception = enif_make_badarg(env);
+        return NULL;
+    }
+    program_t *program = enif_alloc_resource(
+        program_resource_type, sizeof(program_t) + length * (sizeof(code_t) + sizeof(stats_counter_t)));
+    if(__builtin_expect(program == NULL, false)) {
+        *exception = raise_exception(env, "Fail to alloc memory");
+        return NULL;
+    }
+    program->length = length;
+    program->stats = (stats_counter_t *)&program->code[length];
+    stats_init(program->stats, length);
+    program->locals = 0;
+    program->sends = 0;
+    program->max_stack = 0;
+    program->args = 0;
+    program->superlinear = false;
+    program->env = enif_alloc_env();
+    if(__builtin_expect(program->env == NULL, false)) {
+        enif_release_resource(program);
+        *exception = raise_exception(env, "Fail to alloc memory");
+        return NULL;
+    }
+
+    ERL_NIF_TERM head, tail = list;
+    for(unsigned pc = 0; pc < length; pc++) {
+        if(__builtin_expect(!enif_get_list_cell(env, tail, &head, &tail), false)) {
+            enif_release_resource(program);
+            *exception = raise_exception(env, "Should be list");
+            return NULL;
+        }
+        int arity;
+        const ERL_NIF_TERM *array;
+        if(__builtin_expect(!enif_get_tuple(env, head, &arity, &array) || arity != 2, false)) {
+            enif_release_resource(program);
+            *exception = raise_exception(env, "Should be list of tuple2");
+            return NULL;
+        }
+        ErlNifUInt64 opcode;
+        if(__builtin_expect(!enif_get_uint64(env, array[0], &opcode), false)) {
+            enif_release_resource(program);
+            *exception = raise_exception(env, "Invalid opcode");
+            return NULL;
+        }
+        if(__builtin_expect(opcode & MASK_RESERVED, false)) {
+            enif_release_resource(program);
+            *exception = raise_exception(env, "Should not use reserved bit");
+            return NULL;
+        }
+        program->code[pc].inst = (opcode & MASK_INSTRUCTION) >> SHIFT_INSTRUCTION;
+        if(program->code[pc].inst == INST_GEMM) {
+            program->superlinear = true;
+        }
+        if(__builtin_expect(!decode_operand(env, program, pc, array[1], exception), false)) {
+            enif_release_resource(program);
+            return NULL;
+        }
+    }
+
+    // The body of fuse is checked after it is decoded.
+    for(unsigned pc = 0; pc < length; pc++) {
+        if(program->code[pc].inst != INST_FUSE) {
+            continue;
+        }
+        fuse_op_t ops[FUSE_MAX_OPS];
+        unsigned body_length = program->code[pc].operand.fuse.length;
+        for(unsigned i = 0; i < body_length && i < FUSE_MAX_OPS; i++) {
+            ops[i].inst = program->code[pc + 1 + i].inst;
+            ops[i].index = (unsigned)program->code[pc + 1 + i].operand.uint;
+        }
+        const char *error = fuse_check(ops, body_length, program->code[pc].operand.fuse.inputs);
+        if(__builtin_expect(error != NULL, false)) {
+            enif_release_resource(program);
+            *exception = raise_exception(env, error);
+            return NULL;
+        }
+    }
+
+    // The stack is verified once here, so that execute() does not check it.
+    verify_op_t *ops = enif_alloc(sizeof(verify_op_t) * (length > 0 ? length : 1));
+    if(__builtin_expect(ops == NULL, false)) {
+        enif_release_resource(program);
+        *exception = raise_exception(env, "Fail to alloc memory");
+        return NULL;
+    }
+    for(unsigned pc = 0; pc < length; pc++) {
+        const code_t *code_p = &program->code[pc];
+        ops[pc] = (verify_op_t){.inst = code_p->inst};
+        switch(code_p->inst) {
+            case INST_ALOADT:
+            case INST_STORE:
+            case INST_LOAD:
+            case INST_TAKE:
+                // An index out of unsigned still fails the check of the arguments.
+                ops[pc].index = code_p->operand.uint >= UINT_MAX ? UINT_MAX - 1 : (unsigned)code_p->operand.uint;
+                break;
+            case INST_FUSE:
+                ops[pc].index = code_p->operand.fuse.inputs;
+                ops[pc].length = code_p->operand.fuse.length;
+                break;
+            case INST_SKIP:
+                ops[pc].target = code_p->operand.skip.target;
+                ops[pc].conditional = code_p->operand.skip.condition != skip_always;
+                break;
+        }
+    }
+    verify_result_t verified;
+    const char *error = verify(ops, length, program->locals, MAX_STACK, &verified);
+    enif_free(ops);
+    if(__builtin_expect(error != NULL, false)) {
+        enif_release_resource(program);
+        const char *format = "%s at %u";
+        size_t size = strlen(format) + strlen(error) + get_degit(UINT_MAX);
+        char message[size];
+        enif_snprintf(message, size, format, error, verified.pc);
+        *exception = raise_exception(env, message);
+        return NULL;
+    }
+    program->max_stack = verified.max_stack;
+    program->args = verified.args;
+    resolve_handlers(program);
+    return program;
+}
+
+// The elements of an entry of the stack which the stats count.
+static inline uint64_t entry_elements(const p_stack_t *entry)
+{
+    return entry->type == type_tensor || entry->type == type_scalar ? entry->tensor.size : 0;
+}
+
+/*
+ * Runs a program verified by load, which checks the depth of the stack and
+ * the kinds of its values, so the instructions do not check them here.
+ * stack has the max_stack entries of the program.
+ */
+static bool run(ErlNifEnv *env, program_t *program, ERL_NIF_TERM *args, unsigned arg_length, p_stack_t *stack, p_stack_t *locals, reply_t *reply, ERL_NIF_TERM *reason)
+{
+    if(__builtin_expect(arg_length < program->args, false)) {
+        *reason = enif_make_string(env, "the operand of aloadt is over the number of arguments", ERL_NIF_LATIN1);
+        return false;
+    }
+
+    size_t stack_idx = 0;
+
+    // Whether to count the instructions, which is checked once per execution.
+    bool stats = stats_enabled();
+
+#ifdef THREADED_DISPATCH
+    static const void *const targets[] = {
+#define HANDLER_TARGET(name) [HANDLER_##name] = &&target_HANDLER_##name,
+        HANDLERS(HANDLER_TARGET)
+#undef HANDLER_TARGET
+    };
+#endif
+
+    /*
+     * code_p is the last instruction of those which the handler runs,
+     * whose opcode and operand it reads, and at is the first.
+     */
+    unsigned pc = 0, at;
+    code_t *code_p;
+    enum handler handler;
+    uint_fast16_t inst;
+    uint64_t started = 0, elements = 0, allocated = 0;
+
+#define FETCH() \
+    do { \
+        if(__builtin_expect(pc >= program->length, false)) { \
+            return true; \
+        } \
+        at = pc; \
+        code_p = &program->code[pc]; \
+        handler = code_p->handler; \
+        pc += code_p->width; \
+        code_p += code_p->width - 1; \
+        inst = code_p->inst; \
+        if(__builtin_expect(stats, false)) { \
+            elements = stack_idx > 0 ? entry_elements(&stack[stack_idx - 1]) : 0; \
+            allocated = allocated_bytes; \
+            started = stats_now(); \
+        } \
+    } while(0)
+
+#define RECORD() \
+    do { \
+        if(__builtin_expect(stats, false)) { \
+            uint64_t after = stack_idx > 0 ? entry_elements(&stack[stack_idx - 1]) : 0; \
+            stats_record( \
+                inst, &program->stats[at], after > elements ? after : elements, \
+                allocated_bytes - allocated, stats_now() - started); \
+        } \
+    } while(0)
+
+#ifdef THREADED_DISPATCH
+#define TARGET(name) case name: target_##name
+#define NEXT() { RECORD(); FETCH(); goto *targets[handler]; }
+#else
+#define TARGET(name) case name
+#define NEXT() break
+#endif
+
+    for(;;) {
+        FETCH();
+        switch(handler) {
+            TARGET(HANDLER_COPY):
+                {
+                    /*
+                     * Copys the binary of the top of the stack.
+                     *
+                     * The stak top should be type_tensor.
+                     *
+                     * Now, copy supports only in case that the operand is nil.
+                     * When the operand is nil, increment of the source adn the destination are 1.
+                     * A strided view is gathered into the contiguous copy.
+                     */
+
+                    if(__builtin_expect(stack[stack_idx - 1].type != type_tensor, false)) {
+                        *reason = enif_make_string(env, "Should be a tensor in case of copy", ERL_NIF_LATIN1);
                         return false;
                     }
-                    int arity_s;
-                    const ERL_NIF_TERM *array_s;
-                    if(__builtin_expect(!enif_get_tuple(env, stack[stack_idx + 1].content, &arity_s, &array_s), false)) {
-                        *reason = enif_make_string(env, "Stack top should be a tuple in case of scal", ERL_NIF_LATIN1);
+                    tensor_t *tensor = &stack[stack_idx - 1].tensor;
+                    tensor_t in = *tensor;
+                    if(__builtin_expect(!alloc_tensor_data(env, tensor), false)) {
+                        *reason = enif_make_string(env, "Fail to alloc memory in case of copy", ERL_NIF_LATIN1);
                         return false;
                     }
-                    if(__builtin_expect(arity_s != 4, false)) {
-                        *reason = enif_make_string(env, "The arity of tuple should be 4 in case of scal", ERL_NIF_LATIN1);
-                        return false;
+                    // omit check the operand is nil.
+                    if(in.strided) {
+                        view_gather(in.data, tensor_element_size(&in), in.rank, in.shape, in.strides, tensor->data);
+                    } else {
+                        memcpy(tensor->data, in.data, tensor->size * tensor_element_size(tensor));
                     }
-                    ErlNifUInt64 size_s;
-                    if(__builtin_expect(!enif_get_uint64(env, array_s[0], &size_s), false)) {
-                        *reason = enif_make_string(env, "Fail to get uint64 in case of scal", ERL_NIF_LATIN1);
+                    release(&in);
+                }
+                NEXT();
+
+            TARGET(HANDLER_SCAL):
+                {
+                    /*
+                     * Scales a tensor by a constant.
+                     *
+                     * Pops the two values from the stack, and push the result.
+                     * The tensor is scaled in place if it owns its data.
+                     * Otherwise, it is scaled into a copy in one pass by the kernel
+                     * of multiply if the increment is 1, or copied in advance.
+                     *
+                     * The operand should be the positive integer as increment.
+                     *
+                     * The stack top should be of size 1.
+                     *
+                     * {:f, 32} and {:f, 64} are scaled by BLAS with the increment,
+                     * which scales every increment-th element of the tensor,
+                     * and the other real types by the kernel of multiply
+                     * with the scalar converted to the type, where the increment should be 1.
+                     */
+
+                    stack_idx -= 2;
+                    if(__builtin_expect(!make_contiguous_entries(env, &stack[stack_idx], 2, reason), false)) {
                         return false;
                     }
-                    if(__builtin_expect(size_s != 1, false)) {
-                        *reason = enif_make_string(env, "unexpected scalar but size_s != 1", ERL_NIF_LATIN1);
+
+                    // Get the given tensor
+                    tensor_t *tensor = &stack[stack_idx].tensor;
+                    bool blas = tensor->type == tb_f && (tensor->bit_type == btb_32 || tensor->bit_type == btb_64);
+                    binary_kernel_t multiply = binary_kernel(INST_MULTIPLY, tensor->type, tensor->bit_type);
+                    if(__builtin_expect(!blas && multiply == NULL, false)) {
+                        *reason = enif_make_string(env, "Sorry, scal does not support the type of the tensor", ERL_NIF_LATIN1);
                         return false;
                     }
-                    int arity_type_s;
-                    const ERL_NIF_TERM *array_type_s;
-                    char *type_s;
-                    unsigned typel_s;
-                    unsigned int type_size_s;
-                    if(__builtin_expect(
-                        !enif_get_tuple(env, array_s[2], &arity_type_s, &array_type_s)
-                        || arity_type_s != 2
-                        || !enif_get_atom_length(env, array_type_s[0], &typel_s, ERL_NIF_LATIN1)
-                        || (type_s = (char *)enif_alloc((typel_s + 1) * sizeof(char))) == NULL
-                        || !enif_get_atom(env, array_type_s[0], type_s, typel_s + 1, ERL_NIF_LATIN1),
-                        false)) {
-                        *reason = enif_make_string(env, "Fail to get type in case of scal", ERL_NIF_LATIN1);
+
+                    // Get the given scalar
+                    tensor_t *tensor_s = &stack[stack_idx + 1].tensor;
+                    if(__builtin_expect(tensor_s->size != 1, false)) {
+                        *reason = enif_make_string(env, "unexpected scalar but size_s != 1", ERL_NIF_LATIN1);
                         return false;
                     }
-                    if(__builtin_expect(
-                        strncmp(type_s, "f", 1) != 0
-                        || !enif_get_uint(env, array_type_s[1], &type_size_s)
-                        || !(type_size_s == 32 || type_size_s == 64),
-                        false)) {
-                        *reason = enif_make_string(env, "Sorry, scal now supports only {:f, 32} or {:f, 64} as a tensor", ERL_NIF_LATIN1);
+
+                    ErlNifUInt64 increment = code_p->operand.uint;
+                    if(__builtin_expect(!blas && increment != 1, false)) {
+                        *reason = enif_make_string(env, "Sorry, scal supports only the increment 1 except {:f, 32} and {:f, 64}", ERL_NIF_LATIN1);
                         return false;
                     }
-                    ErlNifBinary bin_s;
-                    if(__builtin_expect(!enif_inspect_binary(env, array_s[3], &bin_s), false)) {
-                        *reason = enif_make_string(env, "Fail to get binary in case of scal", ERL_NIF_LATIN1);
+                    if(__builtin_expect(increment == 0, false)) {
+                        *reason = enif_make_string(env, "The increment should be positive in case of scal", ERL_NIF_LATIN1);
                         return false;
                     }
+                    // The elements which BLAS scales, which are within the tensor.
+                    size_t n = (tensor->size + increment - 1) / increment;
 
-                    // get operand
-                    ErlNifUInt64 increment;
-                    if(__builtin_expect(!enif_get_uint64(env, code_p->operand, &increment), false)) {
-                        *reason = enif_make_string(env, "Fail to get uint64 from operand in case of scal", ERL_NIF_LATIN1);
+                    // The scalar in double for BLAS, or in the type of the tensor otherwise.
+                    double scalar;
+                    unary_kernel_t convert = blas
+                        ? convert_kernel(tensor_s->type, tensor_s->bit_type, tb_f, btb_64)
+                        : convert_kernel(tensor_s->type, tensor_s->bit_type, tensor->type, tensor->bit_type);
+                    if(__builtin_expect(convert == NULL, false)) {
+                        *reason = enif_make_string(env, "Sorry, scal does not support the type of the scalar", ERL_NIF_LATIN1);
                         return false;
                     }
-
-                    double scalar;
-                    switch(type_size_s) {
-                        case 32:
-                            scalar = (double)((float *)bin_s.data)[0];
-                            break;
-                        case 64:
-                            scalar = (double)((double *)bin_s.data)[0];
-                            break;
-                        default:
-                            *reason = enif_make_string(env, "unexpected", ERL_NIF_LATIN1);
+                    convert(1, tensor_s->data, &scalar);
+                    release(tensor_s);
+                    bool scaled = false;
+                    if(!owned(tensor)) {
+                        tensor_t in = *tensor;
+                        if(__builtin_expect(!alloc_tensor_data(env, tensor), false)) {
+                            *reason = enif_make_string(env, "Fail to alloc memory in case of scal", ERL_NIF_LATIN1);
                             return false;
+                        }
+                        if(increment == 1 && multiply != NULL) {
+                            float single = (float)scalar;
+                            const void *factor = blas && tensor->bit_type == btb_32 ? (const void *)&single : (const void *)&scalar;
+                            multiply(tensor->size, in.data, false, factor, true, tensor->data);
+                            scaled = true;
+                        } else {
+                            memcpy(tensor->data, in.data, tensor->size * tensor_element_size(tensor));
+                        }
+                        release(&in);
                     }
-                    switch(type_size) {
-                        case 32:
-                            cblas_sscal(size, (float)scalar, (float *)bin.data, increment);
-                            break;
-                        case 64:
-                            cblas_dscal(size, (double)scalar, (double *)bin.data, increment);
-                            break;
-                        default:
-                            *reason = enif_make_string(env, "unexpected", ERL_NIF_LATIN1);
-                            return false;
+                    if(scaled) {
+                        stack_idx++;
+                        NEXT();
+                    }
+                    if(!blas) {
+                        multiply(tensor->size, tensor->data, false, &scalar, true, tensor->data);
+                    } else if(tensor->bit_type == btb_32) {
+                        cblas_sscal(n, (float)scalar, (float *)tensor->data, increment);
+                    } else {
+                        cblas_dscal(n, scalar, (double *)tensor->data, increment);
                     }
                     stack_idx++;
                 }
-                break;
+                NEXT();
 
-            case INST_SENDT:
+            TARGET(HANDLER_DOT):
                 {
-                    // enif_fprintf(stdout, "inst: sendt\n");
-
                     /*
-                     * Sends a tensor to the process.
-                     * 
-                     * The stak top should be type_tensor:
-                     * {
-                     *   Nx.size(args),
-                     *   Nx.shape(args),
-                     *   Nx.type(args),
-                     *   Nx.to_binary(args)
-                     * }
-                     * 
-                     * Or type_error:
-                     * {
-                     *   :error,
-                     *   enif_make_string(env, reason, ERL_NIF_LATIN1)
-                     * }
+                     * Computes the dot product of two vectors.
                      *
-                     * The sent message in case of type_tensor is:
-                     * {
-                     *   :result,
-                     *   binary,
-                     *   shape,
-                     *   type
-                     * }
-                     * 
-                     * The sent message in case of type_error is:
-                     * {
-                     *   :error,
-                     *   reason (Charlist)
-                     * }
-                     * 
+                     * Pops the two tensors x and y from the stack,
+                     * and push the result as a tensor of the shape {}.
+                     *
+                     * Now, dot supports only in case that Nx.type is as follows:
+                     * {:f, 32}
+                     * {:f, 64}
                      */
 
-                    if(__builtin_expect(stack_idx == 0, false)) {
-                        *reason = enif_make_string(env, "Stack limit is less than 0", ERL_NIF_LATIN1);
+                    stack_idx -= 2;
+                    if(__builtin_expect(!make_contiguous_entries(env, &stack[stack_idx], 2, reason), false)) {
                         return false;
                     }
-                    stack_idx--;
-
-                    if(__builtin_expect(stack[stack_idx].type != type_tensor, false)) {
-                        *reason = enif_make_string(env, "Should be a tensor in case of sendt", ERL_NIF_LATIN1);
+                    if(__builtin_expect(
+                        !is_blas_tensor(&stack[stack_idx])
+                        || !is_blas_tensor(&stack[stack_idx + 1]),
+                        false)) {
+                        *reason = enif_make_string(env, "Sorry, dot now supports only {:f, 32} or {:f, 64} as a tensor", ERL_NIF_LATIN1);
                         return false;
                     }
-                    int arity;
-                    const ERL_NIF_TERM *array;
-                    if(__builtin_expect(!enif_get_tuple(env, stack[stack_idx].content, &arity, &array), false)) {
-                        *reason = enif_make_string(env, "Stack top should be a tuple in case of sendt", ERL_NIF_LATIN1);
+                    tensor_t *x = &stack[stack_idx].tensor;
+                    tensor_t *y = &stack[stack_idx + 1].tensor;
+                    if(__builtin_expect(!same_type(x, y) || x->size != y->size, false)) {
+                        *reason = enif_make_string(env, "The types and the sizes of tensors should be same in case of dot", ERL_NIF_LATIN1);
                         return false;
                     }
-                    if(__builtin_expect(arity != 4, false)) {
-                        *reason = enif_make_string(env, "The arity of tuple should be 4 in case of sendt", ERL_NIF_LATIN1);
+
+                    tensor_t out = {.type = x->type, .bit_type = x->bit_type, .rank = 0, .type_term = x->type_term};
+                    if(__builtin_expect(!alloc_tensor(env, &out), false)) {
+                        *reason = enif_make_string(env, "Fail to alloc memory in case of dot", ERL_NIF_LATIN1);
                         return false;
                     }
-                    ErlNifUInt64 size;
-                    if(__builtin_expect(!enif_get_uint64(env, array[0], &size), false)) {
-                        *reason = enif_make_string(env, "Fail to get uint64 in case of sendt", ERL_NIF_LATIN1);
+                    switch(x->bit_type) {
+                        case btb_32:
+                            ((float *)out.data)[0] = cblas_sdot(x->size, (float *)x->data, 1, (float *)y->data, 1);
+                            break;
+                        case btb_64:
+                            ((double *)out.data)[0] = cblas_ddot(x->size, (double *)x->data, 1, (double *)y->data, 1);
+                            break;
+                        default:
+                            *reason = enif_make_string(env, "unexpected", ERL_NIF_LATIN1);
+                            return false;
+                    }
+                    release(x);
+                    release(y);
+                    stack[stack_idx].type = type_tensor;
+                    stack[stack_idx].tensor = out;
+                    stack_idx++;
+                }
+                NEXT();
+
+            TARGET(HANDLER_AXPY):
+                {
+                    /*
+                     * Computes alpha * x + y into y.
+                     *
+                     * Pops the three values x, y and alpha from the stack,
+                     * and push y as the result.
+                     * alpha is the stack top and should be of size 1.
+                     *
+                     * Like scal, y is overwritten in place if it owns its data,
+                     * or it is copied in advance otherwise.
+                     *
+                     * Now, axpy supports only in case that Nx.type is as follows:
+                     * {:f, 32}
+                     * {:f, 64}
+                     */
+
+                    stack_idx -= 3;
+                    if(__builtin_expect(!make_contiguous_entries(env, &stack[stack_idx], 3, reason), false)) {
                         return false;
                     }
-                    int arity_type;
-                    const ERL_NIF_TERM *array_type;
-                    char *type;
-                    unsigned typel;
-                    // unsigned int type_size;
                     if(__builtin_expect(
-                        !enif_get_tuple(env, array[2], &arity_type, &array_type)
-                        || arity_type != 2
-                        || !enif_get_atom_length(env, array_type[0], &typel, ERL_NIF_LATIN1)
-                        || (type = (char *)enif_alloc((typel + 1) * sizeof(char))) == NULL
-                        || !enif_get_atom(env, array_type[0], type, typel + 1, ERL_NIF_LATIN1),
+                        !is_blas_tensor(&stack[stack_idx])
+                        || !is_blas_tensor(&stack[stack_idx + 1])
+                        || !is_blas_tensor(&stack[stack_idx + 2]),
                         false)) {
-                        *reason = enif_make_string(env, "Fail to get type in case of sendt", ERL_NIF_LATIN1);
+                        *reason = enif_make_string(env, "Sorry, axpy now supports only {:f, 32} or {:f, 64} as a tensor", ERL_NIF_LATIN1);
                         return false;
                     }
-                    ErlNifBinary bin;
-                    if(__builtin_expect(!enif_inspect_binary(env, array[3], &bin), false)) {
-                        *reason = enif_make_string(env, "Fail to get binary in case of sendt", ERL_NIF_LATIN1);
+                    tensor_t *x = &stack[stack_idx].tensor;
+                    tensor_t *y = &stack[stack_idx + 1].tensor;
+                    tensor_t *alpha = &stack[stack_idx + 2].tensor;
+                    if(__builtin_expect(!same_type(x, y) || x->size != y->size, false)) {
+                        *reason = enif_make_string(env, "The types and the sizes of tensors should be same in case of axpy", ERL_NIF_LATIN1);
                         return false;
                     }
-
-                    ErlNifPid pid;
-                    if(__builtin_expect(!enif_get_local_pid(env, rpid, &pid), false)) {
-                        *reason = enif_make_string(env, "Fail to get pid in case sendt", ERL_NIF_LATIN1);
+                    if(__builtin_expect(alpha->size != 1, false)) {
+                        *reason = enif_make_string(env, "alpha should be a scalar in case of axpy", ERL_NIF_LATIN1);
                         return false;
                     }
-
-                    ErlNifEnv *msg_env = enif_alloc_env();
-                    if(__builtin_expect(msg_env == NULL, false)) {
-                        *reason = enif_make_string(env, "Fail to get new environment in case sendt", ERL_NIF_LATIN1);
-                        return false;
+                    double a = alpha->bit_type == btb_32 ? (double)((float *)alpha->data)[0] : ((double *)alpha->data)[0];
+                    release(alpha);
+                    if(!owned(y)) {
+                        tensor_t in = *y;
+                        if(__builtin_expect(!alloc_tensor_data(env, y), false)) {
+                            *reason = enif_make_string(env, "Fail to alloc memory in case of axpy", ERL_NIF_LATIN1);
+                            return false;
+                        }
+                        memcpy(y->data, in.data, y->size * tensor_element_size(y));
+                        release(&in);
                     }
-                    ERL_NIF_TERM message = enif_make_tuple4(env,
-                        enif_make_atom(env, "result"),
-                        array[3],
-                        array[1],
-                        array[2]
-                    );
-
-                    if(__builtin_expect(!enif_send(NULL, &pid, msg_env, message), false)) {
-                        *reason = enif_make_string(env, "Fail to send in case sendt", ERL_NIF_LATIN1);
-                        return false;
+                    switch(x->bit_type) {
+                        case btb_32:
+                            cblas_saxpy(x->size, (float)a, (float *)x->data, 1, (float *)y->data, 1);
+                            break;
+                        case btb_64:
+                            cblas_daxpy(x->size, a, (double *)x->data, 1, (double *)y->data, 1);
+                            break;
+                        default:
+                            *reason = enif_make_string(env, "unexpected", ERL_NIF_LATIN1);
+                            return false;
                     }
+                    release(x);
+                    stack[stack_idx] = stack[stack_idx + 1];
+                    stack[stack_idx].type = type_tensor;
+                    stack_idx++;
                 }
-                break;
+                NEXT();
 
-            case INST_SENDE:
+            TARGET(HANDLER_AXPBY):
                 {
-                    // enif_fprintf(stdout, "inst: sende\n");
-
                     /*
-                     * Sends an error.
-                     * 
-                     * The operand should be as follows:
-                     * Charlist
+                     * Computes alpha * x + beta * y into y.
                      *
-                     * The sent message in case of type_tensor is:
-                     * 
-                     * The sent message in case of type_error is:
-                     * {
-                     *   :error,
-                     *   reason (Charlist)
-                     * }
-                     * 
+                     * Pops the four values x, y, beta and alpha from the stack,
+                     * and push y as the result.
+                     * alpha is the stack top, and alpha and beta should be of size 1.
+                     * It is the same as scal 1 of y by beta followed by axpy,
+                     * into which Engine.optimize/1 merges them.
+                     *
+                     * Like axpy, y is overwritten in place if it owns its data,
+                     * or it is copied in advance otherwise.
+                     * beta is converted from any real type as scal does.
+                     *
+                     * Now, axpby supports only in case that Nx.type is as follows:
+                     * {:f, 32}
+                     * {:f, 64}
                      */
 
-                    ErlNifPid pid;
-                    if(__builtin_expect(!enif_get_local_pid(env, rpid, &pid), false)) {
-                        *reason = enif_make_string(env, "Fail to get pid from operand in case sende", ERL_NIF_LATIN1);
+                    stack_idx -= 4;
+                    if(__builtin_expect(!make_contiguous_entries(env, &stack[stack_idx], 4, reason), false)) {
                         return false;
                     }
-
-                    ErlNifEnv *msg_env = enif_alloc_env();
-                    if(__builtin_expect(msg_env == NULL, false)) {
-                        *reason = enif_make_string(env, "Fail to get new environment in case sende", ERL_NIF_LATIN1);
+                    if(__builtin_expect(
+                        !is_blas_tensor(&stack[stack_idx])
+                        || !is_blas_tensor(&stack[stack_idx + 1])
+                        || !is_blas_tensor(&stack[stack_idx + 3]),
+                        false)) {
+                        *reason = enif_make_string(env, "Sorry, axpby now supports only {:f, 32} or {:f, 64} as a tensor", ERL_NIF_LATIN1);
                         return false;
                     }
-                    ERL_NIF_TERM message = enif_make_tuple2(env,
-                        enif_make_atom(env, "error"),
-                        code_p->operand
-                    );
-
-                    if(__builtin_expect(!enif_send(NULL, &pid, msg_env, message), false)) {
-                        *reason = enif_make_string(env, "Fail to send in case sende", ERL_NIF_LATIN1);
+                    tensor_t *x = &stack[stack_idx].tensor;
+                    tensor_t *y = &stack[stack_idx + 1].tensor;
+                    tensor_t *beta = &stack[stack_idx + 2].tensor;
+                    tensor_t *alpha = &stack[stack_idx + 3].tensor;
+                    if(__builtin_expect(!same_type(x, y) || x->size != y->size, false)) {
+                        *reason = enif_make_string(env, "The types and the sizes of tensors should be same in case of axpby", ERL_NIF_LATIN1);
                         return false;
                     }
-                }
-                break;
-
-            case INST_IS_SCALAR:
-                {
-                    // enif_fprintf(stdout, "inst: is_scalar\n");
-
-                    if(__builtin_expect(stack_idx == 0, false)) {
-                        *reason = enif_make_string(env, "Stack limit is less than 0", ERL_NIF_LATIN1);
+                    if(__builtin_expect(alpha->size != 1 || beta->size != 1, false)) {
+                        *reason = enif_make_string(env, "alpha and beta should be scalars in case of axpby", ERL_NIF_LATIN1);
                         return false;
                     }
-                    int arity;
-                    const ERL_NIF_TERM *array;
-                    if(__builtin_expect(
-                        !(stack[stack_idx - 1].type == type_tensor || stack[stack_idx - 1].type == type_scalar)
-                        || !enif_get_tuple(env, stack[stack_idx - 1].content, &arity, &array),
-                        false)) {
-                        *reason = enif_make_string(env, "The stack top should be type_tensor or type_scalar in case of is_scalar", ERL_NIF_LATIN1);
+                    unary_kernel_t convert = convert_kernel(beta->type, beta->bit_type, tb_f, btb_64);
+                    if(__builtin_expect(convert == NULL, false)) {
+                        *reason = enif_make_string(env, "Sorry, axpby does not support the type of beta", ERL_NIF_LATIN1);
                         return false;
                     }
-                    ErlNifUInt64 size;
-                    if(__builtin_expect(!enif_get_uint64(env, array[0], &size), false)) {
-                        *reason = enif_make_string(env, "Fail to get uint64 in case is_scalar", ERL_NIF_LATIN1);
-                        return false;
+                    double a = alpha->bit_type == btb_32 ? (double)((float *)alpha->data)[0] : ((double *)alpha->data)[0];
+                    double b;
+                    convert(1, beta->data, &b);
+                    release(alpha);
+                    release(beta);
+                    if(!owned(y)) {
+                        tensor_t in = *y;
+                        if(__builtin_expect(!alloc_tensor_data(env, y), false)) {
+                            *reason = enif_make_string(env, "Fail to alloc memory in case of axpby", ERL_NIF_LATIN1);
+                            return false;
+                        }
+                        memcpy(y->data, in.data, y->size * tensor_element_size(y));
+                        release(&in);
                     }
-                    stack[stack_idx].type = type_bool;
-                    if(size == 1) {
-                        stack[stack_idx].content = enif_make_uint(env, 1);
-                        stack[stack_idx - 1].type = type_scalar;
-                    } else {
-                        stack[stack_idx].content = enif_make_uint(env, 0);
+                    switch(x->bit_type) {
+                        case btb_32:
+                            cblas_saxpby(x->size, (float)a, (float *)x->data, 1, (float)b, (float *)y->data, 1);
+                            break;
+                        case btb_64:
+                            cblas_daxpby(x->size, a, (double *)x->data, 1, b, (double *)y->data, 1);
+                            break;
+                        default:
+                            *reason = enif_make_string(env, "unexpected", ERL_NIF_LATIN1);
+                            return false;
                     }
+                    release(x);
+                    stack[stack_idx] = stack[stack_idx + 1];
+                    stack[stack_idx].type = type_tensor;
                     stack_idx++;
                 }
-                break;
+                NEXT();
 
-            case INST_SKIP:
+            TARGET(HANDLER_GEMV):
                 {
-                    // enif_fprintf(stdout, "inst: skip\n");
-
                     /*
-                     * Skips in the given condition by the operand.
-                     * 
-                     * The operand should be a tuple as follows:
-                     * {
-                     *   (a non positive number increment of PC),
-                     *   {
-                     *     :if,
-                     *     true or false
-                     *   }
-                     * }
-                     * or 
-                     * {
-                     *   (a non positive number increment of PC),
-                     *   true
-                     * }
+                     * Computes the product of a matrix A and a vector x.
+                     *
+                     * Pops the two tensors A and x from the stack,
+                     * and push the result as a new vector.
                      *
-                     * If the former, Pops the stack as the condition.
-                     * The type of the poped value should be type_bool. 
+                     * A should be of rank 2 in row major, whose leading dimension is
+                     * the size of its second axis.
+                     *
+                     * The operand is the transposition flags:
+                     * TRANSPOSE_A computes the product of the transposed A and x.
+                     *
+                     * Now, gemv supports only in case that Nx.type is as follows:
+                     * {:f, 32}
+                     * {:f, 64}
                      */
 
-                    int arity;
-                    const ERL_NIF_TERM *array;
+                    stack_idx -= 2;
+                    if(__builtin_expect(!make_contiguous_entries(env, &stack[stack_idx], 2, reason), false)) {
+                        return false;
+                    }
                     if(__builtin_expect(
-                        !enif_get_tuple(env, code_p->operand, &arity, &array)
-                        || arity != 2,
+                        !is_blas_tensor(&stack[stack_idx])
+                        || !is_blas_tensor(&stack[stack_idx + 1]),
                         false)) {
-                        *reason = enif_make_string(env, "Fail to get tuple2 from the operand in case of skip", ERL_NIF_LATIN1);
-                        return false;
-                    }
-                    ErlNifUInt64 skip;
-                    if(__builtin_expect(!enif_get_uint64(env, array[0], &skip), false)) {
-                        *reason = enif_make_string(env, "Fail to get uint64 from the increment of PC in case of skip", ERL_NIF_LATIN1);
-                        return false;
-                    }
-                    ERL_NIF_TERM value = array[1];
-                    if(enif_is_atom(env, value)) {
-                        // case of unconditional branch
-                        unsigned len;
-                        char *buf;
-                        if(__builtin_expect(
-                            !enif_get_atom_length(env, value, &len, ERL_NIF_LATIN1)
-                            || (buf = enif_alloc(len + 1)) == NULL
-                            || !enif_get_atom(env, value, buf, len + 1, ERL_NIF_LATIN1)
-                            || strncmp(buf, "true", len + 1) != 0,
-                            false)) {
-                            *reason = enif_make_string(env, "The conditional value should be true in case of unconditional branch", ERL_NIF_LATIN1);
-                            return false;
-                        }
-                        code_p += skip;
-                        code_length -= skip;
-                    } else if(__builtin_expect(enif_is_tuple(env, value), true)) {
-                        // case of conditional branch
-                        if(__builtin_expect(
-                            !enif_get_tuple(env, value, &arity, &array)
-                            || arity != 2, false)) {
-                            *reason = enif_make_string(env, "The conditional value should be tuple2 in case of conditional branch", ERL_NIF_LATIN1);
-                            return false;
-                        }
-                        unsigned len;
-                        char *buf;
-                        if(__builtin_expect(
-                            !enif_get_atom_length(env, array[0], &len, ERL_NIF_LATIN1)
-                            || (buf = enif_alloc(len + 1)) == NULL
-                            || !enif_get_atom(env, array[0], buf, len + 1, ERL_NIF_LATIN1)
-                            || strncmp(buf, "if", len + 1) != 0,
-                            false)) {
-                            *reason = enif_make_string(env, "The conditional value should be :if in case of conditional branch", ERL_NIF_LATIN1);
-                            return false;
-                        }
-                        int cmp_true, cmp_false;
-                        if(__builtin_expect(
-                            !enif_get_atom_length(env, array[1], &len, ERL_NIF_LATIN1)
-                            || (buf = enif_alloc(len + 1)) == NULL
-                            || !enif_get_atom(env, array[1], buf, len + 1, ERL_NIF_LATIN1)
-                            || !((cmp_true = strncmp(buf, "true", len + 1)) == 0 
-                                || (cmp_false = strncmp(buf, "false", len + 1)) == 0),
-                            false)) {
-                            *reason = enif_make_string(env, "The conditional value should be true or false in case of conditional branch", ERL_NIF_LATIN1);
+                        *reason = enif_make_string(env, "Sorry, gemv now supports only {:f, 32} or {:f, 64} as a tensor", ERL_NIF_LATIN1);
+                        return false;
+                    }
+                    tensor_t *a = &stack[stack_idx].tensor;
+                    tensor_t *x = &stack[stack_idx + 1].tensor;
+                    bool trans = code_p->operand.uint & TRANSPOSE_A;
+                    if(__builtin_expect(!same_type(a, x) || a->rank != 2, false)) {
+                        *reason = enif_make_string(env, "A should be a matrix of the same type as x in case of gemv", ERL_NIF_LATIN1);
+                        return false;
+                    }
+                    ErlNifUInt64 rows = a->shape[0];
+                    ErlNifUInt64 cols = a->shape[1];
+                    if(__builtin_expect(x->size != (trans ? rows : cols), false)) {
+                        *reason = enif_make_string(env, "The size of x does not match A in case of gemv", ERL_NIF_LATIN1);
+                        return false;
+                    }
+
+                    tensor_t out = {.type = a->type, .bit_type = a->bit_type, .rank = 1, .shape = {trans ? cols : rows}, .type_term = a->type_term};
+                    if(__builtin_expect(!alloc_tensor(env, &out), false)) {
+                        *reason = enif_make_string(env, "Fail to alloc memory in case of gemv", ERL_NIF_LATIN1);
+                        return false;
+                    }
+                    enum CBLAS_TRANSPOSE t = trans ? CblasTrans : CblasNoTrans;
+                    switch(a->bit_type) {
+                        case btb_32:
+                            cblas_sgemv(CblasRowMajor, t, rows, cols, 1.0f, (float *)a->data, cols, (float *)x->data, 1, 0.0f, (float *)out.data, 1);
+                            break;
+                        case btb_64:
+                            cblas_dgemv(CblasRowMajor, t, rows, cols, 1.0, (double *)a->data, cols, (double *)x->data, 1, 0.0, (double *)out.data, 1);
+                            break;
+                        default:
+                            *reason = enif_make_string(env, "unexpected", ERL_NIF_LATIN1);
                             return false;
-                        }
-                        if(__builtin_expect(stack_idx == 0, false)) {
-                            *reason = enif_make_string(env, "Stack limit is less than 0", ERL_NIF_LATIN1);
+                    }
+                    release(a);
+                    release(x);
+                    stack[stack_idx].type = type_tensor;
+                    stack[stack_idx].tensor = out;
+                    stack_idx++;
+                }
+                NEXT();
+
+            TARGET(HANDLER_GEMM):
+                {
+                    /*
+                     * Computes the product of two matrices A and B.
+                     *
+                     * Pops the two tensors A and B from the stack,
+                     * and push the result as a new matrix.
+                     *
+                     * A and B should be of rank 2 in row major, whose leading dimensions are
+                     * the sizes of their second axes.
+                     *
+                     * The operand is the transposition flags:
+                     * TRANSPOSE_A and TRANSPOSE_B transpose A and B respectively.
+                     *
+                     * Now, gemm supports only in case that Nx.type is as follows:
+                     * {:f, 32}
+                     * {:f, 64}
+                     */
+
+                    stack_idx -= 2;
+                    if(__builtin_expect(!make_contiguous_entries(env, &stack[stack_idx], 2, reason), false)) {
+                        return false;
+                    }
+                    if(__builtin_expect(
+                        !is_blas_tensor(&stack[stack_idx])
+                        || !is_blas_tensor(&stack[stack_idx + 1]),
+                        false)) {
+                        *reason = enif_make_string(env, "Sorry, gemm now supports only {:f, 32} or {:f, 64} as a tensor", ERL_NIF_LATIN1);
+                        return false;
+                    }
+                    tensor_t *a = &stack[stack_idx].tensor;
+                    tensor_t *b = &stack[stack_idx + 1].tensor;
+                    if(__builtin_expect(!same_type(a, b) || a->rank != 2 || b->rank != 2, false)) {
+                        *reason = enif_make_string(env, "A and B should be matrices of the same type in case of gemm", ERL_NIF_LATIN1);
+                        return false;
+                    }
+                    bool trans_a = code_p->operand.uint & TRANSPOSE_A;
+                    bool trans_b = code_p->operand.uint & TRANSPOSE_B;
+                    ErlNifUInt64 m = trans_a ? a->shape[1] : a->shape[0];
+                    ErlNifUInt64 k = trans_a ? a->shape[0] : a->shape[1];
+                    ErlNifUInt64 n = trans_b ? b->shape[0] : b->shape[1];
+                    if(__builtin_expect(k != (trans_b ? b->shape[1] : b->shape[0]), false)) {
+                        *reason = enif_make_string(env, "The contracted sizes of A and B do not match in case of gemm", ERL_NIF_LATIN1);
+                        return false;
+                    }
+
+                    tensor_t out = {.type = a->type, .bit_type = a->bit_type, .rank = 2, .shape = {m, n}, .type_term = a->type_term};
+                    if(__builtin_expect(!alloc_tensor(env, &out), false)) {
+                        *reason = enif_make_string(env, "Fail to alloc memory in case of gemm", ERL_NIF_LATIN1);
+                        return false;
+                    }
+                    enum CBLAS_TRANSPOSE ta = trans_a ? CblasTrans : CblasNoTrans;
+                    enum CBLAS_TRANSPOSE tb = trans_b ? CblasTrans : CblasNoTrans;
+                    switch(a->bit_type) {
+                        case btb_32:
+                            cblas_sgemm(CblasRowMajor, ta, tb, m, n, k, 1.0f, (float *)a->data, a->shape[1], (float *)b->data, b->shape[1], 0.0f, (float *)out.data, n);
+                            break;
+                        case btb_64:
+                            cblas_dgemm(CblasRowMajor, ta, tb, m, n, k, 1.0, (double *)a->data, a->shape[1], (double *)b->data, b->shape[1], 0.0, (double *)out.data, n);
+                            break;
+                        default:
+                            *reason = enif_make_string(env, "unexpected", ERL_NIF_LATIN1);
                             return false;
-                        }
+                    }
+                    release(a);
+                    release(b);
+                    stack[stack_idx].type = type_tensor;
+                    stack[stack_idx].tensor = out;
+                    stack_idx++;
+                }
+                NEXT();
+
+            TARGET(HANDLER_BINARY_SWAP):
+            TARGET(HANDLER_BINARY_DUP):
+            TARGET(HANDLER_BINARY):
+                {
+                    /*
+                     * Computes an elementwise binary operation.
+                     *
+                     * Pops the two tensors left and right from the stack,
+                     * and push the result as a new tensor.
+                     * right is the stack top.
+                     *
+                     * The types of left and right should be same.
+                     * Their sizes should be same, or either of them should be 1,
+                     * in which case it is broadcast.
+                     *
+                     * The type of the result is {:u, 8} in case of comparison and
+                     * logical operations, or the type of the operands otherwise.
+                     *
+                     * The result is written over an operand of the same type and size
+                     * if it owns its data.
+                     *
+                     * A strided operand is walked by its strides without copying it.
+                     */
+
+                    tensor_t *left, *right;
+                    if(handler == HANDLER_BINARY_DUP) {
+                        // dup folded in: the stack top is both the operands, of one reference.
                         stack_idx--;
-                        unsigned int bool_branch = 0xff;
-                        if(__builtin_expect(
-                            stack[stack_idx].type != type_bool
-                            || !enif_get_uint(env, stack[stack_idx].content, &bool_branch)
-                            || !(bool_branch == 0 || bool_branch == 1), 
-                            false)) {
-                            // enif_fprintf(stdout, "stack[stack_idx].type: %s\n", stack[stack_idx].type == type_bool ? "type_bool" : "other");
-                            *reason = enif_make_string(env, "The stack top should be type_bool in case of conditional branch", ERL_NIF_LATIN1);
-                            return false;
-                        }
-                        if(cmp_true == 0) {
-                            if(bool_branch == 1) {
-                                code_p += skip;
-                                code_length -= skip;
-                            }
-                        } else if(cmp_false == 0) {
-                            if(bool_branch == 0) {
-                                code_p += skip;
-                                code_length -= skip;
-                            }
-                        } else {
-                            *reason = enif_make_string(env, "unexpected case", ERL_NIF_LATIN1);
+                        left = right = &stack[stack_idx].tensor;
+                    } else if(handler == HANDLER_BINARY_SWAP) {
+                        // swap folded in: the operands are read the other way round.
+                        stack_idx -= 2;
+                        left = &stack[stack_idx + 1].tensor;
+                        right = &stack[stack_idx].tensor;
+                    } else {
+                        stack_idx -= 2;
+                        left = &stack[stack_idx].tensor;
+                        right = &stack[stack_idx + 1].tensor;
+                    }
+                    if(__builtin_expect(!same_type(left, right), false)) {
+                        *reason = enif_make_string(env, "The types of tensors should be same in case of binary operations", ERL_NIF_LATIN1);
+                        return false;
+                    }
+                    if(__builtin_expect(!(left->size == right->size || left->size == 1 || right->size == 1), false)) {
+                        *reason = enif_make_string(env, "The sizes of tensors should be same or 1 in case of binary operations", ERL_NIF_LATIN1);
+                        return false;
+                    }
+                    binary_kernel_t kernel = binary_kernel(inst, left->type, left->bit_type);
+                    if(__builtin_expect(kernel == NULL, false)) {
+                        *reason = enif_make_string(env, "Sorry, the binary operation does not support the type", ERL_NIF_LATIN1);
+                        return false;
+                    }
+
+                    tensor_t *shaped = left->size >= right->size ? left : right;
+                    tensor_t out = *shaped;
+                    out.strided = false;
+                    if(binary_returns_u8(inst)) {
+                        out.type = tb_u;
+                        out.bit_type = btb_8;
+                        out.type_term = enif_make_tuple2(env, atom_u, enif_make_uint(env, 8));
+                    }
+                    tensor_t *reused = reusable(left, &out) ? left : reusable(right, &out) ? right : NULL;
+                    if(reused != NULL) {
+                        out.storage = reused->storage;
+                        out.buffer = reused->buffer;
+                        out.data = reused->data;
+                        out.offset = reused->offset;
+                    } else if(__builtin_expect(!alloc_tensor_data(env, &out), false)) {
+                        *reason = enif_make_string(env, "Fail to alloc memory in case of binary operations", ERL_NIF_LATIN1);
+                        return false;
+                    }
+                    if(left->strided || right->strided) {
+                        const char *error = binary_strided(env, kernel, left, right, &out);
+                        if(__builtin_expect(error != NULL, false)) {
+                            *reason = enif_make_string(env, error, ERL_NIF_LATIN1);
                             return false;
                         }
-                    } else {
-                        *reason = enif_make_string(env, "Unrecognized format of the branch condition in case of skip", ERL_NIF_LATIN1);
+                    } else if(__builtin_expect(
+                        !run_binary(kernel, out.size, left, left->size != out.size, right, right->size != out.size, &out),
+                        false)) {
+                        *reason = enif_make_string(env, "Division by zero in case of binary operations", ERL_NIF_LATIN1);
                         return false;
                     }
+                    if(reused != left) {
+                        release(left);
+                    }
+                    if(reused != right && right != left) {
+                        release(right);
+                    }
+                    stack[stack_idx].type = type_tensor;
+                    stack[stack_idx].tensor = out;
+                    stack_idx++;
                 }
-                break;
+                NEXT();
 
-            case INST_RETURN:
+            TARGET(HANDLER_UNARY):
                 {
-                    // enif_fprintf(stdout, "inst: return\n");
-                    // enif_fprintf(stdout, "stack_idx: %u\n", stack_idx);
-                    if(__builtin_expect(stack_idx != 0, false)) {
-                        *reason = enif_make_string(env, "stack is not zero at return", ERL_NIF_LATIN1);
+                    /*
+                     * Computes an elementwise unary operation.
+                     *
+                     * Pops a tensor from the stack,
+                     * and push the result as a new tensor of the same type and shape.
+                     *
+                     * exp, log, log1p, sigmoid, tanh, erf, sqrt and rsqrt support
+                     * {:f, 16}, {:bf, 16}, {:f, 32} and {:f, 64},
+                     * and abs also supports the integer types.
+                     *
+                     * The result is written over the tensor if it owns its data.
+                     * A strided tensor is gathered into the result, which is computed in place.
+                     */
+
+                    stack_idx--;
+                    if(__builtin_expect(!make_contiguous_entries(env, &stack[stack_idx], 1, reason), false)) {
                         return false;
                     }
-                    return true;
+                    tensor_t *in = &stack[stack_idx].tensor;
+                    tensor_t out = *in;
+                    unary_kernel_t kernel = unary_kernel(inst, out.type, out.bit_type);
+                    if(__builtin_expect(kernel == NULL, false)) {
+                        *reason = enif_make_string(env, "Sorry, the unary operation does not support the type", ERL_NIF_LATIN1);
+                        return false;
+                    }
+                    if(!owned(in)) {
+                        if(__builtin_expect(!alloc_tensor_data(env, &out), false)) {
+                            *reason = enif_make_string(env, "Fail to alloc memory in case of unary operations", ERL_NIF_LATIN1);
+                            return false;
+                        }
+                        release(in);
+                    }
+                    run_unary(kernel, in, &out);
+                    stack[stack_idx].type = type_tensor;
+                    stack[stack_idx].tensor = out;
+                    stack_idx++;
                 }
-                break;
+                NEXT();
 
-            case INST_DUP:
+            TARGET(HANDLER_AS_TYPE):
                 {
-                    // enif_fprintf(stdout, "inst: dup\n");
-                    if(__builtin_expect(stack_idx == 0, false)) {
-                        *reason = enif_make_string(env, "stack should be greater than zero in case of dup", ERL_NIF_LATIN1);
+                    /*
+                     * Converts a tensor into the type of the operand.
+                     *
+                     * Pops a tensor from the stack,
+                     * and push the result of the same shape.
+                     *
+                     * The real types are supported.
+                     * The result is written over the tensor if it owns its data
+                     * and the types are of the same size.
+                     */
+
+                    stack_idx--;
+                    if(__builtin_expect(!make_contiguous_entries(env, &stack[stack_idx], 1, reason), false)) {
+                        return false;
+                    }
+                    tensor_t *in = &stack[stack_idx].tensor;
+                    tensor_t out = *in;
+                    out.type = code_p->operand.as_type.type;
+                    out.bit_type = code_p->operand.as_type.bit_type;
+                    unary_kernel_t kernel = convert_kernel(in->type, in->bit_type, out.type, out.bit_type);
+                    if(__builtin_expect(kernel == NULL, false)) {
+                        *reason = enif_make_string(env, "Sorry, as_type does not support the type", ERL_NIF_LATIN1);
                         return false;
                     }
-                    stack[stack_idx].type = stack[stack_idx - 1].type;
-                    stack[stack_idx].content = stack[stack_idx - 1].content;
+                    if(!same_type(in, &out)) {
+                        out.type_term = make_type(env, out.type, out.bit_type);
+                    }
+                    if(!(owned(in) && tensor_element_size(in) == tensor_element_size(&out))) {
+                        if(__builtin_expect(!alloc_tensor_data(env, &out), false)) {
+                            *reason = enif_make_string(env, "Fail to alloc memory in case of as_type", ERL_NIF_LATIN1);
+                            return false;
+                        }
+                        release(in);
+                    }
+                    run_unary(kernel, in, &out);
+                    stack[stack_idx].tensor = out;
                     stack_idx++;
                 }
-                break;
+                NEXT();
 
-            case INST_POP:
+            TARGET(HANDLER_REDUCE):
                 {
-                    // enif_fprintf(stdout, "inst: pop\n");
-                    if(__builtin_expect(stack_idx == 0, false)) {
-                        *reason = enif_make_string(env, "stack should be greater than zero in case of pop", ERL_NIF_LATIN1);
+                    /*
+                     * Reduces a tensor over axes.
+                     *
+                     * Pops a tensor from the stack,
+                     * and push the result as a new tensor.
+                     *
+                     * The operand is the mask of the reduced axes and the flags:
+                     * REDUCE_KEEP_AXES keeps the reduced axes as axes of size 1.
+                     * REDUCE_TIE_BREAK_HIGH makes argmax and argmin take the highest index.
+                     *
+                     * The type of the result is {:s, 64} in case of argmax and argmin,
+                     * {:u, 8} in case of all and any, or the type of the tensor otherwise.
+                     * argmax and argmin over all axes return the index in the flattened tensor.
+                     */
+
+                    stack_idx--;
+                    if(__builtin_expect(!make_contiguous_entries(env, &stack[stack_idx], 1, reason), false)) {
                         return false;
                     }
-                    stack_idx--;
-                    stack[stack_idx].type = type_undefined;
+                    tensor_t *in = &stack[stack_idx].tensor;
+                    if(__builtin_expect(in->rank > MAX_RANK, false)) {
+                        *reason = enif_make_string(env, "Sorry, reductions support tensors of rank up to 8", ERL_NIF_LATIN1);
+                        return false;
+                    }
+                    unsigned axes_mask = code_p->operand.uint & REDUCE_AXES_MASK & ((1u << in->rank) - 1);
+                    tensor_t out = {.rank = 0};
+                    if(__builtin_expect(!reduce_result_type(inst, in->type, in->bit_type, &out.type, &out.bit_type), false)) {
+                        *reason = enif_make_string(env, "Sorry, the reduction does not support the type", ERL_NIF_LATIN1);
+                        return false;
+                    }
+                    uint64_t shape[MAX_RANK];
+                    for(unsigned i = 0; i < in->rank; i++) {
+                        shape[i] = in->shape[i];
+                        if(!((axes_mask >> i) & 1)) {
+                            out.shape[out.rank++] = in->shape[i];
+                        } else if(code_p->operand.uint & REDUCE_KEEP_AXES) {
+                            out.shape[out.rank++] = 1;
+                        }
+                    }
+                    out.type_term = same_type(in, &out) ? in->type_term : make_type(env, out.type, out.bit_type);
+                    if(__builtin_expect(!alloc_tensor(env, &out), false)) {
+                        *reason = enif_make_string(env, "Fail to alloc memory in case of reductions", ERL_NIF_LATIN1);
+                        return false;
+                    }
+                    const char *error = reduce(
+                        inst, in->type, in->bit_type, in->data, in->rank, shape, axes_mask,
+                        code_p->operand.uint & REDUCE_TIE_BREAK_HIGH, out.data);
+                    if(__builtin_expect(error != NULL, false)) {
+                        *reason = enif_make_string(env, error, ERL_NIF_LATIN1);
+                        return false;
+                    }
+                    release(in);
+                    stack[stack_idx].type = type_tensor;
+                    stack[stack_idx].tensor = out;
+                    stack_idx++;
                 }
-                break;
+                NEXT();
 
-            case INST_POP2:
+            TARGET(HANDLER_SENDT):
                 {
-                    // enif_fprintf(stdout, "inst: pop2\n");
-                    if(__builtin_expect(stack_idx <= 1, false)) {
-                        *reason = enif_make_string(env, "stack should be greater than one in case of pop2", ERL_NIF_LATIN1);
+                    /*
+                     * Returns a tensor as a result, or sends it to the process
+                     * if the reply has the pid.
+                     *
+                     * The stak top should be type_tensor.
+                     *
+                     * The result is:
+                     * {
+                     *   binary or buffer,
+                     *   shape,
+                     *   type
+                     * }
+                     *
+                     * The sent message is:
+                     * {
+                     *   :result,
+                     *   binary or buffer,
+                     *   shape,
+                     *   type
+                     * }
+                     *
+                     * The data is a buffer if the storage is storage_buffer,
+                     * or a binary otherwise, which refers to the aligned data of
+                     * the buffer of the result without copying it.
+                     * A view is gathered into a buffer of its own,
+                     * or returned as a sub binary if it is contiguous.
+                     */
+
+                    stack_idx--;
+
+                    if(__builtin_expect(stack[stack_idx].type != type_tensor, false)) {
+                        *reason = enif_make_string(env, "Should be a tensor in case of sendt", ERL_NIF_LATIN1);
+                        return false;
+                    }
+                    if(__builtin_expect(!make_contiguous_entries(env, &stack[stack_idx], 1, reason), false)) {
+                        return false;
+                    }
+                    tensor_t *tensor = &stack[stack_idx].tensor;
+                    if(tensor->buffer != NULL && tensor->buffer->arena
+                        && __builtin_expect(!export_tensor(env, tensor), false)) {
+                        *reason = enif_make_string(env, "Fail to alloc memory in case sendt", ERL_NIF_LATIN1);
                         return false;
                     }
-                    stack_idx -= 2;
-                    stack[stack_idx + 1].type = type_undefined;
-                    stack[stack_idx].type = type_undefined;
-                }
-                break;
 
-            case INST_SWAP:
-                {
-                    // enif_fprintf(stdout, "inst: swap\n");
-                    if(__builtin_expect(stack_idx <= 1, false)) {
-                        *reason = enif_make_string(env, "stack should be greater than one in case of swap", ERL_NIF_LATIN1);
+                    size_t bytes = tensor->size * tensor_element_size(tensor);
+                    ERL_NIF_TERM data = tensor->storage;
+                    // A view of a part of a buffer is copied, since the buffer is returned as a whole.
+                    if(reply->storage == storage_buffer
+                        && (tensor->buffer == NULL || tensor->offset != 0 || tensor->buffer->size != bytes)) {
+                        tensor_t copied = *tensor;
+                        if(__builtin_expect(!alloc_tensor_data(env, &copied) || !export_tensor(env, &copied), false)) {
+                            *reason = enif_make_string(env, "Fail to alloc memory in case sendt", ERL_NIF_LATIN1);
+                            return false;
+                        }
+                        memcpy(copied.data, tensor->data, bytes);
+                        copied.buffer->writable = false;
+                        data = copied.storage;
+                    } else if(reply->storage == storage_binary && tensor->buffer != NULL) {
+                        data = buffer_make_binary(env, tensor->buffer->resource, tensor->offset, bytes);
+                    } else if(reply->storage == storage_binary) {
+                        ErlNifBinary bin;
+                        if(tensor->offset != 0 || (enif_inspect_binary(env, data, &bin) && bin.size != bytes)) {
+                            data = enif_make_sub_binary(env, data, tensor->offset, bytes);
+                        }
+                    }
+
+                    // The data is not overwritten anymore, since the caller keeps it.
+                    release(tensor);
+                    if(tensor->buffer != NULL) {
+                        tensor->buffer->writable = false;
+                    }
+
+                    if(reply->pid == NULL) {
+                        reply->outputs[reply->num_outputs++] = enif_make_tuple3(env,
+                            data,
+                            tensor->shape_term,
+                            tensor->type_term
+                        );
+                        break;
+                    }
+
+                    ERL_NIF_TERM message = enif_make_tuple4(env,
+                        atom_result,
+                        data,
+                        tensor->shape_term,
+                        tensor->type_term
+                    );
+
+                    if(__builtin_expect(!enif_send(env, reply->pid, NULL, message), false)) {
+                        *reason = enif_make_string(env, "Fail to send in case sendt", ERL_NIF_LATIN1);
                         return false;
                     }
-                    enum stack_type t;
-                    ERL_NIF_TERM term;
-                    t = stack[stack_idx - 1].type;
-                    stack[stack_idx - 1].type = stack[stack_idx - 2].type;
-                    stack[stack_idx - 2].type = t;
-                    term = stack[stack_idx - 1].content;
-                    stack[stack_idx - 1].content = stack[stack_idx - 2].content;
-                    stack[stack_idx - 2].content = term;
                 }
-                break;
+                NEXT();
 
-            case INST_ALOADT:
+            TARGET(HANDLER_SENDE):
                 {
-                    ErlNifUInt64 local_variable_num;
-                    if(__builtin_expect(!enif_get_uint64(env, code_p->operand, &local_variable_num), false)) {
-                        *reason = enif_make_string(env, "the operand of aloadt should be unsigned integer", ERL_NIF_LATIN1);
+                    /*
+                     * Stops the program with an error, or sends the error
+                     * to the process if the reply has the pid.
+                     *
+                     * The operand should be as follows:
+                     * Charlist
+                     *
+                     * The sent message in case of type_error is:
+                     * {
+                     *   :error,
+                     *   reason (Charlist)
+                     * }
+                     */
+
+                    if(reply->pid == NULL) {
+                        *reason = enif_make_copy(env, code_p->operand.term);
                         return false;
                     }
 
-                    // check the local variable only whether it is tuple4 or not.
-                    int arity;
-                    const ERL_NIF_TERM *array;
-                    if(__builtin_expect(!enif_get_tuple(env, args[local_variable_num], &arity, &array), false)) {
-                        const char *error_message = "the local variable %lu should be a tuple in case of aloadt";
-                        size_t error_buf_len = strlen(error_message) - 3 + get_degit(UINT64_MAX);
-                        char *error_buf = enif_alloc(error_buf_len);
-                        enif_snprintf(error_buf, error_buf_len, error_message, local_variable_num);
-                        *reason = enif_make_string(env, error_buf, ERL_NIF_LATIN1);
-                        enif_free(error_buf);
+                    ERL_NIF_TERM message = enif_make_tuple2(env,
+                        atom_error,
+                        enif_make_copy(env, code_p->operand.term)
+                    );
+
+                    if(__builtin_expect(!enif_send(env, reply->pid, NULL, message), false)) {
+                        *reason = enif_make_string(env, "Fail to send in case sende", ERL_NIF_LATIN1);
                         return false;
                     }
-                    if(__builtin_expect(arity != 4, false)) {
-                        *reason = enif_make_string(env, "The arity of tuple should be 4 in case of aloadt", ERL_NIF_LATIN1);
-                        return false;
+                }
+                NEXT();
+
+            TARGET(HANDLER_IS_SCALAR):
+                {
+                    stack[stack_idx].type = type_bool;
+                    if(stack[stack_idx - 1].tensor.size == 1) {
+                        stack[stack_idx].boolean = true;
+                        stack[stack_idx - 1].type = type_scalar;
+                    } else {
+                        stack[stack_idx].boolean = false;
                     }
-                    stack[stack_idx].type = type_tensor;
-                    stack[stack_idx].content = args[local_variable_num];
                     stack_idx++;
                 }
-                break;
+                NEXT();
 
-            default:
+            TARGET(HANDLER_SKIP):
                 {
-                    const char *err = "unrecognized instruction %04X";
-                    size_t length = strlen(err) + 1;
-                    char *error_message = enif_alloc(length);
-                    enif_snprintf(error_message, length, err, inst);
-                    *reason = enif_make_string(env, error_message, ERL_NIF_LATIN1);
-                    return false;
+                    /*
+                     * Skips in the given condition by the operand.
+                     *
+                     * The target and the condition are decoded by load_program.
+                     *
+                     * If the condition is conditional, Pops the stack as the condition,
+                     * which load has verified to be type_bool.
+                     */
+
+                    if(code_p->operand.skip.condition == skip_always) {
+                        pc = code_p->operand.skip.target;
+                        break;
+                    }
+                    stack_idx--;
+                    if(stack[stack_idx].boolean == (code_p->operand.skip.condition == skip_if_true)) {
+                        pc = code_p->operand.skip.target;
+                    }
                 }
-        }
-        if(stack_idx > MAX_STACK) {
-            *reason = enif_make_string(env, "stack limit is over MAX_STACK", ERL_NIF_LATIN1);
-            return false;
-        }
-    }
-    // enif_fprintf(stdout, "stack_idx: %u\n", stack_idx);
-    if(__builtin_expect(stack_idx != 0, false)) {
-        *reason = enif_make_string(env, "stack is not zero at the end of code", ERL_NIF_LATIN1);
-        return false;
-    }
-    return true;
-}
+                NEXT();
 
-static ERL_NIF_TERM execute_engine(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
-{
-    if(__builtin_expect(argc != 3, false)) {
-        return enif_make_badarg(env);
-    }
-    unsigned length;
-    code_t *code;
-    ERL_NIF_TERM exception;
+            TARGET(HANDLER_RETURN):
+                {
+                    return true;
+                }
+                NEXT();
 
-    if(__builtin_expect(!getcode(env, argv[0], &code, &length, &exception), false)) {
-        return exception;
-    }
+            TARGET(HANDLER_DUP):
+                {
+                    stack[stack_idx] = stack[stack_idx - 1];
+                    retain_entry(&stack[stack_idx]);
+                    stack_idx++;
+                }
+                NEXT();
 
-    unsigned arg_length;
-    if(__builtin_expect(!enif_get_list_length(env, argv[1], &arg_length), false)) {
-        return enif_make_badarg(env);
-    }
-    ERL_NIF_TERM *args = enif_alloc(sizeof(ERL_NIF_TERM) * arg_length);
-    ERL_NIF_TERM tail = argv[1];
-    for(unsigned i = 0; i < arg_length; i++) {
-        if(__builtin_expect(!enif_get_list_cell(env, tail, &args[i], &tail), false)) {
-            return enif_make_badarg(env);
-        }
-    }
+            TARGET(HANDLER_POP):
+                {
+                    stack_idx--;
+                    release_entry(&stack[stack_idx]);
+                    stack[stack_idx].type = type_undefined;
+                }
+                NEXT();
 
-    ERL_NIF_TERM reason;
-    if(execute(env, code, length, args, arg_length, argv[2], &reason)) {
-        enif_free(code);
-        return enif_make_atom(env, "ok");
+            TARGET(HANDLER_POP2):
+                {
+                    stack_idx -= 2;
+                    release_entry(&stack[stack_idx + 1]);
+                    release_entry(&stack[stack_idx]);
+                    stack[stack_idx + 1].type = type_undefined;
+                    stack[stack_idx].type = type_undefined;
+                }
+                NEXT();
+
+            TARGET(HANDLER_SWAP):
+                {
+                    p_stack_t t = stack[stack_idx - 1];
+                    stack[stack_idx - 1] = stack[stack_idx - 2];
+                    stack[stack_idx - 2] = t;
+                }
+                NEXT();
+
+            TARGET(HANDLER_ALOADT):
+                {
+                    ErlNifUInt64 local_variable_num = code_p->operand.uint;
+
+                    /*
+                     * Decodes the local variable into the tensor descriptor:
+                     * {
+                     *   Nx.size(args),
+                     *   Nx.shape(args),
+                     *   Nx.type(args),
+                     *   Nx.to_binary(args)
+                     * }
+                     *
+                     * The later instructions use only the descriptor.
+                     */
+                    if(__builtin_expect(!get_tensor(env, args[local_variable_num], &stack[stack_idx].tensor), false)) {
+                        const char *error_message = "the local variable %lu should be a tensor tuple in case of aloadt";
+                        size_t error_buf_len = strlen(error_message) - 3 + get_degit(UINT64_MAX);
+                        char error_buf[error_buf_len];
+                        enif_snprintf(error_buf, error_buf_len, error_message, local_variable_num);
+                        *reason = enif_make_string(env, error_buf, ERL_NIF_LATIN1);
+                        return false;
+                    }
+                    retain(&stack[stack_idx].tensor);
+                    stack[stack_idx].type = type_tensor;
+                    stack_idx++;
+                }
+                NEXT();
+
+            TARGET(HANDLER_FUSE):
+                {
+                    /*
+                     * Computes a chain of elementwise operations in one loop.
+                     *
+                     * Pops the inputs from the stack, runs the body which follows
+                     * this instruction over them, and push the result as a new tensor.
+                     * The first input is the deepest in the stack.
+                     *
+                     * The sizes of the inputs should be same, or 1, in which case it is broadcast.
+                     * The shape of the result is that of the first input of the largest size.
+                     */
+
+                    unsigned inputs = code_p->operand.fuse.inputs;
+                    unsigned length = code_p->operand.fuse.length;
+                    stack_idx -= inputs;
+                    if(__builtin_expect(!make_contiguous_entries(env, &stack[stack_idx], inputs, reason), false)) {
+                        return false;
+                    }
+
+                    fuse_input_t fuse_inputs[FUSE_MAX_INPUTS];
+                    tensor_t *shaped = NULL;
+                    for(unsigned i = 0; i < inputs; i++) {
+                        p_stack_t *entry = &stack[stack_idx + i];
+                        fuse_inputs[i].type = entry->tensor.type;
+                        fuse_inputs[i].bit_type = entry->tensor.bit_type;
+                        fuse_inputs[i].size = entry->tensor.size;
+                        fuse_inputs[i].data = entry->tensor.data;
+                        if(shaped == NULL || entry->tensor.size > shaped->size) {
+                            shaped = &entry->tensor;
+                        }
+                    }
+                    for(unsigned i = 0; i < inputs; i++) {
+                        if(__builtin_expect(!(fuse_inputs[i].size == shaped->size || fuse_inputs[i].size == 1), false)) {
+                            *reason = enif_make_string(env, "The sizes of tensors should be same or 1 in case of fuse", ERL_NIF_LATIN1);
+                            return false;
+                        }
+                    }
+
+                    fuse_op_t ops[FUSE_MAX_OPS];
+                    for(unsigned i = 0; i < length; i++) {
+                        ops[i].inst = code_p[1 + i].inst;
+                        ops[i].index = (unsigned)code_p[1 + i].operand.uint;
+                    }
+                    fuse_plan_t plan;
+                    const char *error = fuse_prepare(&plan, ops, length, fuse_inputs, inputs);
+                    if(__builtin_expect(error != NULL, false)) {
+                        *reason = enif_make_string(env, error, ERL_NIF_LATIN1);
+                        return false;
+                    }
+
+                    tensor_t out = *shaped;
+                    out.type = plan.type;
+                    out.bit_type = plan.bit_type;
+                    if(!same_type(&out, shaped)) {
+                        out.type_term = make_type(env, out.type, out.bit_type);
+                    }
+                    /*
+                     * Each element of the output is written after all the inputs
+                     * of the element are read, so the output may be an input
+                     * of the full size which is owned.
+                     */
+                    unsigned reused = inputs;
+                    for(unsigned i = 0; i < inputs; i++) {
+                        if(reusable(&stack[stack_idx + i].tensor, &out)) {
+                            reused = i;
+                            break;
+                        }
+                    }
+                    if(reused < inputs) {
+                        out.storage = stack[stack_idx + reused].tensor.storage;
+                        out.buffer = stack[stack_idx + reused].tensor.buffer;
+                        out.data = stack[stack_idx + reused].tensor.data;
+                        out.offset = stack[stack_idx + reused].tensor.offset;
+                    } else if(__builtin_expect(!alloc_tensor_data(env, &out), false)) {
+                        *reason = enif_make_string(env, "Fail to alloc memory in case of fuse", ERL_NIF_LATIN1);
+                        return false;
+                    }
+                    error = fuse_run(&plan, out.size, out.data);
+                    if(__builtin_expect(error != NULL, false)) {
+                        *reason = enif_make_string(env, error, ERL_NIF_LATIN1);
+                        return false;
+                    }
+                    for(unsigned i = 0; i < inputs; i++) {
+                        if(i != reused) {
+                            release_entry(&stack[stack_idx + i]);
+                        }
+                    }
+                    for(unsigned i = 1; i < inputs; i++) {
+                        stack[stack_idx + i].type = type_undefined;
+                    }
+                    stack[stack_idx].type = type_tensor;
+                    stack[stack_idx].tensor = out;
+                    stack_idx++;
+                    pc += length;
+                }
+                NEXT();
+
+            TARGET(HANDLER_STORE):
+                {
+                    /*
+                     * Pops the stack top into the local of the operand,
+                     * so that a value used many times is computed once.
+                     */
+                    stack_idx--;
+                    release_entry(&locals[code_p->operand.uint]);
+                    locals[code_p->operand.uint] = stack[stack_idx];
+                    stack[stack_idx].type = type_undefined;
+                }
+                NEXT();
+
+            TARGET(HANDLER_TEE):
+                {
+                    /*
+                     * Copies the stack top into the local of the operand of store,
+                     * which dup and store do, sharing the data like load.
+                     */
+                    release_entry(&locals[code_p->operand.uint]);
+                    locals[code_p->operand.uint] = stack[stack_idx - 1];
+                    retain_entry(&locals[code_p->operand.uint]);
+                }
+                NEXT();
+
+            TARGET(HANDLER_LOAD):
+                {
+                    /*
+                     * Pushes the local of the operand.
+                     *
+                     * The local and the pushed value share the data,
+                     * so neither of them is overwritten in place.
+                     */
+                    if(__builtin_expect(locals[code_p->operand.uint].type == type_undefined, false)) {
+                        *reason = enif_make_string(env, "the local should be stored before load", ERL_NIF_LATIN1);
+                        return false;
+                    }
+                    stack[stack_idx] = locals[code_p->operand.uint];
+                    retain_entry(&stack[stack_idx]);
+                    stack_idx++;
+                }
+                NEXT();
+
+            TARGET(HANDLER_TAKE):
+                {
+                    /*
+                     * Moves the local of the operand to the stack,
+                     * at the last use of the local,
+                     * so that the next instruction may overwrite it in place.
+                     */
+                    if(__builtin_expect(locals[code_p->operand.uint].type == type_undefined, false)) {
+                        *reason = enif_make_string(env, "the local should be stored before take", ERL_NIF_LATIN1);
+                        return false;
+                    }
+                    stack[stack_idx] = locals[code_p->operand.uint];
+                    locals[code_p->operand.uint].type = type_undefined;
+                    stack_idx++;
+                }
+                NEXT();
+
+            default:
+                {
+                    *reason = enif_make_string(env, "unexpected", ERL_NIF_LATIN1);
+                    return false;
+                }
+        }
+        RECORD();
+    }
+
+#undef FETCH
+#undef RECORD
+#undef TARGET
+#undef NEXT
+}
+
+/*
+ * Runs a program with an arena, which owns the intermediate buffers
+ * and returns them to the pool at once when the program ends.
+ *
+ * The operand stack is on the native stack up to INLINE_STACK_BYTES,
+ * and allocated if the program is deeper.
+ */
+bool execute(ErlNifEnv *env, program_t *program, ERL_NIF_TERM *args, unsigned arg_length, p_stack_t *locals, reply_t *reply, ERL_NIF_TERM *reason)
+{
+    p_stack_t inline_stack[INLINE_STACK_BYTES / sizeof(p_stack_t)];
+    p_stack_t *stack = inline_stack;
+    if(program->max_stack > sizeof(inline_stack) / sizeof(p_stack_t)) {
+        stack = enif_alloc(sizeof(p_stack_t) * program->max_stack);
+        if(__builtin_expect(stack == NULL, false)) {
+            *reason = enif_make_string(env, "Fail to alloc memory", ERL_NIF_LATIN1);
+            return false;
+        }
+    }
+
+    buffer_arena_t arena;
+    buffer_arena_init(&arena);
+    buffer_arena_t *outer = current_arena;
+    current_arena = &arena;
+    bool ok = run(env, program, args, arg_length, stack, locals, reply, reason);
+    current_arena = outer;
+    buffer_arena_release(&arena);
+
+    if(stack != inline_stack) {
+        enif_free(stack);
+    }
+    return ok;
+}
+
+/*
+ * The bytes of the elements of the tensor arguments, rather than of their storage,
+ * since a view may broadcast a few bytes to a tensor which the program gathers.
+ * The total saturates, and get_tensor rejects the tuples which overflow.
+ *
+ * If the program is superlinear, the bytes of each matrix are weighted by
+ * its smaller dimension, since gemm of m x k by k x n matrices does
+ * m * n * k multiply-adds, which is the bytes of either times k if it is square.
+ * gemv and the others do work linear in the bytes, which are not weighted.
+ */
+ErlNifUInt64 args_byte_size(ErlNifEnv *env, ERL_NIF_TERM list, const program_t *program)
+{
+    ErlNifUInt64 total = 0;
+    ERL_NIF_TERM head, tail = list;
+    while(enif_get_list_cell(env, tail, &head, &tail)) {
+        int arity;
+        const ERL_NIF_TERM *array;
+        tensor_t tensor;
+        if(!enif_get_tuple(env, head, &arity, &array)
+            || (arity != 4 && arity != 5)
+            || !enif_get_uint64(env, array[0], &tensor.size)
+            || !get_type(env, array[2], &tensor.type, &tensor.bit_type)) {
+            continue;
+        }
+        ErlNifUInt64 weight = 1;
+        int rank;
+        const ERL_NIF_TERM *dims;
+        ErlNifUInt64 rows, columns;
+        if(program->superlinear
+            && enif_get_tuple(env, array[1], &rank, &dims)
+            && rank >= 2
+            && enif_get_uint64(env, dims[rank - 2], &rows)
+            && enif_get_uint64(env, dims[rank - 1], &columns)) {
+            weight = rows < columns ? rows : columns;
+        }
+        ErlNifUInt64 bytes;
+        if(__builtin_mul_overflow(tensor.size, tensor_element_size(&tensor), &bytes)
+            || __builtin_mul_overflow(bytes, weight, &bytes)
+            || __builtin_add_overflow(total, bytes, &total)) {
+            return UINT64_MAX;
+        }
+    }
+    return total;
+}
+
+/*
+ * Unpins the buffers which pin_args has pinned, of which the first num_donated
+ * are those which it has made writable, and only they are made read only again.
+ */
+void unpin_args(buffer_t **pinned, unsigned num_pinned, unsigned num_donated)
+{
+    for(unsigned i = 0; i < num_pinned; i++) {
+        if(i < num_donated) {
+            pinned[i]->writable = false;
+            pinned[i]->refs = 0;
+        }
+        buffer_unpin(pinned[i]);
+    }
+}
+
+/*
+ * Pins the buffers of the tensor arguments, so that they are not
+ * deallocated while the program reads them.
+ *
+ * The buffer of an argument with :donate is writable during the execution,
+ * so that the program may compute in place over it, unless a binary refers
+ * to it or another execution pins it. The caller should not use the donated
+ * tensor afterwards, and the program should load it only once.
+ *
+ * Donation is decided after all the buffers are pinned, so that a buffer
+ * which appears more than once in the arguments is pinned more than once,
+ * and is not donated.
+ *
+ * Returns the number of the pinned buffers in pinned, the first num_donated of
+ * which are the donated ones, or false if any of them has been deallocated.
+ */
+bool pin_args(ErlNifEnv *env, ERL_NIF_TERM *args, unsigned arg_length, buffer_t **pinned, unsigned *num_pinned, unsigned *num_donated)
+{
+    *num_pinned = 0;
+    *num_donated = 0;
+    for(unsigned i = 0; i < arg_length; i++) {
+        int arity;
+        const ERL_NIF_TERM *array;
+        buffer_t *buffer;
+        if(!enif_get_tuple(env, args[i], &arity, &array)
+            || (arity != 4 && arity != 5)
+            || !buffer_get(env, array[3], &buffer)) {
+            continue;
+        }
+        if(__builtin_expect(!buffer_pin(buffer), false)) {
+            unpin_args(pinned, *num_pinned, 0);
+            *num_pinned = 0;
+            return false;
+        }
+        pinned[(*num_pinned)++] = buffer;
+    }
+    for(unsigned i = 0; i < arg_length; i++) {
+        int arity;
+        const ERL_NIF_TERM *array;
+        buffer_t *buffer;
+        if(!enif_get_tuple(env, args[i], &arity, &array)
+            || arity != 5
+            || !enif_is_identical(array[4], atom_donate)
+            || !buffer_get(env, array[3], &buffer)
+            || atomic_load(&buffer->exposed)
+            || atomic_load(&buffer->pins) != 1) {
+            continue;
+        }
+        // The buffer is pinned once, so it is once in pinned, which moves to the donated ones.
+        for(unsigned j = *num_donated; j < *num_pinned; j++) {
+            if(pinned[j] == buffer) {
+                pinned[j] = pinned[*num_donated];
+                pinned[(*num_donated)++] = buffer;
+                buffer->writable = true;
+                buffer->refs = 0;
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * Executes a program with the list of arg_length arguments, and returns
+ * {:ok, results}, or :ok if the reply has the pid, or {:error, reason}.
+ *
+ * args and pinned should have room for the arguments, and locals for
+ * the locals of the program, which are cleared here.
+ */
+static ERL_NIF_TERM execute_args(ErlNifEnv *env, program_t *program, ERL_NIF_TERM list, unsigned arg_length, ERL_NIF_TERM *args, buffer_t **pinned, p_stack_t *locals, reply_t *reply)
+{
+    ERL_NIF_TERM tail = list;
+    for(unsigned i = 0; i < arg_length; i++) {
+        enif_get_list_cell(env, tail, &args[i], &tail);
+    }
+    for(unsigned i = 0; i < program->locals; i++) {
+        locals[i].type = type_undefined;
+    }
+    reply->num_outputs = 0;
+
+    ERL_NIF_TERM reason;
+    unsigned num_pinned, num_donated;
+    bool ok;
+    if(pin_args(env, args, arg_length, pinned, &num_pinned, &num_donated)) {
+        ok = execute(env, program, args, arg_length, locals, reply, &reason);
+        unpin_args(pinned, num_pinned, num_donated);
+    } else {
+        ok = false;
+        reason = enif_make_string(env, "the buffer of an argument has been deallocated", ERL_NIF_LATIN1);
+    }
+    if(!ok) {
+        return enif_make_tuple2(env, atom_error, reason);
+    } else if(reply->pid != NULL) {
+        return atom_ok;
+    } else {
+        return enif_make_tuple2(env, atom_ok, enif_make_tuple_from_array(env, reply->outputs, reply->num_outputs));
+    }
+}
+
+/*
+ * Gets the program of a resource, or loads it from the code,
+ * and keeps it until the caller releases it.
+ */
+static program_t *get_program(ErlNifEnv *env, ERL_NIF_TERM term, ERL_NIF_TERM *exception)
+{
+    program_t *program;
+    if(enif_get_resource(env, term, program_resource_type, (void **)&program)) {
+        enif_keep_resource(program);
+        return program;
+    }
+    return load(env, term, exception);
+}
+
+static bool get_storage(ERL_NIF_TERM term, enum storage *storage)
+{
+    if(enif_is_identical(term, atom_binary)) {
+        *storage = storage_binary;
+    } else if(enif_is_identical(term, atom_buffer)) {
+        *storage = storage_buffer;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Runs the program which the caller keeps, and releases it.
+static ERL_NIF_TERM execute_engine_program(ErlNifEnv *env, program_t *program, const ERL_NIF_TERM argv[])
+{
+    unsigned arg_length;
+    if(__builtin_expect(!enif_get_list_length(env, argv[1], &arg_length), false)) {
+        enif_release_resource(program);
+        return enif_make_badarg(env);
+    }
+
+    /*
+     * The results are returned if the third argument is :return,
+     * or sent to it if it is a pid.
+     */
+    reply_t reply = {.pid = NULL, .num_outputs = 0};
+    ErlNifPid pid;
+    if(enif_get_local_pid(env, argv[2], &pid)) {
+        reply.pid = &pid;
+    } else if(__builtin_expect(!enif_is_identical(argv[2], atom_return), false)) {
+        enif_release_resource(program);
+        return enif_make_badarg(env);
+    }
+    if(__builtin_expect(!get_storage(argv[3], &reply.storage), false)) {
+        enif_release_resource(program);
+        return enif_make_badarg(env);
+    }
+
+    ERL_NIF_TERM *args = enif_alloc(sizeof(ERL_NIF_TERM) * (arg_length > 0 ? arg_length : 1));
+    p_stack_t *locals = enif_alloc(sizeof(p_stack_t) * (program->locals > 0 ? program->locals : 1));
+    buffer_t **pinned = enif_alloc(sizeof(buffer_t *) * (arg_length > 0 ? arg_length : 1));
+    reply.outputs = enif_alloc(sizeof(ERL_NIF_TERM) * (program->sends > 0 ? program->sends : 1));
+    ERL_NIF_TERM result;
+    if(__builtin_expect(args == NULL || locals == NULL || pinned == NULL || reply.outputs == NULL, false)) {
+        result = raise_exception(env, "Fail to alloc memory");
     } else {
-        enif_free(code);
-        return enif_make_tuple2(env, enif_make_atom(env, "error"), reason);
+        result = execute_args(env, program, argv[1], arg_length, args, pinned, locals, &reply);
+    }
+    if(reply.outputs != NULL) {
+        enif_free(reply.outputs);
+    }
+    if(pinned != NULL) {
+        enif_free(pinned);
     }
+    if(locals != NULL) {
+        enif_free(locals);
+    }
+    if(args != NULL) {
+        enif_free(args);
+    }
+    enif_release_resource(program);
+    return result;
+}
+
+static ERL_NIF_TERM execute_engine_dirty(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    program_t *program;
+    ERL_NIF_TERM exception;
+    if(__builtin_expect((program = get_program(env, argv[0], &exception)) == NULL, false)) {
+        return exception;
+    }
+    return execute_engine_program(env, program, argv);
+}
+
+static ERL_NIF_TERM execute_engine(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    if(__builtin_expect(argc != 4, false)) {
+        return enif_make_badarg(env);
+    }
+
+    program_t *program;
+    ERL_NIF_TERM exception;
+    if(__builtin_expect((program = get_program(env, argv[0], &exception)) == NULL, false)) {
+        return exception;
+    }
+
+    /*
+     * Large tensors go to a dirty CPU scheduler, so that BLAS sweeps over
+     * them do not stall the other processes on this scheduler.
+     * Small ones run here and report the share of the timeslice they used.
+     * The dirty NIF is given the program loaded here as a resource.
+     */
+    ErlNifUInt64 bytes = args_byte_size(env, argv[1], program);
+    if(bytes >= DIRTY_THRESHOLD_BYTES) {
+        ERL_NIF_TERM dirty_argv[] = {enif_make_resource(env, program), argv[1], argv[2], argv[3]};
+        enif_release_resource(program);
+        return enif_schedule_nif(env, "execute_engine_dirty", ERL_NIF_DIRTY_JOB_CPU_BOUND, execute_engine_dirty, argc, dirty_argv);
+    }
+
+    ERL_NIF_TERM result = execute_engine_program(env, program, argv);
+
+    int percent = (int)(bytes * 100 / DIRTY_THRESHOLD_BYTES);
+    enif_consume_timeslice(env, percent > 0 ? percent : 1);
+    return result;
+}
+
+// Runs the program which the caller keeps over the batch, and releases it.
+static ERL_NIF_TERM execute_engine_batch_program(ErlNifEnv *env, program_t *program, const ERL_NIF_TERM argv[])
+{
+    // The lists of the arguments are checked before any runs.
+    unsigned num_sets;
+    unsigned max_length = 0;
+    if(__builtin_expect(!enif_get_list_length(env, argv[1], &num_sets), false)) {
+        enif_release_resource(program);
+        return enif_make_badarg(env);
+    }
+    ERL_NIF_TERM head, tail = argv[1];
+    while(enif_get_list_cell(env, tail, &head, &tail)) {
+        unsigned arg_length;
+        if(__builtin_expect(!enif_get_list_length(env, head, &arg_length), false)) {
+            enif_release_resource(program);
+            return enif_make_badarg(env);
+        }
+        if(arg_length > max_length) {
+            max_length = arg_length;
+        }
+    }
+
+    reply_t reply = {.pid = NULL, .num_outputs = 0};
+    if(__builtin_expect(!get_storage(argv[2], &reply.storage), false)) {
+        enif_release_resource(program);
+        return enif_make_badarg(env);
+    }
+
+    /*
+     * The sets run one after another on the memory allocated once here,
+     * while the intermediates of each run go back to the pool of this thread
+     * for the next one.
+     */
+    ERL_NIF_TERM *args = enif_alloc(sizeof(ERL_NIF_TERM) * (max_length > 0 ? max_length : 1));
+    p_stack_t *locals = enif_alloc(sizeof(p_stack_t) * (program->locals > 0 ? program->locals : 1));
+    buffer_t **pinned = enif_alloc(sizeof(buffer_t *) * (max_length > 0 ? max_length : 1));
+    reply.outputs = enif_alloc(sizeof(ERL_NIF_TERM) * (program->sends > 0 ? program->sends : 1));
+    ERL_NIF_TERM *results = enif_alloc(sizeof(ERL_NIF_TERM) * (num_sets > 0 ? num_sets : 1));
+    ERL_NIF_TERM result;
+    if(__builtin_expect(args == NULL || locals == NULL || pinned == NULL || reply.outputs == NULL || results == NULL, false)) {
+        result = raise_exception(env, "Fail to alloc memory");
+    } else {
+        tail = argv[1];
+        for(unsigned i = 0; i < num_sets; i++) {
+            unsigned arg_length;
+            enif_get_list_cell(env, tail, &head, &tail);
+            enif_get_list_length(env, head, &arg_length);
+            results[i] = execute_args(env, program, head, arg_length, args, pinned, locals, &reply);
+        }
+        result = enif_make_list_from_array(env, results, num_sets);
+    }
+    if(results != NULL) {
+        enif_free(results);
+    }
+    if(reply.outputs != NULL) {
+        enif_free(reply.outputs);
+    }
+    if(pinned != NULL) {
+        enif_free(pinned);
+    }
+    if(locals != NULL) {
+        enif_free(locals);
+    }
+    if(args != NULL) {
+        enif_free(args);
+    }
+    enif_release_resource(program);
+    return result;
+}
+
+static ERL_NIF_TERM execute_engine_batch_dirty(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    program_t *program;
+    ERL_NIF_TERM exception;
+    if(__builtin_expect((program = get_program(env, argv[0], &exception)) == NULL, false)) {
+        return exception;
+    }
+    return execute_engine_batch_program(env, program, argv);
+}
+
+/*
+ * Runs a program over each of a list of argument lists in this call,
+ * and returns the list of {:ok, results} or {:error, reason} in order.
+ * A failing set does not stop the ones after it.
+ */
+static ERL_NIF_TERM execute_engine_batch(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    if(__builtin_expect(argc != 3, false)) {
+        return enif_make_badarg(env);
+    }
+
+    program_t *program;
+    ERL_NIF_TERM exception;
+    if(__builtin_expect((program = get_program(env, argv[0], &exception)) == NULL, false)) {
+        return exception;
+    }
+
+    ErlNifUInt64 bytes = 0;
+    unsigned num_sets = 0;
+    ERL_NIF_TERM head, tail = argv[1];
+    while(enif_get_list_cell(env, tail, &head, &tail)) {
+        if(__builtin_add_overflow(bytes, args_byte_size(env, head, program), &bytes)) {
+            bytes = UINT64_MAX;
+        }
+        num_sets++;
+    }
+    if(bytes >= DIRTY_THRESHOLD_BYTES || num_sets > DIRTY_THRESHOLD_BATCH) {
+        ERL_NIF_TERM dirty_argv[] = {enif_make_resource(env, program), argv[1], argv[2]};
+        enif_release_resource(program);
+        return enif_schedule_nif(env, "execute_engine_batch_dirty", ERL_NIF_DIRTY_JOB_CPU_BOUND, execute_engine_batch_dirty, argc, dirty_argv);
+    }
+
+    ERL_NIF_TERM result = execute_engine_batch_program(env, program, argv);
+
+    int percent = (int)(bytes * 100 / DIRTY_THRESHOLD_BYTES) + (int)(num_sets * 100 / DIRTY_THRESHOLD_BATCH);
+    enif_consume_timeslice(env, percent > 100 ? 100 : (percent > 0 ? percent : 1));
+    return result;
+}
+
+/*
+ * A job submitted to the queue, which is a resource so that the caller can refer to it.
+ *
+ * env holds the copies of the arguments and the term of the job for the message,
+ * and is freed when the job finishes. The buffers of the arguments are pinned
+ * while the job waits and runs.
+ */
+typedef struct job {
+    queue_job_t queue;
+    ErlNifEnv *env;
+    program_t *program;
+    ERL_NIF_TERM *args;
+    unsigned arg_length;
+    buffer_t **pinned;
+    unsigned num_pinned;
+    unsigned num_donated;
+    ErlNifPid pid;
+    enum storage storage;
+    ERL_NIF_TERM term;
+} job_t;
+
+static void job_dtor(ErlNifEnv *env, void *obj)
+{
+    job_t *job = (job_t *)obj;
+    if(job->env != NULL) {
+        enif_free_env(job->env);
+    }
+}
+
+// Releases what the job holds, and the reference of the queue to it.
+static void finish_job(job_t *job)
+{
+    unpin_args(job->pinned, job->num_pinned, job->num_donated);
+    enif_free(job->pinned);
+    enif_free(job->args);
+    enif_release_resource(job->program);
+    enif_free_env(job->env);
+    job->env = NULL;
+    enif_release_resource(job);
+}
+
+static void drop_job(queue_job_t *queue_job)
+{
+    finish_job((job_t *)queue_job);
+}
+
+/*
+ * Runs the job on a worker of the queue, and sends the process
+ * {:result, job, results} or {:error, job, reason}
+ */
+static void run_job(queue_job_t *queue_job)
+{
+    job_t *job = (job_t *)queue_job;
+    ErlNifEnv *env = job->env;
+    program_t *program = job->program;
+    reply_t reply = {.pid = NULL, .storage = job->storage, .num_outputs = 0};
+    p_stack_t *locals = enif_alloc(sizeof(p_stack_t) * (program->locals > 0 ? program->locals : 1));
+    reply.outputs = enif_alloc(sizeof(ERL_NIF_TERM) * (program->sends > 0 ? program->sends : 1));
+
+    ERL_NIF_TERM message;
+    if(__builtin_expect(locals == NULL || reply.outputs == NULL, false)) {
+        message = enif_make_tuple3(env, atom_error, job->term, enif_make_string(env, "Fail to alloc memory", ERL_NIF_LATIN1));
+    } else {
+        for(unsigned i = 0; i < program->locals; i++) {
+            locals[i].type = type_undefined;
+        }
+        ERL_NIF_TERM reason;
+        if(execute(env, program, job->args, job->arg_length, locals, &reply, &reason)) {
+            message = enif_make_tuple3(env, atom_result, job->term, enif_make_tuple_from_array(env, reply.outputs, reply.num_outputs));
+        } else {
+            message = enif_make_tuple3(env, atom_error, job->term, reason);
+        }
+    }
+    if(reply.outputs != NULL) {
+        enif_free(reply.outputs);
+    }
+    if(locals != NULL) {
+        enif_free(locals);
+    }
+    /*
+     * enif_send clears env, which holds the only references to the buffers
+     * of the arguments, so that they are unpinned before it.
+     */
+    unpin_args(job->pinned, job->num_pinned, job->num_donated);
+    job->num_pinned = 0;
+    enif_send(NULL, &job->pid, env, message);
+    finish_job(job);
+}
+
+/*
+ * Submits a program with the arguments to the queue, and returns {:ok, job}
+ * without waiting for it. The arguments are the same as execute_engine,
+ * but the third is the pid which receives the result.
+ *
+ * Returns {:error, :queue_full} if the queue is full,
+ * or {:error, reason} if a buffer of the arguments has been deallocated.
+ */
+static ERL_NIF_TERM submit(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    ErlNifPid pid;
+    unsigned arg_length;
+    if(__builtin_expect(
+        argc != 4
+        || !enif_get_local_pid(env, argv[2], &pid)
+        || !enif_get_list_length(env, argv[1], &arg_length)
+        || !(enif_is_identical(argv[3], atom_binary) || enif_is_identical(argv[3], atom_buffer)),
+        false)) {
+        return enif_make_badarg(env);
+    }
+
+    program_t *program;
+    ERL_NIF_TERM exception;
+    if(enif_get_resource(env, argv[0], program_resource_type, (void **)&program)) {
+        enif_keep_resource(program);
+    } else if(__builtin_expect((program = load(env, argv[0], &exception)) == NULL, false)) {
+        return exception;
+    }
+
+    job_t *job = enif_alloc_resource(job_resource_type, sizeof(job_t));
+    if(__builtin_expect(job == NULL, false)) {
+        enif_release_resource(program);
+        return raise_exception(env, "Fail to alloc memory");
+    }
+    job->queue.run = run_job;
+    job->queue.drop = drop_job;
+    job->program = program;
+    job->pid = pid;
+    job->storage = enif_is_identical(argv[3], atom_buffer) ? storage_buffer : storage_binary;
+    job->arg_length = arg_length;
+    job->num_pinned = 0;
+    job->num_donated = 0;
+    job->env = enif_alloc_env();
+    job->args = enif_alloc(sizeof(ERL_NIF_TERM) * (arg_length > 0 ? arg_length : 1));
+    job->pinned = enif_alloc(sizeof(buffer_t *) * (arg_length > 0 ? arg_length : 1));
+    ERL_NIF_TERM term = enif_make_resource(env, job);
+    if(__builtin_expect(job->env == NULL || job->args == NULL || job->pinned == NULL, false)) {
+        if(job->pinned != NULL) {
+            enif_free(job->pinned);
+        }
+        if(job->args != NULL) {
+            enif_free(job->args);
+        }
+        enif_release_resource(program);
+        enif_release_resource(job);
+        return raise_exception(env, "Fail to alloc memory");
+    }
+    job->term = enif_make_resource(job->env, job);
+    ERL_NIF_TERM tail = enif_make_copy(job->env, argv[1]);
+    for(unsigned i = 0; i < arg_length; i++) {
+        enif_get_list_cell(job->env, tail, &job->args[i], &tail);
+    }
+
+    /*
+     * The queue keeps the reference which is made by enif_alloc_resource,
+     * until the job finishes.
+     */
+    ERL_NIF_TERM result;
+    if(__builtin_expect(!pin_args(job->env, job->args, arg_length, job->pinned, &job->num_pinned, &job->num_donated), false)) {
+        result = enif_make_tuple2(env, atom_error, enif_make_string(env, "the buffer of an argument has been deallocated", ERL_NIF_LATIN1));
+        // pin_args has unpinned them.
+        finish_job(job);
+    } else if(__builtin_expect(!queue_push(&job->queue), false)) {
+        result = enif_make_tuple2(env, atom_error, atom_queue_full);
+        finish_job(job);
+    } else {
+        result = enif_make_tuple2(env, atom_ok, term);
+    }
+    return result;
+}
+
+/*
+ * Cancels a submitted job which has not started.
+ *
+ * Returns true if it is cancelled, in which case no message is sent,
+ * or false if it has started.
+ */
+static ERL_NIF_TERM cancel(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    job_t *job;
+    if(__builtin_expect(argc != 1 || !enif_get_resource(env, argv[0], job_resource_type, (void **)&job), false)) {
+        return enif_make_badarg(env);
+    }
+    if(!queue_cancel(&job->queue)) {
+        return atom_false;
+    }
+    finish_job(job);
+    return atom_true;
+}
+
+static ERL_NIF_TERM load_program(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    if(__builtin_expect(argc != 1, false)) {
+        return enif_make_badarg(env);
+    }
+    ERL_NIF_TERM exception;
+    program_t *program = load(env, argv[0], &exception);
+    if(__builtin_expect(program == NULL, false)) {
+        return exception;
+    }
+    ERL_NIF_TERM term = enif_make_resource(env, program);
+    enif_release_resource(program);
+    return term;
+}
+
+static ERL_NIF_TERM make_stats(ErlNifEnv *env, unsigned inst, const stats_values_t *values)
+{
+    return enif_make_tuple5(
+        env,
+        enif_make_uint(env, inst),
+        enif_make_uint64(env, values->executions),
+        enif_make_uint64(env, values->elements),
+        enif_make_uint64(env, values->bytes),
+        enif_make_uint64(env, values->ns));
+}
+
+/*
+ * Returns the list of {opcode, executions, elements, bytes, ns}
+ * of the opcodes which have been executed since the stats were reset.
+ */
+static ERL_NIF_TERM engine_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    ERL_NIF_TERM list = enif_make_list(env, 0);
+    for(unsigned i = STATS_NUM_INSTS; i-- > 0;) {
+        stats_values_t values;
+        unsigned inst = stats_read_inst(i, &values);
+        if(values.executions > 0) {
+            list = enif_make_list_cell(env, make_stats(env, inst, &values), list);
+        }
+    }
+    return list;
+}
+
+static ERL_NIF_TERM reset_engine_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    stats_reset();
+    return atom_ok;
+}
+
+/*
+ * Enables the stats if the argument is true, or disables them otherwise,
+ * and returns whether they were enabled.
+ */
+static ERL_NIF_TERM enable_engine_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    bool enabled = stats_enabled();
+    stats_enable(enif_is_identical(argv[0], atom_true));
+    return enabled ? atom_true : atom_false;
+}
+
+// Returns whether the stats are enabled.
+static ERL_NIF_TERM engine_stats_enabled(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    return stats_enabled() ? atom_true : atom_false;
+}
+
+/*
+ * Returns the list of {opcode, executions, elements, bytes, ns} of
+ * the instructions of the program by pc, since it was loaded.
+ */
+static ERL_NIF_TERM program_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    program_t *program;
+    if(__builtin_expect(!enif_get_resource(env, argv[0], program_resource_type, (void **)&program), false)) {
+        return enif_make_badarg(env);
+    }
+    ERL_NIF_TERM list = enif_make_list(env, 0);
+    for(unsigned pc = program->length; pc-- > 0;) {
+        stats_values_t values;
+        stats_read(&program->stats[pc], &values);
+        list = enif_make_list_cell(env, make_stats(env, program->code[pc].inst, &values), list);
+    }
+    return list;
+}
+
+static ERL_NIF_TERM buffer_from_binary_s(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    ErlNifBinary bin;
+    if(__builtin_expect(!enif_inspect_binary(env, argv[0], &bin), false)) {
+        return enif_make_badarg(env);
+    }
+    buffer_t *buffer = buffer_alloc(bin.size);
+    if(__builtin_expect(buffer == NULL, false)) {
+        return raise_exception(env, "Fail to alloc memory");
+    }
+    memcpy(buffer->data, bin.data, bin.size);
+    ERL_NIF_TERM term = enif_make_resource(env, buffer);
+    enif_release_resource(buffer);
+    return term;
+}
+
+static ERL_NIF_TERM buffer_from_binary(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    if(__builtin_expect(argc != 1, false)) {
+        return enif_make_badarg(env);
+    }
+    ErlNifBinary bin;
+    if(enif_inspect_binary(env, argv[0], &bin) && bin.size >= DIRTY_THRESHOLD_BYTES) {
+        return enif_schedule_nif(env, "buffer_from_binary_dirty", ERL_NIF_DIRTY_JOB_CPU_BOUND, buffer_from_binary_s, argc, argv);
+    }
+    return buffer_from_binary_s(env, argc, argv);
+}
+
+static ERL_NIF_TERM buffer_to_binary_s(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    buffer_t *buffer;
+    if(__builtin_expect(!buffer_get(env, argv[0], &buffer), false)) {
+        return enif_make_badarg(env);
+    }
+    if(__builtin_expect(!buffer_pin(buffer), false)) {
+        return raise_exception(env, "the buffer has been deallocated");
+    }
+    ERL_NIF_TERM term;
+    unsigned char *data = enif_make_new_binary(env, buffer->size, &term);
+    if(__builtin_expect(data == NULL, false)) {
+        buffer_unpin(buffer);
+        return raise_exception(env, "Fail to alloc memory");
+    }
+    memcpy(data, buffer->data, buffer->size);
+    buffer_unpin(buffer);
+    return term;
+}
+
+static ERL_NIF_TERM buffer_to_binary(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    if(__builtin_expect(argc != 1, false)) {
+        return enif_make_badarg(env);
+    }
+    buffer_t *buffer;
+    if(buffer_get(env, argv[0], &buffer) && buffer->size >= DIRTY_THRESHOLD_BYTES) {
+        return enif_schedule_nif(env, "buffer_to_binary_dirty", ERL_NIF_DIRTY_JOB_CPU_BOUND, buffer_to_binary_s, argc, argv);
+    }
+    return buffer_to_binary_s(env, argc, argv);
+}
+
+static ERL_NIF_TERM buffer_deallocate_nif(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    buffer_t *buffer;
+    if(__builtin_expect(argc != 1 || !buffer_get(env, argv[0], &buffer), false)) {
+        return enif_make_badarg(env);
+    }
+    return buffer_deallocate(buffer) ? atom_ok : atom_already_deallocated;
+}
+
+static int open_resource_types(ErlNifEnv *env, ErlNifResourceFlags flags)
+{
+    program_resource_type = enif_open_resource_type(env, NULL, "program", program_dtor, flags, NULL);
+    if(program_resource_type == NULL) {
+        return -1;
+    }
+    job_resource_type = enif_open_resource_type(env, NULL, "job", job_dtor, flags, NULL);
+    if(job_resource_type == NULL) {
+        return -1;
+    }
+    if(buffer_open_resource_type(env, flags) != 0) {
+        return -1;
+    }
+
+    atom_ok = enif_make_atom(env, "ok");
+    atom_error = enif_make_atom(env, "error");
+    atom_result = enif_make_atom(env, "result");
+    atom_if = enif_make_atom(env, "if");
+    atom_true = enif_make_atom(env, "true");
+    atom_false = enif_make_atom(env, "false");
+    atom_s = enif_make_atom(env, "s");
+    atom_u = enif_make_atom(env, "u");
+    atom_f = enif_make_atom(env, "f");
+    atom_bf = enif_make_atom(env, "bf");
+    atom_c = enif_make_atom(env, "c");
+    atom_binary = enif_make_atom(env, "binary");
+    atom_buffer = enif_make_atom(env, "buffer");
+    atom_already_deallocated = enif_make_atom(env, "already_deallocated");
+    atom_return = enif_make_atom(env, "return");
+    atom_donate = enif_make_atom(env, "donate");
+    atom_threads = enif_make_atom(env, "threads");
+    atom_blas_threads = enif_make_atom(env, "blas_threads");
+    atom_queue_workers = enif_make_atom(env, "queue_workers");
+    atom_queue_depth = enif_make_atom(env, "queue_depth");
+    atom_queue_full = enif_make_atom(env, "queue_full");
+    atom_stats = enif_make_atom(env, "stats");
+    return 0;
+}
+
+static unsigned get_load_info(ErlNifEnv *env, ERL_NIF_TERM load_info, ERL_NIF_TERM key, unsigned default_value)
+{
+    ERL_NIF_TERM term;
+    unsigned value;
+    if(enif_get_map_value(env, load_info, key, &term) && enif_get_uint(env, term, &value)) {
+        return value;
+    }
+    return default_value;
+}
+
+/*
+ * Starts the pool and the queue of submitted jobs, and limits the threads of
+ * OpenBLAS by the load info:
+ * %{threads: threads, blas_threads: blas_threads, queue_workers: workers, queue_depth: depth}
+ *
+ * BLAS runs on the calling thread while the workers of the pool sleep,
+ * so the two pools do not run at once in an execution.
+ *
+ * An upgrade from the same image shares the running pool and queue
+ * with the old instance, and the unload of the last instance stops them.
+ */
+static int start_threads(ErlNifEnv *env, ERL_NIF_TERM load_info)
+{
+    unsigned blas_threads = get_load_info(env, load_info, atom_blas_threads, 1);
+    openblas_set_num_threads(blas_threads > 0 ? (int)blas_threads : 1);
+    if(pool_start(get_load_info(env, load_info, atom_threads, 1)) != 0) {
+        return -1;
+    }
+    if(queue_start(get_load_info(env, load_info, atom_queue_workers, 1), get_load_info(env, load_info, atom_queue_depth, 64)) != 0) {
+        pool_stop();
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Enables the stats if the load info has stats: true.
+ */
+static void configure_stats(ErlNifEnv *env, ERL_NIF_TERM load_info)
+{
+    ERL_NIF_TERM term;
+    stats_enable(enif_get_map_value(env, load_info, atom_stats, &term) && enif_is_identical(term, atom_true));
+}
+
+static int load_nif(ErlNifEnv *env, void **priv_data, ERL_NIF_TERM load_info)
+{
+    if(open_resource_types(env, ERL_NIF_RT_CREATE) != 0) {
+        return -1;
+    }
+    configure_stats(env, load_info);
+    return start_threads(env, load_info);
+}
+
+static int upgrade_nif(ErlNifEnv *env, void **priv_data, void **old_priv_data, ERL_NIF_TERM load_info)
+{
+    if(open_resource_types(env, ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER) != 0) {
+        return -1;
+    }
+    configure_stats(env, load_info);
+    return start_threads(env, load_info);
+}
+
+static void unload_nif(ErlNifEnv *env, void *priv_data)
+{
+    queue_stop();
+    pool_stop();
 }
 
 static ErlNifFunc nif_funcs [] =
 {
-    {"execute_engine", 3, execute_engine}
+    {"execute_engine", 4, execute_engine},
+    {"execute_engine_batch", 3, execute_engine_batch},
+    {"submit", 4, submit},
+    {"cancel", 1, cancel},
+    {"load_program", 1, load_program},
+    {"engine_stats", 0, engine_stats},
+    {"reset_engine_stats", 0, reset_engine_stats},
+    {"enable_engine_stats", 1, enable_engine_stats},
+    {"engine_stats_enabled", 0, engine_stats_enabled},
+    {"program_stats", 1, program_stats},
+    {"buffer_from_binary", 1, buffer_from_binary},
+    {"buffer_to_binary", 1, buffer_to_binary},
+    {"buffer_deallocate", 1, buffer_deallocate_nif}
 };
 
-ERL_NIF_INIT(Elixir.PelemayBackend.NIF, nif_funcs, NULL, NULL, NULL, NULL)
\ No newline at end of file
+ERL_NIF_INIT(Elixir.PelemayBackend.NIF, nif_funcs, load_nif, NULL, upgrade_nif, unload_nif)
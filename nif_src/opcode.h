@@ -14,6 +14,49 @@ enum instruction {
     INST_COPY = 0x2,
     INST_DOT = 0x3,
     INST_AXPY = 0x4,
+    INST_AXPBY = 0x5,
+    INST_ADD = 0x100,
+    INST_SUBTRACT = 0x101,
+    INST_MULTIPLY = 0x102,
+    INST_DIVIDE = 0x103,
+    INST_POWER = 0x104,
+    INST_REMAINDER = 0x105,
+    INST_ATAN2 = 0x106,
+    INST_MIN = 0x107,
+    INST_MAX = 0x108,
+    INST_QUOTIENT = 0x109,
+    INST_BITWISE_AND = 0x10A,
+    INST_BITWISE_OR = 0x10B,
+    INST_BITWISE_XOR = 0x10C,
+    INST_LEFT_SHIFT = 0x10D,
+    INST_RIGHT_SHIFT = 0x10E,
+    INST_EQUAL = 0x10F,
+    INST_NOT_EQUAL = 0x110,
+    INST_GREATER = 0x111,
+    INST_LESS = 0x112,
+    INST_GREATER_EQUAL = 0x113,
+    INST_LESS_EQUAL = 0x114,
+    INST_LOGICAL_AND = 0x115,
+    INST_LOGICAL_OR = 0x116,
+    INST_LOGICAL_XOR = 0x117,
+    INST_EXP = 0x200,
+    INST_LOG = 0x201,
+    INST_LOG1P = 0x202,
+    INST_SIGMOID = 0x203,
+    INST_TANH = 0x204,
+    INST_ERF = 0x205,
+    INST_SQRT = 0x206,
+    INST_RSQRT = 0x207,
+    INST_ABS = 0x208,
+    INST_SUM = 0x300,
+    INST_PRODUCT = 0x301,
+    INST_REDUCE_MAX = 0x302,
+    INST_REDUCE_MIN = 0x303,
+    INST_ARGMAX = 0x304,
+    INST_ARGMIN = 0x305,
+    INST_ALL = 0x306,
+    INST_ANY = 0x307,
+    INST_AS_TYPE = 0x400,
     INST_GEMV = 0x1000,
     INST_GEMM = 0x2000,
     INST_ALOADT = 0x8000,
@@ -26,6 +69,10 @@ enum instruction {
     INST_POP2 = 0x8007,
     INST_SWAP = 0x8008,
     INST_SENDE = 0x8009,
+    INST_STORE = 0x800A,
+    INST_LOAD = 0x800B,
+    INST_FUSE = 0x800C,
+    INST_TAKE = 0x800D,
 };
 
 
@@ -55,4 +102,15 @@ enum bit_type_binary {
   btb_c64 = 2,
   btb_c128 = 3,
 };
+
+enum transpose_flag {
+  TRANSPOSE_A = 0x1,
+  TRANSPOSE_B = 0x2,
+};
+
+enum reduce_flag {
+  REDUCE_AXES_MASK = 0xFF,
+  REDUCE_KEEP_AXES = 0x100,
+  REDUCE_TIE_BREAK_HIGH = 0x200,
+};
 #endif // PELEMAY_ENGINE_OPCODE_H
@@ -0,0 +1,217 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <erl_nif.h>
+
+#include "pool.h"
+
+// A slot of the chunks of a participant, which is on its own cache line.
+typedef struct slot {
+    atomic_size_t next;
+    size_t end;
+    char padding[64 - sizeof(atomic_size_t) - sizeof(size_t)];
+} slot_t;
+
+typedef struct job {
+    pool_task_t task;
+    void *arg;
+    size_t n;
+    size_t grain;
+    unsigned participants;
+    atomic_bool failed;
+    slot_t slots[POOL_MAX_THREADS];
+} job_t;
+
+/*
+ * lock protects job, generation, running and stopping.
+ * submit is held by the caller whose job is running.
+ * instances is the number of the loaded instances of the module which share
+ * the pool, which only load, upgrade and unload change one at a time.
+ */
+static struct {
+    ErlNifMutex *lock;
+    ErlNifMutex *submit;
+    ErlNifCond *wake;
+    ErlNifCond *done;
+    job_t *job;
+    unsigned generation;
+    unsigned running;
+    bool stopping;
+    unsigned instances;
+    unsigned workers;
+    ErlNifTid tids[POOL_MAX_THREADS];
+} pool;
+
+static void run_chunk(job_t *job, size_t chunk)
+{
+    size_t begin = chunk * job->grain;
+    size_t end = begin + job->grain < job->n ? begin + job->grain : job->n;
+    if(__builtin_expect(!job->task(job->arg, begin, end), false)) {
+        atomic_store(&job->failed, true);
+    }
+}
+
+// Runs the chunks of the slot of self, and then steals those of the others.
+static void participate(job_t *job, unsigned self)
+{
+    for(unsigned i = 0; i < job->participants; i++) {
+        slot_t *slot = &job->slots[(self + i) % job->participants];
+        size_t chunk;
+        while((chunk = atomic_fetch_add(&slot->next, 1)) < slot->end) {
+            run_chunk(job, chunk);
+        }
+    }
+}
+
+static void *worker(void *arg)
+{
+    unsigned self = (unsigned)(size_t)arg;
+    unsigned seen = 0;
+    enif_mutex_lock(pool.lock);
+    for(;;) {
+        while(!pool.stopping && pool.generation == seen) {
+            enif_cond_wait(pool.wake, pool.lock);
+        }
+        if(pool.stopping) {
+            break;
+        }
+        seen = pool.generation;
+        job_t *job = pool.job;
+        enif_mutex_unlock(pool.lock);
+
+        if(self < job->participants) {
+            participate(job, self);
+        }
+
+        enif_mutex_lock(pool.lock);
+        if(--pool.running == 0) {
+            enif_cond_signal(pool.done);
+        }
+    }
+    enif_mutex_unlock(pool.lock);
+    return NULL;
+}
+
+int pool_start(unsigned threads)
+{
+    // An upgrade from the same image keeps the running pool and its workers.
+    if(pool.instances > 0) {
+        pool.instances++;
+        return 0;
+    }
+    pool.workers = 0;
+    pool.generation = 0;
+    pool.running = 0;
+    pool.stopping = false;
+    pool.lock = enif_mutex_create("pelemay_pool_lock");
+    pool.submit = enif_mutex_create("pelemay_pool_submit");
+    pool.wake = enif_cond_create("pelemay_pool_wake");
+    pool.done = enif_cond_create("pelemay_pool_done");
+    if(pool.lock == NULL || pool.submit == NULL || pool.wake == NULL || pool.done == NULL) {
+        pool_stop();
+        return -1;
+    }
+    if(threads > POOL_MAX_THREADS) {
+        threads = POOL_MAX_THREADS;
+    }
+    // The worker of id 0 is the caller.
+    for(unsigned id = 1; id < threads; id++) {
+        ErlNifThreadOpts *opts = enif_thread_opts_create("pelemay_pool_opts");
+        int failed = enif_thread_create("pelemay_pool", &pool.tids[id - 1], worker, (void *)(size_t)id, opts);
+        if(opts != NULL) {
+            enif_thread_opts_destroy(opts);
+        }
+        if(failed != 0) {
+            break;
+        }
+        pool.workers++;
+    }
+    pool.instances = 1;
+    return 0;
+}
+
+void pool_stop(void)
+{
+    if(pool.instances > 1) {
+        pool.instances--;
+        return;
+    }
+    pool.instances = 0;
+    if(pool.lock != NULL) {
+        enif_mutex_lock(pool.lock);
+        pool.stopping = true;
+        enif_cond_broadcast(pool.wake);
+        enif_mutex_unlock(pool.lock);
+    }
+    for(unsigned i = 0; i < pool.workers; i++) {
+        enif_thread_join(pool.tids[i], NULL);
+    }
+    pool.workers = 0;
+    if(pool.done != NULL) {
+        enif_cond_destroy(pool.done);
+        pool.done = NULL;
+    }
+    if(pool.wake != NULL) {
+        enif_cond_destroy(pool.wake);
+        pool.wake = NULL;
+    }
+    if(pool.submit != NULL) {
+        enif_mutex_destroy(pool.submit);
+        pool.submit = NULL;
+    }
+    if(pool.lock != NULL) {
+        enif_mutex_destroy(pool.lock);
+        pool.lock = NULL;
+    }
+}
+
+unsigned pool_threads(void)
+{
+    return pool.workers + 1;
+}
+
+bool pool_run(size_t n, size_t grain, pool_task_t task, void *arg)
+{
+    if(grain == 0) {
+        grain = 1;
+    }
+    size_t chunks = n / grain + (n % grain != 0);
+    if(pool.workers == 0 || chunks <= 1 || enif_mutex_trylock(pool.submit) != 0) {
+        return n == 0 || task(arg, 0, n);
+    }
+
+    job_t job = {.task = task, .arg = arg, .n = n, .grain = grain};
+    job.participants = chunks < pool.workers + 1 ? (unsigned)chunks : pool.workers + 1;
+    atomic_init(&job.failed, false);
+    for(unsigned i = 0; i < job.participants; i++) {
+        atomic_init(&job.slots[i].next, chunks * i / job.participants);
+        job.slots[i].end = chunks * (i + 1) / job.participants;
+    }
+
+    enif_mutex_lock(pool.lock);
+    pool.job = &job;
+    pool.generation++;
+    pool.running = pool.workers;
+    enif_cond_broadcast(pool.wake);
+    enif_mutex_unlock(pool.lock);
+
+    participate(&job, 0);
+
+    // The job is on the stack, so it waits for all the workers to leave it.
+    enif_mutex_lock(pool.lock);
+    while(pool.running > 0) {
+        enif_cond_wait(pool.done, pool.lock);
+    }
+    pool.job = NULL;
+    enif_mutex_unlock(pool.lock);
+    enif_mutex_unlock(pool.submit);
+    return !atomic_load(&job.failed);
+}
+
+size_t pool_grain(size_t n, size_t element_size)
+{
+    if(n * element_size < POOL_THRESHOLD_BYTES) {
+        return n;
+    }
+    return POOL_CHUNK_BYTES / element_size;
+}
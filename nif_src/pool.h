@@ -0,0 +1,75 @@
+#ifndef PELEMAY_ENGINE_POOL_H
+#define PELEMAY_ENGINE_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A pool of worker threads which run large kernels chunk by chunk
+ * together with the calling thread.
+ *
+ * A job of n items is split into chunks of grain items, which are dealt
+ * evenly to the participants in advance. Each participant takes the chunks
+ * of its own from the front, and then steals those of the others, so that
+ * a participant which is delayed by the OS or the BEAM does not hold up
+ * the job.
+ *
+ * One job runs at a time. A caller which finds the pool busy runs its job
+ * on its own thread, so that concurrent executions do not oversubscribe
+ * the cores.
+ */
+
+#define POOL_MAX_THREADS 64
+
+/*
+ * The size of the data which a chunk of an elementwise kernel reads or writes
+ * per operand, which keeps the operands of a chunk in the L2 cache.
+ */
+#define POOL_CHUNK_BYTES ((size_t)1 << 16)
+
+/*
+ * Kernels over less data than this run on the calling thread,
+ * since waking the workers costs more than it saves.
+ */
+#define POOL_THRESHOLD_BYTES ((size_t)1 << 20)
+
+/*
+ * Runs the items from begin to end.
+ *
+ * Returns false if it fails, in which case the job fails.
+ */
+typedef bool (*pool_task_t)(void *arg, size_t begin, size_t end);
+
+/*
+ * Starts the pool, where the jobs run on threads threads including the caller.
+ * If it is running for another instance of the module, it is shared as it is.
+ *
+ * Returns 0 on success, or -1.
+ */
+int pool_start(unsigned threads);
+
+/*
+ * Stops and joins the workers when the last instance which started the pool stops it.
+ */
+void pool_stop(void);
+
+/*
+ * Gets the number of the threads which run a job, including the caller.
+ */
+unsigned pool_threads(void);
+
+/*
+ * Runs the task over n items split into chunks of grain items,
+ * and returns when all of them are done.
+ *
+ * Returns false if the task fails for any chunk.
+ */
+bool pool_run(size_t n, size_t grain, pool_task_t task, void *arg);
+
+/*
+ * Gets the grain of an elementwise kernel whose widest operand has elements of element_size bytes,
+ * or the number of the items if it is too small to run in parallel.
+ */
+size_t pool_grain(size_t n, size_t element_size);
+
+#endif // PELEMAY_ENGINE_POOL_H
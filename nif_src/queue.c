@@ -0,0 +1,177 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <erl_nif.h>
+
+#include "buffer.h"
+#include "queue.h"
+
+#define QUEUE_MAX_WORKERS 64
+
+/*
+ * lock protects all the fields but the threads and instances, which is the
+ * number of the loaded instances of the module which share the queue,
+ * and which only load, upgrade and unload change one at a time.
+ */
+static struct {
+    ErlNifMutex *lock;
+    ErlNifCond *ready;
+    queue_job_t *head;
+    queue_job_t *tail;
+    unsigned length;
+    unsigned depth;
+    bool stopping;
+    unsigned instances;
+    unsigned workers;
+    ErlNifTid tids[QUEUE_MAX_WORKERS];
+} queue;
+
+static void *worker(void *arg)
+{
+    enif_mutex_lock(queue.lock);
+    for(;;) {
+        while(!queue.stopping && queue.head == NULL) {
+            enif_cond_wait(queue.ready, queue.lock);
+        }
+        if(queue.stopping) {
+            break;
+        }
+        queue_job_t *job = queue.head;
+        queue.head = job->next;
+        if(queue.head == NULL) {
+            queue.tail = NULL;
+        }
+        queue.length--;
+        enif_mutex_unlock(queue.lock);
+
+        job->run(job);
+
+        enif_mutex_lock(queue.lock);
+    }
+    enif_mutex_unlock(queue.lock);
+    // The jobs leave the blocks of their buffers in the pool of the thread.
+    buffer_pool_trim();
+    return NULL;
+}
+
+int queue_start(unsigned workers, unsigned depth)
+{
+    // An upgrade from the same image keeps the running queue and its waiting jobs.
+    if(queue.instances > 0) {
+        queue.instances++;
+        return 0;
+    }
+    queue.head = NULL;
+    queue.tail = NULL;
+    queue.length = 0;
+    queue.depth = depth;
+    queue.stopping = false;
+    queue.workers = 0;
+    queue.lock = enif_mutex_create("pelemay_queue_lock");
+    queue.ready = enif_cond_create("pelemay_queue_ready");
+    if(queue.lock == NULL || queue.ready == NULL) {
+        queue_stop();
+        return -1;
+    }
+    if(workers > QUEUE_MAX_WORKERS) {
+        workers = QUEUE_MAX_WORKERS;
+    }
+    for(unsigned i = 0; i < workers; i++) {
+        if(enif_thread_create("pelemay_queue", &queue.tids[i], worker, NULL, NULL) != 0) {
+            break;
+        }
+        queue.workers++;
+    }
+    if(workers > 0 && queue.workers == 0) {
+        queue_stop();
+        return -1;
+    }
+    queue.instances = 1;
+    return 0;
+}
+
+void queue_stop(void)
+{
+    if(queue.instances > 1) {
+        queue.instances--;
+        return;
+    }
+    queue.instances = 0;
+    queue_job_t *dropped = NULL;
+    if(queue.lock != NULL) {
+        enif_mutex_lock(queue.lock);
+        queue.stopping = true;
+        dropped = queue.head;
+        queue.head = NULL;
+        queue.tail = NULL;
+        queue.length = 0;
+        enif_cond_broadcast(queue.ready);
+        enif_mutex_unlock(queue.lock);
+    }
+    for(unsigned i = 0; i < queue.workers; i++) {
+        enif_thread_join(queue.tids[i], NULL);
+    }
+    queue.workers = 0;
+    while(dropped != NULL) {
+        queue_job_t *next = dropped->next;
+        dropped->drop(dropped);
+        dropped = next;
+    }
+    if(queue.ready != NULL) {
+        enif_cond_destroy(queue.ready);
+        queue.ready = NULL;
+    }
+    if(queue.lock != NULL) {
+        enif_mutex_destroy(queue.lock);
+        queue.lock = NULL;
+    }
+}
+
+bool queue_push(queue_job_t *job)
+{
+    if(__builtin_expect(queue.lock == NULL, false)) {
+        return false;
+    }
+    enif_mutex_lock(queue.lock);
+    if(queue.stopping || queue.workers == 0 || queue.length >= queue.depth) {
+        enif_mutex_unlock(queue.lock);
+        return false;
+    }
+    job->next = NULL;
+    if(queue.tail != NULL) {
+        queue.tail->next = job;
+    } else {
+        queue.head = job;
+    }
+    queue.tail = job;
+    queue.length++;
+    enif_cond_signal(queue.ready);
+    enif_mutex_unlock(queue.lock);
+    return true;
+}
+
+bool queue_cancel(queue_job_t *job)
+{
+    if(__builtin_expect(queue.lock == NULL, false)) {
+        return false;
+    }
+    bool taken = false;
+    enif_mutex_lock(queue.lock);
+    queue_job_t *previous = NULL;
+    for(queue_job_t *j = queue.head; j != NULL; previous = j, j = j->next) {
+        if(j == job) {
+            if(previous != NULL) {
+                previous->next = j->next;
+            } else {
+                queue.head = j->next;
+            }
+            if(queue.tail == j) {
+                queue.tail = previous;
+            }
+            queue.length--;
+            taken = true;
+            break;
+        }
+    }
+    enif_mutex_unlock(queue.lock);
+    return taken;
+}
@@ -0,0 +1,48 @@
+#ifndef PELEMAY_ENGINE_QUEUE_H
+#define PELEMAY_ENGINE_QUEUE_H
+
+#include <stdbool.h>
+
+/*
+ * A bounded queue of jobs run in order by worker threads.
+ *
+ * A job is embedded at the head of the struct of the caller, whose run is
+ * called on a worker, or whose drop is called instead if the queue is stopped
+ * before it runs. Either of them is called once, and owns the job after.
+ */
+typedef struct queue_job {
+    struct queue_job *next;
+    void (*run)(struct queue_job *job);
+    void (*drop)(struct queue_job *job);
+} queue_job_t;
+
+/*
+ * Starts workers threads which run the jobs, up to depth of which may wait.
+ * If it is running for another instance of the module, it is shared as it is.
+ *
+ * Returns 0 on success, or -1.
+ */
+int queue_start(unsigned workers, unsigned depth);
+
+/*
+ * Drops the waiting jobs, and joins the workers after their running jobs,
+ * when the last instance which started the queue stops it.
+ */
+void queue_stop(void);
+
+/*
+ * Puts the job at the tail of the queue.
+ *
+ * Returns false if the queue is full or stopped, in which case the caller keeps the job.
+ */
+bool queue_push(queue_job_t *job);
+
+/*
+ * Takes the job out of the queue if it is waiting.
+ *
+ * Returns true if it is taken, in which case the caller owns the job,
+ * or false if it has run or is running.
+ */
+bool queue_cancel(queue_job_t *job);
+
+#endif // PELEMAY_ENGINE_QUEUE_H
@@ -0,0 +1,492 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <erl_nif.h>
+
+#include "kernel.h"
+#include "pool.h"
+#include "reduce.h"
+
+/*
+ * Reductions.
+ *
+ * Reducing a contiguous block of axes views the tensor as
+ * [outer][length][inner], where length is the product of the reduced axes.
+ * Other axes are reduced by further passes over the result.
+ *
+ * The reduced axis is split into chunks of REDUCE_CHUNK elements, and
+ * the inner axis into blocks of REDUCE_INNER_BLOCK elements. A task computes
+ * the partial result of a chunk for a block, and the partial results are
+ * combined in the order of the chunks after all tasks are done.
+ */
+
+#define REDUCE_CHUNK ((size_t)1 << 16)
+#define REDUCE_INNER_BLOCK ((size_t)1024)
+#define REDUCE_MAX_RANK 32
+#define PAIRWISE_BLOCK 128
+#define LANES 8
+
+/*
+ * Passes whose input is larger than this are split across the threads of the pool.
+ */
+#define PARALLEL_THRESHOLD_BYTES ((size_t)1 << 22)
+
+typedef struct reduce_pass reduce_pass_t;
+
+typedef struct reduce_ops {
+    size_t partial_size;
+    void (*task)(const reduce_pass_t *pass, size_t o, size_t k, size_t i0, size_t i1);
+    void (*finish)(const reduce_pass_t *pass);
+} reduce_ops_t;
+
+struct reduce_pass {
+    const reduce_ops_t *ops;
+    const void *in;
+    void *out;
+    void *partial;
+    size_t outer;
+    size_t length;
+    size_t inner;
+    size_t chunks;
+    size_t blocks;
+    bool tie_break_high;
+};
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define SAME(x) (x)
+#define NONZERO(x) ((x) != 0)
+#define ADD(a, b) ((a) + (b))
+#define MUL(a, b) ((a) * (b))
+#define AND(a, b) ((a) & (b))
+#define OR(a, b) ((a) | (b))
+// NaN is greater than any number.
+#define MAX(a, b) ((b) > (a) || (b) != (b) ? (b) : (a))
+#define MIN_NAN_GREATEST(a, b) ((b) < (a) || (a) != (a) ? (b) : (a))
+
+#define KAHAN_ADD(s, c, v) \
+    do { \
+        __typeof__(s) y_ = (v) - (c); \
+        __typeof__(s) t_ = (s) + y_; \
+        (c) = (t_ - (s)) - y_; \
+        (s) = t_; \
+    } while(0)
+
+/*
+ * Defines the reduction of values of ctype into an accumulator of atype,
+ * stored as otype. If kahan, COMBINE should be ADD and the columns are
+ * summed by Kahan summation.
+ */
+#define DEFINE_VALUE_REDUCE(name, ctype, atype, otype, identity, MAP, COMBINE, kahan) \
+static atype name##_pairwise(const ctype *x, size_t n) \
+{ \
+    if(n <= PAIRWISE_BLOCK) { \
+        atype acc[LANES]; \
+        for(int j = 0; j < LANES; j++) { \
+            acc[j] = (identity); \
+        } \
+        size_t i = 0; \
+        for(; i + LANES <= n; i += LANES) { \
+            for(int j = 0; j < LANES; j++) { \
+                acc[j] = COMBINE(acc[j], (atype)MAP(x[i + j])); \
+            } \
+        } \
+        for(; i < n; i++) { \
+            acc[0] = COMBINE(acc[0], (atype)MAP(x[i])); \
+        } \
+        for(int w = LANES / 2; w > 0; w /= 2) { \
+            for(int j = 0; j < w; j++) { \
+                acc[j] = COMBINE(acc[j], acc[j + w]); \
+            } \
+        } \
+        return acc[0]; \
+    } \
+    size_t h = n / 2; \
+    return COMBINE(name##_pairwise(x, h), name##_pairwise(x + h, n - h)); \
+} \
+\
+static void name##_task(const reduce_pass_t *pass, size_t o, size_t k, size_t i0, size_t i1) \
+{ \
+    size_t r0 = k * REDUCE_CHUNK; \
+    size_t rows = MIN(REDUCE_CHUNK, pass->length - r0); \
+    const ctype *x = (const ctype *)pass->in + (o * pass->length + r0) * pass->inner; \
+    atype *restrict acc = (atype *)pass->partial + (o * pass->chunks + k) * pass->inner; \
+    if(pass->inner == 1) { \
+        acc[0] = name##_pairwise(x, rows); \
+        return; \
+    } \
+    atype comp[REDUCE_INNER_BLOCK]; \
+    for(size_t i = i0; i < i1; i++) { \
+        acc[i] = (identity); \
+        comp[i - i0] = 0; \
+    } \
+    for(size_t r = 0; r < rows; r++) { \
+        const ctype *restrict row = x + r * pass->inner; \
+        if(kahan) { \
+            for(size_t i = i0; i < i1; i++) { \
+                KAHAN_ADD(acc[i], comp[i - i0], (atype)MAP(row[i])); \
+            } \
+        } else { \
+            for(size_t i = i0; i < i1; i++) { \
+                acc[i] = COMBINE(acc[i], (atype)MAP(row[i])); \
+            } \
+        } \
+    } \
+} \
+\
+static void name##_finish(const reduce_pass_t *pass) \
+{ \
+    const atype *partial = pass->partial; \
+    otype *out = pass->out; \
+    for(size_t o = 0; o < pass->outer; o++) { \
+        for(size_t i = 0; i < pass->inner; i++) { \
+            const atype *p = partial + o * pass->chunks * pass->inner + i; \
+            atype s = p[0]; \
+            atype c = 0; \
+            for(size_t k = 1; k < pass->chunks; k++) { \
+                if(kahan) { \
+                    KAHAN_ADD(s, c, p[k * pass->inner]); \
+                } else { \
+                    s = COMBINE(s, p[k * pass->inner]); \
+                } \
+            } \
+            (void)c; \
+            out[o * pass->inner + i] = (otype)s; \
+        } \
+    } \
+} \
+\
+static const reduce_ops_t name##_ops = {sizeof(atype), name##_task, name##_finish};
+
+/*
+ * Defines argmax (less is false) or argmin (less is true) of values of ctype.
+ */
+#define DEFINE_ARG_REDUCE(name, ctype, less) \
+typedef struct name##_best { \
+    ctype value; \
+    int64_t index; \
+} name##_best_t; \
+\
+static inline bool name##_better(ctype x, ctype best) \
+{ \
+    if(less) { \
+        return x < best || (best != best && x == x); \
+    } else { \
+        return x > best || (x != x && best == best); \
+    } \
+} \
+\
+static inline bool name##_take(ctype x, ctype best, bool tie_break_high) \
+{ \
+    return name##_better(x, best) || (tie_break_high && (x == best || (x != x && best != best))); \
+} \
+\
+static void name##_task(const reduce_pass_t *pass, size_t o, size_t k, size_t i0, size_t i1) \
+{ \
+    size_t r0 = k * REDUCE_CHUNK; \
+    size_t rows = MIN(REDUCE_CHUNK, pass->length - r0); \
+    const ctype *x = (const ctype *)pass->in + (o * pass->length + r0) * pass->inner; \
+    name##_best_t *best = (name##_best_t *)pass->partial + (o * pass->chunks + k) * pass->inner; \
+    for(size_t i = i0; i < i1; i++) { \
+        best[i].value = x[i]; \
+        best[i].index = (int64_t)r0; \
+    } \
+    for(size_t r = 1; r < rows; r++) { \
+        const ctype *row = x + r * pass->inner; \
+        for(size_t i = i0; i < i1; i++) { \
+            if(name##_take(row[i], best[i].value, pass->tie_break_high)) { \
+                best[i].value = row[i]; \
+                best[i].index = (int64_t)(r0 + r); \
+            } \
+        } \
+    } \
+} \
+\
+static void name##_finish(const reduce_pass_t *pass) \
+{ \
+    const name##_best_t *partial = pass->partial; \
+    int64_t *out = pass->out; \
+    for(size_t o = 0; o < pass->outer; o++) { \
+        for(size_t i = 0; i < pass->inner; i++) { \
+            const name##_best_t *p = partial + o * pass->chunks * pass->inner + i; \
+            name##_best_t best = p[0]; \
+            for(size_t k = 1; k < pass->chunks; k++) { \
+                if(name##_take(p[k * pass->inner].value, best.value, pass->tie_break_high)) { \
+                    best = p[k * pass->inner]; \
+                } \
+            } \
+            out[o * pass->inner + i] = best.index; \
+        } \
+    } \
+} \
+\
+static const reduce_ops_t name##_ops = {sizeof(name##_best_t), name##_task, name##_finish};
+
+/*
+ * Integers are summed and multiplied in the unsigned type utype,
+ * so that they wrap around as Nx does.
+ */
+#define DEFINE_INT_REDUCE(t, ctype, utype, min, max) \
+DEFINE_VALUE_REDUCE(sum_##t, ctype, utype, ctype, 0, SAME, ADD, false) \
+DEFINE_VALUE_REDUCE(product_##t, ctype, utype, ctype, 1, SAME, MUL, false) \
+DEFINE_VALUE_REDUCE(reduce_max_##t, ctype, ctype, ctype, min, SAME, MAX, false) \
+DEFINE_VALUE_REDUCE(reduce_min_##t, ctype, ctype, ctype, max, SAME, MIN_NAN_GREATEST, false) \
+DEFINE_VALUE_REDUCE(all_##t, ctype, uint8_t, uint8_t, 1, NONZERO, AND, false) \
+DEFINE_VALUE_REDUCE(any_##t, ctype, uint8_t, uint8_t, 0, NONZERO, OR, false) \
+DEFINE_ARG_REDUCE(argmax_##t, ctype, false) \
+DEFINE_ARG_REDUCE(argmin_##t, ctype, true)
+
+/*
+ * The identity of reduce_min is NaN, which is greater than any number.
+ */
+#define DEFINE_FLOAT_REDUCE(t, ctype, kahan) \
+DEFINE_VALUE_REDUCE(sum_##t, ctype, double, ctype, 0, SAME, ADD, kahan) \
+DEFINE_VALUE_REDUCE(product_##t, ctype, double, ctype, 1, SAME, MUL, false) \
+DEFINE_VALUE_REDUCE(reduce_max_##t, ctype, ctype, ctype, -INFINITY, SAME, MAX, false) \
+DEFINE_VALUE_REDUCE(reduce_min_##t, ctype, ctype, ctype, NAN, SAME, MIN_NAN_GREATEST, false) \
+DEFINE_VALUE_REDUCE(all_##t, ctype, uint8_t, uint8_t, 1, NONZERO, AND, false) \
+DEFINE_VALUE_REDUCE(any_##t, ctype, uint8_t, uint8_t, 0, NONZERO, OR, false) \
+DEFINE_ARG_REDUCE(argmax_##t, ctype, false) \
+DEFINE_ARG_REDUCE(argmin_##t, ctype, true)
+
+DEFINE_INT_REDUCE(s8, int8_t, uint32_t, INT8_MIN, INT8_MAX)
+DEFINE_INT_REDUCE(s16, int16_t, uint32_t, INT16_MIN, INT16_MAX)
+DEFINE_INT_REDUCE(s32, int32_t, uint32_t, INT32_MIN, INT32_MAX)
+DEFINE_INT_REDUCE(s64, int64_t, uint64_t, INT64_MIN, INT64_MAX)
+DEFINE_INT_REDUCE(u8, uint8_t, uint32_t, 0, UINT8_MAX)
+DEFINE_INT_REDUCE(u16, uint16_t, uint32_t, 0, UINT16_MAX)
+DEFINE_INT_REDUCE(u32, uint32_t, uint32_t, 0, UINT32_MAX)
+DEFINE_INT_REDUCE(u64, uint64_t, uint64_t, 0, UINT64_MAX)
+// f32 is accumulated in double, which is accurate enough without compensation.
+DEFINE_FLOAT_REDUCE(f32, float, false)
+DEFINE_FLOAT_REDUCE(f64, double, true)
+
+#define REDUCE_ENTRIES(t, kt) \
+    [REDUCE_OP(INST_SUM)][kt] = &sum_##t##_ops, \
+    [REDUCE_OP(INST_PRODUCT)][kt] = &product_##t##_ops, \
+    [REDUCE_OP(INST_REDUCE_MAX)][kt] = &reduce_max_##t##_ops, \
+    [REDUCE_OP(INST_REDUCE_MIN)][kt] = &reduce_min_##t##_ops, \
+    [REDUCE_OP(INST_ARGMAX)][kt] = &argmax_##t##_ops, \
+    [REDUCE_OP(INST_ARGMIN)][kt] = &argmin_##t##_ops, \
+    [REDUCE_OP(INST_ALL)][kt] = &all_##t##_ops, \
+    [REDUCE_OP(INST_ANY)][kt] = &any_##t##_ops
+
+static const reduce_ops_t *const reduce_ops_table[NUM_REDUCE_OPS][NUM_KERNEL_TYPES] = {
+    REDUCE_ENTRIES(s8, KERNEL_TYPE(tb_s, btb_8)),
+    REDUCE_ENTRIES(s16, KERNEL_TYPE(tb_s, btb_16)),
+    REDUCE_ENTRIES(s32, KERNEL_TYPE(tb_s, btb_32)),
+    REDUCE_ENTRIES(s64, KERNEL_TYPE(tb_s, btb_64)),
+    REDUCE_ENTRIES(u8, KERNEL_TYPE(tb_u, btb_8)),
+    REDUCE_ENTRIES(u16, KERNEL_TYPE(tb_u, btb_16)),
+    REDUCE_ENTRIES(u32, KERNEL_TYPE(tb_u, btb_32)),
+    REDUCE_ENTRIES(u64, KERNEL_TYPE(tb_u, btb_64)),
+    REDUCE_ENTRIES(f32, KERNEL_TYPE(tb_f, btb_32)),
+    REDUCE_ENTRIES(f64, KERNEL_TYPE(tb_f, btb_64)),
+};
+
+static const reduce_ops_t *get_reduce_ops(unsigned inst, enum type_binary type, enum bit_type_binary bit_type)
+{
+    unsigned kt = KERNEL_TYPE(type, bit_type);
+    if(!IS_REDUCE_INST(inst) || kt >= NUM_KERNEL_TYPES) {
+        return NULL;
+    }
+    return reduce_ops_table[REDUCE_OP(inst)][kt];
+}
+
+bool reduce_result_type(unsigned inst, enum type_binary type, enum bit_type_binary bit_type, enum type_binary *result_type, enum bit_type_binary *result_bit_type)
+{
+    if(get_reduce_ops(inst, type, bit_type) == NULL) {
+        return false;
+    }
+    switch(inst) {
+        case INST_ARGMAX:
+        case INST_ARGMIN:
+            *result_type = tb_s;
+            *result_bit_type = btb_64;
+            break;
+
+        case INST_ALL:
+        case INST_ANY:
+            *result_type = tb_u;
+            *result_bit_type = btb_8;
+            break;
+
+        default:
+            *result_type = type;
+            *result_bit_type = bit_type;
+            break;
+    }
+    return true;
+}
+
+static bool run_tasks(void *arg, size_t begin, size_t end)
+{
+    const reduce_pass_t *pass = arg;
+    for(size_t t = begin; t < end; t++) {
+        size_t o = t / (pass->chunks * pass->blocks);
+        size_t k = t / pass->blocks % pass->chunks;
+        size_t i0 = t % pass->blocks * REDUCE_INNER_BLOCK;
+        pass->ops->task(pass, o, k, i0, MIN(pass->inner, i0 + REDUCE_INNER_BLOCK));
+    }
+    return true;
+}
+
+/*
+ * Runs the tasks of the pass in the pool if the input is large, one task a chunk,
+ * or on the calling thread otherwise.
+ */
+static void run_pass(reduce_pass_t *pass, size_t element_size)
+{
+    size_t tasks = pass->outer * pass->chunks * pass->blocks;
+    bool parallel = pass->outer * pass->length * pass->inner * element_size >= PARALLEL_THRESHOLD_BYTES;
+    pool_run(tasks, parallel ? 1 : tasks, run_tasks, pass);
+    pass->ops->finish(pass);
+}
+
+// allocates at least 1 byte, so that NULL means failure.
+static void *alloc_buffer(size_t size)
+{
+    return enif_alloc(size > 0 ? size : 1);
+}
+
+static void free_buffer(void *buffer)
+{
+    if(buffer != NULL) {
+        enif_free(buffer);
+    }
+}
+
+const char *reduce(
+    unsigned inst,
+    enum type_binary type,
+    enum bit_type_binary bit_type,
+    const void *in,
+    unsigned rank,
+    const uint64_t *shape,
+    unsigned axes_mask,
+    bool tie_break_high,
+    void *out)
+{
+    enum type_binary result_type;
+    enum bit_type_binary result_bit_type;
+    if(!reduce_result_type(inst, type, bit_type, &result_type, &result_bit_type)) {
+        return "Sorry, the reduction does not support the type";
+    }
+
+    /*
+     * Merges adjacent axes which are both reduced or both not,
+     * ignoring axes of size 1.
+     */
+    if(rank > REDUCE_MAX_RANK) {
+        return "Sorry, the reduction supports tensors of rank up to 32";
+    }
+    uint64_t sizes[REDUCE_MAX_RANK + 1];
+    bool reduced[REDUCE_MAX_RANK + 1];
+    unsigned groups = 0;
+    uint64_t size = 1;
+    for(unsigned axis = 0; axis < rank; axis++) {
+        size *= shape[axis];
+        if(shape[axis] == 1) {
+            continue;
+        }
+        bool r = (axes_mask >> axis) & 1;
+        if(groups > 0 && reduced[groups - 1] == r) {
+            sizes[groups - 1] *= shape[axis];
+        } else {
+            sizes[groups] = shape[axis];
+            reduced[groups] = r;
+            groups++;
+        }
+    }
+    // reduces an axis of size 1 if none is left, to convert the type.
+    unsigned reduced_groups = 0;
+    for(unsigned g = 0; g < groups; g++) {
+        reduced_groups += reduced[g];
+    }
+    if(reduced_groups == 0) {
+        sizes[groups] = 1;
+        reduced[groups] = true;
+        groups++;
+        reduced_groups = 1;
+    }
+    if(IS_ARG_REDUCE_INST(inst)) {
+        if(reduced_groups > 1) {
+            return "argmax and argmin reduce only one axis or all axes";
+        }
+        if(size == 0) {
+            return "argmax and argmin do not support empty tensors";
+        }
+    }
+
+    size_t element_size = (size_t)1 << bit_type;
+    const void *current = in;
+    void *buffers[2] = {NULL, NULL};
+    const char *error = NULL;
+
+    // reduces the last reduced group until none is left.
+    while(reduced_groups > 0) {
+        unsigned j = groups;
+        while(!reduced[--j]);
+
+        uint64_t outer = 1;
+        uint64_t inner = 1;
+        for(unsigned g = 0; g < j; g++) {
+            outer *= sizes[g];
+        }
+        for(unsigned g = j + 1; g < groups; g++) {
+            inner *= sizes[g];
+        }
+
+        const reduce_ops_t *ops = get_reduce_ops(inst, type, bit_type);
+        reduce_pass_t pass = {
+            .ops = ops,
+            .in = current,
+            .outer = outer,
+            .length = sizes[j],
+            .inner = inner,
+            .chunks = sizes[j] == 0 ? 1 : (sizes[j] + REDUCE_CHUNK - 1) / REDUCE_CHUNK,
+            .blocks = inner == 0 ? 0 : (inner + REDUCE_INNER_BLOCK - 1) / REDUCE_INNER_BLOCK,
+            .tie_break_high = tie_break_high,
+        };
+
+        size_t result_size = (size_t)1 << result_bit_type;
+        if(reduced_groups == 1) {
+            pass.out = out;
+        } else {
+            unsigned b = current == buffers[0] ? 1 : 0;
+            free_buffer(buffers[b]);
+            buffers[b] = alloc_buffer(outer * inner * result_size);
+            if(buffers[b] == NULL) {
+                error = "Fail to alloc memory in case of reductions";
+                break;
+            }
+            pass.out = buffers[b];
+        }
+        pass.partial = alloc_buffer(outer * pass.chunks * inner * ops->partial_size);
+        if(pass.partial == NULL) {
+            error = "Fail to alloc memory in case of reductions";
+            break;
+        }
+        run_pass(&pass, element_size);
+        free_buffer(pass.partial);
+
+        current = pass.out;
+        type = result_type;
+        bit_type = result_bit_type;
+        element_size = result_size;
+
+        // removes the reduced group.
+        for(unsigned g = j; g + 1 < groups; g++) {
+            sizes[g] = sizes[g + 1];
+            reduced[g] = reduced[g + 1];
+        }
+        groups--;
+        reduced_groups--;
+    }
+
+    free_buffer(buffers[0]);
+    free_buffer(buffers[1]);
+    return error;
+}
@@ -0,0 +1,54 @@
+#ifndef PELEMAY_ENGINE_REDUCE_H
+#define PELEMAY_ENGINE_REDUCE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "opcode.h"
+
+#define REDUCE_OP(inst) ((inst) - INST_SUM)
+#define NUM_REDUCE_OPS (INST_ANY - INST_SUM + 1)
+#define IS_REDUCE_INST(inst) ((inst) >= INST_SUM && (inst) <= INST_ANY)
+#define IS_ARG_REDUCE_INST(inst) ((inst) == INST_ARGMAX || (inst) == INST_ARGMIN)
+
+/*
+ * Gets the type of the result of the reduction of a tensor of the type.
+ *
+ * It is {:s, 64} in case of argmax and argmin, {:u, 8} in case of all and any,
+ * or the type of the tensor otherwise.
+ *
+ * Returns false if the reduction does not support the type.
+ */
+bool reduce_result_type(unsigned inst, enum type_binary type, enum bit_type_binary bit_type, enum type_binary *result_type, enum bit_type_binary *result_bit_type);
+
+/*
+ * Reduces the tensor in over the axes whose bits are set in axes_mask,
+ * and stores the result in row-major order of the remaining axes to out.
+ *
+ * Sums are accumulated pairwise along contiguous axes and in double
+ * precision (f32) or by Kahan summation (f64) otherwise.
+ * NaN is treated as greater than any number, so reduce_max and argmax
+ * propagate NaN while reduce_min and argmin ignore it unless all are NaN.
+ *
+ * argmax and argmin reduce one axis, or all axes as a flattened tensor.
+ * Ties are broken by the lowest index, or the highest if tie_break_high.
+ *
+ * Large tensors are split across threads. Each thread computes partial results
+ * over fixed chunks of the reduced axis, which are combined in order, so the
+ * result does not depend on the number of threads.
+ *
+ * Returns NULL on success, or the message of the error.
+ */
+const char *reduce(
+    unsigned inst,
+    enum type_binary type,
+    enum bit_type_binary bit_type,
+    const void *in,
+    unsigned rank,
+    const uint64_t *shape,
+    unsigned axes_mask,
+    bool tie_break_high,
+    void *out);
+
+#endif // PELEMAY_ENGINE_REDUCE_H
@@ -0,0 +1,124 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "opcode.h"
+#include "stats.h"
+
+/*
+ * The ranges of the opcodes, whose counters are laid out in this order.
+ */
+static const struct {
+    unsigned first;
+    unsigned last;
+} ranges[] = {
+    {INST_SCAL, INST_AXPBY},
+    {INST_ADD, INST_LOGICAL_XOR},
+    {INST_EXP, INST_ABS},
+    {INST_SUM, INST_ANY},
+    {INST_AS_TYPE, INST_AS_TYPE},
+    {INST_GEMV, INST_GEMV},
+    {INST_GEMM, INST_GEMM},
+    {INST_ALOADT, INST_TAKE},
+};
+
+#define NUM_RANGES (sizeof(ranges) / sizeof(ranges[0]))
+
+static atomic_bool enabled;
+static stats_counter_t by_inst[STATS_NUM_INSTS];
+
+_Static_assert(
+    STATS_NUM_INSTS == (INST_AXPBY - INST_SCAL + 1) + (INST_LOGICAL_XOR - INST_ADD + 1)
+        + (INST_ABS - INST_EXP + 1) + (INST_ANY - INST_SUM + 1) + 3 + (INST_TAKE - INST_ALOADT + 1),
+    "STATS_NUM_INSTS should be the number of the opcodes");
+
+// Gets the index of the counter of the opcode, or -1 if it is unknown.
+static int index_of(unsigned inst)
+{
+    unsigned base = 0;
+    for(unsigned i = 0; i < NUM_RANGES; i++) {
+        if(inst >= ranges[i].first && inst <= ranges[i].last) {
+            return (int)(base + inst - ranges[i].first);
+        }
+        base += ranges[i].last - ranges[i].first + 1;
+    }
+    return -1;
+}
+
+void stats_enable(bool value)
+{
+    atomic_store_explicit(&enabled, value, memory_order_relaxed);
+}
+
+bool stats_enabled(void)
+{
+    return atomic_load_explicit(&enabled, memory_order_relaxed);
+}
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+void stats_init(stats_counter_t *counters, unsigned n)
+{
+    for(unsigned i = 0; i < n; i++) {
+        atomic_init(&counters[i].executions, 0);
+        atomic_init(&counters[i].elements, 0);
+        atomic_init(&counters[i].bytes, 0);
+        atomic_init(&counters[i].ns, 0);
+    }
+}
+
+static void add(stats_counter_t *counter, uint64_t elements, uint64_t bytes, uint64_t ns)
+{
+    atomic_fetch_add_explicit(&counter->executions, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counter->elements, elements, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counter->bytes, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counter->ns, ns, memory_order_relaxed);
+}
+
+void stats_record(unsigned inst, stats_counter_t *counter, uint64_t elements, uint64_t bytes, uint64_t ns)
+{
+    int index = index_of(inst);
+    if(index >= 0) {
+        add(&by_inst[index], elements, bytes, ns);
+    }
+    add(counter, elements, bytes, ns);
+}
+
+void stats_read(const stats_counter_t *counter, stats_values_t *values)
+{
+    values->executions = atomic_load_explicit(&counter->executions, memory_order_relaxed);
+    values->elements = atomic_load_explicit(&counter->elements, memory_order_relaxed);
+    values->bytes = atomic_load_explicit(&counter->bytes, memory_order_relaxed);
+    values->ns = atomic_load_explicit(&counter->ns, memory_order_relaxed);
+}
+
+unsigned stats_read_inst(unsigned index, stats_values_t *values)
+{
+    stats_read(&by_inst[index], values);
+    for(unsigned i = 0; i < NUM_RANGES; i++) {
+        unsigned length = ranges[i].last - ranges[i].first + 1;
+        if(index < length) {
+            return ranges[i].first + index;
+        }
+        index -= length;
+    }
+    return 0;
+}
+
+void stats_reset(void)
+{
+    for(unsigned i = 0; i < STATS_NUM_INSTS; i++) {
+        atomic_store_explicit(&by_inst[i].executions, 0, memory_order_relaxed);
+        atomic_store_explicit(&by_inst[i].elements, 0, memory_order_relaxed);
+        atomic_store_explicit(&by_inst[i].bytes, 0, memory_order_relaxed);
+        atomic_store_explicit(&by_inst[i].ns, 0, memory_order_relaxed);
+    }
+}
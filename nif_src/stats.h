@@ -0,0 +1,78 @@
+#ifndef PELEMAY_ENGINE_STATS_H
+#define PELEMAY_ENGINE_STATS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Counters of the executions of the instructions.
+ *
+ * While the stats are enabled, execute() counts each instruction it runs
+ * into the counter of its opcode and that of its position in the program:
+ * the executions, the elements it processes, which are those of the larger
+ * of the top of the stack before and after it, the bytes it allocates for
+ * the data of tensors, and the nanoseconds it takes by the monotonic clock.
+ *
+ * The counters are relaxed atomics, which executions on any thread add to,
+ * and which are read without stopping them. Disabled, the stats cost
+ * a branch per instruction.
+ */
+typedef struct stats_counter {
+    atomic_uint_fast64_t executions;
+    atomic_uint_fast64_t elements;
+    atomic_uint_fast64_t bytes;
+    atomic_uint_fast64_t ns;
+} stats_counter_t;
+
+/*
+ * The values of a counter at a moment.
+ */
+typedef struct stats_values {
+    uint64_t executions;
+    uint64_t elements;
+    uint64_t bytes;
+    uint64_t ns;
+} stats_values_t;
+
+/*
+ * The number of the opcodes which have counters.
+ */
+#define STATS_NUM_INSTS 64
+
+/*
+ * Enables or disables the stats.
+ */
+void stats_enable(bool enabled);
+
+bool stats_enabled(void);
+
+/*
+ * Gets the time of the monotonic clock in nanoseconds.
+ */
+uint64_t stats_now(void);
+
+/*
+ * Zeroes n counters.
+ */
+void stats_init(stats_counter_t *counters, unsigned n);
+
+/*
+ * Adds an execution of the instruction to its counter of the opcode and to counter.
+ */
+void stats_record(unsigned inst, stats_counter_t *counter, uint64_t elements, uint64_t bytes, uint64_t ns);
+
+void stats_read(const stats_counter_t *counter, stats_values_t *values);
+
+/*
+ * Gets the values of the counter of the opcode of index in [0, STATS_NUM_INSTS)
+ * and the opcode.
+ */
+unsigned stats_read_inst(unsigned index, stats_values_t *values);
+
+/*
+ * Zeroes the counters of the opcodes.
+ */
+void stats_reset(void);
+
+#endif // PELEMAY_ENGINE_STATS_H
@@ -0,0 +1,281 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <erl_nif.h>
+
+#include "opcode.h"
+#include "kernel.h"
+#include "reduce.h"
+#include "verify.h"
+
+/*
+ * The verifier sweeps the code once in order, since skip only jumps forward.
+ *
+ * The state of the sweep is the kinds of the values on the stack and in
+ * the locals. skip and fuse, which jumps over its body, leave their state
+ * at their target, where the states of all the paths meet before it is
+ * swept. The stacks which meet should be the same, while a local which is
+ * a tensor on a path and a boolean on another is a conflict, which only
+ * load and take reject.
+ */
+
+enum kind {
+    kind_none,
+    kind_tensor,
+    kind_bool,
+    kind_conflict,
+};
+
+typedef struct state {
+    bool reached;
+    unsigned depth;
+    unsigned char *stack;
+    unsigned char *locals;
+} state_t;
+
+/*
+ * The state left at a target, whose kinds are those of the stack
+ * followed by those of the locals, or NULL if no path has reached it yet.
+ */
+typedef struct pending {
+    unsigned depth;
+    unsigned char *kinds;
+} pending_t;
+
+static const char *merge(pending_t *into, const state_t *from, unsigned num_locals)
+{
+    if(into->kinds == NULL) {
+        into->kinds = enif_alloc(from->depth + num_locals + 1);
+        if(into->kinds == NULL) {
+            return "Fail to alloc memory";
+        }
+        into->depth = from->depth;
+        memcpy(into->kinds, from->stack, from->depth);
+        memcpy(into->kinds + from->depth, from->locals, num_locals);
+        return NULL;
+    }
+    if(into->depth != from->depth) {
+        return "The depths of the stack differ at the target of skip";
+    }
+    if(memcmp(into->kinds, from->stack, from->depth) != 0) {
+        return "A boolean and a tensor meet on the stack at the target of skip";
+    }
+    unsigned char *locals = into->kinds + into->depth;
+    for(unsigned i = 0; i < num_locals; i++) {
+        if(locals[i] == kind_none) {
+            locals[i] = from->locals[i];
+        } else if(from->locals[i] != kind_none && from->locals[i] != locals[i]) {
+            locals[i] = kind_conflict;
+        }
+    }
+    return NULL;
+}
+
+static void resume(state_t *state, pending_t *pending, unsigned num_locals)
+{
+    state->reached = true;
+    state->depth = pending->depth;
+    memcpy(state->stack, pending->kinds, pending->depth);
+    memcpy(state->locals, pending->kinds + pending->depth, num_locals);
+    enif_free(pending->kinds);
+    pending->kinds = NULL;
+}
+
+static const char *pop(state_t *state, unsigned n, enum kind kind)
+{
+    if(state->depth < n) {
+        return "Stack limit is less than the operands";
+    }
+    for(unsigned i = 0; i < n; i++) {
+        unsigned char k = state->stack[state->depth - 1 - i];
+        if(kind == kind_tensor && k != kind_tensor) {
+            return "Should be tensors, but a boolean is on the stack";
+        }
+        if(kind == kind_bool && k != kind_bool) {
+            return "The stack top should be a boolean in case of conditional branch";
+        }
+    }
+    state->depth -= n;
+    return NULL;
+}
+
+static const char *push(state_t *state, unsigned char kind, unsigned max_stack, verify_result_t *result)
+{
+    if(state->depth >= max_stack) {
+        return "stack limit is over MAX_STACK";
+    }
+    state->stack[state->depth++] = kind;
+    if(state->depth > result->max_stack) {
+        result->max_stack = state->depth;
+    }
+    return NULL;
+}
+
+static const char *step(const verify_op_t *op, unsigned pc, state_t *state, pending_t *pending, unsigned num_locals, unsigned max_stack, verify_result_t *result)
+{
+    const char *error;
+    unsigned inst = op->inst;
+
+    if(IS_BINARY_INST(inst) || inst == INST_SCAL || inst == INST_DOT || inst == INST_GEMV || inst == INST_GEMM) {
+        return (error = pop(state, 2, kind_tensor)) != NULL ? error : push(state, kind_tensor, max_stack, result);
+    }
+    if(IS_UNARY_INST(inst) || IS_REDUCE_INST(inst) || inst == INST_AS_TYPE || inst == INST_COPY) {
+        return (error = pop(state, 1, kind_tensor)) != NULL ? error : push(state, kind_tensor, max_stack, result);
+    }
+
+    switch(inst) {
+        case INST_AXPY:
+            return (error = pop(state, 3, kind_tensor)) != NULL ? error : push(state, kind_tensor, max_stack, result);
+
+        case INST_AXPBY:
+            return (error = pop(state, 4, kind_tensor)) != NULL ? error : push(state, kind_tensor, max_stack, result);
+
+        case INST_SENDT:
+            return pop(state, 1, kind_tensor);
+
+        case INST_SENDE:
+            return NULL;
+
+        case INST_IS_SCALAR:
+            if((error = pop(state, 1, kind_tensor)) != NULL || (error = push(state, kind_tensor, max_stack, result)) != NULL) {
+                return error;
+            }
+            return push(state, kind_bool, max_stack, result);
+
+        case INST_SKIP:
+            if(op->conditional && (error = pop(state, 1, kind_bool)) != NULL) {
+                return error;
+            }
+            if((error = merge(&pending[op->target], state, num_locals)) != NULL) {
+                return error;
+            }
+            state->reached = op->conditional;
+            return NULL;
+
+        case INST_RETURN:
+            if(state->depth != 0) {
+                return "stack is not zero at return";
+            }
+            state->reached = false;
+            return NULL;
+
+        case INST_DUP:
+            if(state->depth == 0) {
+                return "stack should be greater than zero in case of dup";
+            }
+            return push(state, state->stack[state->depth - 1], max_stack, result);
+
+        case INST_POP:
+            return pop(state, 1, kind_none);
+
+        case INST_POP2:
+            return pop(state, 2, kind_none);
+
+        case INST_SWAP:
+            {
+                if(state->depth <= 1) {
+                    return "stack should be greater than one in case of swap";
+                }
+                unsigned char k = state->stack[state->depth - 1];
+                state->stack[state->depth - 1] = state->stack[state->depth - 2];
+                state->stack[state->depth - 2] = k;
+                return NULL;
+            }
+
+        case INST_ALOADT:
+            if(op->index >= result->args) {
+                result->args = op->index + 1;
+            }
+            return push(state, kind_tensor, max_stack, result);
+
+        case INST_FUSE:
+            if((error = pop(state, op->index, kind_tensor)) != NULL
+                || (error = push(state, kind_tensor, max_stack, result)) != NULL
+                || (error = merge(&pending[pc + 1 + op->length], state, num_locals)) != NULL) {
+                return error;
+            }
+            state->reached = false;
+            return NULL;
+
+        case INST_STORE:
+            if(state->depth == 0) {
+                return "stack should be greater than zero in case of store";
+            }
+            state->locals[op->index] = state->stack[--state->depth];
+            return NULL;
+
+        case INST_LOAD:
+        case INST_TAKE:
+            {
+                unsigned char k = state->locals[op->index];
+                if(k == kind_conflict) {
+                    return "The local may be a boolean or a tensor in case of load and take";
+                }
+                if(inst == INST_TAKE) {
+                    state->locals[op->index] = kind_none;
+                }
+                // A local which no path stores fails at run time before it is used.
+                return push(state, k == kind_none ? kind_tensor : k, max_stack, result);
+            }
+
+        default:
+            return "unexpected";
+    }
+}
+
+const char *verify(const verify_op_t *ops, unsigned length, unsigned num_locals, unsigned max_stack, verify_result_t *result)
+{
+    result->max_stack = 0;
+    result->args = 0;
+    result->pc = 0;
+
+    pending_t *pending = enif_alloc(sizeof(pending_t) * (length + 1));
+    unsigned char *kinds = enif_alloc(max_stack + num_locals + 1);
+    if(pending == NULL || kinds == NULL) {
+        if(pending != NULL) {
+            enif_free(pending);
+        }
+        if(kinds != NULL) {
+            enif_free(kinds);
+        }
+        return "Fail to alloc memory";
+    }
+    for(unsigned pc = 0; pc <= length; pc++) {
+        pending[pc].kinds = NULL;
+    }
+    state_t state = {.reached = true, .depth = 0, .stack = kinds, .locals = kinds + max_stack};
+    memset(state.locals, kind_none, num_locals);
+
+    const char *error = NULL;
+    for(unsigned pc = 0; pc <= length && error == NULL; pc++) {
+        result->pc = pc;
+        if(pending[pc].kinds != NULL) {
+            if(state.reached) {
+                error = merge(&pending[pc], &state, num_locals);
+                if(error != NULL) {
+                    break;
+                }
+            }
+            resume(&state, &pending[pc], num_locals);
+        }
+        if(pc == length) {
+            if(state.reached && state.depth != 0) {
+                error = "stack is not zero at the end of code";
+            }
+            break;
+        }
+        // Code which no path reaches is never run.
+        if(state.reached) {
+            error = step(&ops[pc], pc, &state, pending, num_locals, max_stack, result);
+        }
+    }
+
+    for(unsigned pc = 0; pc <= length; pc++) {
+        if(pending[pc].kinds != NULL) {
+            enif_free(pending[pc].kinds);
+        }
+    }
+    enif_free(kinds);
+    enif_free(pending);
+    return error;
+}
@@ -0,0 +1,51 @@
+#ifndef PELEMAY_ENGINE_VERIFY_H
+#define PELEMAY_ENGINE_VERIFY_H
+
+#include <stdbool.h>
+
+/*
+ * An instruction of a program to verify.
+ *
+ * index is the index of the argument for aloadt, that of the local for
+ * store, load and take, and the number of the inputs for fuse.
+ * length is the length of the body of fuse.
+ * target is the absolute target of skip, which is conditional
+ * if it pops a boolean.
+ */
+typedef struct verify_op {
+    unsigned inst;
+    unsigned index;
+    unsigned length;
+    unsigned target;
+    bool conditional;
+} verify_op_t;
+
+/*
+ * What execute() may assume of a verified program.
+ *
+ * max_stack is the maximum depth of the stack over all the paths,
+ * and args is the number of the arguments which aloadt reads.
+ * pc is the instruction which fails verification.
+ */
+typedef struct verify_result {
+    unsigned max_stack;
+    unsigned args;
+    unsigned pc;
+} verify_result_t;
+
+/*
+ * Checks the stack of a program along every path of skip, which only
+ * jumps forward, by interpreting it over the kinds of the values: tensors,
+ * which are tensors or scalars, and the booleans of is_scalar.
+ *
+ * On success, every instruction finds as many values on the stack as it pops,
+ * of the kinds which it expects, the stack is within max_stack, and it is
+ * empty at return and at the end of the code, so that execute() checks
+ * none of them at run time. Whether a local is stored before load and take,
+ * and whether a tensor is a scalar, depend on the run, and are still checked.
+ *
+ * Returns NULL on success, or the message of the error.
+ */
+const char *verify(const verify_op_t *ops, unsigned length, unsigned num_locals, unsigned max_stack, verify_result_t *result);
+
+#endif // PELEMAY_ENGINE_VERIFY_H
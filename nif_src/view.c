@@ -0,0 +1,90 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "view.h"
+
+void view_contiguous_strides(unsigned rank, const uint64_t *shape, uint64_t *strides)
+{
+    uint64_t stride = 1;
+    for(unsigned i = rank; i > 0; i--) {
+        strides[i - 1] = stride;
+        stride *= shape[i - 1];
+    }
+}
+
+bool view_is_contiguous(unsigned rank, const uint64_t *shape, const uint64_t *strides)
+{
+    uint64_t stride = 1;
+    for(unsigned i = rank; i > 0; i--) {
+        if(shape[i - 1] != 1 && strides[i - 1] != stride) {
+            return false;
+        }
+        stride *= shape[i - 1];
+    }
+    return true;
+}
+
+uint64_t view_rows(unsigned rank, const uint64_t *shape, uint64_t *length)
+{
+    if(rank == 0) {
+        *length = 1;
+        return 1;
+    }
+    uint64_t rows = 1;
+    for(unsigned i = 0; i + 1 < rank; i++) {
+        rows *= shape[i];
+    }
+    *length = shape[rank - 1];
+    return rows;
+}
+
+uint64_t view_row_offset(unsigned rank, const uint64_t *shape, const uint64_t *strides, uint64_t row)
+{
+    uint64_t offset = 0;
+    if(rank == 0) {
+        return 0;
+    }
+    for(unsigned i = rank - 1; i > 0 && row > 0; i--) {
+        offset += (row % shape[i - 1]) * strides[i - 1];
+        row /= shape[i - 1];
+    }
+    return offset;
+}
+
+// The sizes are constants in each case, so that memcpy is a move of a register.
+#define GATHER_ROW(size) \
+    for(uint64_t i = 0; i < n; i++) { \
+        memcpy(o + i * (size), p + i * stride * (size), (size)); \
+    } \
+    break;
+
+void view_gather_row(const void *in, size_t element_size, uint64_t n, uint64_t stride, void *out)
+{
+    const char *p = in;
+    char *o = out;
+    if(stride == 1) {
+        memcpy(out, in, n * element_size);
+        return;
+    }
+    switch(element_size) {
+        case 1: GATHER_ROW(1)
+        case 2: GATHER_ROW(2)
+        case 4: GATHER_ROW(4)
+        case 8: GATHER_ROW(8)
+        case 16: GATHER_ROW(16)
+        default: GATHER_ROW(element_size)
+    }
+}
+
+void view_gather(const void *data, size_t element_size, unsigned rank, const uint64_t *shape, const uint64_t *strides, void *out)
+{
+    uint64_t length;
+    uint64_t rows = view_rows(rank, shape, &length);
+    uint64_t stride = rank == 0 ? 1 : strides[rank - 1];
+    for(uint64_t row = 0; row < rows; row++) {
+        const char *in = (const char *)data + view_row_offset(rank, shape, strides, row) * element_size;
+        view_gather_row(in, element_size, length, stride, (char *)out + row * length * element_size);
+    }
+}
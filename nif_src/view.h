@@ -0,0 +1,51 @@
+#ifndef PELEMAY_ENGINE_VIEW_H
+#define PELEMAY_ENGINE_VIEW_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Strided views.
+ *
+ * A view is the data of a tensor addressed by the strides of the axes
+ * in elements: the element at the indices i is at sum(i[k] * strides[k]).
+ * A stride of 0 broadcasts the axis.
+ *
+ * The elements are walked by rows, which are the last axis,
+ * so that the kernels run over a row whose stride is 1 or 0.
+ * A tensor of rank 0 is one row of one element.
+ */
+
+/*
+ * Gets the strides of the shape in row major order.
+ */
+void view_contiguous_strides(unsigned rank, const uint64_t *shape, uint64_t *strides);
+
+/*
+ * Whether the strides address the elements of the shape in row major order,
+ * ignoring the axes of size 1.
+ */
+bool view_is_contiguous(unsigned rank, const uint64_t *shape, const uint64_t *strides);
+
+/*
+ * Gets the number of the rows and the length of a row.
+ */
+uint64_t view_rows(unsigned rank, const uint64_t *shape, uint64_t *length);
+
+/*
+ * Gets the offset in elements of the first element of the row-th row.
+ */
+uint64_t view_row_offset(unsigned rank, const uint64_t *shape, const uint64_t *strides, uint64_t row);
+
+/*
+ * Copies n elements of element_size bytes at the stride from in to out contiguously.
+ */
+void view_gather_row(const void *in, size_t element_size, uint64_t n, uint64_t stride, void *out);
+
+/*
+ * Copies the elements of the view into out in row major order.
+ */
+void view_gather(const void *data, size_t element_size, unsigned rank, const uint64_t *shape, const uint64_t *strides, void *out);
+
+#endif // PELEMAY_ENGINE_VIEW_H
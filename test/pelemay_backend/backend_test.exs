@@ -7,6 +7,21 @@ defmodule PelemayBackend.BackendTest do
     :ok
   end
 
+  defp assert_same(actual, expected) do
+    assert Nx.type(actual) == Nx.type(expected)
+    assert Nx.shape(actual) == Nx.shape(expected)
+    assert Nx.to_binary(actual) == Nx.to_binary(expected)
+  end
+
+  defp assert_close(actual, expected, rtol) do
+    assert Nx.type(actual) == Nx.type(expected)
+    assert Nx.shape(actual) == Nx.shape(expected)
+
+    for {a, e} <- Enum.zip(Nx.to_flat_list(actual), Nx.to_flat_list(expected)) do
+      assert abs(a - e) <= rtol * abs(e), "#{a} is not close to #{e}"
+    end
+  end
+
   test "multiply scalar and vector" do
     assert Nx.multiply(2.0, Nx.tensor([1.0, 2.0], type: {:f, 32})) ==
              Nx.tensor([2.0, 4.0], type: {:f, 32})
@@ -23,11 +38,195 @@ defmodule PelemayBackend.BackendTest do
     assert Nx.multiply(4.0, Nx.tensor([3.0, 4.0, 5.0], type: {:f, 64})) ==
              Nx.tensor([12.0, 16.0, 20.0], type: {:f, 64})
 
-    assert_raise RuntimeError, fn ->
-      Nx.multiply(Nx.tensor([1.0, 2.0]), Nx.tensor([2.0, 4.0]))
+    assert Nx.multiply(Nx.tensor([1.0, 2.0]), Nx.tensor([2.0, 4.0])) == Nx.tensor([2.0, 8.0])
+  end
+
+  test "dot of vectors and matrices" do
+    for type <- [{:f, 32}, {:f, 64}] do
+      v = Nx.tensor([1.0, 2.0, 3.0], type: type)
+      m = Nx.tensor([[1.0, 2.0, 3.0], [4.0, 5.0, 6.0]], type: type)
+      bm = Nx.backend_copy(m, Nx.BinaryBackend)
+      bv = Nx.backend_copy(v, Nx.BinaryBackend)
+
+      assert Nx.dot(v, v) == Nx.tensor(14.0, type: type)
+      assert Nx.dot(m, v) == Nx.tensor([14.0, 32.0], type: type)
+      assert Nx.dot(Nx.tensor([1.0, 2.0], type: type), m) ==
+               Nx.tensor([9.0, 12.0, 15.0], type: type)
+
+      for {c1, c2} <- [{[1], [1]}, {[0], [0]}, {[1], [0]}, {[0], [1]}],
+          left = if(c1 == [1], do: m, else: Nx.transpose(m)),
+          right = if(c2 == [1], do: m, else: Nx.transpose(m)) do
+        expected =
+          Nx.dot(
+            Nx.backend_copy(left, Nx.BinaryBackend),
+            c1,
+            Nx.backend_copy(right, Nx.BinaryBackend),
+            c2
+          )
+
+        assert_same(Nx.dot(left, c1, right, c2), expected)
+      end
+
+      assert_same(Nx.dot(m, [1], v, [0]), Nx.dot(bm, [1], bv, [0]))
+    end
+  end
+
+  test "elementwise binary operations match Nx.BinaryBackend" do
+    ops =
+      [:add, :subtract, :remainder, :min, :max, :divide, :power, :atan2, :quotient] ++
+        [:bitwise_and, :bitwise_or, :bitwise_xor, :left_shift, :right_shift] ++
+        [:equal, :not_equal, :greater, :less, :greater_equal, :less_equal] ++
+        [:logical_and, :logical_or, :logical_xor]
+
+    for type <- [{:s, 8}, {:s, 32}, {:s, 64}, {:u, 8}, {:u, 16}, {:u, 64}, {:f, 32}, {:f, 64}],
+        op <- ops,
+        op not in [:quotient, :bitwise_and, :bitwise_or, :bitwise_xor] or elem(type, 0) != :f,
+        op not in [:left_shift, :right_shift] or elem(type, 0) != :f do
+      left = Nx.tensor([[1, 7, 0], [12, 5, 3]], type: type, backend: Nx.BinaryBackend)
+      right = Nx.tensor([3, 2, 5], type: type, backend: Nx.BinaryBackend)
+      scalar = Nx.tensor(2, type: type, backend: Nx.BinaryBackend)
+
+      for {l, r} <- [{left, right}, {left, scalar}, {scalar, right}] do
+        expected = apply(Nx, op, [l, r])
+
+        actual =
+          apply(Nx, op, [
+            Nx.backend_copy(l, PelemayBackend.Backend),
+            Nx.backend_copy(r, PelemayBackend.Backend)
+          ])
+
+        assert_same(actual, expected)
+      end
+    end
+  end
+
+  test "elementwise unary operations are close to Nx.BinaryBackend" do
+    for {type, rtol} <- [{{:f, 32}, 1.0e-6}, {{:f, 64}, 1.0e-14}],
+        op <- [:exp, :log, :log1p, :sigmoid, :tanh, :erf, :sqrt, :rsqrt, :abs] do
+      input =
+        if op in [:log, :log1p, :sqrt, :rsqrt] do
+          [[0.25, 0.5, 1.0], [2.0, 3.5, 7.0]]
+        else
+          [[-3.5, -1.0, -0.25], [0.125, 0.5, 2.0]]
+        end
+
+      t = Nx.tensor(input, type: type, backend: Nx.BinaryBackend)
+      expected = apply(Nx, op, [t])
+      actual = apply(Nx, op, [Nx.backend_copy(t, PelemayBackend.Backend)])
+      assert_close(actual, expected, rtol)
+    end
+
+    for type <- [{:s, 32}, {:s, 64}] do
+      t = Nx.tensor([-3, 0, 5], type: type, backend: Nx.BinaryBackend)
+      assert_same(Nx.abs(Nx.backend_copy(t, PelemayBackend.Backend)), Nx.abs(t))
+      assert_close(Nx.exp(Nx.backend_copy(t, PelemayBackend.Backend)), Nx.exp(t), 1.0e-6)
     end
   end
 
+  test "as_type and 16 bit floats match Nx.BinaryBackend" do
+    types = [{:s, 8}, {:s, 64}, {:u, 16}, {:u, 64}, {:f, 16}, {:bf, 16}, {:f, 32}, {:f, 64}]
+
+    for from <- types, to <- types do
+      t = Nx.tensor([0, 1, 5, 100], type: from, backend: Nx.BinaryBackend)
+      assert_same(Nx.as_type(Nx.backend_copy(t, PelemayBackend.Backend), to), Nx.as_type(t, to))
+    end
+
+    for type <- [{:f, 16}, {:bf, 16}], op <- [:add, :multiply, :max, :less] do
+      left = Nx.tensor([0.5, 1.5, -3.0], type: type, backend: Nx.BinaryBackend)
+      right = Nx.tensor([2.0, 0.25, 1.0], type: type, backend: Nx.BinaryBackend)
+      native = Enum.map([left, right], &Nx.backend_copy(&1, PelemayBackend.Backend))
+      actual = apply(Nx, op, native)
+
+      assert_same(actual, apply(Nx, op, [left, right]))
+    end
+  end
+
+  test "reductions match Nx.BinaryBackend" do
+    input = [
+      [[1, 7, 0, 4], [12, 5, 3, 5]],
+      [[2, 12, 9, 1], [0, 6, 3, 8]],
+      [[5, 5, 1, 2], [7, 0, 4, 6]]
+    ]
+
+    for type <- [{:s, 32}, {:s, 64}, {:u, 8}, {:f, 32}, {:f, 64}],
+        op <- [:sum, :product, :reduce_max, :reduce_min, :all, :any],
+        axes <- [nil, [0], [1], [2], [0, 1], [0, 2], [1, 2]],
+        keep_axes <- [false, true] do
+      t = Nx.tensor(input, type: type, backend: Nx.BinaryBackend)
+      opts = [axes: axes, keep_axes: keep_axes]
+      expected = apply(Nx, op, [t, opts])
+      actual = apply(Nx, op, [Nx.backend_copy(t, PelemayBackend.Backend), opts])
+      assert_same(actual, expected)
+    end
+
+    for type <- [{:s, 32}, {:f, 32}, {:f, 64}],
+        op <- [:argmax, :argmin],
+        axis <- [nil, 0, 1, 2],
+        tie_break <- [:low, :high] do
+      t = Nx.tensor(input, type: type, backend: Nx.BinaryBackend)
+      opts = [axis: axis, tie_break: tie_break]
+      expected = apply(Nx, op, [t, opts])
+      actual = apply(Nx, op, [Nx.backend_copy(t, PelemayBackend.Backend), opts])
+      assert_same(actual, expected)
+    end
+  end
+
+  test "views match Nx.BinaryBackend" do
+    for backend <- [PelemayBackend.Backend, {PelemayBackend.Backend, storage: :buffer}] do
+      expected = Nx.iota({4, 6}, type: {:f, 32}, backend: Nx.BinaryBackend)
+      t = Nx.iota({4, 6}, type: {:f, 32}, backend: backend)
+
+      views = [
+        &Nx.slice(&1, [1, 2], [2, 3]),
+        &Nx.slice(&1, [0, 1], [4, 5], strides: [2, 2]),
+        &Nx.transpose/1,
+        &(&1 |> Nx.transpose() |> Nx.reshape({3, 8})),
+        &(&1 |> Nx.slice([1, 0], [1, 6]) |> Nx.squeeze()),
+        &(&1 |> Nx.slice([0, 2], [4, 1]) |> Nx.broadcast({2, 4, 3}, axes: [1, 2])),
+        &(&1 |> Nx.slice_along_axis(1, 2, axis: 1) |> Nx.reshape({2, 4}))
+      ]
+
+      for view <- views do
+        assert_same(view.(t), view.(expected))
+        assert_same(Nx.exp(view.(t)), Nx.exp(view.(expected)))
+        assert_same(Nx.add(view.(t), 1.0), Nx.add(view.(expected), 1.0))
+        assert_same(Nx.sum(view.(t), axes: [0]), Nx.sum(view.(expected), axes: [0]))
+      end
+
+      # A row broadcast against the transposed tensor, neither of which is copied.
+      row = Nx.slice(t, [0, 0], [1, 4])
+      expected_row = Nx.slice(expected, [0, 0], [1, 4])
+      expected_product = Nx.multiply(Nx.transpose(expected), Nx.squeeze(expected_row))
+      assert_same(Nx.multiply(Nx.transpose(t), Nx.squeeze(row)), expected_product)
+
+      zeros = Nx.broadcast(Nx.tensor(0.0), {6, 4})
+      assert_same(Nx.subtract(Nx.transpose(t), Nx.transpose(t)), zeros)
+    end
+  end
+
+  test "tensors in native buffers" do
+    input = [[1.0, -2.0, 0.5], [3.0, 4.0, -0.25]]
+    expected = Nx.tensor(input, type: {:f, 32}, backend: Nx.BinaryBackend)
+    t = Nx.tensor(input, type: {:f, 32}, backend: {PelemayBackend.Backend, storage: :buffer})
+    assert is_reference(t.data.state)
+    assert_same(t, expected)
+
+    # The results of the native operations stay in native buffers.
+    result = Nx.exp(Nx.add(t, t))
+    assert is_reference(result.data.state)
+    assert_close(result, Nx.exp(Nx.add(expected, expected)), 1.0e-6)
+    assert_same(Nx.sum(t, axes: [1]), Nx.sum(expected, axes: [1]))
+    assert_same(Nx.transpose(t), Nx.transpose(expected))
+
+    transferred = Nx.backend_transfer(t, Nx.BinaryBackend)
+    assert is_struct(transferred.data, Nx.BinaryBackend)
+    assert_same(transferred, expected)
+    assert Nx.backend_deallocate(t) == :already_deallocated
+    assert_raise RuntimeError, fn -> Nx.exp(t) end
+
+    assert Nx.backend_deallocate(result) == :ok
+  end
+
   @precision_error_doctests [
     expm1: 1,
     erfc: 1,
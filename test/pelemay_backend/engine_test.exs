@@ -1,4 +1,439 @@
 defmodule PelemayBackend.EngineTest do
   use ExUnit.Case
   doctest PelemayBackend.Engine
+
+  alias PelemayBackend.Engine
+
+  defp arg(tensor), do: {Nx.size(tensor), Nx.shape(tensor), Nx.type(tensor), Nx.to_binary(tensor)}
+
+  test "a loaded program can be executed many times" do
+    program =
+      """
+      aloadt 0
+      copy
+      aloadt 1
+      scal 1
+      sendt
+      """
+      |> Engine.assemble()
+      |> Engine.load()
+
+    x = Nx.tensor([1.0, 2.0, 3.0], type: {:f, 32}, backend: Nx.BinaryBackend)
+
+    for s <- [2.0, 3.0] do
+      scalar = Nx.tensor(s, type: {:f, 32}, backend: Nx.BinaryBackend)
+      assert :ok == Engine.execute(program, [arg(x), arg(scalar)], self())
+      assert_receive {:result, binary, {3}, {:f, 32}}
+      assert Nx.from_binary(binary, {:f, 32}, backend: Nx.BinaryBackend) == Nx.multiply(x, s)
+    end
+  end
+
+  test "scal with an increment scales every increment-th element within the tensor" do
+    program = "aloadt 0\naloadt 1\nscal 2\nsendt\n" |> Engine.assemble() |> Engine.load()
+    x = Nx.tensor([1.0, 2.0, 3.0, 4.0, 5.0], type: {:f, 64}, backend: Nx.BinaryBackend)
+    s = Nx.tensor(10.0, type: {:f, 64}, backend: Nx.BinaryBackend)
+
+    assert {:ok, {{binary, {5}, {:f, 64}}}} = Engine.execute(program, [arg(x), arg(s)])
+    assert binary == Nx.to_binary(Nx.tensor([10.0, 2.0, 30.0, 4.0, 50.0], type: {:f, 64}))
+  end
+
+  test "results are returned in the order of sendt, and sende returns the error" do
+    program =
+      """
+      aloadt 0
+      dup
+      exp
+      sendt
+      sendt
+      """
+      |> Engine.assemble()
+      |> Engine.load()
+
+    x = Nx.tensor([0.0, 1.0], type: {:f, 64}, backend: Nx.BinaryBackend)
+    result = Engine.execute(program, [arg(x)])
+    assert {:ok, {{exp, {2}, {:f, 64}}, {binary, {2}, {:f, 64}}}} = result
+    assert binary == Nx.to_binary(x)
+    assert exp == Nx.to_binary(Nx.exp(x))
+    refute_received {:result, _, _, _}
+
+    assert_raise RuntimeError, ~r/should send one tensor/, fn -> Engine.run(program, [x]) end
+
+    program = "sende 'failed'\n" |> Engine.assemble() |> Engine.load()
+    assert {:error, ~c"failed"} == Engine.execute(program, [])
+  end
+
+  test "submitted jobs deliver their results later" do
+    program = "aloadt 0\nexp\nsendt\n" |> Engine.assemble() |> Engine.load()
+    xs = for i <- 1..8, do: Nx.tensor([0.0, i * 1.0], type: {:f, 64}, backend: Nx.BinaryBackend)
+
+    jobs =
+      for x <- xs do
+        assert {:ok, job} = Engine.submit(program, [x])
+        job
+      end
+
+    for {job, x} <- Enum.zip(jobs, xs) do
+      assert {{binary, {2}, {:f, 64}}} = Engine.await(job)
+      assert binary == Nx.to_binary(Nx.exp(x))
+      # A finished job cannot be cancelled.
+      refute Engine.cancel(job)
+    end
+
+    {:ok, job} = Engine.submit("sende 'failed'\n" |> Engine.assemble(), [])
+    assert_raise RuntimeError, ~r/failed/, fn -> Engine.await(job) end
+  end
+
+  test "take moves a local, which cannot be loaded after" do
+    program =
+      """
+      aloadt 0
+      exp
+      dup
+      store 0
+      take 0
+      add
+      sendt
+      """
+      |> Engine.assemble()
+      |> Engine.load()
+
+    x = Nx.tensor([0.0, 1.0], type: {:f, 64}, backend: Nx.BinaryBackend)
+    assert {:ok, {{binary, {2}, {:f, 64}}}} = Engine.execute(program, [arg(x)])
+    assert binary == Nx.to_binary(Nx.multiply(Nx.exp(x), 2))
+
+    program =
+      "aloadt 0\nstore 0\ntake 0\nload 0\npop\nsendt\n"
+      |> Engine.assemble()
+      |> Engine.load()
+
+    error = ~c"the local should be stored before load"
+    assert {:error, error} == Engine.execute(program, [arg(x)])
+  end
+
+  test "a donated buffer is overwritten in place" do
+    program = "aloadt 0\nexp\nsendt\n" |> Engine.assemble() |> Engine.load()
+    x = Nx.tensor([0.0, 1.0], type: {:f, 64}, backend: Nx.BinaryBackend)
+
+    buffer = PelemayBackend.NIF.buffer_from_binary(Nx.to_binary(x))
+    {size, shape, type, _} = arg(x)
+    args = [{size, shape, type, buffer}]
+    assert {:ok, {{result, {2}, {:f, 64}}}} = Engine.execute(program, args, :return, :buffer)
+    assert result != buffer
+    assert PelemayBackend.NIF.buffer_to_binary(buffer) == Nx.to_binary(x)
+
+    assert {:ok, {{^buffer, {2}, {:f, 64}}}} =
+             Engine.execute(program, [{size, shape, type, buffer, :donate}], :return, :buffer)
+
+    assert PelemayBackend.NIF.buffer_to_binary(buffer) == Nx.to_binary(Nx.exp(x))
+
+    # A buffer which is another argument as well is not donated.
+    other = PelemayBackend.NIF.buffer_from_binary(Nx.to_binary(x))
+    args = [{size, shape, type, other, :donate}, {size, shape, type, other}]
+    assert {:ok, {{result, {2}, {:f, 64}}}} = Engine.execute(program, args, :return, :buffer)
+    assert result != other
+    assert PelemayBackend.NIF.buffer_to_binary(other) == Nx.to_binary(x)
+  end
+
+  test "the results outlive the buffers which the next executions reuse" do
+    program = "aloadt 0\nexp\ndup\nsendt\nexp\nsendt\n" |> Engine.assemble() |> Engine.load()
+    x = Nx.tensor([0.0, 1.0], type: {:f, 64}, backend: Nx.BinaryBackend)
+    y = Nx.tensor([2.0, 3.0], type: {:f, 64}, backend: Nx.BinaryBackend)
+
+    result = Engine.execute(program, [arg(x)], :return, :buffer)
+    assert {:ok, {{exp, _, _}, {buffer, _, _}}} = result
+    assert {:ok, {{binary, _, _}, _}} = Engine.execute(program, [arg(y)])
+
+    assert PelemayBackend.NIF.buffer_to_binary(exp) == Nx.to_binary(Nx.exp(x))
+    assert PelemayBackend.NIF.buffer_to_binary(buffer) == Nx.to_binary(Nx.exp(Nx.exp(x)))
+    assert binary == Nx.to_binary(Nx.exp(y))
+  end
+
+  test "a batch runs each set of arguments and reports the errors of each" do
+    program = "aloadt 0\nexp\nsendt\n" |> Engine.assemble() |> Engine.load()
+    x = Nx.tensor([0.0, 1.0], type: {:f, 64}, backend: Nx.BinaryBackend)
+    y = Nx.tensor([2.0, 3.0, 4.0], type: {:f, 64}, backend: Nx.BinaryBackend)
+
+    assert [{:ok, {{ex, {2}, {:f, 64}}}}, {:error, _}, {:ok, {{ey, {3}, {:f, 64}}}}] =
+             Engine.execute_batch(program, [[arg(x)], [], [arg(y)]])
+
+    assert ex == Nx.to_binary(Nx.exp(x))
+    assert ey == Nx.to_binary(Nx.exp(y))
+
+    assert [{{^ex, {2}, {:f, 64}}}, {{^ey, {3}, {:f, 64}}}] =
+             Engine.run_batch(program, [[x], [y]])
+
+    assert [] == Engine.run_batch(program, [])
+  end
+
+  test "a view is read by its offset and strides" do
+    program = "aloadt 0\naloadt 1\nadd\nsendt\n" |> Engine.assemble() |> Engine.load()
+    x = Nx.iota({3, 4}, type: {:s, 32}, backend: Nx.BinaryBackend)
+    {_, _, type, binary} = arg(x)
+
+    # The second column, transposed, plus the first row broadcast as the columns.
+    column = {3, {1, 3}, type, binary, {1, {0, 4}}}
+    row = {3, {1, 3}, type, binary, {0, {0, 1}}}
+    assert {:ok, {{result, {1, 3}, {:s, 32}}}} = Engine.execute(program, [column, row])
+    assert result == <<1::32-signed-native, 6::32-signed-native, 11::32-signed-native>>
+
+    broadcast = {6, {2, 3}, type, binary, {8, {0, 1}}}
+    assert {:ok, {{result, {2, 3}, {:s, 32}}}} = Engine.execute(program, [broadcast, broadcast])
+    sums = <<16::32-signed-native, 18::32-signed-native, 20::32-signed-native>>
+    assert result == :binary.copy(sums, 2)
+
+    # A view out of the data is rejected.
+    assert {:error, _} = Engine.execute(program, [{3, {3}, type, binary, {10, {1}}}, row])
+
+    # So is a contiguous view whose size is over its shape, and one whose extent overflows.
+    pair = {2, {2}, type, binary, {2, {1}}}
+    assert {:ok, _} = Engine.execute(program, [{2, {2}, type, binary, {0, {1}}}, pair])
+    assert {:error, _} = Engine.execute(program, [{100, {2}, type, binary, {0, {1}}}, pair])
+    overflow = {3, {3}, type, binary, {0, {0x8000000000000000}}}
+    assert {:error, _} = Engine.execute(program, [overflow, row])
+  end
+
+  test "as_type converts between the real types, saturating floats into integers" do
+    program =
+      """
+      aloadt 0
+      as_type {:f, 16}
+      dup
+      add
+      as_type {:s, 8}
+      sendt
+      """
+      |> Engine.assemble()
+      |> Engine.load()
+
+    x = Nx.tensor([1.5, -300.0, 2.25], type: {:f, 32}, backend: Nx.BinaryBackend)
+    assert {:ok, {{binary, {3}, {:s, 8}}}} = Engine.execute(program, [arg(x)])
+    assert binary == <<3::8-signed, -128::8-signed, 4::8-signed>>
+  end
+
+  test "fuse computes a chain of elementwise operations in one loop" do
+    program =
+      """
+      aloadt 0
+      aloadt 1
+      aloadt 2
+      fuse {3, 6}
+      aloadt 0
+      aloadt 1
+      multiply
+      aloadt 2
+      add
+      exp
+      sendt
+      """
+      |> Engine.assemble()
+      |> Engine.load()
+
+    a = Nx.iota({2000}, type: {:f, 64}, backend: Nx.BinaryBackend) |> Nx.divide(1000)
+    b = Nx.iota({2000}, type: {:f, 64}, backend: Nx.BinaryBackend) |> Nx.divide(-2000)
+    c = Nx.tensor(2.0, type: {:f, 64}, backend: Nx.BinaryBackend)
+    assert :ok == Engine.execute(program, [arg(a), arg(c), arg(b)], self())
+    assert_receive {:result, binary, {2000}, {:f, 64}}
+    result = Nx.from_binary(binary, {:f, 64}, backend: Nx.BinaryBackend)
+    assert Nx.to_number(Nx.all_close(result, Nx.exp(Nx.add(Nx.multiply(a, c), b)))) == 1
+  end
+
+  test "swap and dup before a binary operation compute as on the stack" do
+    x = Nx.tensor([1.0, 2.0, 3.0], type: {:f, 64}, backend: Nx.BinaryBackend)
+    y = Nx.tensor([10.0, 20.0, 30.0], type: {:f, 64}, backend: Nx.BinaryBackend)
+
+    program = "aloadt 0\naloadt 1\nswap\nsubtract\nsendt\n" |> Engine.assemble() |> Engine.load()
+    assert {:ok, {{binary, {3}, {:f, 64}}}} = Engine.execute(program, [arg(x), arg(y)])
+    assert binary == Nx.to_binary(Nx.subtract(y, x))
+
+    program =
+      "aloadt 0\ncopy\ndup\nmultiply\ndup\nstore 0\ntake 0\nadd\nsendt\n"
+      |> Engine.assemble()
+      |> Engine.load()
+
+    assert {:ok, {{binary, {3}, {:f, 64}}}} = Engine.execute(program, [arg(x)])
+    assert binary == Nx.to_binary(Nx.multiply(Nx.multiply(x, x), 2))
+  end
+
+  test "a program deeper than the stack on the native stack runs with the stack allocated" do
+    code = String.duplicate("aloadt 0\n", 200) <> String.duplicate("add\n", 199) <> "sendt\n"
+    program = code |> Engine.assemble(optimize: false) |> Engine.load()
+    x = Nx.tensor([1.0, 2.0], type: {:f, 64}, backend: Nx.BinaryBackend)
+
+    assert {:ok, {{binary, {2}, {:f, 64}}}} = Engine.execute(program, [arg(x)])
+    assert binary == Nx.to_binary(Nx.multiply(x, 200))
+  end
+
+  test "assemble optimizes the code, which computes as before" do
+    assert Engine.assemble("aloadt 0\ncopy\naloadt 1\ndup\npop\nscal 1\nsendt\nreturn\nexp\n") ==
+             Engine.assemble("aloadt 0\naloadt 1\nscal 1\nsendt\nreturn\n", optimize: false)
+
+    code = "aloadt 0\nis_scalar\nskip {0, {:if, true}}\nskip {1, true}\nexp\nsendt\n"
+    expected = Engine.assemble("aloadt 0\nis_scalar\npop\nsendt\n", optimize: false)
+    assert Engine.assemble(code) == expected
+
+    # The target of skip is moved over the removed instructions.
+    code = "aloadt 0\nis_scalar\nskip {5, {:if, true}}\ndup\nswap\nswap\npop\nexp\nsendt\n"
+    program = Engine.assemble(code)
+    code = "aloadt 0\nis_scalar\nskip {1, {:if, true}}\nexp\nsendt\n"
+    assert program == Engine.assemble(code, optimize: false)
+
+    x = Nx.tensor([0.0, 1.0], type: {:f, 64}, backend: Nx.BinaryBackend)
+    s = Nx.tensor(2.0, type: {:f, 64}, backend: Nx.BinaryBackend)
+    assert {{binary, _, _}} = Engine.run_all(program, [x])
+    assert binary == Nx.to_binary(Nx.exp(x))
+    assert {{binary, _, _}} = Engine.run_all(program, [s])
+    assert binary == Nx.to_binary(s)
+
+    # alpha * x + beta * y by axpby
+    code = "aloadt 0\naloadt 1\naloadt 2\nscal 1\naloadt 3\naxpy\nsendt\n"
+    axpby = Map.get(Engine.instruction_code(), :axpby)
+    assert [_, _, _, _, {^axpby, nil}, _] = Engine.assemble(code)
+    y = Nx.tensor([10.0, 20.0], type: {:f, 64}, backend: Nx.BinaryBackend)
+    beta = Nx.tensor(3, type: {:s, 32}, backend: Nx.BinaryBackend)
+    expected = Nx.add(Nx.multiply(x, s), Nx.multiply(y, 3)) |> Nx.to_binary()
+
+    for optimize <- [true, false] do
+      program = Engine.assemble(code, optimize: optimize)
+      assert {{^expected, {2}, {:f, 64}}} = Engine.run_all(program, [x, y, beta, s])
+    end
+  end
+
+  test "large tensors are computed in chunks by the pool" do
+    program =
+      """
+      aloadt 0
+      dup
+      aloadt 1
+      multiply
+      dup
+      fuse {2, 3}
+      aloadt 0
+      aloadt 1
+      add
+      add
+      sum {1, false}
+      sendt
+      """
+      |> Engine.assemble()
+      |> Engine.load()
+
+    # 8 MiB, over the thresholds of the pool and of the reduction.
+    a = Nx.iota({1_048_576}, type: {:f, 64}, backend: Nx.BinaryBackend) |> Nx.remainder(1000)
+    c = Nx.tensor(0.5, type: {:f, 64}, backend: Nx.BinaryBackend)
+    assert {:ok, {{binary, {}, {:f, 64}}}} = Engine.execute(program, [arg(a), arg(c)])
+
+    # a + 2 * a * c is exact, and so is the sum of the integers.
+    expected = Nx.sum(Nx.add(a, Nx.multiply(Nx.multiply(a, c), 2)))
+    assert binary == Nx.to_binary(expected)
+  end
+
+  test "stats count the instructions executed while they are enabled" do
+    program = "aloadt 0\nexp\nsendt\n" |> Engine.assemble() |> Engine.load()
+    x = Nx.tensor([0.0, 1.0, 2.0], type: {:f, 64}, backend: Nx.BinaryBackend)
+
+    previous = Engine.enable_stats(true)
+
+    try do
+      Engine.reset_stats()
+      assert {:ok, _} = Engine.execute(program, [arg(x)])
+      assert {:ok, _} = Engine.execute(program, [arg(x)])
+
+      assert %{exp: %{executions: 2, elements: 6, bytes: 48}} = Engine.stats()
+      assert [{:aloadt, _}, {:exp, %{executions: 2}}, {:sendt, _}] = Engine.program_stats(program)
+
+      Engine.enable_stats(false)
+      assert {:ok, _} = Engine.execute(program, [arg(x)])
+      assert %{exp: %{executions: 2}} = Engine.stats()
+    after
+      Engine.enable_stats(previous)
+    end
+  end
+
+  test "telemetry events carry the counters of the program while the stats are enabled" do
+    program = "aloadt 0\nexp\nsendt\n" |> Engine.assemble() |> Engine.load()
+    x = Nx.tensor([0.0, 1.0, 2.0], type: {:f, 64}, backend: Nx.BinaryBackend)
+    parent = self()
+    handler = "engine-telemetry-#{inspect(make_ref())}"
+
+    :telemetry.attach(
+      handler,
+      [:pelemay_backend, :engine, :execute, :stop],
+      fn _event, measurements, metadata, _config ->
+        send(parent, {:stop, measurements, metadata})
+      end,
+      nil
+    )
+
+    previous = Engine.enable_stats(false)
+
+    try do
+      assert {:ok, _} = Engine.execute(program, [arg(x)])
+      refute_received {:stop, _, _}
+
+      Engine.enable_stats(true)
+      assert {:ok, _} = Engine.execute(program, [arg(x)])
+      assert_received {:stop, %{duration: _, instructions: instructions}, %{program: ^program}}
+      assert [{:aloadt, _}, {:exp, %{executions: 1, elements: 3}}, {:sendt, _}] = instructions
+
+      # The code of a list is loaded once, and its counters add up.
+      code = Engine.assemble("aloadt 0\nexp\nsendt\n")
+      assert {:ok, _} = Engine.execute(code, [arg(x)])
+      assert_received {:stop, _, %{program: loaded}}
+      assert {:ok, _} = Engine.execute(code, [arg(x)])
+      assert_received {:stop, %{instructions: instructions}, %{program: ^loaded}}
+      assert [{:aloadt, _}, {:exp, %{executions: 2}}, {:sendt, _}] = instructions
+    after
+      Engine.enable_stats(previous)
+      :telemetry.detach(handler)
+    end
+  end
+
+  test "load rejects the body of fuse which does not leave one value" do
+    assert_raise ErlangError, fn ->
+      "aloadt 0\nfuse {1, 2}\naloadt 0\naloadt 0\nsendt\n" |> Engine.assemble() |> Engine.load()
+    end
+  end
+
+  test "load verifies the stack along every path" do
+    assert_raise ErlangError, ~r/less than the operands at 1/, fn ->
+      "aloadt 0\nadd\nsendt\n" |> Engine.assemble() |> Engine.load()
+    end
+
+    assert_raise ErlangError, ~r/not zero at the end of code/, fn ->
+      "aloadt 0\ndup\nsendt\n" |> Engine.assemble() |> Engine.load()
+    end
+
+    # The path which skips pop leaves the boolean of is_scalar.
+    assert_raise ErlangError, ~r/depths of the stack differ/, fn ->
+      # aloadt 0, is_scalar, skip {1, {:if, true}}, pop, sendt
+      Engine.load([
+        {0x8000, 0},
+        {0x8004, nil},
+        {0x8003, {1, {:if, true}}},
+        {0x8006, nil},
+        {0x8001, nil}
+      ])
+    end
+
+    assert_raise ErlangError, ~r/boolean is on the stack/, fn ->
+      "aloadt 0\nis_scalar\nexp\nsendt\n" |> Engine.assemble() |> Engine.load()
+    end
+  end
+
+  test "load rejects an unknown instruction" do
+    assert_raise ErlangError, fn -> Engine.load([{0x7FFF, nil}]) end
+  end
+
+  test "a tensor whose shape does not have its size elements is rejected" do
+    program = "aloadt 0\ncopy\nsendt\n" |> Engine.assemble() |> Engine.load()
+    assert {_, {2}, {:f, 32}} = Engine.run(program, [{2, {2}, {:f, 32}, <<0::64>>}])
+
+    assert_raise RuntimeError, fn ->
+      Engine.run(program, [{2, {100, 100}, {:f, 32}, <<0::64>>}])
+    end
+
+    # The rank is over MAX_RANK.
+    shape = List.to_tuple(List.duplicate(1, 9))
+    assert_raise RuntimeError, fn -> Engine.run(program, [{1, shape, {:f, 32}, <<0::32>>}]) end
+  end
 end
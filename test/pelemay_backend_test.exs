@@ -11,4 +11,110 @@ defmodule PelemayBackendTest do
     assert result == PelemayBackend.jit_apply(fun, [2.0, input])
     assert result == PelemayBackend.jit_apply(fun, [input, 2.0])
   end
+
+  test "unary operations in defn" do
+    input = Nx.tensor([0.5, 1.0, 2.0], type: {:f, 32})
+
+    for fun <- [&Nx.exp/1, &Nx.log/1, &Nx.sigmoid/1, &Nx.tanh/1, &Nx.sqrt/1] do
+      expected = fun.(input)
+      result = PelemayBackend.jit_apply(fun, [input])
+      assert Nx.to_number(Nx.all_close(result, expected)) == 1
+    end
+  end
+
+  test "graphs of operations in defn" do
+    x = Nx.tensor([[0.5, 1.0, 2.0], [3.0, -1.5, 0.25]], type: {:f, 32})
+    y = Nx.tensor([[1.0, 2.0], [0.5, -1.0], [2.0, 0.0]], type: {:f, 32})
+
+    funs = [
+      # shared subexpressions
+      fn x, _y -> Nx.add(Nx.exp(x), Nx.multiply(Nx.exp(x), 2)) end,
+      # reductions and dot
+      fn x, y -> Nx.sum(Nx.dot(Nx.tanh(x), y), axes: [1]) end,
+      fn x, _y -> Nx.argmax(Nx.subtract(x, Nx.reduce_max(x)), axis: 1, tie_break: :high) end,
+      # nodes which fall back to Nx.BinaryBackend
+      fn x, y -> Nx.dot(Nx.sin(x), Nx.reshape(Nx.abs(y), {3, 2})) end,
+      fn x, _y -> Nx.add(Nx.as_type(Nx.greater(x, 1.0), {:f, 32}), x) end,
+      # chains of elementwise operations fused into one loop
+      fn x, _y -> Nx.exp(Nx.subtract(Nx.multiply(x, 2.0), Nx.sigmoid(x))) end,
+      fn x, _y -> Nx.sum(Nx.tanh(Nx.add(Nx.multiply(x, x), Nx.reduce_max(x))), axes: [0]) end
+    ]
+
+    for fun <- funs do
+      expected = fun.(x, y)
+      result = PelemayBackend.jit_apply(fun, [x, y])
+      assert Nx.shape(result) == Nx.shape(expected)
+      assert Nx.type(result) == Nx.type(expected)
+      assert Nx.to_number(Nx.all_close(result, expected)) == 1
+    end
+  end
+
+  test "engine programs read the results of nodes which fall back" do
+    x = Nx.tensor([[0.5, 1.0, 2.0], [3.0, -1.5, 0.25]], type: {:f, 32})
+
+    funs = [
+      fn x -> Nx.exp(Nx.sin(x)) end,
+      fn x -> Nx.multiply(Nx.cos(x), Nx.sin(x)) end,
+      # creation ops, which take the backend options
+      fn x -> Nx.add(Nx.iota({2, 3}, type: {:f, 32}), Nx.exp(x)) end,
+      fn x -> Nx.dot(Nx.tanh(x), Nx.eye(3, type: {:f, 32})) end
+    ]
+
+    for fun <- funs do
+      expected = fun.(x)
+      result = PelemayBackend.jit_apply(fun, [x])
+      assert Nx.shape(result) == Nx.shape(expected)
+      assert Nx.to_number(Nx.all_close(result, expected)) == 1
+    end
+  end
+
+  test "results stay on the backend of the engine if it is the default" do
+    fun = fn a, b -> Nx.add(Nx.exp(a), b) end
+    left = Nx.tensor([1.0, 2.0], type: {:f, 32})
+    right = Nx.tensor([3.0, 4.0], type: {:f, 32})
+    expected = fun.(left, right)
+
+    result =
+      Nx.with_default_backend(PelemayBackend.Backend, fn ->
+        PelemayBackend.jit(fun).(left, right)
+      end)
+
+    assert %PelemayBackend.Backend{} = result.data
+    copied = Nx.from_binary(Nx.to_binary(result), {:f, 32})
+    assert Nx.to_number(Nx.all_close(copied, expected)) == 1
+
+    assert %Nx.BinaryBackend{} = PelemayBackend.jit(fun).(left, right).data
+  end
+
+  test "compiled programs are cached for each signature of the arguments" do
+    fun = fn a, b -> Nx.add(Nx.exp(a), b) end
+    left = Nx.tensor([1.0, 2.0], type: {:f, 32})
+    right = Nx.tensor([3.0, 4.0], type: {:f, 32})
+
+    refute PelemayBackend.cached?(fun, [left, right])
+    result = PelemayBackend.jit(fun).(left, right)
+    assert PelemayBackend.cached?(fun, [left, right])
+    refute PelemayBackend.cached?(fun, [Nx.tensor([1.0, 2.0, 3.0], type: {:f, 32}), right])
+    assert PelemayBackend.jit(fun).(left, right) == result
+  end
+
+  test "streams keep the accumulator across chunks" do
+    fun = fn x, acc -> {acc, Nx.add(Nx.exp(Nx.multiply(x, 2.0)), acc)} end
+    acc = Nx.tensor([1.0, 2.0, 3.0], type: {:f, 32})
+    stream = PelemayBackend.stream(fun, [Nx.template({3}, {:f, 32}), acc])
+
+    expected =
+      for i <- 1..4, reduce: acc do
+        expected ->
+          x = Nx.multiply(Nx.tensor([0.25, 0.5, -1.0], type: {:f, 32}), i)
+          assert :ok == Nx.Stream.send(stream, x)
+          assert Nx.to_number(Nx.all_close(Nx.Stream.recv(stream), expected)) == 1
+          Nx.add(Nx.exp(Nx.multiply(x, 2.0)), expected)
+      end
+
+    assert Nx.to_number(Nx.all_close(Nx.Stream.done(stream), expected)) == 1
+    # The initial accumulator is not overwritten.
+    assert acc == Nx.tensor([1.0, 2.0, 3.0], type: {:f, 32})
+    assert PelemayBackend.stream_cached?(fun, [Nx.template({3}, {:f, 32}), acc])
+  end
 end